@@ -10,8 +10,10 @@
 
 #define DESTROY "destroy"
 #define BLKRESCAN "blkrescan"
+#define BALLOON "balloon"
+#define USBSTAT "usbstat"
 
-#define CMDS_NUM 2U
+#define CMDS_NUM 4U
 #define CMD_NAME_MAX 32U
 #define CMD_ARG_MAX 320U
 
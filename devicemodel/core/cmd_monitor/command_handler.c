@@ -24,7 +24,7 @@
 #define SUCCEEDED 0
 #define FAILED -1
 
-static char *generate_ack_message(int ret_val)
+static char *generate_ack_message(int ret_val, const char *info)
 {
 	char *ack_msg;
 	cJSON *val;
@@ -36,13 +36,16 @@ static char *generate_ack_message(int ret_val)
 	if (val == NULL)
 		return NULL;
 	cJSON_AddItemToObject(ret_obj, "ack", val);
+	if (info != NULL)
+		cJSON_AddStringToObject(ret_obj, "info", info);
 	ack_msg = cJSON_Print(ret_obj);
 	if (ack_msg == NULL)
 		fprintf(stderr, "Failed to generate ACK message.\n");
 	cJSON_Delete(ret_obj);
 	return ack_msg;
 }
-static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+/* ack the command, with an "info" string for the commands that report something */
+static int send_socket_reply(struct socket_dev *sock, int fd, bool normal, const char *info)
 {
 	int ret = 0, val;
 	char *ack_message;
@@ -52,7 +55,7 @@ static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
 	if (client == NULL)
 		return -1;
 	val = normal ? SUCCEEDED : FAILED;
-	ack_message = generate_ack_message(val);
+	ack_message = generate_ack_message(val, info);
 
 	if (ack_message != NULL) {
 		memset(client->buf, 0, CLIENT_BUF_LEN);
@@ -66,6 +69,10 @@ static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
 	}
 	return ret;
 }
+static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+{
+	return send_socket_reply(sock, fd, normal, NULL);
+}
 
 int user_vm_destroy_handler(void *arg, void *command_para)
 {
@@ -122,3 +129,59 @@ int user_vm_blkrescan_handler(void *arg, void *command_para)
 	}
 	return ret;
 }
+
+int user_vm_balloon_handler(void *arg, void *command_para)
+{
+	int ret = 0;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	bool cmd_completed = false;
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	ret = vm_monitor_balloon(hdl_arg->ctx_arg, cmd_para->option);
+	if (ret >= 0) {
+		cmd_completed = true;
+	} else {
+		pr_err("Failed to set the balloon target.\n");
+	}
+
+	ret = send_socket_ack(sock, cmd_para->fd, cmd_completed);
+	if (ret < 0) {
+		pr_err("Failed to send ACK by socket.\n");
+	}
+	return ret;
+}
+
+int user_vm_usbstat_handler(void *arg, void *command_para)
+{
+	int ret = 0;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	bool cmd_completed = false;
+	char stats[CLIENT_BUF_LEN / 2];
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	ret = vm_monitor_usbstat(hdl_arg->ctx_arg, stats, sizeof(stats));
+	if (ret >= 0) {
+		cmd_completed = true;
+	} else {
+		pr_err("Failed to get the USB statistics.\n");
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, cmd_completed,
+				cmd_completed ? stats : NULL);
+	if (ret < 0) {
+		pr_err("Failed to send ACK by socket.\n");
+	}
+	return ret;
+}
@@ -28,6 +28,9 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
@@ -39,6 +42,7 @@
 #include <linux/memfd.h>
 
 #include "vmmapi.h"
+#include "atomic.h"
 
 extern char *vmname;
 
@@ -50,6 +54,10 @@ extern char *vmname;
 
 #define MAX_PATH_LEN 256
 
+/* prefault workers per mapping, and the least memory worth a worker */
+#define PREFAULT_MAX_WORKERS	16
+#define PREFAULT_MIN_CHUNK	(256 * MB)
+
 /* HugePage Level 1 for 2M page, Level 2 for 1G page*/
 
 #define SYS_PATH_LV1  "/sys/kernel/mm/hugepages/hugepages-2048kB/"
@@ -77,8 +85,7 @@ extern char *vmname;
  * - pg_size: this hugetlbfs's page size
  * - lowmem: lowmem of this hugetlbfs need allocate
  * - highmem: highmem of this hugetlbfs need allocate
- *.- pages_delta: its value equals needed pages - free pages,
- *.---if > 0: it's the gap for needed page; if < 0, more free than needed.
+ * - reserve_us/prefault_us: time spent growing the pool and touching pages
  * - nr_pages_path: sys path for total number of pages
  *.- free_pages_path: sys path for number of free pages
  */
@@ -91,7 +98,8 @@ struct hugetlb_info {
 	size_t highmem;
 	unsigned int flags;
 
-	int pages_delta;
+	uint64_t reserve_us;
+	uint64_t prefault_us;
 	char *nr_pages_path;
 	char *free_pages_path;
 };
@@ -107,7 +115,6 @@ static struct hugetlb_info hugetlb_priv[HUGETLB_LV_MAX] = {
 		.flags = MFD_CLOEXEC | MFD_ALLOW_SEALING |
 			 MFD_HUGETLB | MFD_HUGE_2MB,
 
-		.pages_delta = 0,
 		.nr_pages_path = SYS_PATH_LV1 SYS_NR_HUGEPAGES,
 		.free_pages_path = SYS_PATH_LV1 SYS_FREE_HUGEPAGES,
 	},
@@ -121,7 +128,6 @@ static struct hugetlb_info hugetlb_priv[HUGETLB_LV_MAX] = {
 		.flags = MFD_CLOEXEC | MFD_ALLOW_SEALING |
 			 MFD_HUGETLB | MFD_HUGE_1GB,
 
-		.pages_delta = 0,
 		.nr_pages_path = SYS_PATH_LV2 SYS_NR_HUGEPAGES,
 		.free_pages_path = SYS_PATH_LV2 SYS_FREE_HUGEPAGES,
 	},
@@ -133,6 +139,14 @@ struct vm_mmap_mem_region {
 	vm_paddr_t fd_offset;
 	char *hva_base;
 	int fd;
+	size_t pg_size;
+	uint64_t *discarded;	/* hugepages punched out, allocated on demand */
+};
+
+struct prefault_work {
+	char *addr;
+	size_t len;
+	size_t pg_size;
 };
 
 static struct vm_mmap_mem_region mmap_mem_regions[16];
@@ -143,6 +157,11 @@ static size_t total_size;
 static int hugetlb_lv_max;
 static int lock_fd;
 
+/* users holding long term pins on guest memory, see hugetlb_pin() */
+static int hugetlb_pinned;
+/* hugepages currently discarded, lets vm_map_gpa() skip the bitmaps */
+static int hugetlb_ndiscarded;
+
 static int lock_acrn_hugetlb(void)
 {
 	int ret;
@@ -172,6 +191,76 @@ static int unlock_acrn_hugetlb(void)
 }
 
 
+static uint64_t hugetlb_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void *prefault_worker(void *arg)
+{
+	struct prefault_work *work = arg;
+	size_t off;
+
+	/* Access to the address will trigger hugetlb_fault() in kernel,
+	 * it will allocate and clear the huge page.*/
+	for (off = 0; off < work->len; off += work->pg_size)
+		*(volatile char *)(work->addr + off) = *(work->addr + off);
+
+	return NULL;
+}
+
+/*
+ * Touch the hugepages of a mapping from several threads, as clearing them
+ * dominates VM creation for large guests. The workers inherit the CPU
+ * affinity of the device model, so starting it under taskset or numactl
+ * keeps the faults, and with the default policy the pages, on those nodes.
+ */
+static int prefault_hugetlb(char *addr, size_t len, size_t pg_size)
+{
+	struct prefault_work work[PREFAULT_MAX_WORKERS];
+	pthread_t tids[PREFAULT_MAX_WORKERS];
+	size_t pages, per, off = 0;
+	cpu_set_t cpus;
+	int nr = 1, started, i;
+
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+		nr = CPU_COUNT(&cpus);
+	pages = len / pg_size;
+	if (nr > PREFAULT_MAX_WORKERS)
+		nr = PREFAULT_MAX_WORKERS;
+	if (nr > len / PREFAULT_MIN_CHUNK)
+		nr = len / PREFAULT_MIN_CHUNK;
+	if (nr > pages)
+		nr = pages;
+	if (nr < 1)
+		nr = 1;
+
+	per = pages / nr;
+	for (i = 0; i < nr; i++) {
+		work[i].addr = addr + off;
+		work[i].len = (per + ((i < pages % nr) ? 1 : 0)) * pg_size;
+		work[i].pg_size = pg_size;
+		off += work[i].len;
+	}
+
+	/* the caller takes the first slice, and any a worker can't be made for */
+	for (started = 1; started < nr; started++) {
+		if (pthread_create(&tids[started], NULL, prefault_worker,
+				&work[started]) != 0)
+			break;
+	}
+	prefault_worker(&work[0]);
+	for (i = started; i < nr; i++)
+		prefault_worker(&work[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	return started;
+}
+
 static void close_hugetlbfs(int level)
 {
 	if (level >= HUGETLB_LV_MAX) {
@@ -211,7 +300,8 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 {
 	char *addr;
 	size_t pagesz = 0;
-	int fd, i;
+	uint64_t start, us;
+	int fd, workers;
 
 	if (level >= HUGETLB_LV_MAX) {
 		pr_err("exceed max hugetlb level");
@@ -237,20 +327,20 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	mmap_mem_regions[mem_idx].fd = fd;
 	mmap_mem_regions[mem_idx].fd_offset = skip;
 	mmap_mem_regions[mem_idx].hva_base = addr;
+	mmap_mem_regions[mem_idx].pg_size = hugetlb_priv[level].pg_size;
 	mem_idx++;
 	pr_info("mmap 0x%lx@%p\n", len, addr);
 
 	/* pre-allocate hugepages by touch them */
 	pagesz = hugetlb_priv[level].pg_size;
 
-	pr_info("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
+	start = hugetlb_now_us();
+	workers = prefault_hugetlb(addr, len, pagesz);
+	us = hugetlb_now_us() - start;
+	hugetlb_priv[level].prefault_us += us;
 
-	/* Access to the address will trigger hugetlb_fault() in kernel,
-	 * it will allocate and clear the huge page.*/
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
-	}
+	pr_info("touch %ld pages with pagesz 0x%lx: %d threads, %lu ms\n",
+		len/pagesz, pagesz, workers, us / 1000);
 
 	return 0;
 }
@@ -381,158 +471,144 @@ static int read_sys_info(const char *sys_path)
 	return pages;
 }
 
-/* check if enough free huge pages for the User VM */
-static bool hugetlb_check_memgap(void)
+/* resize the pool of a level, the kernel may settle on fewer pages */
+static int write_sys_info(const char *sys_path, int pages)
 {
-	int lvl, free_pages, need_pages;
-	bool has_gap = false;
-
-	for (lvl = HUGETLB_LV1; lvl < hugetlb_lv_max; lvl++) {
-		if (hugetlb_priv[lvl].fd < 0) {
-			hugetlb_priv[lvl].pages_delta = 0;
-			continue;
-		}
-		free_pages = read_sys_info(hugetlb_priv[lvl].free_pages_path);
-		need_pages = (hugetlb_priv[lvl].lowmem + hugetlb_priv[lvl].fbmem +
-			hugetlb_priv[lvl].biosmem + hugetlb_priv[lvl].highmem) /
-			hugetlb_priv[lvl].pg_size;
-
-		hugetlb_priv[lvl].pages_delta = need_pages - free_pages;
-		/* if delta > 0, it's a gap for needed pages, to be handled */
-		if (hugetlb_priv[lvl].pages_delta > 0)
-			has_gap = true;
+	FILE *fp;
+	int ret = 0;
 
-		pr_info("level %d free/need pages:%d/%d page size:0x%x\n", lvl,
-			free_pages, need_pages, hugetlb_priv[lvl].pg_size);
+	fp = fopen(sys_path, "w");
+	if (fp == NULL) {
+		pr_err("can't open: %s, err: %s\n", sys_path, strerror(errno));
+		return -1;
 	}
 
-	return has_gap;
+	if (fprintf(fp, "%d", pages) < 0)
+		ret = -1;
+	if (fclose(fp) == EOF)
+		ret = -1;
+	if (ret < 0)
+		pr_err("write %s, error: %s, please check!\n",
+			sys_path, strerror(errno));
+	return ret;
 }
 
-/* try to reserve more huge pages on the level */
-static void reserve_more_pages(int level)
+static int hugetlb_need_pages(int level)
 {
-	int total_pages, orig_pages, cur_pages;
-	char cmd_buf[MAX_PATH_LEN];
-	FILE *fp;
-
-	orig_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
-	total_pages = orig_pages + hugetlb_priv[level].pages_delta;
-	snprintf(cmd_buf, MAX_PATH_LEN, "echo %d > %s",
-		total_pages, hugetlb_priv[level].nr_pages_path);
-
-	/* system cmd to reserve needed huge pages */
-	fp = popen(cmd_buf, "r");
-	if (fp == NULL) {
-		pr_err("cmd: %s failed!\n", cmd_buf);
-		return;
-	}
-	pclose(fp);
-
-	pr_info("to reserve pages (+orig %d): %s\n", orig_pages, cmd_buf);
-	cur_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
-	hugetlb_priv[level].pages_delta = total_pages - cur_pages;
+	return (hugetlb_priv[level].lowmem + hugetlb_priv[level].fbmem +
+		hugetlb_priv[level].biosmem + hugetlb_priv[level].highmem) /
+		hugetlb_priv[level].pg_size;
 }
 
-/* try to release larger free page */
-static bool release_larger_freepage(int level_limit)
+/*
+ * Grow the pool of the level until it has need free pages, or as close
+ * as the kernel gets. Return the number of free pages.
+ */
+static int hugetlb_grow_pool(int level, int need)
 {
-	int level;
-	int total_pages, orig_pages, cur_pages;
-	char cmd_buf[MAX_PATH_LEN];
-	FILE *fp;
+	int free_pages, nr_pages;
 
-	for (level = hugetlb_lv_max - 1; level >= level_limit; level--) {
-		if (hugetlb_priv[level].pages_delta >= 0)
-			continue;
+	free_pages = read_sys_info(hugetlb_priv[level].free_pages_path);
+	if (free_pages >= need)
+		return free_pages;
 
-		/* free one un-used larger page */
-		orig_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
-		total_pages = orig_pages - 1;
-		snprintf(cmd_buf, MAX_PATH_LEN, "echo %d > %s",
-			total_pages, hugetlb_priv[level].nr_pages_path);
+	nr_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
+	write_sys_info(hugetlb_priv[level].nr_pages_path,
+			nr_pages + need - free_pages);
+	pr_info("level %d: grow pool from %d by %d pages\n", level,
+		nr_pages, need - free_pages);
 
-		fp = popen(cmd_buf, "r");
-		if (fp == NULL) {
-			pr_err("cmd to free mem: %s failed!\n", cmd_buf);
-			return false;
-		}
-		pclose(fp);
+	return read_sys_info(hugetlb_priv[level].free_pages_path);
+}
 
-		cur_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
+/* give free pages the plan doesn't use back to the system */
+static void hugetlb_trim_pool(int level)
+{
+	int surplus, nr_pages;
 
-		/* release page successfully */
-		if (cur_pages < orig_pages) {
-			hugetlb_priv[level].pages_delta++;
-			break;
-		}
-	}
+	surplus = read_sys_info(hugetlb_priv[level].free_pages_path) -
+		hugetlb_need_pages(level);
+	if (surplus <= 0)
+		return;
 
-	if (level < level_limit)
-		return false;
+	nr_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
+	write_sys_info(hugetlb_priv[level].nr_pages_path, nr_pages - surplus);
+	pr_info("level %d: return %d unused pages\n", level, surplus);
+}
 
-	return true;
+/* move pages of the level down to the next level, highmem first */
+static void hugetlb_demote(int level, int pages)
+{
+	struct hugetlb_info *htlb = &hugetlb_priv[level];
+	struct hugetlb_info *lower = &hugetlb_priv[level - 1];
+	size_t pg_size = htlb->pg_size;
+
+	while (pages > 0 && htlb->highmem >= pg_size) {
+		htlb->highmem -= pg_size;
+		lower->highmem += pg_size;
+		pages--;
+	}
+	while (pages > 0 && htlb->lowmem >= pg_size) {
+		htlb->lowmem -= pg_size;
+		lower->lowmem += pg_size;
+		pages--;
+	}
+	while (pages > 0 && htlb->biosmem >= pg_size) {
+		htlb->biosmem -= pg_size;
+		lower->biosmem += pg_size;
+		pages--;
+	}
+	while (pages > 0 && htlb->fbmem >= pg_size) {
+		htlb->fbmem -= pg_size;
+		lower->fbmem += pg_size;
+		pages--;
+	}
 }
 
-/* reserve more free huge pages as different levels.
- * it need handle following cases:
- * A.no enough free memory to reserve gap pages, just fails.
- * B enough free memory to reserve each level gap pages
- *.C.enough free memory, but it can't reserve enough higher level gap pages,
- *    so lower level need handle that, to reserve more free pages.
- *.D.enough higher level free pages, but not enough free memory for
- *    lower level gap pages, so release some higher level free pages for that.
- * other info:
- *.   even enough free memory, it is easier to reserve smaller pages than
- * lager ones, for example:2MB easier than 1GB. One flow of current solution:
- *.it could leave Service VM very small free memory.
- *.return value: true: success; false: failure
+/*
+ * Plan which hugepage level backs each part of guest memory and reserve
+ * the pages, largest pages first. hugetlb_setup_memory() starts with as
+ * much as possible in 1G pages; whatever the 1G pool can't provide, which
+ * is common as the kernel rarely finds free 1G ranges late after boot,
+ * moves to 2M pages. If the 2M pool still falls short, free 1G pages this
+ * VM doesn't use go back to the system to make room and the 2M pool is
+ * tried once more.
+ * return value: true: success; false: failure
  */
-static bool hugetlb_reserve_pages(void)
+static bool hugetlb_plan_layout(void)
 {
-	int left_gap = 0, pg_size;
-	int level;
+	int level, lv, need, got;
+	uint64_t start;
 
-	pr_info("to reserve more free pages:\n");
 	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
-		if (hugetlb_priv[level].pages_delta <= 0)
+		if (hugetlb_priv[level].fd < 0)
 			continue;
 
-		/* if gaps, try to reserve more pages */
-		reserve_more_pages(level);
+		start = hugetlb_now_us();
+		need = hugetlb_need_pages(level);
+		got = hugetlb_grow_pool(level, need);
 
-		/* check if reserved enough pages */
-		if (hugetlb_priv[level].pages_delta <= 0)
-			continue;
+		if (got < need && level == HUGETLB_LV1) {
+			for (lv = hugetlb_lv_max - 1; lv > HUGETLB_LV1; lv--)
+				if (hugetlb_priv[lv].fd >= 0)
+					hugetlb_trim_pool(lv);
+			got = hugetlb_grow_pool(level, need);
+		}
+		hugetlb_priv[level].reserve_us = hugetlb_now_us() - start;
 
-		/* probably system allocates fewer pages than needed
-		 * especially for larger page like 1GB, even there is enough
-		 * free memory, it still can fail to allocate 1GB huge page.
-		 * so if that, it needs the next level to handle it.
-		 */
-		if (level > HUGETLB_LV1) {
-			left_gap = hugetlb_priv[level].pages_delta;
-			pg_size = hugetlb_priv[level].pg_size;
-			hugetlb_priv[level - 1].pages_delta += (size_t)left_gap
-				* (pg_size / hugetlb_priv[level - 1].pg_size);
+		pr_info("level %d free/need pages:%d/%d page size:0x%x, %lu ms\n",
+			level, got, need, hugetlb_priv[level].pg_size,
+			hugetlb_priv[level].reserve_us / 1000);
+
+		if (got >= need)
 			continue;
+		if (level == HUGETLB_LV1) {
+			pr_err("level %d pages gap: %d failed to reserve!\n",
+				level, need - got);
+			return false;
 		}
 
-		/* now for level == HUGETLB_LV1 it still can't alloc enough
-		 * pages, go back to larger pages, to check if it can
-		 *.release some unused free pages, if release success,
-		 * let it go LV1 again
-		 */
-		if (release_larger_freepage(level + 1))
-			level++;
-		else
-			break;
-	}
-
-	if (level >= HUGETLB_LV1) {
-		pr_err("level %d pages gap: %d failed to reserve!\n",
-			level, left_gap);
-		return false;
+		hugetlb_demote(level, need - got);
 	}
 
 	pr_info("now enough free pages are reserved!\n");
@@ -604,7 +680,6 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 {
 	int level;
 	size_t lowmem, fbmem, biosmem, highmem;
-	bool has_gap;
 	int fd;
 	unsigned int seal_flag = F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL;
 	size_t mem_size_level;
@@ -659,6 +734,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	highmem = ctx->highmem;
 
 	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		hugetlb_priv[level].reserve_us = 0;
+		hugetlb_priv[level].prefault_us = 0;
 		if (hugetlb_priv[level].fd < 0) {
 			hugetlb_priv[level].lowmem = 0;
 			hugetlb_priv[level].highmem = 0;
@@ -689,12 +766,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 
 	lock_acrn_hugetlb();
 
-	/* it will check each level memory need */
-	has_gap = hugetlb_check_memgap();
-	if (has_gap) {
-		if (!hugetlb_reserve_pages())
-			goto err_lock;
-	}
+	if (!hugetlb_plan_layout())
+		goto err_lock;
 
 	/* align up total size with huge page size for vma alignment */
 	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
@@ -791,11 +864,13 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	/* dump hugepage really setup */
 	pr_info("\nreally setup hugepage with:\n");
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
-		pr_info("\tlevel %d - lowmem 0x%lx, biosmem 0x%lx, highmem 0x%lx\n",
+		pr_info("\tlevel %d - lowmem 0x%lx, biosmem 0x%lx, highmem 0x%lx, reserve %lu ms, prefault %lu ms\n",
 			level,
 			hugetlb_priv[level].lowmem,
 			hugetlb_priv[level].biosmem,
-			hugetlb_priv[level].highmem);
+			hugetlb_priv[level].highmem,
+			hugetlb_priv[level].reserve_us / 1000,
+			hugetlb_priv[level].prefault_us / 1000);
 	}
 
 	/* map ept for lowmem */
@@ -842,7 +917,13 @@ err:
 
 void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
-	int level;
+	int level, i;
+
+	for (i = 0; i < mem_idx; i++) {
+		free(mmap_mem_regions[i].discarded);
+		mmap_mem_regions[i].discarded = NULL;
+	}
+	atomic_store(&hugetlb_ndiscarded, 0);
 
 	if (total_size > 0) {
 		munmap(ptr, total_size);
@@ -855,6 +936,163 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 	}
 }
 
+static struct vm_mmap_mem_region *
+hugetlb_find_region(vm_paddr_t gpa)
+{
+	int i;
+
+	for (i = 0; i < mem_idx; i++) {
+		if ((gpa >= mmap_mem_regions[i].gpa_start) &&
+			(gpa < mmap_mem_regions[i].gpa_end))
+			return &mmap_mem_regions[i];
+	}
+	return NULL;
+}
+
+/* size of the hugepage backing gpa, 0 if gpa is not guest RAM */
+size_t
+hugetlb_page_size(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	struct vm_mmap_mem_region *region = hugetlb_find_region(gpa);
+
+	return region ? region->pg_size : 0;
+}
+
+/*
+ * Guest memory is pinned for as long as a user (e.g. the fixed buffers of
+ * an io_uring) holds references to its pages. Punching out a pinned
+ * hugepage would not free it, and the pinned user would keep using the
+ * old page after hugetlb_populate() hands a new one to the guest, so no
+ * hugepage is discarded while any pin is held.
+ */
+void
+hugetlb_pin(struct vmctx *ctx)
+{
+	atomic_add_fetch(&hugetlb_pinned, 1);
+}
+
+void
+hugetlb_unpin(struct vmctx *ctx)
+{
+	atomic_sub_fetch(&hugetlb_pinned, 1);
+}
+
+/*
+ * Give the hugepage backing gpa back to the hugetlb pool. The guest must no
+ * longer have it mapped, see vm_release_memory(). Touching it through the
+ * device model mapping afterwards would allocate a new hugepage, so code
+ * walking all of guest memory checks hugetlb_discarded() first, and
+ * vm_map_gpa() refuses DMA into it.
+ */
+int
+hugetlb_discard_page(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	struct vm_mmap_mem_region *region = hugetlb_find_region(gpa);
+	static bool warned;
+	size_t nr, pg;
+
+	if (region == NULL)
+		return -EINVAL;
+
+	if (atomic_load(&hugetlb_pinned) > 0) {
+		if (!warned) {
+			pr_notice("%s: guest memory is pinned, discarded pages stay allocated\n",
+				__func__);
+			warned = true;
+		}
+		return -EBUSY;
+	}
+
+	if (region->discarded == NULL) {
+		nr = (region->gpa_end - region->gpa_start) / region->pg_size;
+		region->discarded = calloc((nr + 63) / 64, sizeof(uint64_t));
+		if (region->discarded == NULL)
+			return -ENOMEM;
+	}
+
+	pg = (gpa - region->gpa_start) / region->pg_size;
+	if (fallocate(region->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			region->fd_offset + pg * region->pg_size,
+			region->pg_size) < 0) {
+		pr_err("%s: fallocate failed: %s\n", __func__, strerror(errno));
+		return -errno;
+	}
+	if ((region->discarded[pg / 64] & (1UL << (pg % 64))) == 0) {
+		region->discarded[pg / 64] |= 1UL << (pg % 64);
+		atomic_add_fetch(&hugetlb_ndiscarded, 1);
+	}
+	return 0;
+}
+
+/*
+ * Allocate the discarded hugepages in [gpa, gpa + len) again, so the range
+ * can be handed back to the guest. Fails with -ENOSPC if the hugetlb pool
+ * ran dry in the meantime.
+ */
+int
+hugetlb_populate(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	vm_paddr_t end = gpa + len;
+	size_t pg;
+
+	while (gpa < end) {
+		region = hugetlb_find_region(gpa);
+		if (region == NULL)
+			return -EINVAL;
+
+		pg = (gpa - region->gpa_start) / region->pg_size;
+		if (region->discarded &&
+			(region->discarded[pg / 64] & (1UL << (pg % 64)))) {
+			if (fallocate(region->fd, 0,
+					region->fd_offset + pg * region->pg_size,
+					region->pg_size) < 0) {
+				pr_err("%s: fallocate failed: %s\n", __func__,
+					strerror(errno));
+				return -errno;
+			}
+			region->discarded[pg / 64] &= ~(1UL << (pg % 64));
+			atomic_sub_fetch(&hugetlb_ndiscarded, 1);
+		}
+		gpa = region->gpa_start + (pg + 1) * region->pg_size;
+	}
+	return 0;
+}
+
+bool
+hugetlb_discarded(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	struct vm_mmap_mem_region *region = hugetlb_find_region(gpa);
+	size_t pg;
+
+	if (region == NULL || region->discarded == NULL)
+		return false;
+
+	pg = (gpa - region->gpa_start) / region->pg_size;
+	return (region->discarded[pg / 64] & (1UL << (pg % 64))) != 0;
+}
+
+/* Is any hugepage backing [gpa, gpa + len) discarded? */
+bool
+hugetlb_range_discarded(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	vm_paddr_t end = gpa + len;
+
+	if (atomic_load(&hugetlb_ndiscarded) == 0)
+		return false;
+
+	while (gpa < end) {
+		region = hugetlb_find_region(gpa);
+		if (region == NULL)
+			return false;
+		if (hugetlb_discarded(ctx, gpa))
+			return true;
+		gpa = (gpa & ~(region->pg_size - 1)) + region->pg_size;
+	}
+	return false;
+}
+
 bool
 vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			struct vm_mem_region *ret_region)
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "inout.h"
 #include "log.h"
@@ -38,6 +39,15 @@ SET_DECLARE(inout_port_set, struct inout_port);
 #define	VERIFY_IOPORT(port, size) \
 	((port) >= 0 && (size) > 0 && ((port) + (size)) <= MAX_IOPORTS)
 
+/*
+ * Port I/O handlers are not reentrant; serialize them when ioreqs are
+ * dispatched from several threads. The handler table has its own lock, as
+ * handlers (e.g. a BAR write through 0xcfc) and MMIO emulation under a
+ * PCI device lock register and unregister ports themselves.
+ */
+static pthread_mutex_t inout_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t inout_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 static struct {
 	const char	*name;
 	int		flags;
@@ -102,19 +112,22 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *pio_reques
 		((bytes != 1) && (bytes != 2) && (bytes != 4)))
 		return -1;
 
+	pthread_mutex_lock(&inout_lock);
+	pthread_rwlock_rdlock(&inout_table_lock);
 	handler = inout_handlers[port].handler;
 	flags = inout_handlers[port].flags;
 	arg = inout_handlers[port].arg;
+	pthread_rwlock_unlock(&inout_table_lock);
 
-	if (pio_request->direction == ACRN_IOREQ_DIR_READ) {
-		if (!(flags & IOPORT_F_IN))
-			return -1;
-	} else {
-		if (!(flags & IOPORT_F_OUT))
-			return -1;
-	}
-	retval = handler(ctx, *pvcpu, in, port, bytes,
-		(uint32_t *)&(pio_request->value), arg);
+	if (pio_request->direction == ACRN_IOREQ_DIR_READ)
+		retval = (flags & IOPORT_F_IN) ? 0 : -1;
+	else
+		retval = (flags & IOPORT_F_OUT) ? 0 : -1;
+
+	if (retval == 0)
+		retval = handler(ctx, *pvcpu, in, port, bytes,
+			(uint32_t *)&(pio_request->value), arg);
+	pthread_mutex_unlock(&inout_lock);
 	return retval;
 }
 
@@ -156,14 +169,18 @@ register_inout(struct inout_port *iop)
 		return -1;
 	}
 
+	pthread_rwlock_wrlock(&inout_table_lock);
+
 	/*
 	 * Verify that the new registration is not overwriting an already
 	 * allocated i/o range.
 	 */
 	if ((iop->flags & IOPORT_F_DEFAULT) == 0) {
 		for (i = iop->port; i < iop->port + iop->size; i++) {
-			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0)
+			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0) {
+				pthread_rwlock_unlock(&inout_table_lock);
 				return -1;
+			}
 		}
 	}
 
@@ -174,6 +191,7 @@ register_inout(struct inout_port *iop)
 		inout_handlers[i].arg = iop->arg;
 	}
 
+	pthread_rwlock_unlock(&inout_table_lock);
 	return 0;
 }
 
@@ -8,8 +8,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
 #include <pthread.h>
@@ -18,81 +21,319 @@
 #include "iothread.h"
 #include "log.h"
 #include "mevent.h"
+#include "dm_string.h"
+#include "types.h"
 
 
 #define MEVENT_MAX 64
 #define MAX_EVENT_NUM 64
+
+/*
+ * Adaptive busy-poll, modelled on KVM halt-polling: the window grows when
+ * a notification arrives shortly after polling gave up and shrinks when
+ * the queues stay idle for longer than the maximum window.
+ */
+#define IOTHREAD_POLL_NS_START		10000UL
+#define IOTHREAD_POLL_GROW		2UL
+#define IOTHREAD_POLL_SHRINK		2UL
+/* check the epoll set for other events every that many poll rounds */
+#define IOTHREAD_POLL_EPOLL_INTERVAL	16U
+
+/* per-thread settings from --iothread, kept across VM resets */
+struct iothread_opts {
+	bool configured;
+	cpu_set_t cpus;
+	bool has_cpus;
+	int prio;
+};
+
 struct iothread_ctx {
+	int id;
 	pthread_t tid;
 	int epfd;
 	bool started;
 	pthread_mutex_t mtx;
+
+	/* busy-poll state, the list is protected by mtx */
+	struct iothread_mevent *pollers[MEVENT_MAX];
+	int npoll;
+	bool in_poll;		/* a poll round is calling into pollers */
+	pthread_cond_t poll_cond;
+	uint64_t poll_ns;
+	uint64_t poll_deadline;
+	uint64_t poll_stopped;
+
+	/* statistics */
+	uint64_t busy_ns;
+	uint64_t wakeups;
+	uint64_t events;
+	uint64_t poll_hits;
 };
-static struct iothread_ctx ioctx;
+static struct iothread_opts ioopts[IOTHREAD_NUM_MAX];
+static struct iothread_ctx ioctx[IOTHREAD_NUM_MAX];
+static uint64_t poll_max_ns;
+
+static uint64_t
+iothread_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+iothread_poll_adjust(struct iothread_ctx *ctx, uint64_t now)
+{
+	uint64_t block_ns = now - ctx->poll_stopped;
+
+	if (block_ns <= poll_max_ns) {
+		/* polling a bit longer would have caught this event */
+		ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * IOTHREAD_POLL_GROW :
+				IOTHREAD_POLL_NS_START;
+		if (ctx->poll_ns > poll_max_ns)
+			ctx->poll_ns = poll_max_ns;
+	} else {
+		ctx->poll_ns /= IOTHREAD_POLL_SHRINK;
+		if (ctx->poll_ns < IOTHREAD_POLL_NS_START)
+			ctx->poll_ns = 0;
+	}
+	ctx->poll_stopped = 0;
+}
+
+static void
+iothread_poll_add(struct iothread_ctx *ctx, struct iothread_mevent *aevp,
+		uint64_t now)
+{
+	/* only the iothread adds pollers, so the list cannot fill up meanwhile */
+	if (aevp->polling || (ctx->npoll >= MEVENT_MAX))
+		return;
+
+	(*aevp->poll_start)(aevp->arg);
+
+	pthread_mutex_lock(&ctx->mtx);
+	ctx->pollers[ctx->npoll++] = aevp;
+	aevp->polling = true;
+	pthread_mutex_unlock(&ctx->mtx);
+	ctx->poll_deadline = now + ctx->poll_ns;
+}
+
+static void
+iothread_poll_remove(struct iothread_ctx *ctx, struct iothread_mevent *aevp)
+{
+	int i;
+
+	for (i = 0; i < ctx->npoll; i++) {
+		if (ctx->pollers[i] == aevp) {
+			ctx->pollers[i] = ctx->pollers[--ctx->npoll];
+			aevp->polling = false;
+			break;
+		}
+	}
+}
+
+/*
+ * One busy-poll round over the polled queues. The callbacks take the
+ * device locks, so they are called on a copy of the list and without
+ * holding ctx->mtx. The copy stays pinned by in_poll until the round is
+ * over: iothread_del() waits for it, so its caller cannot free a poller
+ * that is still being called.
+ */
+static void
+iothread_poll(struct iothread_ctx *ctx)
+{
+	struct iothread_mevent *pollers[MEVENT_MAX];
+	bool hit = false, expired = false;
+	uint64_t now;
+	int i, n;
+
+	pthread_mutex_lock(&ctx->mtx);
+	n = ctx->npoll;
+	memcpy(pollers, ctx->pollers, n * sizeof(pollers[0]));
+	ctx->in_poll = true;
+	pthread_mutex_unlock(&ctx->mtx);
+
+	for (i = 0; i < n; i++) {
+		if ((*pollers[i]->poll)(pollers[i]->arg))
+			hit = true;
+	}
+
+	now = iothread_now_ns();
+	if (hit) {
+		ctx->poll_hits++;
+		ctx->poll_deadline = now + ctx->poll_ns;
+	} else if (now >= ctx->poll_deadline) {
+		/* the window expired without new work, go back to notifications */
+		expired = true;
+		for (i = 0; i < n; i++) {
+			if ((*pollers[i]->poll_stop)(pollers[i]->arg)) {
+				(*pollers[i]->poll_start)(pollers[i]->arg);
+				hit = true;
+				pollers[i] = NULL;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&ctx->mtx);
+	if (expired) {
+		for (i = 0; i < n; i++) {
+			if (pollers[i])
+				iothread_poll_remove(ctx, pollers[i]);
+		}
+	}
+	ctx->in_poll = false;
+	pthread_cond_broadcast(&ctx->poll_cond);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	if (expired) {
+		if (hit)
+			ctx->poll_deadline = now + ctx->poll_ns;
+		else
+			ctx->poll_stopped = now;
+	}
+}
 
 static void *
 io_thread(void *arg)
 {
+	struct iothread_ctx *ctx = arg;
 	struct epoll_event eventlist[MEVENT_MAX];
 	struct iothread_mevent *aevp;
 	int i, n, status;
 	char buf[MAX_EVENT_NUM];
+	uint64_t start;
+	unsigned int rounds = 0;
 
-	while(ioctx.started) {
-		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
-		if (n < 0) {
-			if (errno == EINTR)
-				pr_info("%s: exit from epoll_wait\n", __func__);
-			else
+	while(ctx->started) {
+		if ((ctx->npoll == 0) || ((++rounds % IOTHREAD_POLL_EPOLL_INTERVAL) == 0)) {
+			n = epoll_wait(ctx->epfd, eventlist, MEVENT_MAX, ctx->npoll ? 0 : -1);
+			if (n < 0) {
+				/*
+				 * Task work of the io_uring submitted from this
+				 * thread interrupts the wait too, so only stop
+				 * when asked to.
+				 */
+				if (errno == EINTR) {
+					if (!ctx->started)
+						pr_info("%s: exit from epoll_wait\n", __func__);
+					continue;
+				}
 				pr_err("%s: return from epoll wait with errno %d\r\n", __func__, errno);
-			break;
-		}
-		for (i = 0; i < n; i++) {
-			aevp = eventlist[i].data.ptr;
-			if (aevp && aevp->run) {
-				/* Mitigate the epoll_wait repeat cycles by reading out the events as more as possible.*/
-				do {
-					status = read(aevp->fd, buf, sizeof(buf));
-				} while (status == MAX_EVENT_NUM);
-				(*aevp->run)(aevp->arg);
+				break;
+			}
+
+			if (n > 0) {
+				start = iothread_now_ns();
+				if (ctx->poll_stopped)
+					iothread_poll_adjust(ctx, start);
+
+				for (i = 0; i < n; i++) {
+					aevp = eventlist[i].data.ptr;
+					if (aevp && aevp->run) {
+						/* Mitigate the epoll_wait repeat cycles by reading out the events as more as possible.*/
+						if (!aevp->nodrain) {
+							do {
+								status = read(aevp->fd, buf, sizeof(buf));
+							} while (status == MAX_EVENT_NUM);
+						}
+						(*aevp->run)(aevp->arg);
+						if (aevp->poll && poll_max_ns)
+							iothread_poll_add(ctx, aevp, start);
+					}
+				}
+				ctx->busy_ns += iothread_now_ns() - start;
+				ctx->wakeups++;
+				ctx->events += n;
 			}
 		}
+
+		if (ctx->npoll > 0)
+			iothread_poll(ctx);
 	}
 
 	return NULL;
 }
 
+void
+iothread_set_poll_max(uint64_t ns)
+{
+	poll_max_ns = ns;
+}
+
+static void
+iothread_set_sched(struct iothread_ctx *ctx)
+{
+	struct iothread_opts *opts = &ioopts[ctx->id];
+	struct sched_param param;
+
+	if (opts->has_cpus &&
+	    pthread_setaffinity_np(ctx->tid, sizeof(cpu_set_t), &opts->cpus) != 0)
+		pr_err("%s: failed to set the affinity of iothread %d\n",
+			__func__, ctx->id);
+
+	if (opts->prio > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = opts->prio;
+		if (pthread_setschedparam(ctx->tid, SCHED_FIFO, &param) != 0)
+			pr_err("%s: failed to set SCHED_FIFO %d on iothread %d\n",
+				__func__, opts->prio, ctx->id);
+	}
+}
+
 static int
-iothread_start(void)
+iothread_start(struct iothread_ctx *ctx)
 {
-	pthread_mutex_lock(&ioctx.mtx);
+	char tname[MAXCOMLEN + 1];
 
-	if (ioctx.started) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	pthread_mutex_lock(&ctx->mtx);
+
+	if (ctx->started) {
+		pthread_mutex_unlock(&ctx->mtx);
 		return 0;
 	}
 
-	if (pthread_create(&ioctx.tid, NULL, io_thread, NULL) != 0) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	ctx->started = true;
+	if (pthread_create(&ctx->tid, NULL, io_thread, ctx) != 0) {
+		ctx->started = false;
+		pthread_mutex_unlock(&ctx->mtx);
 		pr_err("%s", "iothread create failed\r\n");
 		return -1;
 	}
-	ioctx.started = true;
-	pthread_setname_np(ioctx.tid, "iothread");
-	pthread_mutex_unlock(&ioctx.mtx);
-	pr_info("iothread started\n");
+	snprintf(tname, sizeof(tname), "iothread%d", ctx->id);
+	pthread_setname_np(ctx->tid, tname);
+	iothread_set_sched(ctx);
+	pthread_mutex_unlock(&ctx->mtx);
+	pr_info("iothread %d started\n", ctx->id);
 	return 0;
 }
 
+bool
+iothread_valid(int id)
+{
+	return (id == 0) || ((id > 0) && (id < IOTHREAD_NUM_MAX) && ioopts[id].configured);
+}
+
 int
-iothread_add(int fd, struct iothread_mevent *aevt)
+iothread_add(int id, int fd, struct iothread_mevent *aevt)
 {
+	struct iothread_ctx *ctx;
 	struct epoll_event ee;
 	int ret;
-	/* Create a epoll instance before the first fd is added.*/
+
+	if (!iothread_valid(id)) {
+		pr_err("%s: iothread %d is not configured\n", __func__, id);
+		return -1;
+	}
+	ctx = &ioctx[id];
+
+	pthread_mutex_lock(&ctx->mtx);
+	iothread_poll_remove(ctx, aevt);
+	aevt->polling = false;
+	pthread_mutex_unlock(&ctx->mtx);
+
 	ee.events = EPOLLIN;
 	ee.data.ptr = aevt;
-	ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_ADD, fd, &ee);
+	ret = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ee);
 	if (ret < 0) {
 		pr_err("%s: failed to add fd, error is %d\n",
 			__func__, errno);
@@ -100,7 +341,7 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 	}
 
 	/* Start the iothread after the first fd is added.*/
-	ret = iothread_start();
+	ret = iothread_start(ctx);
 	if (ret < 0) {
 		pr_err("%s: failed to start iothread thread\n",
 			__func__);
@@ -109,57 +350,199 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 }
 
 int
-iothread_del(int fd)
+iothread_del(int id, int fd)
 {
-	int ret = 0;
+	struct iothread_ctx *ctx;
+	int i, ret = 0;
+
+	if (!iothread_valid(id))
+		return -1;
+	ctx = &ioctx[id];
 
-	if (ioctx.epfd) {
-		ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (ctx->epfd > 0) {
+		ret = epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL);
 		if (ret < 0)
 			pr_err("%s: failed to delete fd from epoll fd, error is %d\n",
 				__func__, errno);
 	}
+
+	pthread_mutex_lock(&ctx->mtx);
+	for (i = 0; i < ctx->npoll; i++) {
+		if (ctx->pollers[i]->fd == fd) {
+			iothread_poll_remove(ctx, ctx->pollers[i]);
+			break;
+		}
+	}
+	/* let a poll round still using the removed poller finish */
+	if (!pthread_equal(pthread_self(), ctx->tid)) {
+		while (ctx->in_poll)
+			pthread_cond_wait(&ctx->poll_cond, &ctx->mtx);
+	}
+	pthread_mutex_unlock(&ctx->mtx);
 	return ret;
 }
 
-void
-iothread_deinit(void)
+static int
+iothread_parse_int(const char *s, int *val)
+{
+	char *end;
+
+	if (dm_strtoi(s, &end, 10, val) || (*end != '\0'))
+		return -1;
+	return 0;
+}
+
+/*
+ * Parse one --iothread option: <id>[,cpu=<cpu>[-<cpu>]][,prio=<priority>]
+ * Thread 0 is the default iothread and can be given an affinity or a
+ * priority as well.
+ */
+int
+iothread_parse_options(char *opt)
+{
+	char *str, *cp, *key, *val;
+	struct iothread_opts *opts;
+	int id, first, last, prio, cpu;
+	int ret = -1;
+
+	str = cp = strdup(opt);
+	if (!str)
+		return -1;
+
+	key = strsep(&cp, ",");
+	if (iothread_parse_int(key, &id) || (id < 0) || (id >= IOTHREAD_NUM_MAX)) {
+		pr_err("%s: invalid iothread id %s\n", __func__, key);
+		goto out;
+	}
+	opts = &ioopts[id];
+	CPU_ZERO(&opts->cpus);
+	opts->has_cpus = false;
+	opts->prio = 0;
+
+	while ((val = strsep(&cp, ",")) != NULL) {
+		key = strsep(&val, "=");
+		if (val == NULL)
+			goto out;
+
+		if (strcmp(key, "cpu") == 0) {
+			if (iothread_parse_int(strsep(&val, "-"), &first) || (first < 0))
+				goto out;
+			last = first;
+			if (val && (iothread_parse_int(val, &last) || (last < first)))
+				goto out;
+			for (cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++)
+				CPU_SET(cpu, &opts->cpus);
+			opts->has_cpus = true;
+		} else if (strcmp(key, "prio") == 0) {
+			if (iothread_parse_int(val, &prio) ||
+			    (prio < sched_get_priority_min(SCHED_FIFO)) ||
+			    (prio > sched_get_priority_max(SCHED_FIFO)))
+				goto out;
+			opts->prio = prio;
+		} else {
+			goto out;
+		}
+	}
+
+	opts->configured = true;
+	ret = 0;
+
+out:
+	if (ret)
+		pr_err("%s: invalid iothread option %s\n", __func__, opt);
+	free(str);
+	return ret;
+}
+
+static void
+iothread_ctx_deinit(struct iothread_ctx *ctx)
 {
 	void *jval;
 
-	if (ioctx.tid > 0) {
-		pthread_mutex_lock(&ioctx.mtx);
-		ioctx.started = false;
-		pthread_mutex_unlock(&ioctx.mtx);
-		pthread_kill(ioctx.tid, SIGCONT);
-		pthread_join(ioctx.tid, &jval);
+	if (ctx->tid > 0) {
+		pthread_mutex_lock(&ctx->mtx);
+		ctx->started = false;
+		pthread_mutex_unlock(&ctx->mtx);
+		pthread_kill(ctx->tid, SIGCONT);
+		pthread_join(ctx->tid, &jval);
+
+		pr_notice("iothread %d: busy %lu ms, %lu wakeups, %lu.%02lu events per wakeup\n",
+			ctx->id, ctx->busy_ns / 1000000UL, ctx->wakeups,
+			ctx->wakeups ? ctx->events / ctx->wakeups : 0UL,
+			ctx->wakeups ? (ctx->events * 100UL / ctx->wakeups) % 100UL : 0UL);
+		if (poll_max_ns)
+			pr_notice("iothread %d: %lu poll hits, poll window %lu ns\n",
+				ctx->id, ctx->poll_hits, ctx->poll_ns);
 	}
-	if (ioctx.epfd > 0) {
-		close(ioctx.epfd);
-		ioctx.epfd = -1;
+	if (ctx->epfd > 0) {
+		close(ctx->epfd);
+		ctx->epfd = -1;
+	}
+	pthread_cond_destroy(&ctx->poll_cond);
+	pthread_mutex_destroy(&ctx->mtx);
+}
+
+void
+iothread_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < IOTHREAD_NUM_MAX; i++) {
+		if (iothread_valid(i))
+			iothread_ctx_deinit(&ioctx[i]);
 	}
-	pthread_mutex_destroy(&ioctx.mtx);
 	pr_info("iothread stop\n");
 }
 
-int
-iothread_init(void)
+static int
+iothread_ctx_init(struct iothread_ctx *ctx, int id)
 {
 	pthread_mutexattr_t attr;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&ioctx.mtx, &attr);
+	pthread_mutex_init(&ctx->mtx, &attr);
 	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&ctx->poll_cond, NULL);
 
-	ioctx.tid = 0;
-	ioctx.started = false;
-	ioctx.epfd = epoll_create1(0);
+	ctx->id = id;
+	ctx->tid = 0;
+	ctx->started = false;
+	ctx->busy_ns = 0;
+	ctx->wakeups = 0;
+	ctx->events = 0;
+	ctx->npoll = 0;
+	ctx->in_poll = false;
+	ctx->poll_ns = 0;
+	ctx->poll_stopped = 0;
+	ctx->poll_hits = 0;
+	ctx->epfd = epoll_create1(0);
 
-	if (ioctx.epfd < 0) {
+	if (ctx->epfd < 0) {
 		pr_err("%s: failed to create epoll fd, error is %d\r\n",
 			__func__, errno);
+		pthread_cond_destroy(&ctx->poll_cond);
+		pthread_mutex_destroy(&ctx->mtx);
 		return -1;
 	}
 	return 0;
 }
+
+int
+iothread_init(void)
+{
+	int i;
+
+	for (i = 0; i < IOTHREAD_NUM_MAX; i++) {
+		if (!iothread_valid(i))
+			continue;
+		if (iothread_ctx_init(&ioctx[i], i) != 0) {
+			while (--i >= 0) {
+				if (iothread_valid(i))
+					iothread_ctx_deinit(&ioctx[i]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -34,9 +34,13 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <sysexits.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -71,6 +75,7 @@
 #include "cmd_monitor.h"
 #include "vdisplay.h"
 #include "iothread.h"
+#include "snapshot.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
@@ -107,6 +112,10 @@ static int virtio_msix = 1;
 static bool debugexit_enabled;
 static int pm_notify_channel;
 static bool cmd_monitor;
+static char *snapshot_path;
+static char *restore_path;
+static struct mevent *snapshot_mevp;
+static bool ioreq_threads;
 
 static char *progname;
 static const int BSP;
@@ -138,6 +147,32 @@ struct mt_vmm_info {
 	int		mt_vcpu;
 } mt_vmm_info[VM_MAXCPU];
 
+/*
+ * With --ioreq_threads, vm_loop() only waits for ioreq notifications and
+ * hands each pending slot to the dispatch thread of its vCPU, so a slow
+ * emulation only stalls the vCPU that issued it.
+ */
+static struct ioreq_worker {
+	pthread_t	thr;
+	struct vmctx	*ctx;
+	int		vcpu;
+	int		efd;
+	bool		busy;
+} ioreq_workers[VM_MAXCPU];
+
+static pthread_mutex_t ioreq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_cond;
+static int ioreq_inflight;
+static bool ioreq_workers_stop;
+
+/*
+ * The HSM keeps reporting pending requests until every one of them is
+ * completed, so vm_loop() cannot sleep in the HSM while a request is in
+ * flight. It sleeps on ioreq_cond instead, for at most this long, so that
+ * a request of another vCPU is not held up by a slow emulation.
+ */
+#define IOREQ_REPOLL_NS		(50 * 1000)
+
 static struct vmctx *_ctx;
 
 static void
@@ -154,7 +189,8 @@ usage(int code)
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
 		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
-		"       %*s [--ssram] <vm>\n"
+		"       %*s [--ssram] [--snapshot path] [--restore path]\n"
+		"       %*s [--ioreq_threads] [--iothread id[,cpu=n[-m]][,prio=p]] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
 		"       -h: help\n"
@@ -175,7 +211,7 @@ usage(int code)
 		"            its params: threshold/s,probe-period(s),delay_time(ms),delay_duration(ms)\n"
 		"       --cmd_monitor: enable command monitor\n"
 		"            its params: unix domain socket path\n"
-		"       --virtio_poll: enable virtio poll mode with poll interval with ns\n"
+		"       --virtio_poll: busy-poll virtqueues from iothreads, with the maximum poll window in ns\n"
 		"       --acpidev_pt: ACPI device ID args: HID in ACPI Table\n"
 		"       --mmiodev_pt: MMIO resources args: physical MMIO regions\n"
 		"       --vtpm2: Virtual TPM2 args: sock_path=$PATH_OF_SWTPM_SOCKET\n"
@@ -184,12 +220,18 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --snapshot: save a VM snapshot to the path on SIGUSR2\n"
+		"       --restore: start the VM from a snapshot file instead of booting\n"
+		"       --ioreq_threads: handle the I/O requests of each vCPU in its own thread\n"
+		"       --iothread: configure an iothread that virtio devices can select with iothread=<id>,\n"
+		"            optionally pinned to host CPUs and running with a SCHED_FIFO priority\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
-		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "");
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "");
 
 	exit(code);
 }
@@ -272,7 +314,9 @@ add_cpu(struct vmctx *ctx, int vcpu_num)
 		mt_vmm_info[i].mt_vcpu = i;
 	}
 
-	vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
+	/* a restored VM already has all of its vCPU states loaded */
+	if (!restore_path)
+		vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
 
 	error = pthread_create(&mt_vmm_info[0].mt_thr, NULL,
 	    start_thread, &mt_vmm_info[0]);
@@ -699,6 +743,143 @@ vm_suspend_resume(struct vmctx *ctx)
 	vm_run(ctx);
 }
 
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *w = param;
+	struct acrn_io_request *io_req = &ioreq_buf[w->vcpu];
+	eventfd_t val;
+
+	while (1) {
+		if (eventfd_read(w->efd, &val) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (atomic_load(&ioreq_workers_stop))
+			break;
+
+		handle_vmexit(w->ctx, io_req, w->vcpu);
+
+		pthread_mutex_lock(&ioreq_mtx);
+		w->busy = false;
+		ioreq_inflight--;
+		pthread_cond_broadcast(&ioreq_cond);
+		pthread_mutex_unlock(&ioreq_mtx);
+	}
+
+	return NULL;
+}
+
+static void
+ioreq_workers_deinit(int num)
+{
+	int i;
+
+	atomic_store(&ioreq_workers_stop, true);
+	for (i = 0; i < num; i++) {
+		eventfd_write(ioreq_workers[i].efd, 1);
+		pthread_join(ioreq_workers[i].thr, NULL);
+		close(ioreq_workers[i].efd);
+	}
+	pthread_cond_destroy(&ioreq_cond);
+}
+
+static int
+ioreq_workers_init(struct vmctx *ctx)
+{
+	char tname[MAXCOMLEN + 1];
+	struct ioreq_worker *w;
+	pthread_condattr_t attr;
+	int i;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ioreq_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	atomic_store(&ioreq_workers_stop, false);
+	ioreq_inflight = 0;
+	for (i = 0; i < guest_ncpus; i++) {
+		w = &ioreq_workers[i];
+		w->ctx = ctx;
+		w->vcpu = i;
+		w->busy = false;
+		w->efd = eventfd(0, EFD_CLOEXEC);
+		if (w->efd < 0)
+			goto fail;
+
+		if (pthread_create(&w->thr, NULL, ioreq_worker_thread, w) != 0) {
+			close(w->efd);
+			goto fail;
+		}
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(w->thr, tname);
+	}
+
+	return 0;
+
+fail:
+	pr_err("%s: failed to start ioreq thread %d\n", __func__, i);
+	ioreq_workers_deinit(i);
+	return -1;
+}
+
+/*
+ * Hand every pending ioreq that is not being handled yet to the thread of
+ * its vCPU. When there is nothing new to dispatch but requests are still
+ * in flight, wait until one of them completes or IOREQ_REPOLL_NS passes,
+ * whichever comes first; the caller then checks the HSM again. Requests
+ * left pending by a reset or suspend are not dispatched again; the suspend
+ * mode is set before the handling thread drops its busy flag.
+ */
+static void
+ioreq_dispatch(void)
+{
+	struct acrn_io_request *io_req;
+	struct timespec ts;
+	bool dispatched = false;
+	int vcpu_id;
+
+	pthread_mutex_lock(&ioreq_mtx);
+	for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+		if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
+			break;
+
+		io_req = &ioreq_buf[vcpu_id];
+		if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+			&& !io_req->kernel_handled && !ioreq_workers[vcpu_id].busy) {
+			ioreq_workers[vcpu_id].busy = true;
+			ioreq_inflight++;
+			eventfd_write(ioreq_workers[vcpu_id].efd, 1);
+			dispatched = true;
+		}
+	}
+
+	if (!dispatched && ioreq_inflight > 0
+		&& vm_get_suspend_mode() == VM_SUSPEND_NONE) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += IOREQ_REPOLL_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ioreq_cond, &ioreq_mtx, &ts);
+	}
+	pthread_mutex_unlock(&ioreq_mtx);
+}
+
+/* Wait until no ioreq is being handled, e.g. before resetting the VM */
+static void
+ioreq_drain(void)
+{
+	pthread_mutex_lock(&ioreq_mtx);
+	while (ioreq_inflight > 0)
+		pthread_cond_wait(&ioreq_cond, &ioreq_mtx);
+	pthread_mutex_unlock(&ioreq_mtx);
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -710,9 +891,12 @@ vm_loop(struct vmctx *ctx)
 		return;
 	}
 
+	if (ioreq_threads && ioreq_workers_init(ctx) != 0)
+		return;
+
 	if (vm_run(ctx) != 0) {
 		pr_err("%s, failed to run VM.\n", __func__);
-		return;
+		goto out;
 	}
 
 	while (1) {
@@ -723,11 +907,17 @@ vm_loop(struct vmctx *ctx)
 		if (error)
 			break;
 
-		for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
-			io_req = &ioreq_buf[vcpu_id];
-			if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
-				&& !io_req->kernel_handled)
-				handle_vmexit(ctx, io_req, vcpu_id);
+		if (ioreq_threads) {
+			ioreq_dispatch();
+			if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
+				ioreq_drain();
+		} else {
+			for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+				io_req = &ioreq_buf[vcpu_id];
+				if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+					&& !io_req->kernel_handled)
+					handle_vmexit(ctx, io_req, vcpu_id);
+			}
 		}
 
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
@@ -745,6 +935,10 @@ vm_loop(struct vmctx *ctx)
 		}
 	}
 	pr_err("VM loop exit\n");
+
+out:
+	if (ioreq_threads)
+		ioreq_workers_deinit(guest_ncpus);
 }
 
 static int
@@ -756,6 +950,57 @@ num_vcpus_allowed(struct vmctx *ctx)
 	return VM_MAXCPU;
 }
 
+static void
+snapshot_handler(int fd, enum ev_type t, void *arg)
+{
+	struct vmctx *ctx = arg;
+	struct signalfd_siginfo info;
+
+	if (read(fd, &info, sizeof(info)) != sizeof(info))
+		return;
+
+	pr_notice("Received SIGUSR2, saving VM snapshot to %s\n", snapshot_path);
+	vm_pause(ctx);
+	vm_snapshot_save(ctx, snapshot_path, guest_ncpus);
+	vm_run(ctx);
+}
+
+/*
+ * SIGUSR2 triggers a snapshot. The signal is consumed through a signalfd
+ * on the mevent thread so the VM can be paused and saved synchronously.
+ * It must be blocked before any other thread is created.
+ */
+static int
+snapshot_init(struct vmctx *ctx)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: failed to create signalfd: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	snapshot_mevp = mevent_add(fd, EVF_READ, snapshot_handler, ctx, NULL, NULL);
+	if (!snapshot_mevp) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+snapshot_deinit(void)
+{
+	if (snapshot_mevp) {
+		mevent_delete_close(snapshot_mevp);
+		snapshot_mevp = NULL;
+	}
+}
+
 static void
 sig_handler_term(int signo)
 {
@@ -790,6 +1035,10 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_SNAPSHOT,
+	CMD_OPT_RESTORE,
+	CMD_OPT_IOREQ_THREADS,
+	CMD_OPT_IOTHREAD,
 };
 
 static struct option long_options[] = {
@@ -833,6 +1082,10 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"snapshot",		required_argument,	0, CMD_OPT_SNAPSHOT},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
+	{"ioreq_threads",	no_argument,		0, CMD_OPT_IOREQ_THREADS},
+	{"iothread",		required_argument,	0, CMD_OPT_IOTHREAD},
 	{0,			0,			0,  0  },
 };
 
@@ -1043,6 +1296,19 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_SNAPSHOT:
+			snapshot_path = optarg;
+			break;
+		case CMD_OPT_RESTORE:
+			restore_path = optarg;
+			break;
+		case CMD_OPT_IOREQ_THREADS:
+			ioreq_threads = true;
+			break;
+		case CMD_OPT_IOTHREAD:
+			if (iothread_parse_options(optarg) != 0)
+				errx(EX_USAGE, "invalid iothread param %s", optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -1081,6 +1347,14 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (snapshot_path) {
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR2);
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	}
+
 	if (!init_hugetlb()) {
 		pr_err("init_hugetlb failed\n");
 		exit(1);
@@ -1160,10 +1434,24 @@ main(int argc, char *argv[])
 			goto vm_fail;
 		}
 
-		pr_notice("acrn_sw_load\n");
-		error = acrn_sw_load(ctx);
-		if (error) {
-			pr_err("acrn_sw_load failed, error=%d\n", error);
+		if (restore_path) {
+			pr_notice("vm_snapshot_restore: %s\n", restore_path);
+			error = vm_snapshot_restore(ctx, restore_path, guest_ncpus);
+			if (error) {
+				pr_err("vm_snapshot_restore failed, error=%d\n", error);
+				goto vm_fail;
+			}
+		} else {
+			pr_notice("acrn_sw_load\n");
+			error = acrn_sw_load(ctx);
+			if (error) {
+				pr_err("acrn_sw_load failed, error=%d\n", error);
+				goto vm_fail;
+			}
+		}
+
+		if (snapshot_path && snapshot_init(ctx) != 0) {
+			pr_err("Unable to set up snapshot trigger\n");
 			goto vm_fail;
 		}
 
@@ -1182,6 +1470,9 @@ main(int argc, char *argv[])
 			goto vm_fail;
 		}
 
+		/* a full reset boots the guest normally */
+		restore_path = NULL;
+
 		/* Make a copy for ctx */
 		_ctx = ctx;
 
@@ -1198,6 +1489,7 @@ main(int argc, char *argv[])
 			break;
 		}
 
+		snapshot_deinit();
 		vm_deinit_vdevs(ctx);
 		mevent_deinit();
 		iothread_deinit();
@@ -1210,6 +1502,7 @@ main(int argc, char *argv[])
 	}
 
 vm_fail:
+	snapshot_deinit();
 	vm_deinit_vdevs(ctx);
 	if (ssram)
 		clean_vssram_configs();
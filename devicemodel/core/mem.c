@@ -40,6 +40,7 @@
 
 #include "mem.h"
 #include "tree.h"
+#include "atomic.h"
 
 #define MEMNAMESZ (80)
 
@@ -54,11 +55,22 @@ static RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 RB_PROTOTYPE_STATIC(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
- * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * Per-thread MRU cache. Since most accesses from a vCPU will be to
+ * consecutive addresses in a few ranges, it makes sense to cache the
+ * result of a lookup. Entries hold a copy of the range, so a hit needs
+ * no lock; they are only valid while mmio_gen is unchanged, which every
+ * register/unregister bumps.
  */
-static struct mmio_rb_range	*mmio_hint __aligned(sizeof(struct mmio_rb_range *));
+#define MMIO_CACHE_ENTRIES	4
+
+struct mmio_cache {
+	uint64_t		gen;
+	int			nr;
+	struct mmio_rb_range	entries[MMIO_CACHE_ENTRIES];
+};
+
+static __thread struct mmio_cache mmio_cache;
+static uint64_t mmio_gen = 1;
 
 static pthread_rwlock_t mmio_rwlock;
 
@@ -149,36 +161,84 @@ mem_write(void *ctx, int vcpu, uint64_t gpa, uint64_t wval, int size, void *arg)
 	return error;
 }
 
+static struct mmio_rb_range *
+mmio_cache_lookup(uint64_t addr)
+{
+	struct mmio_cache *cache = &mmio_cache;
+	struct mmio_rb_range entry;
+	int i;
+
+	if (cache->gen != atomic_load(&mmio_gen)) {
+		cache->gen = atomic_load(&mmio_gen);
+		cache->nr = 0;
+		return NULL;
+	}
+
+	for (i = 0; i < cache->nr; i++) {
+		if (addr >= cache->entries[i].mr_base &&
+		    addr <= cache->entries[i].mr_end) {
+			/* move to front */
+			if (i > 0) {
+				entry = cache->entries[i];
+				memmove(&cache->entries[1], &cache->entries[0],
+					i * sizeof(entry));
+				cache->entries[0] = entry;
+			}
+			return &cache->entries[0];
+		}
+	}
+
+	return NULL;
+}
+
+/* Called with mmio_rwlock held, so the range cannot be stale */
+static struct mmio_rb_range *
+mmio_cache_insert(struct mmio_rb_range *entry, uint64_t gen)
+{
+	struct mmio_cache *cache = &mmio_cache;
+
+	if (cache->gen != gen) {
+		cache->gen = gen;
+		cache->nr = 0;
+	}
+
+	if (cache->nr < MMIO_CACHE_ENTRIES)
+		cache->nr++;
+	memmove(&cache->entries[1], &cache->entries[0],
+		(cache->nr - 1) * sizeof(*entry));
+	cache->entries[0] = *entry;
+
+	return &cache->entries[0];
+}
+
 int
 emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 {
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
-	struct mmio_rb_range *hint, *entry = NULL;
+	struct mmio_rb_range *entry = NULL;
+	struct mmio_rb_range fallback;
 	int err;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
-
 	/*
-	 * First check the per-VM cache
+	 * First check the per-thread cache
 	 */
-	hint = mmio_hint;
-
-	if (hint && paddr >= hint->mr_base && paddr <= hint->mr_end)
-		entry = hint;
-	else if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-		/* Update the per-VM cache */
-		mmio_hint = entry;
-	else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
+	entry = mmio_cache_lookup(paddr);
+	if (entry == NULL) {
+		pthread_rwlock_rdlock(&mmio_rwlock);
+		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
+			/* Update the per-thread cache */
+			entry = mmio_cache_insert(entry, atomic_load(&mmio_gen));
+		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry) == 0) {
+			fallback = *entry;
+			entry = &fallback;
+		} else {
+			pthread_rwlock_unlock(&mmio_rwlock);
+			return -ESRCH;
+		}
 		pthread_rwlock_unlock(&mmio_rwlock);
-		return -ESRCH;
 	}
 
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry == NULL)
-		return -EINVAL;
-
 	if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
 		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
 				size, &entry->mr_param);
@@ -206,6 +266,9 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		pthread_rwlock_wrlock(&mmio_rwlock);
 		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
 			err = mmio_rb_add(rbt, mrp);
+		/* flush the per-thread caches */
+		if (err == 0)
+			atomic_add_fetch(&mmio_gen, 1);
 		pthread_rwlock_unlock(&mmio_rwlock);
 		if (err)
 			free(mrp);
@@ -244,9 +307,8 @@ unregister_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		} else {
 			RB_REMOVE(mmio_rb_tree, rbt, entry);
 
-			/* flush Per-VM cache */
-			if (mmio_hint == entry)
-				mmio_hint = NULL;
+			/* flush the per-thread caches */
+			atomic_add_fetch(&mmio_gen, 1);
 
 			free(entry);
 		}
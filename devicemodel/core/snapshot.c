@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * VM snapshot/restore.
+ *
+ * Snapshot file layout:
+ *   struct snapshot_header
+ *   struct acrn_vcpu_snapshot[nr_vcpus]
+ *   { struct snapshot_section, payload } * nr_sections
+ *   guest memory, page aligned: lowmem followed by highmem
+ *
+ * Guest memory is written sparsely, all-zero pages are left as holes in
+ * the file, so a snapshot of a mostly idle guest stays small and restore
+ * only has to read the populated extents back. Hugepages a balloon gave
+ * back to the host are holes too, without being read.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "snapshot.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC		0x504e534e524341ULL	/* "ACRNSNP" */
+#define SNAPSHOT_VERSION	3U
+#define SNAPSHOT_PAGE_SIZE	4096UL
+
+struct snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t nr_vcpus;
+	uint32_t nr_sections;
+	uint32_t reserved;
+	uint64_t lowmem;
+	uint64_t highmem_gpa_base;
+	uint64_t highmem;
+	uint64_t mem_offset;
+};
+
+struct snapshot_section {
+	char name[SNAPSHOT_NAME_LEN];
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct snapshot_entry {
+	char name[SNAPSHOT_NAME_LEN];
+	struct snapshot_ops *ops;
+	void *arg;
+	void *owner;
+	LIST_ENTRY(snapshot_entry) list;
+};
+
+static LIST_HEAD(snapshot_list, snapshot_entry) snapshot_head;
+static pthread_mutex_t snapshot_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+int
+snapshot_register(const char *name, struct snapshot_ops *ops,
+		void *arg, void *owner)
+{
+	struct snapshot_entry *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
+
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->ops = ops;
+	entry->arg = arg;
+	entry->owner = owner;
+
+	pthread_mutex_lock(&snapshot_mtx);
+	LIST_INSERT_HEAD(&snapshot_head, entry, list);
+	pthread_mutex_unlock(&snapshot_mtx);
+	return 0;
+}
+
+void
+snapshot_unregister(void *owner)
+{
+	struct snapshot_entry *entry, *next;
+
+	pthread_mutex_lock(&snapshot_mtx);
+	entry = LIST_FIRST(&snapshot_head);
+	while (entry) {
+		next = LIST_NEXT(entry, list);
+		if (entry->owner == owner) {
+			LIST_REMOVE(entry, list);
+			free(entry);
+		}
+		entry = next;
+	}
+	pthread_mutex_unlock(&snapshot_mtx);
+}
+
+static struct snapshot_entry *
+snapshot_find(const char *name)
+{
+	struct snapshot_entry *entry;
+
+	LIST_FOREACH(entry, &snapshot_head, list) {
+		if (!strncmp(entry->name, name, SNAPSHOT_NAME_LEN))
+			return entry;
+	}
+	return NULL;
+}
+
+int
+snapshot_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+snapshot_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static bool
+page_is_zero(const uint64_t *page)
+{
+	size_t i;
+
+	for (i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(uint64_t); i++) {
+		if (page[i] != 0UL)
+			return false;
+	}
+	return true;
+}
+
+static bool
+page_is_hole(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	return hugetlb_discarded(ctx, gpa) ||
+		page_is_zero((const uint64_t *)(ctx->baseaddr + gpa));
+}
+
+static int
+save_mem_region(int fd, struct vmctx *ctx, vm_paddr_t gpa, size_t size,
+		off_t offset)
+{
+	const char *hva = ctx->baseaddr + gpa;
+	size_t pos, run;
+	ssize_t n;
+
+	pos = 0;
+	while (pos < size) {
+		/* skip zero pages, they become holes in the file */
+		if (page_is_hole(ctx, gpa + pos)) {
+			pos += SNAPSHOT_PAGE_SIZE;
+			continue;
+		}
+
+		/* coalesce contiguous populated pages into one write */
+		run = SNAPSHOT_PAGE_SIZE;
+		while (pos + run < size && !page_is_hole(ctx, gpa + pos + run))
+			run += SNAPSHOT_PAGE_SIZE;
+
+		while (run > 0) {
+			n = pwrite(fd, hva + pos, run, offset + pos);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			pos += n;
+			run -= n;
+		}
+	}
+	return 0;
+}
+
+static int
+restore_mem_region(int fd, char *hva, size_t size, off_t offset)
+{
+	off_t data, hole, end = offset + size;
+	ssize_t n;
+
+	data = offset;
+	while (data < end) {
+		data = lseek(fd, data, SEEK_DATA);
+		if (data < 0 || data >= end)
+			break;	/* the rest of the region is a hole */
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		while (data < hole) {
+			n = pread(fd, hva + (data - offset), hole - data, data);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (n == 0)
+				return -EIO;
+			data += n;
+		}
+	}
+	return 0;
+}
+
+static int
+save_sections(int fd, uint32_t *nr_sections)
+{
+	struct snapshot_entry *entry;
+	struct snapshot_section sec;
+	off_t start, end;
+	int ret = 0;
+
+	*nr_sections = 0;
+	pthread_mutex_lock(&snapshot_mtx);
+	LIST_FOREACH(entry, &snapshot_head, list) {
+		memset(&sec, 0, sizeof(sec));
+		memcpy(sec.name, entry->name, sizeof(sec.name));
+
+		start = lseek(fd, 0, SEEK_CUR);
+		ret = snapshot_write(fd, &sec, sizeof(sec));
+		if (ret < 0)
+			break;
+
+		ret = entry->ops->save(entry->arg, fd);
+		if (ret < 0) {
+			pr_err("%s: failed to save %s\n", __func__, entry->name);
+			break;
+		}
+
+		/* patch the payload length into the section header */
+		end = lseek(fd, 0, SEEK_CUR);
+		sec.len = (uint32_t)(end - start - sizeof(sec));
+		if (pwrite(fd, &sec, sizeof(sec), start) != sizeof(sec)) {
+			ret = -errno;
+			break;
+		}
+		(*nr_sections)++;
+	}
+	pthread_mutex_unlock(&snapshot_mtx);
+	return ret;
+}
+
+static int
+restore_sections(int fd, uint32_t nr_sections)
+{
+	struct snapshot_entry *entry;
+	struct snapshot_section sec;
+	off_t start;
+	uint32_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&snapshot_mtx);
+	for (i = 0; i < nr_sections; i++) {
+		ret = snapshot_read(fd, &sec, sizeof(sec));
+		if (ret < 0)
+			break;
+		sec.name[SNAPSHOT_NAME_LEN - 1] = '\0';
+
+		start = lseek(fd, 0, SEEK_CUR);
+		entry = snapshot_find(sec.name);
+		if (!entry) {
+			pr_warn("%s: no device for section %s, skipped\n",
+				__func__, sec.name);
+		} else {
+			ret = entry->ops->restore(entry->arg, fd, sec.len);
+			if (ret < 0) {
+				pr_err("%s: failed to restore %s\n",
+					__func__, sec.name);
+				break;
+			}
+		}
+
+		if (lseek(fd, start + sec.len, SEEK_SET) < 0) {
+			ret = -errno;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&snapshot_mtx);
+	return ret;
+}
+
+/*
+ * Let every device finish the requests it has already taken from the
+ * guest, a request in flight would be lost by a restore.
+ */
+static int
+quiesce_devices(void)
+{
+	struct snapshot_entry *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&snapshot_mtx);
+	LIST_FOREACH(entry, &snapshot_head, list) {
+		if (!entry->ops->quiesce)
+			continue;
+		ret = entry->ops->quiesce(entry->arg);
+		if (ret < 0) {
+			pr_err("%s: %s did not go idle\n", __func__, entry->name);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&snapshot_mtx);
+	return ret;
+}
+
+/*
+ * The VM must be paused by the caller. Outstanding I/O requests are
+ * drained first; the snapshot fails if a device does not go idle.
+ */
+int
+vm_snapshot_save(struct vmctx *ctx, const char *path, int nr_vcpus)
+{
+	struct acrn_vcpu_snapshot snap;
+	struct snapshot_header hdr;
+	off_t off;
+	int fd, i, ret;
+
+	if (quiesce_devices() < 0) {
+		pr_err("%s: I/O still in flight, no snapshot taken\n", __func__);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_err("%s: failed to open %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.nr_vcpus = nr_vcpus;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem_gpa_base = ctx->highmem_gpa_base;
+	hdr.highmem = ctx->highmem;
+
+	/* header is rewritten once section count and memory offset are known */
+	ret = snapshot_write(fd, &hdr, sizeof(hdr));
+	for (i = 0; (ret == 0) && (i < nr_vcpus); i++) {
+		memset(&snap, 0, sizeof(snap));
+		snap.vcpu_id = i;
+		ret = vm_get_vcpu_snapshot(ctx, &snap) ? -EIO : 0;
+		if (ret == 0)
+			ret = snapshot_write(fd, &snap, sizeof(snap));
+	}
+	if (ret == 0)
+		ret = save_sections(fd, &hdr.nr_sections);
+	if (ret < 0)
+		goto out;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	hdr.mem_offset = (off + SNAPSHOT_PAGE_SIZE - 1) & ~(SNAPSHOT_PAGE_SIZE - 1);
+
+	ret = save_mem_region(fd, ctx, 0, ctx->lowmem, hdr.mem_offset);
+	if (ret == 0 && ctx->highmem > 0)
+		ret = save_mem_region(fd, ctx, ctx->highmem_gpa_base,
+				ctx->highmem, hdr.mem_offset + ctx->lowmem);
+	if (ret == 0 && ftruncate(fd, hdr.mem_offset + ctx->lowmem + ctx->highmem) < 0)
+		ret = -errno;
+	if (ret == 0 && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		ret = -errno;
+	if (ret == 0)
+		ret = fsync(fd) ? -errno : 0;
+
+out:
+	close(fd);
+	if (ret < 0) {
+		pr_err("%s: failed to save snapshot to %s: %s\n",
+			__func__, path, strerror(-ret));
+		unlink(path);
+		return -1;
+	}
+	pr_notice("VM snapshot saved to %s\n", path);
+	return 0;
+}
+
+/*
+ * Called after the guest memory is set up and all virtual devices are
+ * initialized, but before any vCPU is started. Guest memory is freshly
+ * allocated and zeroed, so holes in the file need no work.
+ */
+int
+vm_snapshot_restore(struct vmctx *ctx, const char *path, int nr_vcpus)
+{
+	struct acrn_vcpu_snapshot snap;
+	struct snapshot_header hdr;
+	int fd, i, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("%s: failed to open %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	ret = snapshot_read(fd, &hdr, sizeof(hdr));
+	if (ret < 0)
+		goto out;
+
+	if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+		hdr.nr_vcpus != (uint32_t)nr_vcpus || hdr.lowmem != ctx->lowmem ||
+		hdr.highmem != ctx->highmem ||
+		hdr.highmem_gpa_base != ctx->highmem_gpa_base) {
+		pr_err("%s: %s does not match the VM configuration\n", __func__, path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = restore_mem_region(fd, ctx->baseaddr, ctx->lowmem, hdr.mem_offset);
+	if (ret == 0 && ctx->highmem > 0)
+		ret = restore_mem_region(fd, ctx->baseaddr + ctx->highmem_gpa_base,
+				ctx->highmem, hdr.mem_offset + ctx->lowmem);
+	if (ret < 0)
+		goto out;
+
+	if (lseek(fd, sizeof(hdr), SEEK_SET) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	for (i = 0; (ret == 0) && (i < nr_vcpus); i++) {
+		ret = snapshot_read(fd, &snap, sizeof(snap));
+		if (ret == 0)
+			ret = vm_set_vcpu_snapshot(ctx, &snap) ? -EIO : 0;
+	}
+	if (ret == 0)
+		ret = restore_sections(fd, hdr.nr_sections);
+
+out:
+	close(fd);
+	if (ret < 0) {
+		pr_err("%s: failed to restore snapshot from %s: %s\n",
+			__func__, path, strerror(-ret));
+		return -1;
+	}
+	pr_notice("VM restored from %s\n", path);
+	return 0;
+}
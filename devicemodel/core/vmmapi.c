@@ -423,6 +423,11 @@ vm_unsetup_memory(struct vmctx *ctx)
 void *
 vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 {
+	/* touching a ballooned hugepage would allocate it again, or SIGBUS */
+	if (hugetlb_range_discarded(ctx, gaddr, len)) {
+		pr_dbg("%s: 0x%lx is in the balloon\n", __func__, gaddr);
+		return NULL;
+	}
 
 	if (ctx->lowmem > 0) {
 		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
@@ -443,6 +448,88 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 	return NULL;
 }
 
+/*
+ * Start or stop dirty page logging on [gpa, gpa + len), rounded up to
+ * ACRN_DIRTY_LOG_GRANULE. Any guest mapping can be logged, RAM or a BAR.
+ */
+int
+vm_set_dirty_log_range(struct vmctx *ctx, vm_paddr_t gpa, size_t len, bool enable)
+{
+	struct acrn_dirty_log log;
+	int error;
+
+	bzero(&log, sizeof(struct acrn_dirty_log));
+	log.gpa = gpa;
+	log.size = roundup2(len, ACRN_DIRTY_LOG_GRANULE);
+	log.enable = enable ? 1U : 0U;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_DIRTY_LOG, &log);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_DIRTY_LOG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+/*
+ * Start or stop dirty page logging on all of the guest RAM (lowmem and
+ * highmem). Starting it write protects the RAM and clears the log.
+ */
+int
+vm_set_dirty_log(struct vmctx *ctx, bool enable)
+{
+	int error = 0;
+
+	if (ctx->lowmem > 0)
+		error = vm_set_dirty_log_range(ctx, 0, ctx->lowmem, enable);
+
+	if (!error && ctx->highmem > 0)
+		error = vm_set_dirty_log_range(ctx, ctx->highmem_gpa_base,
+				ctx->highmem, enable);
+
+	return error;
+}
+
+/*
+ * Fetch and clear the dirty log of [gpa, gpa + len) into 'bitmap', one bit
+ * per 4K page. gpa and len must be ACRN_DIRTY_LOG_GRANULE aligned and
+ * 'bitmap' must hold len / (4096 * 8) bytes.
+ */
+int
+vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len, uint64_t *bitmap)
+{
+	struct acrn_dirty_log log;
+	int error;
+
+	bzero(&log, sizeof(struct acrn_dirty_log));
+	log.gpa = gpa;
+	log.size = len;
+	log.bitmap = (__u64)bitmap;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_DIRTY_LOG, &log);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_DIRTY_LOG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+/*
+ * Take [gpa, gpa + len) of guest RAM away from the guest, so its backing
+ * pages can be freed. vm_map_memseg_vma() gives it back.
+ */
+int
+vm_release_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct acrn_mem_release rel;
+	int error;
+
+	bzero(&rel, sizeof(struct acrn_mem_release));
+	rel.gpa = gpa;
+	rel.size = len;
+	error = ioctl(ctx->fd, ACRN_IOCTL_RELEASE_MEM, &rel);
+	if (error) {
+		pr_err("ACRN_IOCTL_RELEASE_MEM ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 size_t
 vm_get_lowmem_size(struct vmctx *ctx)
 {
@@ -705,6 +792,28 @@ vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *vcpu_regs)
 	return error;
 }
 
+int
+vm_get_vcpu_snapshot(struct vmctx *ctx, struct acrn_vcpu_snapshot *snap)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_VCPU_SNAPSHOT, snap);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_VCPU_SNAPSHOT ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_vcpu_snapshot(struct vmctx *ctx, struct acrn_vcpu_snapshot *snap)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_VCPU_SNAPSHOT, snap);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_VCPU_SNAPSHOT ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_get_cpu_state(struct vmctx *ctx, void *state_buf)
 {
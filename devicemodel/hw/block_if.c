@@ -30,8 +30,11 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <err.h>
 #include <fcntl.h>
@@ -42,10 +45,18 @@
 #include <signal.h>
 #include <unistd.h>
 
+/* keep the max end offset of each interval tree subtree up to date */
+#define RB_AUGMENT(x)	blockif_augment(x)
+#include "tree.h"
+
 #include "dm.h"
+#include "vmmapi.h"
 #include "block_if.h"
+#include "block_img.h"
 #include "ahci.h"
 #include "dm_string.h"
+#include "iothread.h"
+#include "atomic.h"
 #include "log.h"
 
 /*
@@ -63,9 +74,20 @@
 #define BLOCKIF_SIG	0xb109b109
 
 #define BLOCKIF_NUMTHR	8
-#define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
+#define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)	/* default queue depth */
+#define BLOCKIF_MAXREQ_MAX	4096
 #define MAX_DISCARD_SEGMENT	256
 
+/*
+ * io_uring backend: requests go to the ring without waking a thread and
+ * complete on an iothread.  One worker thread stays for the operations
+ * the ring does not do (discard).
+ */
+#define BLOCKIF_URING_ENTRIES	128	/* at least, power of 2, >= maxreq */
+#define BLOCKIF_URING_NUMTHR	1
+#define BLOCKIF_URING_MAXBUFS	64	/* guest memory, in chunks */
+#define BLOCKIF_URING_BUFSZ	(1UL << 30) /* largest fixed buffer */
+
 /*
  * Debug printf
  */
@@ -88,13 +110,58 @@ enum blockstat {
 	BST_DONE
 };
 
+/*
+ * Reads and writes in flight are kept in an interval tree keyed by
+ * [start, end) and ordered by start, then by arrival.  A request waits
+ * for each earlier overlapping request unless both are reads: deps
+ * counts them, and the request sits on blockq until it drops to zero.
+ * Flushes and discards do not take part.
+ */
 struct blockif_elem {
 	TAILQ_ENTRY(blockif_elem) link;
 	struct blockif_req  *req;
 	enum blockop	     op;
 	enum blockstat	     status;
-	pthread_t            tid;
-	off_t		     block;
+	pthread_t            tid;	/* 0 if on the io_uring */
+
+	RB_ENTRY(blockif_elem) node;
+	bool		     in_tree;
+	off_t		     start;
+	off_t		     end;
+	off_t		     maxend;	/* largest end in the subtree */
+	uint64_t	     seq;
+	int		     deps;	/* earlier requests it waits for */
+};
+
+struct blockif_uring {
+	int			fd;
+	char			*sq_ring;
+	size_t			sq_ring_sz;
+	char			*cq_ring;
+	size_t			cq_ring_sz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	unsigned int		to_submit;	/* queued, not entered yet */
+	int			plugged;
+	int			inflight;
+
+	/* registered guest memory, see blockif_register_mem() */
+	struct iovec		bufs[BLOCKIF_URING_MAXBUFS];
+	int			nbufs;
+	struct vmctx		*pinned;	/* holds a hugetlb pin */
+
+	struct iothread_mevent	iomvt;		/* completions */
+	int			iothread_id;
 };
 
 struct blockif_ctxt {
@@ -113,18 +180,32 @@ struct blockif_ctxt {
 	int			max_discard_seg;
 	int			discard_sector_alignment;
 	int			closing;
+	int			nthr;
 	pthread_t		btid[BLOCKIF_NUMTHR];
+	struct blockif_uring	*ring;		/* io_uring backend, or NULL */
+	struct blkimg		*img;		/* sparse image, or NULL if raw */
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
 
-	/* Request elements and free/pending/busy queues */
+	/*
+	 * Request elements and free/blocked/pending/busy queues. Only
+	 * requests that are ready to go are on pendq.
+	 */
 	TAILQ_HEAD(, blockif_elem) freeq;
+	TAILQ_HEAD(, blockif_elem) blockq;
 	TAILQ_HEAD(, blockif_elem) pendq;
 	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	RB_HEAD(blockif_tree, blockif_elem) tree;
+	uint64_t		seq;
+	int			maxreq;
+	struct blockif_elem	*reqs;
 
 	/* write cache enable */
 	uint8_t			wce;
+
+	/* see blockif_set_batch_done() */
+	void			(*batch_done)(void *arg);
+	void			*batch_arg;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -157,12 +238,100 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 	return err;
 }
 
+static inline void
+blockif_augment(struct blockif_elem *be)
+{
+	struct blockif_elem *child;
+	off_t maxend = be->end;
+
+	child = RB_LEFT(be, node);
+	if (child && child->maxend > maxend)
+		maxend = child->maxend;
+	child = RB_RIGHT(be, node);
+	if (child && child->maxend > maxend)
+		maxend = child->maxend;
+	be->maxend = maxend;
+}
+
+static int
+blockif_elem_cmp(struct blockif_elem *a, struct blockif_elem *b)
+{
+	if (a->start != b->start)
+		return (a->start < b->start) ? -1 : 1;
+	if (a->seq != b->seq)
+		return (a->seq < b->seq) ? -1 : 1;
+	return 0;
+}
+
+RB_GENERATE_STATIC(blockif_tree, blockif_elem, node, blockif_elem_cmp);
+
+/*
+ * The tree code only refreshes the nodes it rotates, bring the rest of
+ * the path to the root up to date.
+ */
+static void
+blockif_augment_up(struct blockif_elem *be)
+{
+	for (; be != NULL; be = RB_PARENT(be, node))
+		blockif_augment(be);
+}
+
+static inline bool
+blockif_conflict(struct blockif_elem *a, struct blockif_elem *b)
+{
+	return a->op == BOP_WRITE || b->op == BOP_WRITE;
+}
+
+/*
+ * Call visit() on each request in the subtree whose range overlaps
+ * be's.  Subtrees ending before be starts are skipped via maxend, and
+ * the walk stops once nodes start past its end.
+ */
+static void
+blockif_overlaps(struct blockif_ctxt *bc, struct blockif_elem *node,
+		 struct blockif_elem *be,
+		 void (*visit)(struct blockif_ctxt *, struct blockif_elem *,
+			       struct blockif_elem *))
+{
+	while (node != NULL && node->maxend > be->start) {
+		blockif_overlaps(bc, RB_LEFT(node, node), be, visit);
+		if (node->start >= be->end)
+			return;
+		if (node->end > be->start && node != be)
+			visit(bc, be, node);
+		node = RB_RIGHT(node, node);
+	}
+}
+
+static void
+blockif_add_dep(struct blockif_ctxt *bc, struct blockif_elem *be,
+		struct blockif_elem *tbe)
+{
+	if (blockif_conflict(be, tbe))
+		be->deps++;
+}
+
+static void
+blockif_put_dep(struct blockif_ctxt *bc, struct blockif_elem *be,
+		struct blockif_elem *tbe)
+{
+	if (tbe->seq < be->seq || !blockif_conflict(be, tbe) ||
+	    tbe->status != BST_BLOCK)
+		return;
+
+	if (--tbe->deps == 0) {
+		TAILQ_REMOVE(&bc->blockq, tbe, link);
+		tbe->status = BST_PEND;
+		TAILQ_INSERT_TAIL(&bc->pendq, tbe, link);
+	}
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
-	struct blockif_elem *be, *tbe;
-	off_t off;
+	struct blockif_elem *be;
+	off_t len;
 	int i;
 
 	be = TAILQ_FIRST(&bc->freeq);
@@ -173,34 +342,30 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->freeq, be, link);
 	be->req = breq;
 	be->op = op;
-	switch (op) {
-	case BOP_READ:
-	case BOP_WRITE:
-	case BOP_DISCARD:
-		off = breq->offset;
-		for (i = 0; i < breq->iovcnt; i++)
-			off += breq->iov[i].iov_len;
-		break;
-	default:
-		/* off = OFF_MAX; */
-		off = 1 << (sizeof(off_t) - 1);
-	}
-	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->block == breq->offset)
-			break;
+	be->seq = bc->seq++;
+	be->deps = 0;
+	be->in_tree = false;
+
+	if (op == BOP_READ || op == BOP_WRITE) {
+		for (i = 0, len = 0; i < breq->iovcnt; i++)
+			len += breq->iov[i].iov_len;
+		be->start = breq->offset;
+		be->end = breq->offset + len;
+		blockif_overlaps(bc, RB_ROOT(&bc->tree), be, blockif_add_dep);
+
+		be->maxend = be->end;
+		RB_INSERT(blockif_tree, &bc->tree, be);
+		blockif_augment_up(be);
+		be->in_tree = true;
 	}
-	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
-			if (tbe->block == breq->offset)
-				break;
-		}
-	}
-	if (tbe == NULL)
+
+	if (be->deps == 0) {
 		be->status = BST_PEND;
-	else
+		TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	} else {
 		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+		TAILQ_INSERT_TAIL(&bc->blockq, be, link);
+	}
 	return (be->status == BST_PEND);
 }
 
@@ -209,10 +374,7 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
-			break;
-	}
+	be = TAILQ_FIRST(&bc->pendq);
 	if (be == NULL)
 		return 0;
 	TAILQ_REMOVE(&bc->pendq, be, link);
@@ -226,16 +388,25 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 static void
 blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
-	struct blockif_elem *tbe;
+	struct blockif_elem *parent;
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
 		TAILQ_REMOVE(&bc->busyq, be, link);
+	else if (be->status == BST_BLOCK)
+		TAILQ_REMOVE(&bc->blockq, be, link);
 	else
 		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->req->offset == be->block)
-			tbe->status = BST_PEND;
+
+	if (be->in_tree) {
+		/* let go of the later requests waiting for this one */
+		blockif_overlaps(bc, RB_ROOT(&bc->tree), be, blockif_put_dep);
+
+		parent = RB_PARENT(be, node);
+		RB_REMOVE(blockif_tree, &bc->tree, be);
+		blockif_augment_up(parent);
+		be->in_tree = false;
 	}
+
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
@@ -300,7 +471,10 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 		segment = 1;
 	}
 	for (i = 0; i < segment; i++) {
-		if (bc->isblk) {
+		if (bc->img) {
+			/* frees the clusters the range covers */
+			err = -blkimg_discard(bc->img, arg[i][0], arg[i][1]);
+		} else if (bc->isblk) {
 			err = ioctl(bc->fd, BLKDISCARD, arg[i]);
 		} else {
 			/* FALLOC_FL_PUNCH_HOLE:
@@ -337,8 +511,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
-				 br->offset + bc->sub_file_start_lba);
+		if (bc->img) {
+			len = blkimg_preadv(bc->img, br->iov, br->iovcnt,
+					br->offset);
+			if (len < 0) {
+				err = -len;
+				break;
+			}
+		} else
+			len = preadv(bc->fd, br->iov, br->iovcnt,
+					 br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else
@@ -350,8 +532,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, br->iov, br->iovcnt,
-				  br->offset + bc->sub_file_start_lba);
+		if (bc->img) {
+			len = blkimg_pwritev(bc->img, br->iov, br->iovcnt,
+					br->offset);
+			if (len < 0) {
+				err = -len;
+				break;
+			}
+		} else
+			len = pwritev(bc->fd, br->iov, br->iovcnt,
+					  br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else {
@@ -392,6 +582,8 @@ blockif_thr(void *arg)
 		while (blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->mtx);
 			blockif_proc(bc, be);
+			if (bc->batch_done)
+				(*bc->batch_done)(bc->batch_arg);
 			pthread_mutex_lock(&bc->mtx);
 			blockif_complete(bc, be);
 		}
@@ -406,6 +598,333 @@ blockif_thr(void *arg)
 	return NULL;
 }
 
+static int
+blockif_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+blockif_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		    unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int
+blockif_uring_register(int fd, unsigned int opcode, void *arg,
+		       unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Index of the registered buffer holding the iovec, or -1.
+ */
+static int
+blockif_uring_buf(struct blockif_uring *ring, struct iovec *iov)
+{
+	uintptr_t base = (uintptr_t)iov->iov_base;
+	uintptr_t bbase;
+	int i;
+
+	for (i = 0; i < ring->nbufs; i++) {
+		bbase = (uintptr_t)ring->bufs[i].iov_base;
+		if (base >= bbase &&
+		    base + iov->iov_len <= bbase + ring->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Fill in the next submission queue entry for a request.  A single
+ * buffer in registered guest memory uses the fixed buffer opcodes.
+ * Write-through is done per write with RWF_DSYNC instead of the fsync
+ * the threads issue after pwritev().
+ */
+static void
+blockif_uring_prep(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_uring *ring = bc->ring;
+	struct blockif_req *br = be->req;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, i;
+	int buf;
+
+	tail = *ring->sq_tail;
+	i = tail & ring->sq_mask;
+	sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = 0;		/* the registered file */
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->user_data = (uintptr_t)be;
+
+	switch (be->op) {
+	case BOP_READ:
+	case BOP_WRITE:
+		sqe->off = br->offset + bc->sub_file_start_lba;
+		buf = (br->iovcnt == 1) ? blockif_uring_buf(ring, br->iov) : -1;
+		if (buf >= 0) {
+			sqe->opcode = (be->op == BOP_READ) ?
+				IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->addr = (uintptr_t)br->iov[0].iov_base;
+			sqe->len = br->iov[0].iov_len;
+			sqe->buf_index = buf;
+		} else {
+			sqe->opcode = (be->op == BOP_READ) ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)br->iov;
+			sqe->len = br->iovcnt;
+		}
+		if (be->op == BOP_WRITE && !bc->wce)
+			sqe->rw_flags = RWF_DSYNC;
+		break;
+	default:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	}
+
+	ring->sq_array[i] = i;
+	atomic_store(ring->sq_tail, tail + 1);
+	ring->to_submit++;
+	ring->inflight++;
+}
+
+/*
+ * Move the requests that are ready onto the ring; called with bc->mtx
+ * held.  Returns how many ready requests are left for the worker thread.
+ */
+static int
+blockif_uring_queue(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be, *next;
+	int left = 0;
+
+	for (be = TAILQ_FIRST(&bc->pendq); be != NULL; be = next) {
+		next = TAILQ_NEXT(be, link);
+		if (be->op == BOP_DISCARD ||
+		    (be->op == BOP_WRITE && bc->rdonly)) {
+			left++;
+			continue;
+		}
+
+		TAILQ_REMOVE(&bc->pendq, be, link);
+		be->status = BST_BUSY;
+		be->tid = 0;
+		TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+		blockif_uring_prep(bc, be);
+	}
+	return left;
+}
+
+/*
+ * Hand the queued entries to the kernel, unless a caller batches them
+ * with blockif_plug(); called with bc->mtx held.
+ */
+static void
+blockif_uring_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring = bc->ring;
+	int rc;
+
+	if (ring->plugged || ring->to_submit == 0)
+		return;
+
+	rc = blockif_uring_enter(ring->fd, ring->to_submit, 0, 0);
+	if (rc < 0) {
+		WPRINTF(("%s: io_uring_enter failed: %d\n", __func__, errno));
+		return;
+	}
+	ring->to_submit -= rc;
+}
+
+/*
+ * Iothread handler of the ring fd: reap the completions, then submit
+ * the requests they unblocked.
+ */
+static void
+blockif_uring_complete(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_uring *ring = bc->ring;
+	struct io_uring_cqe *cqe;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	unsigned int head;
+	int res, err, reaped = 0;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head == atomic_load(ring->cq_tail))
+			break;
+		reaped++;
+
+		cqe = &ring->cqes[head & ring->cq_mask];
+		be = (struct blockif_elem *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		atomic_store(ring->cq_head, head + 1);
+
+		br = be->req;
+		err = 0;
+		if (res < 0)
+			err = -res;
+		else if (be->op != BOP_FLUSH)
+			br->resid -= res;
+
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+
+		pthread_mutex_lock(&bc->mtx);
+		ring->inflight--;
+		blockif_complete(bc, be);
+		if (blockif_uring_queue(bc))
+			pthread_cond_signal(&bc->cond);
+		blockif_uring_submit(bc);
+		pthread_mutex_unlock(&bc->mtx);
+	}
+
+	if (reaped && bc->batch_done)
+		(*bc->batch_done)(bc->batch_arg);
+}
+
+static void
+blockif_uring_free(struct blockif_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	free(ring);
+}
+
+/*
+ * Set up the ring of a blockif context, with the backing file registered
+ * and completions on iothread 0.  The caller falls back to the thread
+ * pool if this fails.
+ */
+static int
+blockif_uring_init(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring;
+	struct io_uring_params p;
+	unsigned int entries;
+	char *ptr;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return -1;
+
+	/* every request in the queue must fit on the ring at once */
+	entries = BLOCKIF_URING_ENTRIES;
+	while (entries < bc->maxreq)
+		entries <<= 1;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = blockif_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		WPRINTF(("io_uring_setup failed: %d\n", errno));
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_sz = ring->cq_ring_sz =
+			MAX(ring->sq_ring_sz, ring->cq_ring_sz);
+
+	ptr = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ptr = ring->sq_ring;
+	else
+		ptr = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->cq_ring = ptr;
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = (struct io_uring_sqe *)ptr;
+
+	ring->sq_head = (void *)(ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (void *)(ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (void *)(ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (void *)(ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (void *)(ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (void *)(ring->cq_ring + p.cq_off.cqes);
+
+	if (blockif_uring_register(ring->fd, IORING_REGISTER_FILES,
+				   &bc->fd, 1) < 0) {
+		WPRINTF(("io_uring file registration failed: %d\n", errno));
+		goto fail;
+	}
+
+	ring->iothread_id = 0;
+	ring->iomvt.run = blockif_uring_complete;
+	ring->iomvt.arg = bc;
+	ring->iomvt.fd = ring->fd;
+	/* completions are reaped from the CQ ring, read() only fails */
+	ring->iomvt.nodrain = true;
+	bc->ring = ring;
+	if (iothread_add(ring->iothread_id, ring->fd, &ring->iomvt) < 0) {
+		bc->ring = NULL;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	blockif_uring_free(ring);
+	return -1;
+}
+
+/*
+ * Wait for the requests on the ring and release it.
+ */
+static void
+blockif_uring_deinit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring = bc->ring;
+
+	iothread_del(ring->iothread_id, ring->fd);
+
+	pthread_mutex_lock(&bc->mtx);
+	ring->plugged = 0;
+	blockif_uring_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+
+	while (ring->inflight) {
+		if (blockif_uring_enter(ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			break;
+		blockif_uring_complete(bc);
+	}
+
+	bc->ring = NULL;
+	if (ring->pinned)
+		hugetlb_unpin(ring->pinned);
+	blockif_uring_free(ring);
+}
+
 static void
 blockif_sigcont_handler(int signal)
 {
@@ -487,8 +1006,13 @@ sub_file_unlock(struct blockif_ctxt *bc)
 }
 
 
+/*
+ * Open a block context on the backing file of optstr. nqueues is the number
+ * of contexts the caller opens on the same file, one per request queue;
+ * they share the worker threads a single context would get.
+ */
 struct blockif_ctxt *
-blockif_open(const char *optstr, const char *ident)
+blockif_open(const char *optstr, const char *ident, int nqueues)
 {
 	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
@@ -499,6 +1023,8 @@ blockif_open(const char *optstr, const char *ident)
 	off_t size, psectsz, psectoff;
 	int fd, i, sectsz;
 	int writeback, ro, candiscard, ssopt, pssopt;
+	int use_uring, direct, oflags, maxreq;
+	struct blkimg *img = NULL;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -526,6 +1052,10 @@ blockif_open(const char *optstr, const char *ident)
 
 	candiscard = 0;
 
+	use_uring = 0;
+	direct = 0;
+	maxreq = BLOCKIF_MAXREQ;
+
 	/*
 	 * The first element in the optstring is always a pathname.
 	 * Optional elements follow
@@ -545,6 +1075,22 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=io_uring"))
+			use_uring = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			use_uring = 0;
+		else if (!strcmp(cp, "direct"))
+			direct = 1;
+		else if (!strncmp(cp, "qdepth", strlen("qdepth"))) {
+			/* qdepth=<requests in flight> */
+			if (!(strsep(&cp, "=") &&
+				!dm_strtoi(cp, &cp, 10, &maxreq) && *cp == '\0' &&
+				maxreq >= 2 && maxreq <= BLOCKIF_MAXREQ_MAX)) {
+				pr_err("Invalid qdepth, 2..%d\n",
+					BLOCKIF_MAXREQ_MAX);
+				goto err;
+			}
+		}
 		else if (!strncmp(cp, "discard", strlen("discard"))) {
 			strsep(&cp, "=");
 			if (cp != NULL) {
@@ -585,6 +1131,12 @@ blockif_open(const char *optstr, const char *ident)
 		}
 	}
 
+	/* every queue would take the OFD lock of the range for itself */
+	if (sub_file_assign && nqueues > 1) {
+		pr_err("%s: range is not supported with multiple queues\n", nopt);
+		goto err;
+	}
+
 	/*
 	 * To support "writeback" and "writethru" mode switch during runtime,
 	 * O_SYNC is not used directly, as O_SYNC flag cannot dynamic change
@@ -592,10 +1144,12 @@ blockif_open(const char *optstr, const char *ident)
 	 * operation to emulate it.
 	 */
 
-	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
+	/* "direct" bypasses the host page cache */
+	oflags = direct ? O_DIRECT : 0;
+	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | oflags);
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY);
+		fd = open(nopt, O_RDONLY | oflags);
 		ro = 1;
 	}
 
@@ -658,6 +1212,31 @@ blockif_open(const char *optstr, const char *ident)
 		}
 
 	} else {
+		/* a sparse image presents its virtual disk */
+		if (blkimg_probe(fd) > 0) {
+			if (direct || sub_file_assign) {
+				pr_err("%s: direct and range are not supported on images\n",
+					nopt);
+				goto err;
+			}
+			/*
+			 * The cluster map and allocation state live in the
+			 * blkimg, one per context; several queues would
+			 * allocate clusters of the same file independently.
+			 */
+			if (nqueues > 1) {
+				pr_err("%s: images are not supported with multiple queues\n",
+					nopt);
+				goto err;
+			}
+			img = blkimg_open(fd, nopt, ro, &err_code);
+			if (img == NULL) {
+				pr_err("Could not open image %s: %s\n", nopt,
+					strerror(-err_code));
+				goto err;
+			}
+			size = blkimg_size(img);
+		}
 		if (size < DEV_BSIZE || (size & (DEV_BSIZE - 1))) {
 			WPRINTF(("%s size not corret, should be multiple of %d\n",
 						nopt, DEV_BSIZE));
@@ -699,6 +1278,13 @@ blockif_open(const char *optstr, const char *ident)
 		pr_err("calloc");
 		goto err;
 	}
+	bc->maxreq = maxreq;
+	bc->reqs = calloc(maxreq, sizeof(struct blockif_elem));
+	if (bc->reqs == NULL) {
+		pr_err("calloc");
+		free(bc);
+		goto err;
+	}
 
 	if (sub_file_assign) {
 		DPRINTF(("sector size is %d\n", sectsz));
@@ -720,6 +1306,7 @@ blockif_open(const char *optstr, const char *ident)
 	}
 
 	bc->fd = fd;
+	bc->img = img;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->candiscard = candiscard;
 	if (candiscard) {
@@ -740,14 +1327,29 @@ blockif_open(const char *optstr, const char *ident)
 	pthread_mutex_init(&bc->mtx, NULL);
 	pthread_cond_init(&bc->cond, NULL);
 	TAILQ_INIT(&bc->freeq);
+	TAILQ_INIT(&bc->blockq);
 	TAILQ_INIT(&bc->pendq);
 	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+	RB_INIT(&bc->tree);
+	for (i = 0; i < bc->maxreq; i++) {
 		bc->reqs[i].status = BST_FREE;
 		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
+	bc->nthr = BLOCKIF_NUMTHR;
+	if (nqueues > 1)
+		bc->nthr = (nqueues < BLOCKIF_NUMTHR) ? (BLOCKIF_NUMTHR / nqueues) : 1;
+	if (use_uring && img) {
+		pr_notice("blk-%s: io_uring is not used with images\n", ident);
+	} else if (use_uring) {
+		if (blockif_uring_init(bc) == 0)
+			bc->nthr = BLOCKIF_URING_NUMTHR;
+		else
+			pr_err("blk-%s: io_uring unavailable, using threads\n",
+				ident);
+	}
+
+	for (i = 0; i < bc->nthr; i++) {
 		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
 					ident, i) >= sizeof(tname)) {
 			pr_err("blk thread name too long");
@@ -768,6 +1370,8 @@ err:
 	if (nopt)
 		free(nopt);
 
+	if (img)
+		blkimg_close(img);
 	if (fd >= 0)
 		close(fd);
 	return NULL;
@@ -785,10 +1389,15 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 	if (!TAILQ_EMPTY(&bc->freeq)) {
 		/*
 		 * Enqueue and inform the block i/o thread
-		 * that there is work available
+		 * that there is work available.  With io_uring,
+		 * the thread only gets what the ring can't do.
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bc, breq, op)) {
+			if (bc->ring == NULL || blockif_uring_queue(bc))
+				pthread_cond_signal(&bc->cond);
+			if (bc->ring)
+				blockif_uring_submit(bc);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -834,12 +1443,18 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 
 	pthread_mutex_lock(&bc->mtx);
 	/*
-	 * Check pending requests.
+	 * Check pending and blocked requests.
 	 */
 	TAILQ_FOREACH(be, &bc->pendq, link) {
 		if (be->req == breq)
 			break;
 	}
+	if (be == NULL) {
+		TAILQ_FOREACH(be, &bc->blockq, link) {
+			if (be->req == breq)
+				break;
+		}
+	}
 	if (be != NULL) {
 		/*
 		 * Found it.
@@ -865,6 +1480,14 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return -1;
 	}
 
+	/*
+	 * A request on the io_uring completes through the ring.
+	 */
+	if (be->tid == 0) {
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -918,15 +1541,21 @@ blockif_close(struct blockif_ctxt *bc)
 	pthread_cond_broadcast(&bc->cond);
 	pthread_mutex_unlock(&bc->mtx);
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->nthr; i++)
 		pthread_join(bc->btid[i], &jval);
 
+	if (bc->ring)
+		blockif_uring_deinit(bc);
+
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
 	 * Release resources
 	 */
+	if (bc->img)
+		blkimg_close(bc->img);
 	close(bc->fd);
+	free(bc->reqs);
 	free(bc);
 
 	return 0;
@@ -1004,7 +1633,7 @@ blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off)
 int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->maxreq - 1);
 }
 
 int
@@ -1049,6 +1678,96 @@ blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce)
 	bc->wce = wce;
 }
 
+/*
+ * Have cb called after each run of request callbacks, so a frontend can
+ * defer the guest notification of the requests completed together to
+ * it: the completions reaped from the io_uring at once, or a single
+ * request of the thread pool.  Called without any blockif lock held.
+ */
+void
+blockif_set_batch_done(struct blockif_ctxt *bc, void (*cb)(void *arg),
+		       void *arg)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->batch_done = cb;
+	bc->batch_arg = arg;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+/*
+ * Batch the requests issued until blockif_unplug() into one io_uring
+ * submission.  No-op for the thread pool.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	if (bc->ring == NULL)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	bc->ring->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	if (bc->ring == NULL)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	if (--bc->ring->plugged == 0)
+		blockif_uring_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+/*
+ * Register the guest memory with the io_uring, so single buffer requests
+ * use fixed buffers and skip the page pinning on every request.  Fixed
+ * buffers are at most 1 GiB, larger regions are registered in chunks.
+ * The registration pins all of guest memory, so the balloon stops
+ * returning hugepages to the host while the ring exists.
+ */
+int
+blockif_register_mem(struct blockif_ctxt *bc, struct vmctx *ctx)
+{
+	struct blockif_uring *ring = bc->ring;
+	char *base[2];
+	size_t len[2], sz;
+	int i, n;
+
+	if (ring == NULL)
+		return 0;
+
+	base[0] = ctx->baseaddr;
+	len[0] = ctx->lowmem;
+	base[1] = ctx->baseaddr + ctx->highmem_gpa_base;
+	len[1] = ctx->highmem;
+
+	for (i = 0, n = 0; i < 2; i++) {
+		while (len[i] && n < BLOCKIF_URING_MAXBUFS) {
+			sz = MIN(len[i], BLOCKIF_URING_BUFSZ);
+			ring->bufs[n].iov_base = base[i];
+			ring->bufs[n].iov_len = sz;
+			base[i] += sz;
+			len[i] -= sz;
+			n++;
+		}
+	}
+
+	/* pin first, so no hugepage is discarded under the registration */
+	hugetlb_pin(ctx);
+	if (n == 0 || blockif_uring_register(ring->fd,
+				IORING_REGISTER_BUFFERS, ring->bufs, n) < 0) {
+		WPRINTF(("io_uring buffer registration failed: %d\n", errno));
+		hugetlb_unpin(ctx);
+		return -1;
+	}
+	ring->nbufs = n;
+	ring->pinned = ctx;
+	return 0;
+}
+
 int
 blockif_flush_all(struct blockif_ctxt *bc)
 {
@@ -0,0 +1,882 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * ACRN sparse disk image, see block_img.h for the layout.
+ *
+ * Metadata is written through: an update of an L1 or L2 entry is a
+ * pwrite of that entry, issued after the cluster it points to is
+ * written. Nothing is cached dirty, so a flush of the file descriptor
+ * is a flush of the image. A crash between a cluster write and the
+ * entry pointing to it leaks the cluster, which "acrn-img check"
+ * reports and "acrn-img convert" drops.
+ *
+ * Locking: img->mtx covers the tables and the allocation, and is held
+ * across a copy-on-write so a cluster is only allocated once. Guest data
+ * in allocated clusters is read and written without it, under the read
+ * side of img->io_lock; a discard takes the write side before it punches
+ * clusters out, so no I/O can land in a cluster while it is freed.
+ */
+
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_img.h"
+
+#define BLKIMG_L2_CACHE		32	/* L2 tables kept in memory */
+#define BLKIMG_PREALLOC		(1UL << 20)	/* reserve file space by */
+#define BLKIMG_MAX_CHAIN	16	/* backing files deep */
+#define BLKIMG_MAX_SIZE		(1UL << 56)
+
+struct blkimg_l2 {
+	uint64_t	offset;		/* of the table in the file, 0 if free */
+	uint64_t	lru;
+	uint64_t	*tbl;		/* host byte order */
+};
+
+struct blkimg {
+	int		fd;
+	bool		rdonly;
+	uint32_t	cluster_bits;
+	uint64_t	cluster_size;
+	uint32_t	l2_bits;	/* entries per L2 table, log2 */
+	uint64_t	size;
+
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+	uint64_t	*l1;		/* host byte order */
+
+	struct blkimg_l2 l2_cache[BLKIMG_L2_CACHE];
+	uint64_t	lru_clock;
+
+	uint64_t	alloc_end;	/* where the next cluster goes */
+	uint64_t	prealloc_end;	/* file space reserved up to here */
+
+	char		*backing;	/* name as stored in the header */
+	struct blkimg	*backing_img;	/* backing image, or */
+	int		backing_fd;	/* raw backing file, or -1 */
+	uint64_t	backing_size;
+
+	pthread_mutex_t	mtx;
+	pthread_rwlock_t io_lock;
+};
+
+static struct blkimg *blkimg_open_chain(int fd, const char *path, bool rdonly,
+					int depth, int *err);
+
+static inline uint64_t
+blkimg_roundup(uint64_t v, uint64_t align)
+{
+	return (v + align - 1) & ~(align - 1);
+}
+
+static int
+blkimg_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0) {
+			/* past the end of the file reads as zeros */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+blkimg_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Transfer a whole iovec; it is used as scratch space.  Short reads at
+ * the end of the file are filled with zeros.
+ */
+static int
+blkimg_xfer(int fd, struct iovec *iov, int iovcnt, off_t off, bool write)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		n = write ? pwritev(fd, iov, iovcnt, off) :
+			    preadv(fd, iov, iovcnt, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0 && write)
+			return -EIO;
+		if (n == 0) {
+			for (; iovcnt > 0; iov++, iovcnt--)
+				memset(iov->iov_base, 0, iov->iov_len);
+			break;
+		}
+		off += n;
+		while (n > 0 && iovcnt > 0) {
+			if ((size_t)n < iov->iov_len) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+				n = 0;
+			} else {
+				n -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Cut [skip, skip + len) out of an iovec into sub, returns its length */
+static int
+blkimg_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+		 struct iovec *sub)
+{
+	int i, n = 0;
+	size_t l;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = iov[i].iov_len - skip;
+		if (l > len)
+			l = len;
+		sub[n].iov_base = (char *)iov[i].iov_base + skip;
+		sub[n].iov_len = l;
+		n++;
+		len -= l;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+blkimg_iov_zero(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+}
+
+/*
+ * Read what lies under an unallocated cluster: the backing file, which
+ * is shorter than the image in general, or zeros.
+ */
+static int
+blkimg_read_backing(struct blkimg *img, struct iovec *iov, int iovcnt,
+		    uint64_t off, size_t len)
+{
+	struct iovec tail[iovcnt];
+	size_t in;
+	ssize_t n;
+	int ntail;
+
+	if (off >= img->backing_size || (!img->backing_img && img->backing_fd < 0)) {
+		blkimg_iov_zero(iov, iovcnt);
+		return 0;
+	}
+
+	in = len;
+	if (off + len > img->backing_size) {
+		in = img->backing_size - off;
+		ntail = blkimg_iov_slice(iov, iovcnt, in, len - in, tail);
+		blkimg_iov_zero(tail, ntail);
+		iovcnt = blkimg_iov_slice(iov, iovcnt, 0, in, iov);
+	}
+
+	if (img->backing_img) {
+		n = blkimg_preadv(img->backing_img, iov, iovcnt, off);
+		return (n < 0) ? n : 0;
+	}
+	return blkimg_xfer(img->backing_fd, iov, iovcnt, off, false);
+}
+
+/* The L2 table at offset, loaded into the cache if needed */
+static uint64_t *
+blkimg_l2_get(struct blkimg *img, uint64_t offset, bool fresh, int *err)
+{
+	struct blkimg_l2 *l2, *victim = NULL;
+	size_t len = img->cluster_size;
+	uint64_t i;
+	int ret;
+
+	for (i = 0; i < BLKIMG_L2_CACHE; i++) {
+		l2 = &img->l2_cache[i];
+		if (l2->offset == offset) {
+			l2->lru = ++img->lru_clock;
+			return l2->tbl;
+		}
+		if (victim == NULL || l2->lru < victim->lru)
+			victim = l2;
+	}
+
+	/* nothing is dirty, the least recently used table just goes */
+	victim->offset = 0;
+	if (victim->tbl == NULL) {
+		victim->tbl = malloc(len);
+		if (victim->tbl == NULL) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+	}
+	if (fresh) {
+		memset(victim->tbl, 0, len);
+	} else {
+		ret = blkimg_pread_full(img->fd, victim->tbl, len, offset);
+		if (ret < 0) {
+			*err = ret;
+			return NULL;
+		}
+		for (i = 0; i < len / sizeof(uint64_t); i++)
+			victim->tbl[i] = le64toh(victim->tbl[i]);
+	}
+	victim->offset = offset;
+	victim->lru = ++img->lru_clock;
+	return victim->tbl;
+}
+
+static int
+blkimg_get_entry(struct blkimg *img, uint64_t cluster, uint64_t *entry)
+{
+	uint64_t l1_idx = cluster >> img->l2_bits;
+	uint64_t l2_idx = cluster & ((1UL << img->l2_bits) - 1);
+	uint64_t *tbl;
+	int err = 0;
+
+	*entry = 0;
+	if (l1_idx >= img->l1_size)
+		return -EIO;
+	if (img->l1[l1_idx] == 0)
+		return 0;
+	tbl = blkimg_l2_get(img, BLKIMG_E_OFFSET(img->l1[l1_idx]), false, &err);
+	if (tbl == NULL)
+		return err;
+	*entry = tbl[l2_idx];
+	return 0;
+}
+
+/*
+ * Hand out n clusters at the end of the file. Space is reserved ahead in
+ * BLKIMG_PREALLOC steps, without changing the file size, so consecutive
+ * clusters end up contiguous on the host file system.
+ */
+static uint64_t
+blkimg_alloc(struct blkimg *img, uint64_t n)
+{
+	uint64_t off = img->alloc_end;
+	uint64_t end;
+
+	img->alloc_end += n << img->cluster_bits;
+	if (img->alloc_end > img->prealloc_end) {
+		end = blkimg_roundup(img->alloc_end, BLKIMG_PREALLOC);
+		/* only a hint, a failure just leaves it to the writes */
+		if (fallocate(img->fd, FALLOC_FL_KEEP_SIZE, img->prealloc_end,
+			      end - img->prealloc_end) == 0)
+			img->prealloc_end = end;
+		else
+			img->prealloc_end = img->alloc_end;
+	}
+	return off;
+}
+
+static int
+blkimg_set_entry(struct blkimg *img, uint64_t cluster, uint64_t entry)
+{
+	uint64_t l1_idx = cluster >> img->l2_bits;
+	uint64_t l2_idx = cluster & ((1UL << img->l2_bits) - 1);
+	uint64_t l2_off, le;
+	uint64_t *tbl;
+	int err = 0;
+
+	l2_off = BLKIMG_E_OFFSET(img->l1[l1_idx]);
+	if (l2_off == 0) {
+		/* the new table is on disk before the L1 entry points to it */
+		l2_off = blkimg_alloc(img, 1);
+		tbl = blkimg_l2_get(img, l2_off, true, &err);
+		if (tbl == NULL)
+			return err;
+		err = blkimg_pwrite_full(img->fd, tbl, img->cluster_size, l2_off);
+		if (err < 0)
+			return err;
+		le = htole64(l2_off);
+		err = blkimg_pwrite_full(img->fd, &le, sizeof(le),
+				img->l1_offset + l1_idx * sizeof(le));
+		if (err < 0)
+			return err;
+		img->l1[l1_idx] = l2_off;
+	}
+
+	tbl = blkimg_l2_get(img, l2_off, false, &err);
+	if (tbl == NULL)
+		return err;
+	le = htole64(entry);
+	err = blkimg_pwrite_full(img->fd, &le, sizeof(le),
+			l2_off + l2_idx * sizeof(le));
+	if (err < 0)
+		return err;
+	tbl[l2_idx] = entry;
+	return 0;
+}
+
+/*
+ * First write to a cluster: build it from what lay under it and the new
+ * data, write it to a fresh cluster, then point the L2 entry at it.
+ * Called with img->mtx held.
+ */
+static int
+blkimg_cow(struct blkimg *img, uint64_t cluster, uint64_t entry, size_t coff,
+	   const struct iovec *iov, int iovcnt, size_t len)
+{
+	struct iovec whole;
+	uint64_t host;
+	char *buf;
+	size_t done;
+	int i, err;
+
+	err = posix_memalign((void **)&buf, 4096, img->cluster_size);
+	if (err)
+		return -err;
+
+	if (len < img->cluster_size) {
+		whole.iov_base = buf;
+		whole.iov_len = img->cluster_size;
+		if (entry & BLKIMG_E_ZERO)
+			memset(buf, 0, img->cluster_size);
+		else {
+			err = blkimg_read_backing(img, &whole, 1,
+					cluster << img->cluster_bits,
+					img->cluster_size);
+			if (err < 0)
+				goto out;
+		}
+	}
+	for (i = 0, done = 0; i < iovcnt; i++) {
+		memcpy(buf + coff + done, iov[i].iov_base, iov[i].iov_len);
+		done += iov[i].iov_len;
+	}
+
+	host = blkimg_alloc(img, 1);
+	err = blkimg_pwrite_full(img->fd, buf, img->cluster_size, host);
+	if (err == 0)
+		err = blkimg_set_entry(img, cluster, host);
+out:
+	free(buf);
+	return err;
+}
+
+static ssize_t
+blkimg_rw(struct blkimg *img, const struct iovec *iov, int iovcnt,
+	  off_t offset, bool write)
+{
+	struct iovec sub[iovcnt];
+	uint64_t cluster, entry, host;
+	size_t total, done, coff, len;
+	int i, nsub, err = 0;
+	bool cow;
+
+	if (iovcnt <= 0)
+		return 0;
+	for (i = 0, total = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset < 0 || offset + total > img->size)
+		return -EINVAL;
+	if (write && img->rdonly)
+		return -EROFS;
+
+	pthread_rwlock_rdlock(&img->io_lock);
+	for (done = 0; done < total && err == 0; done += len) {
+		cluster = (offset + done) >> img->cluster_bits;
+		coff = (offset + done) & (img->cluster_size - 1);
+		len = img->cluster_size - coff;
+		if (len > total - done)
+			len = total - done;
+		nsub = blkimg_iov_slice(iov, iovcnt, done, len, sub);
+
+		pthread_mutex_lock(&img->mtx);
+		err = blkimg_get_entry(img, cluster, &entry);
+		host = BLKIMG_E_OFFSET(entry);
+		cow = (err == 0 && write && host == 0);
+		if (cow)
+			err = blkimg_cow(img, cluster, entry, coff, sub, nsub, len);
+		pthread_mutex_unlock(&img->mtx);
+		if (err < 0 || cow)
+			continue;
+
+		if (host)
+			err = blkimg_xfer(img->fd, sub, nsub, host + coff, write);
+		else if (entry & BLKIMG_E_ZERO)
+			blkimg_iov_zero(sub, nsub);
+		else
+			err = blkimg_read_backing(img, sub, nsub,
+					offset + done, len);
+	}
+	pthread_rwlock_unlock(&img->io_lock);
+
+	return (err < 0) ? err : (ssize_t)total;
+}
+
+ssize_t
+blkimg_preadv(struct blkimg *img, const struct iovec *iov, int iovcnt,
+	      off_t offset)
+{
+	return blkimg_rw(img, iov, iovcnt, offset, false);
+}
+
+ssize_t
+blkimg_pwritev(struct blkimg *img, const struct iovec *iov, int iovcnt,
+	       off_t offset)
+{
+	return blkimg_rw(img, iov, iovcnt, offset, true);
+}
+
+/*
+ * Free the clusters wholly inside the range. They read as zeros from
+ * then on, which takes an explicit zero entry over a backing file.
+ */
+int
+blkimg_discard(struct blkimg *img, off_t offset, off_t len)
+{
+	uint64_t cluster, last, entry, new;
+	bool backing = img->backing_img || img->backing_fd >= 0;
+	int err = 0;
+
+	if (img->rdonly)
+		return -EROFS;
+	if (offset < 0 || len < 0 || offset + len > img->size)
+		return -EINVAL;
+
+	cluster = blkimg_roundup(offset, img->cluster_size) >> img->cluster_bits;
+	last = (offset + len) >> img->cluster_bits;
+	/* the partial cluster at the end of the disk counts as whole */
+	if (offset + len == img->size)
+		last = blkimg_roundup(img->size, img->cluster_size) >>
+			img->cluster_bits;
+
+	pthread_rwlock_wrlock(&img->io_lock);
+	pthread_mutex_lock(&img->mtx);
+	for (; cluster < last && err == 0; cluster++) {
+		err = blkimg_get_entry(img, cluster, &entry);
+		if (err < 0)
+			break;
+		new = backing ? BLKIMG_E_ZERO : 0;
+		if (entry == new)
+			continue;
+		err = blkimg_set_entry(img, cluster, new);
+		if (err == 0 && BLKIMG_E_OFFSET(entry) &&
+		    fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      BLKIMG_E_OFFSET(entry), img->cluster_size) < 0 &&
+		    errno != EOPNOTSUPP)
+			err = -errno;
+	}
+	pthread_mutex_unlock(&img->mtx);
+	pthread_rwlock_unlock(&img->io_lock);
+	return err;
+}
+
+int
+blkimg_probe(int fd)
+{
+	struct blkimg_header hdr;
+	ssize_t n;
+
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	if (n < 0)
+		return -errno;
+	return (n == sizeof(hdr) &&
+		!memcmp(hdr.magic, BLKIMG_MAGIC, sizeof(hdr.magic)));
+}
+
+/* A backing file name is relative to the image that refers to it */
+static int
+blkimg_backing_path(char *bpath, size_t len, const char *path,
+		    const char *backing)
+{
+	const char *slash = strrchr(path, '/');
+	int ret;
+
+	if (backing[0] == '/' || slash == NULL)
+		ret = snprintf(bpath, len, "%s", backing);
+	else
+		ret = snprintf(bpath, len, "%.*s/%s",
+			(int)(slash - path), path, backing);
+	if (ret < 0 || ret >= len)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+static int
+blkimg_open_backing(struct blkimg *img, const char *path, int depth)
+{
+	char bpath[PATH_MAX];
+	struct stat sbuf;
+	int fd, ret, err = 0;
+
+	ret = blkimg_backing_path(bpath, sizeof(bpath), path, img->backing);
+	if (ret < 0)
+		return ret;
+
+	fd = open(bpath, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = blkimg_probe(fd);
+	if (ret > 0) {
+		img->backing_img = blkimg_open_chain(fd, bpath, true, depth + 1,
+				&err);
+		if (img->backing_img == NULL) {
+			close(fd);
+			return err;
+		}
+		img->backing_size = img->backing_img->size;
+	} else if (ret == 0 && fstat(fd, &sbuf) == 0) {
+		img->backing_fd = fd;
+		img->backing_size = lseek(fd, 0, SEEK_END);
+	} else {
+		close(fd);
+		return ret < 0 ? ret : -errno;
+	}
+	return 0;
+}
+
+static struct blkimg *
+blkimg_open_chain(int fd, const char *path, bool rdonly, int depth, int *err)
+{
+	struct blkimg_header hdr;
+	struct blkimg *img;
+	struct stat sbuf;
+	uint64_t l2_span;
+	int i, ret;
+
+	if (depth > BLKIMG_MAX_CHAIN) {
+		*err = -ELOOP;
+		return NULL;
+	}
+
+	ret = blkimg_pread_full(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0) {
+		*err = ret;
+		return NULL;
+	}
+	if (memcmp(hdr.magic, BLKIMG_MAGIC, sizeof(hdr.magic)) ||
+	    le32toh(hdr.version) != BLKIMG_VERSION) {
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	img->fd = fd;
+	img->rdonly = rdonly;
+	img->backing_fd = -1;
+	img->cluster_bits = le32toh(hdr.cluster_bits);
+	img->size = le64toh(hdr.size);
+	img->l1_offset = le64toh(hdr.l1_offset);
+	img->l1_size = le32toh(hdr.l1_size);
+	pthread_mutex_init(&img->mtx, NULL);
+	pthread_rwlock_init(&img->io_lock, NULL);
+
+	ret = -EINVAL;
+	if (img->cluster_bits < BLKIMG_MIN_CLUSTER_BITS ||
+	    img->cluster_bits > BLKIMG_MAX_CLUSTER_BITS ||
+	    img->size > BLKIMG_MAX_SIZE)
+		goto fail;
+	img->cluster_size = 1UL << img->cluster_bits;
+	img->l2_bits = img->cluster_bits - 3;
+	l2_span = 1UL << (img->cluster_bits + img->l2_bits);
+	if (img->l1_size < blkimg_roundup(img->size, l2_span) / l2_span ||
+	    img->l1_offset < img->cluster_size ||
+	    (img->l1_offset & (img->cluster_size - 1)) ||
+	    le32toh(hdr.backing_len) >= img->cluster_size - sizeof(hdr))
+		goto fail;
+
+	ret = -ENOMEM;
+	img->l1 = calloc(img->l1_size, sizeof(uint64_t));
+	if (img->l1 == NULL)
+		goto fail;
+	ret = blkimg_pread_full(fd, img->l1, img->l1_size * sizeof(uint64_t),
+			img->l1_offset);
+	if (ret < 0)
+		goto fail;
+	for (i = 0; i < img->l1_size; i++)
+		img->l1[i] = le64toh(img->l1[i]);
+
+	if (hdr.backing_len) {
+		ret = -ENOMEM;
+		img->backing = calloc(1, le32toh(hdr.backing_len) + 1);
+		if (img->backing == NULL)
+			goto fail;
+		ret = blkimg_pread_full(fd, img->backing,
+				le32toh(hdr.backing_len), sizeof(hdr));
+		if (ret < 0)
+			goto fail;
+		ret = blkimg_open_backing(img, path, depth);
+		if (ret < 0)
+			goto fail;
+	}
+
+	if (fstat(fd, &sbuf) < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	img->alloc_end = blkimg_roundup(sbuf.st_size, img->cluster_size);
+	img->prealloc_end = img->alloc_end;
+	return img;
+
+fail:
+	blkimg_close(img);
+	*err = ret;
+	return NULL;
+}
+
+/*
+ * Open the image on fd; path locates its backing file. The caller keeps
+ * ownership of fd.
+ */
+struct blkimg *
+blkimg_open(int fd, const char *path, bool rdonly, int *err)
+{
+	return blkimg_open_chain(fd, path, rdonly, 0, err);
+}
+
+void
+blkimg_close(struct blkimg *img)
+{
+	int i;
+
+	if (img->backing_img) {
+		close(img->backing_img->fd);
+		blkimg_close(img->backing_img);
+	}
+	if (img->backing_fd >= 0)
+		close(img->backing_fd);
+	for (i = 0; i < BLKIMG_L2_CACHE; i++)
+		free(img->l2_cache[i].tbl);
+	free(img->backing);
+	free(img->l1);
+	pthread_rwlock_destroy(&img->io_lock);
+	pthread_mutex_destroy(&img->mtx);
+	free(img);
+}
+
+uint64_t
+blkimg_size(struct blkimg *img)
+{
+	return img->size;
+}
+
+uint64_t
+blkimg_cluster_size(struct blkimg *img)
+{
+	return img->cluster_size;
+}
+
+const char *
+blkimg_backing(struct blkimg *img)
+{
+	return img->backing;
+}
+
+int
+blkimg_create(const char *path, uint64_t size, int cluster_bits,
+	      const char *backing)
+{
+	struct blkimg_header hdr;
+	struct blkimg *bimg;
+	uint64_t cluster_size, l2_span, l1_len;
+	size_t blen = backing ? strlen(backing) : 0;
+	char bpath[PATH_MAX];
+	char *buf;
+	int fd, bfd, ret = 0;
+
+	if (cluster_bits < BLKIMG_MIN_CLUSTER_BITS ||
+	    cluster_bits > BLKIMG_MAX_CLUSTER_BITS)
+		return -EINVAL;
+	cluster_size = 1UL << cluster_bits;
+	if (blen >= cluster_size - sizeof(hdr))
+		return -ENAMETOOLONG;
+
+	/* the size defaults to the backing file's */
+	if (backing && size == 0) {
+		ret = blkimg_backing_path(bpath, sizeof(bpath), path, backing);
+		if (ret < 0)
+			return ret;
+		bfd = open(bpath, O_RDONLY);
+		if (bfd < 0)
+			return -errno;
+		if (blkimg_probe(bfd) > 0) {
+			bimg = blkimg_open(bfd, bpath, true, &ret);
+			if (bimg) {
+				size = bimg->size;
+				blkimg_close(bimg);
+			}
+		} else {
+			size = lseek(bfd, 0, SEEK_END);
+		}
+		close(bfd);
+		if (ret < 0)
+			return ret;
+	}
+	if (size == 0 || size > BLKIMG_MAX_SIZE)
+		return -EINVAL;
+
+	l2_span = 1UL << (2 * cluster_bits - 3);
+	memcpy(hdr.magic, BLKIMG_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(BLKIMG_VERSION);
+	hdr.cluster_bits = htole32(cluster_bits);
+	hdr.size = htole64(size);
+	hdr.l1_offset = htole64(cluster_size);
+	hdr.l1_size = htole32(blkimg_roundup(size, l2_span) / l2_span);
+	hdr.backing_len = htole32(blen);
+	l1_len = blkimg_roundup(le32toh(hdr.l1_size) * sizeof(uint64_t),
+			cluster_size);
+
+	buf = calloc(1, cluster_size + l1_len);
+	if (buf == NULL)
+		return -ENOMEM;
+	memcpy(buf, &hdr, sizeof(hdr));
+	if (blen)
+		memcpy(buf + sizeof(hdr), backing, blen);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = blkimg_pwrite_full(fd, buf, cluster_size + l1_len, 0);
+	if (ret == 0 && fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+static int
+blkimg_check_ref(struct blkimg *img, uint8_t *map, uint64_t nclusters,
+		 uint64_t off, struct blkimg_check *res)
+{
+	uint64_t c = off >> img->cluster_bits;
+
+	if ((off & (img->cluster_size - 1)) || c >= nclusters || map[c]) {
+		res->errors++;
+		return -1;
+	}
+	map[c] = 1;
+	return 0;
+}
+
+/*
+ * Walk the tables: every table and cluster must be aligned, inside the
+ * file and referenced once. Clusters nothing refers to but that hold
+ * data are leaks.
+ */
+int
+blkimg_check(struct blkimg *img, struct blkimg_check *res)
+{
+	uint64_t nclusters, c, l1_clusters, e, off;
+	struct stat sbuf;
+	uint64_t *tbl;
+	uint8_t *map;
+	int i, j, err = 0;
+
+	memset(res, 0, sizeof(*res));
+	if (fstat(img->fd, &sbuf) < 0)
+		return -errno;
+	nclusters = blkimg_roundup(sbuf.st_size, img->cluster_size) >>
+		img->cluster_bits;
+	map = calloc(nclusters ? nclusters : 1, 1);
+	if (map == NULL)
+		return -ENOMEM;
+
+	l1_clusters = blkimg_roundup(img->l1_size * sizeof(uint64_t),
+			img->cluster_size) >> img->cluster_bits;
+	map[0] = 1;
+	for (c = 0; c < l1_clusters; c++)
+		blkimg_check_ref(img, map, nclusters,
+			img->l1_offset + (c << img->cluster_bits), res);
+
+	pthread_mutex_lock(&img->mtx);
+	for (i = 0; i < img->l1_size; i++) {
+		off = BLKIMG_E_OFFSET(img->l1[i]);
+		if (off == 0)
+			continue;
+		if (blkimg_check_ref(img, map, nclusters, off, res))
+			continue;
+		res->l2_tables++;
+		tbl = blkimg_l2_get(img, off, false, &err);
+		if (tbl == NULL)
+			break;
+		for (j = 0; j < (1 << img->l2_bits); j++) {
+			e = tbl[j];
+			if (e & BLKIMG_E_ZERO)
+				res->zero++;
+			if (BLKIMG_E_OFFSET(e) == 0)
+				continue;
+			if (blkimg_check_ref(img, map, nclusters,
+					BLKIMG_E_OFFSET(e), res) == 0)
+				res->allocated++;
+		}
+	}
+	pthread_mutex_unlock(&img->mtx);
+
+	for (c = 0; c < nclusters && err == 0; c++) {
+		if (map[c])
+			continue;
+		/* punched out by a discard, or never written */
+		off = lseek(img->fd, c << img->cluster_bits, SEEK_DATA);
+		if (off == (c << img->cluster_bits))
+			res->leaked++;
+	}
+	free(map);
+	return err;
+}
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <pthread.h>
 #include <inttypes.h>
 #include <openssl/md5.h>
@@ -132,6 +133,7 @@ struct ahci_port {
 	uint8_t asc;
 	u_int ccs;
 	uint32_t pending;
+	uint32_t sdb_done;	/* NCQ slots completed, not reported yet */
 
 	uint32_t clb;
 	uint32_t clbu;
@@ -370,14 +372,28 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 		p->err_cfis[3] = error;
 		memcpy(&p->err_cfis[4], cfis + 4, 16);
 	} else {
-		*(uint32_t *)(fis + 4) = (1 << slot);
-		p->sact &= ~(1 << slot);
+		p->sdb_done |= (1 << slot);
+		*(uint32_t *)(fis + 4) = p->sdb_done;
+		p->sact &= ~p->sdb_done;
+		p->sdb_done = 0;
 	}
 	p->tfd &= ~0x77;
 	p->tfd |= tfd;
 	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
 }
 
+/*
+ * Report the NCQ commands completed since the last SDB FIS with one
+ * more, so a burst of completions raises a single interrupt.
+ */
+static void
+ahci_flush_sdb(struct ahci_port *p)
+{
+	if (p->sdb_done != 0)
+		ahci_write_fis_sdb(p, ffs(p->sdb_done) - 1, NULL,
+		    ATA_S_READY | ATA_S_DSC);
+}
+
 static void
 ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -457,6 +473,7 @@ ahci_check_stopped(struct ahci_port *p)
 			p->cmd &= ~(AHCI_P_CMD_CR | AHCI_P_CMD_CCS_MASK);
 			p->ci = 0;
 			p->sact = 0;
+			p->sdb_done = 0;
 			p->waitforclear = 0;
 		}
 	}
@@ -513,6 +530,7 @@ ahci_port_reset(struct ahci_port *pr)
 {
 	pr->serr = 0;
 	pr->sact = 0;
+	pr->sdb_done = 0;
 	pr->xfermode = ATA_UDMA6;
 	pr->mult_sectors = 128;
 
@@ -1871,7 +1889,10 @@ ahci_handle_port(struct ahci_port *p)
 	/*
 	 * Search for any new commands to issue ignoring those that
 	 * are already in-flight.  Stop if device is busy or in error.
+	 * The queued commands found go to the backend together.
 	 */
+	if (p->bctx)
+		blockif_plug(p->bctx);
 	for (; (p->ci & ~p->pending) != 0; p->ccs = ((p->ccs + 1) & 31)) {
 		if ((p->tfd & (ATA_S_BUSY | ATA_S_DRQ)) != 0)
 			break;
@@ -1883,6 +1904,8 @@ ahci_handle_port(struct ahci_port *p)
 			ahci_handle_slot(p, p->ccs);
 		}
 	}
+	if (p->bctx)
+		blockif_unplug(p->bctx);
 }
 
 /*
@@ -1946,9 +1969,13 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 		tfd = ATA_S_READY | ATA_S_DSC;
 	else
 		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
-	if (ncq)
+	if (ncq && !err) {
+		/* reported with the rest of the batch, see ahci_batch_done() */
+		p->sdb_done |= (1 << slot);
+	} else if (ncq) {
+		ahci_flush_sdb(p);
 		ahci_write_fis_sdb(p, slot, cfis, tfd);
-	else
+	} else
 		ahci_write_fis_d2h(p, slot, cfis, tfd);
 
 	/*
@@ -1963,6 +1990,20 @@ out:
 	DPRINTF("%s exit\n", __func__);
 }
 
+/*
+ * blockif batch callback: the completions of a burst are in, tell the
+ * guest about the NCQ commands among them.
+ */
+static void
+ahci_batch_done(void *arg)
+{
+	struct ahci_port *p = arg;
+
+	pthread_mutex_lock(&p->ahci_dev->mtx);
+	ahci_flush_sdb(p);
+	pthread_mutex_unlock(&p->ahci_dev->mtx);
+}
+
 static void
 atapi_ioreq_cb(struct blockif_req *br, int err)
 {
@@ -2056,6 +2097,9 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 	}
 
 	TAILQ_INIT(&pr->iobhd);
+
+	if (!pr->atapi)
+		blockif_set_batch_done(pr->bctx, ahci_batch_done, pr);
 	return 0;
 }
 
@@ -2405,12 +2449,13 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 		 */
 		snprintf(bident, sizeof(bident), "%02x:%02x:%02x", dev->slot,
 		    dev->func, p);
-		bctxt = blockif_open(opts, bident);
+		bctxt = blockif_open(opts, bident, 1);
 		if (bctxt == NULL) {
 			ahci_dev->ports = p;
 			ret = 1;
 			goto open_fail;
 		}
+		blockif_register_mem(bctxt, ctx);
 		ahci_dev->port[p].bctx = bctxt;
 		ahci_dev->port[p].ahci_dev = ahci_dev;
 		ahci_dev->port[p].port = p;
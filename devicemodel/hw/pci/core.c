@@ -48,6 +48,7 @@
 #include "sw_load.h"
 #include "log.h"
 #include "vdisplay.h"
+#include "snapshot.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -507,6 +508,7 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		    port >= pdi->bar[i].addr &&
 		    port + bytes <= pdi->bar[i].addr + pdi->bar[i].size) {
 			offset = port - pdi->bar[i].addr;
+			pthread_mutex_lock(&pdi->emul_lock);
 			if (in) {
 				*eax = (*ops->vdev_barread)(ctx, vcpu, pdi, i,
 				                            offset, bytes);
@@ -514,6 +516,7 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 			} else
 				(*ops->vdev_barwrite)(ctx, vcpu, pdi, i, offset,
 				                      bytes, bar_value(bytes, *eax));
+			pthread_mutex_unlock(&pdi->emul_lock);
 			return 0;
 		}
 	}
@@ -536,6 +539,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 
 	offset = addr - pdi->bar[bidx].addr;
 
+	pthread_mutex_lock(&pdi->emul_lock);
 	if (dir == MEM_F_WRITE) {
 		if (size == 8) {
 			(*ops->vdev_barwrite)(ctx, vcpu, pdi, bidx, offset,
@@ -564,6 +568,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 			*val = bar_value(size, *val);
 		}
 	}
+	pthread_mutex_unlock(&pdi->emul_lock);
 
 	return 0;
 }
@@ -1027,11 +1032,108 @@ pci_emul_finddev(char *name)
 	return NULL;
 }
 
+struct pci_vdev_snapshot {
+	uint8_t		cfgdata[PCI_REGMAX + 1];
+	uint64_t	bar_addr[PCI_BARMAX + 2];
+	int32_t		msi_enabled;
+	int32_t		msix_enabled;
+	int32_t		msix_function_mask;
+	int32_t		msix_table_count;
+	uint64_t	msi_addr;
+	uint64_t	msi_msg_data;
+};
+
+static bool
+bar_decoding(struct pci_vdev *dev, int idx)
+{
+	switch (dev->bar[idx].type) {
+	case PCIBAR_IO:
+		return porten(dev);
+	case PCIBAR_MEM32:
+	case PCIBAR_MEM64:
+		return memen(dev);
+	default:
+		return false;
+	}
+}
+
+static int
+pci_emul_snapshot_save(void *arg, int fd)
+{
+	struct pci_vdev *dev = arg;
+	struct pci_vdev_snapshot snap;
+	int i, ret;
+
+	memset(&snap, 0, sizeof(snap));
+	memcpy(snap.cfgdata, dev->cfgdata, sizeof(snap.cfgdata));
+	for (i = 0; i <= PCI_BARMAX + 1; i++)
+		snap.bar_addr[i] = dev->bar[i].addr;
+	snap.msi_enabled = dev->msi.enabled;
+	snap.msi_addr = dev->msi.addr;
+	snap.msi_msg_data = dev->msi.msg_data;
+	snap.msix_enabled = dev->msix.enabled;
+	snap.msix_function_mask = dev->msix.function_mask;
+	snap.msix_table_count = dev->msix.table ? dev->msix.table_count : 0;
+
+	ret = snapshot_write(fd, &snap, sizeof(snap));
+	if (ret == 0 && snap.msix_table_count > 0)
+		ret = snapshot_write(fd, dev->msix.table,
+			snap.msix_table_count * sizeof(struct msix_table_entry));
+	return ret;
+}
+
+static int
+pci_emul_snapshot_restore(void *arg, int fd, uint32_t len)
+{
+	struct pci_vdev *dev = arg;
+	struct pci_vdev_snapshot snap;
+	int i, ret;
+
+	if (len < sizeof(snap))
+		return -EINVAL;
+	ret = snapshot_read(fd, &snap, sizeof(snap));
+	if (ret < 0)
+		return ret;
+	if (snap.msix_table_count != (dev->msix.table ? dev->msix.table_count : 0))
+		return -EINVAL;
+
+	/* drop the current BAR decoding before the command register changes */
+	for (i = 0; i <= PCI_BARMAX; i++) {
+		if (bar_decoding(dev, i))
+			unregister_bar(dev, i);
+	}
+
+	memcpy(dev->cfgdata, snap.cfgdata, sizeof(dev->cfgdata));
+	for (i = 0; i <= PCI_BARMAX + 1; i++)
+		dev->bar[i].addr = snap.bar_addr[i];
+	dev->msi.enabled = snap.msi_enabled;
+	dev->msi.addr = snap.msi_addr;
+	dev->msi.msg_data = snap.msi_msg_data;
+	dev->msix.enabled = snap.msix_enabled;
+	dev->msix.function_mask = snap.msix_function_mask;
+	if (snap.msix_table_count > 0)
+		ret = snapshot_read(fd, dev->msix.table,
+			snap.msix_table_count * sizeof(struct msix_table_entry));
+
+	for (i = 0; i <= PCI_BARMAX; i++) {
+		if (bar_decoding(dev, i))
+			register_bar(dev, i);
+	}
+
+	return ret;
+}
+
+static struct snapshot_ops pci_emul_snapshot_ops = {
+	.save		= pci_emul_snapshot_save,
+	.restore	= pci_emul_snapshot_restore,
+};
+
 static int
 pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	      int func, struct funcinfo *fi)
 {
 	struct pci_vdev *pdi;
+	char name[SNAPSHOT_NAME_LEN];
 	int err;
 
 	pdi = calloc(1, sizeof(struct pci_vdev));
@@ -1045,6 +1147,7 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pdi->slot = slot;
 	pdi->func = func;
 	pthread_mutex_init(&pdi->lintr.lock, NULL);
+	pthread_mutex_init(&pdi->emul_lock, NULL);
 	pdi->lintr.pin = 0;
 	pdi->lintr.state = IDLE;
 	pdi->lintr.pirq_pin = 0;
@@ -1064,10 +1167,14 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	else
 		fi->fi_param = NULL;
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
-	if (err == 0)
+	if (err == 0) {
 		fi->fi_devi = pdi;
-	else
+		snprintf(name, sizeof(name), "pci@%x:%x.%x", bus, slot, func);
+		snapshot_register(name, &pci_emul_snapshot_ops, pdi, pdi);
+	} else {
+		pthread_mutex_destroy(&pdi->emul_lock);
 		free(pdi);
+	}
 
 	return err;
 }
@@ -1082,9 +1189,11 @@ pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		free(fi->fi_param);
 
 	if (fi->fi_devi) {
+		snapshot_unregister(fi->fi_devi);
 		pci_lintr_release(fi->fi_devi);
 		pci_emul_free_bars(fi->fi_devi);
 		pci_emul_free_msixcap(fi->fi_devi);
+		pthread_mutex_destroy(&fi->fi_devi->emul_lock);
 		free(fi->fi_devi);
 	}
 }
@@ -2406,6 +2515,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 	}
 
 	ops = dev->dev_ops;
+	pthread_mutex_lock(&dev->emul_lock);
 
 	/*
 	 * For non-passthru device, extended config space is NOT supported.
@@ -2429,7 +2539,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 				if (coff <= PCI_REGMAX + 4)
 					*eax = 0x00000000;
 			}
-			return;
+			goto done;
 		}
 	}
 
@@ -2454,7 +2564,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 		if (ops->vdev_cfgwrite != NULL &&
 		    (*ops->vdev_cfgwrite)(ctx, vcpu, dev,
 					  coff, bytes, *eax) == 0)
-			return;
+			goto done;
 
 		/*
 		 * Special handling for write to BAR registers
@@ -2465,7 +2575,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 			 * 4-byte aligned.
 			 */
 			if (bytes != 4 || (coff & 0x3) != 0)
-				return;
+				goto done;
 			idx = (coff - PCIR_BAR(0)) / 4;
 			mask = ~(dev->bar[idx].size - 1);
 
@@ -2546,7 +2656,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 				break;
 			default:
 				pr_err("%s: invalid bar type %d\n", __func__, dev->bar[idx].type);
-				return;
+				goto done;
 			}
 			pci_set_cfgdata32(dev, coff, bar);
 
@@ -2560,6 +2670,9 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 			CFGWRITE(dev, coff, *eax, bytes);
 		}
 	}
+
+done:
+	pthread_mutex_unlock(&dev->emul_lock);
 }
 
 int
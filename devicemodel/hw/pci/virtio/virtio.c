@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "dm.h"
@@ -42,6 +43,8 @@
 #include "hsm_ioctl_defs.h"
 #include "iothread.h"
 #include "vmmapi.h"
+#include "snapshot.h"
+#include "dm_string.h"
 #include <errno.h>
 
 /*
@@ -59,6 +62,16 @@
 static uint8_t virtio_poll_enabled;
 static size_t virtio_poll_interval;
 
+/*
+ * The lock the iothread work on a queue runs under: the queue's own if it
+ * has one, so the queues of a device can be serviced in parallel.
+ */
+static inline pthread_mutex_t *
+vq_iothread_mtx(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	return vq->mtx ? vq->mtx : base->mtx;
+}
+
 static
 void iothread_handler(void *arg)
 {
@@ -66,14 +79,309 @@ void iothread_handler(void *arg)
 	struct virtio_base *base = viothrd->base;
 	int idx = viothrd->idx;
 	struct virtio_vq_info *vq = &base->queues[idx];
+	pthread_mutex_t *mtx = vq_iothread_mtx(base, vq);
 
 	if (viothrd->iothread_run) {
-		if (base->mtx)
-			pthread_mutex_lock(base->mtx);
+		if (mtx)
+			pthread_mutex_lock(mtx);
 		(*viothrd->iothread_run)(base, vq);
-		if (base->mtx)
-			pthread_mutex_unlock(base->mtx);
+		if (mtx)
+			pthread_mutex_unlock(mtx);
+	}
+}
+
+int
+virtio_parse_iothread_opt(char *opt, int *ids, int *nr)
+{
+	char *str, *cp, *tok, *end;
+	int id, ret = -1;
+
+	*nr = 0;
+	if (strcmp(opt, "iothread") == 0)
+		return 0;
+
+	if (strncmp(opt, "iothread=", 9) != 0)
+		return -1;
+
+	str = cp = strdup(opt + 9);
+	if (!str)
+		return -1;
+
+	while ((tok = strsep(&cp, ":")) != NULL) {
+		if (dm_strtoi(tok, &end, 10, &id) || (*end != '\0') ||
+		    !iothread_valid(id) || (*nr >= IOTHREAD_NUM_MAX)) {
+			pr_err("%s: invalid iothread %s\n", __func__, tok);
+			*nr = 0;
+			goto out;
+		}
+		ids[(*nr)++] = id;
+	}
+
+	ret = 0;
+out:
+	free(str);
+	return ret;
+}
+
+int
+virtio_parse_coalesce_opt(char *opt, uint32_t *frames, uint32_t *usecs)
+{
+	char *cp, *end;
+	u_int val;
+
+	if (strncmp(opt, "coalesce=", 9) != 0)
+		return -1;
+
+	cp = opt + 9;
+	if (dm_strtoui(cp, &end, 10, &val) || (*end != ':'))
+		goto err;
+	*frames = val;
+
+	cp = end + 1;
+	if (dm_strtoui(cp, &end, 10, &val) || (*end != '\0'))
+		goto err;
+	*usecs = val;
+	return 0;
+
+err:
+	pr_err("%s: invalid option %s\n", __func__, opt);
+	return -1;
+}
+
+static inline uint64_t
+virtio_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Account for and drop the held back interrupt; the caller delivers
+ * it after releasing coal->mtx.
+ */
+static bool
+vq_coalesce_flush_locked(struct virtio_vq_coalesce *coal, uint64_t now)
+{
+	if (coal->pending == 0)
+		return false;
+
+	coal->interrupts++;
+	coal->delay_ns += now - coal->pending_ns;
+	coal->pending = 0;
+	coal->armed = false;
+	return true;
+}
+
+/* the coalescing timer expired, runs in the queue's iothread */
+static void
+vq_coalesce_timer(void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_vq_coalesce *coal = &vq->coal;
+	uint64_t expirations;
+	bool fire;
+
+	if (read(coal->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	pthread_mutex_lock(&coal->mtx);
+	fire = coal->armed && vq_coalesce_flush_locked(coal, virtio_now_ns());
+	pthread_mutex_unlock(&coal->mtx);
+
+	if (fire && vq_ring_ready(vq))
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * Deliver, or hold back, the interrupt vq_endchains() decided on.
+ * Buffers used while an interrupt is held back ride on it, whether or
+ * not they crossed the guest's event index themselves.
+ */
+static void
+vq_coalesce_signal(struct virtio_vq_info *vq, int intr, uint16_t nused)
+{
+	struct virtio_vq_coalesce *coal = &vq->coal;
+	struct itimerspec its;
+	bool fire = false;
+	uint64_t now;
+
+	if (!coal->timer_ready || coal->max_usecs == 0) {
+		if (intr)
+			vq_interrupt(vq->base, vq);
+		return;
 	}
+
+	pthread_mutex_lock(&coal->mtx);
+	if (intr || coal->pending) {
+		now = virtio_now_ns();
+		if (coal->pending == 0)
+			coal->pending_ns = now;
+		else if (intr)
+			coal->saved++;
+		coal->pending += nused;
+
+		if (coal->max_frames && (coal->pending >= coal->max_frames)) {
+			fire = vq_coalesce_flush_locked(coal, now);
+		} else if (!coal->armed) {
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = coal->max_usecs / 1000000;
+			its.it_value.tv_nsec = (coal->max_usecs % 1000000) * 1000;
+			if (timerfd_settime(coal->timer_fd, 0, &its, NULL) == 0)
+				coal->armed = true;
+			else
+				fire = vq_coalesce_flush_locked(coal, now);
+		}
+	}
+	pthread_mutex_unlock(&coal->mtx);
+
+	if (fire)
+		vq_interrupt(vq->base, vq);
+}
+
+int
+vq_set_coalesce(struct virtio_vq_info *vq, uint32_t max_frames,
+		uint32_t max_usecs)
+{
+	struct virtio_vq_coalesce *coal = &vq->coal;
+	struct virtio_base *base = vq->base;
+	bool fire = false;
+
+	if (max_usecs && !coal->timer_ready) {
+		coal->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		if (coal->timer_fd < 0) {
+			pr_err("%s: timerfd_create failed, error is %d\n",
+				__func__, errno);
+			return -1;
+		}
+
+		/* same iothread as the queue notifications */
+		coal->iothread_id = base->iothread_nr ?
+			base->iothread_ids[vq->num % base->iothread_nr] : 0;
+		coal->iomvt.run = vq_coalesce_timer;
+		coal->iomvt.arg = vq;
+		coal->iomvt.fd = coal->timer_fd;
+		coal->iomvt.poll_start = NULL;
+		coal->iomvt.poll = NULL;
+		coal->iomvt.poll_stop = NULL;
+		if (iothread_add(coal->iothread_id, coal->timer_fd, &coal->iomvt)) {
+			close(coal->timer_fd);
+			coal->timer_fd = -1;
+			return -1;
+		}
+		coal->timer_ready = true;
+	}
+
+	pthread_mutex_lock(&coal->mtx);
+	coal->max_frames = max_frames;
+	coal->max_usecs = max_usecs;
+	if (max_usecs == 0)
+		fire = vq_coalesce_flush_locked(coal, virtio_now_ns());
+	pthread_mutex_unlock(&coal->mtx);
+
+	if (fire && vq_ring_ready(vq))
+		vq_interrupt(base, vq);
+	return 0;
+}
+
+void
+virtio_coalesce_deinit(struct virtio_base *base)
+{
+	struct virtio_vq_coalesce *coal;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		coal = &base->queues[i].coal;
+		if (!coal->timer_ready)
+			continue;
+
+		pr_notice("%s: vq %d coalescing %u/%uus: %lu interrupts, "
+			"%lu saved, %lu us average delay\n",
+			base->vops->name, i, coal->max_frames, coal->max_usecs,
+			coal->interrupts, coal->saved,
+			coal->interrupts ? coal->delay_ns / coal->interrupts / 1000 : 0);
+
+		iothread_del(coal->iothread_id, coal->timer_fd);
+		close(coal->timer_fd);
+		coal->timer_fd = -1;
+		coal->timer_ready = false;
+	}
+}
+
+/*
+ * Busy-poll hooks of the iothread. They run in the iothread and may race
+ * with a reset that unregisters the queue, hence the checks under the
+ * device (or queue) lock.
+ */
+static void
+virtio_iothread_poll_start(void *arg)
+{
+	struct virtio_iothread *viothrd = arg;
+	struct virtio_base *base = viothrd->base;
+	struct virtio_vq_info *vq = &base->queues[viothrd->idx];
+	pthread_mutex_t *mtx = vq_iothread_mtx(base, vq);
+
+	if (mtx)
+		pthread_mutex_lock(mtx);
+	if (viothrd->ioevent_started && vq_ring_ready(vq)) {
+		viothrd->polling = true;
+		vq_set_used_ring_flags(base, vq);
+	}
+	if (mtx)
+		pthread_mutex_unlock(mtx);
+}
+
+static bool
+virtio_iothread_poll(void *arg)
+{
+	struct virtio_iothread *viothrd = arg;
+	struct virtio_base *base = viothrd->base;
+	struct virtio_vq_info *vq = &base->queues[viothrd->idx];
+	pthread_mutex_t *mtx = vq_iothread_mtx(base, vq);
+	bool hit = false;
+
+	/* cheap unlocked peek at avail->idx before taking the lock */
+	if (!vq_has_descs(vq))
+		return false;
+
+	if (mtx)
+		pthread_mutex_lock(mtx);
+	if (viothrd->polling && vq_has_descs(vq) && viothrd->iothread_run) {
+		(*viothrd->iothread_run)(base, vq);
+		hit = true;
+	}
+	if (mtx)
+		pthread_mutex_unlock(mtx);
+
+	return hit;
+}
+
+static bool
+virtio_iothread_poll_stop(void *arg)
+{
+	struct virtio_iothread *viothrd = arg;
+	struct virtio_base *base = viothrd->base;
+	struct virtio_vq_info *vq = &base->queues[viothrd->idx];
+	pthread_mutex_t *mtx = vq_iothread_mtx(base, vq);
+	bool pending = false;
+
+	if (mtx)
+		pthread_mutex_lock(mtx);
+	if (viothrd->polling) {
+		viothrd->polling = false;
+		if (vq_ring_ready(vq)) {
+			vq_clear_used_ring_flags(base, vq);
+			/* make the flag visible before checking for new work */
+			atomic_thread_fence();
+			pending = vq_has_descs(vq);
+		}
+	}
+	if (mtx)
+		pthread_mutex_unlock(mtx);
+
+	return pending;
 }
 
 void
@@ -102,81 +410,55 @@ virtio_set_iothread(struct virtio_base *base,
 				vq->viothrd.iothread_run = NULL;
 			vq->viothrd.base = base;
 			vq->viothrd.idx = idx;
+			vq->viothrd.iothread_id = base->iothread_nr ?
+				base->iothread_ids[idx % base->iothread_nr] : 0;
 			vq->viothrd.iomvt.arg = &vq->viothrd;
 			vq->viothrd.iomvt.run = iothread_handler;
 			vq->viothrd.iomvt.fd = vq->viothrd.kick_fd;
+			vq->viothrd.polling = false;
+			if (virtio_poll_enabled) {
+				vq->viothrd.iomvt.poll_start = virtio_iothread_poll_start;
+				vq->viothrd.iomvt.poll = virtio_iothread_poll;
+				vq->viothrd.iomvt.poll_stop = virtio_iothread_poll_stop;
+			} else {
+				vq->viothrd.iomvt.poll_start = NULL;
+				vq->viothrd.iomvt.poll = NULL;
+				vq->viothrd.iomvt.poll_stop = NULL;
+			}
 
-			if (!iothread_add(vq->viothrd.kick_fd, &vq->viothrd.iomvt))
+			if (!iothread_add(vq->viothrd.iothread_id, vq->viothrd.kick_fd, &vq->viothrd.iomvt))
 				if (!virtio_register_ioeventfd(base, idx, true, vq->viothrd.kick_fd))
 					vq->viothrd.ioevent_started = true;
 		} else {
+			/* the poll hooks check ioevent_started under this */
+			if (vq->mtx)
+				pthread_mutex_lock(vq->mtx);
 			if (!virtio_register_ioeventfd(base, idx, false, vq->viothrd.kick_fd))
-				if (!iothread_del(vq->viothrd.kick_fd)) {
+				if (!iothread_del(vq->viothrd.iothread_id, vq->viothrd.kick_fd)) {
 					vq->viothrd.ioevent_started = false;
 					if (vq->viothrd.kick_fd) {
 						close(vq->viothrd.kick_fd);
 						vq->viothrd.kick_fd = -1;
 					}
 				}
+			if (vq->mtx)
+				pthread_mutex_unlock(vq->mtx);
 		}
 	}
 }
 
-static void
-virtio_start_timer(struct acrn_timer *timer, time_t sec, time_t nsec)
+/*
+ * With --virtio_poll, every VBSU device is serviced by an iothread that
+ * busy-polls its queues.
+ */
+static bool
+virtio_uses_iothread(struct virtio_base *base)
 {
-	struct itimerspec ts;
-
-	/* setting the interval time */
-	ts.it_interval.tv_sec = 0;
-	ts.it_interval.tv_nsec = 0;
-	/* set the delay time it will be started when timer_setting */
-	ts.it_value.tv_sec = sec;
-	ts.it_value.tv_nsec = nsec;
-	if (acrn_timer_settime(timer, &ts) != 0) {
-		pr_err("acrn timer set time failed\n");
-		return;
-	}
+	return (base->backend_type == BACKEND_VBSU) &&
+		(base->iothread || virtio_poll_enabled);
 }
 
-static void
-virtio_poll_timer(void *arg, uint64_t nexp)
-{
-	struct virtio_base *base;
-	struct virtio_ops *vops;
-	struct virtio_vq_info *vq;
-	const char *name;
-	int i;
-
-	base = arg;
-	vops = base->vops;
-	name = vops->name;
-
-	if (base->mtx)
-		pthread_mutex_lock(base->mtx);
-
-	base->polling_in_progress = 1;
-
-	for (i = 0; i < base->vops->nvq; i++) {
-		vq = &base->queues[i];
-		if(!vq_ring_ready(vq))
-			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		/* TODO: call notify when necessary */
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, i);
-	}
-
-	if (base->mtx)
-		pthread_mutex_unlock(base->mtx);
-
-	virtio_start_timer(&base->polling_timer, 0, virtio_poll_interval);
-}
+static struct snapshot_ops virtio_snapshot_ops;
 
 /**
  * @brief Link a virtio_base to its constants, the virtio device,
@@ -194,6 +476,7 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	      struct virtio_vq_info *queues,
 	      int backend_type)
 {
+	char name[SNAPSHOT_NAME_LEN];
 	int i;
 
 	/* base and pci_virtio_dev addresses must match */
@@ -210,6 +493,14 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		pthread_mutex_init(&queues[i].coal.mtx, NULL);
+	}
+
+	/* ring state of the in-kernel backends is not visible here */
+	if (backend_type == BACKEND_VBSU) {
+		snprintf(name, sizeof(name), "virtio@%x:%x.%x",
+			dev->bus, dev->slot, dev->func);
+		snapshot_register(name, &virtio_snapshot_ops, base, dev);
 	}
 }
 
@@ -234,16 +525,22 @@ virtio_reset_dev(struct virtio_base *base)
 /* if (base->mtx) */
 /* assert(pthread_mutex_isowned_np(base->mtx)); */
 
-	acrn_timer_deinit(&base->polling_timer);
-	base->polling_in_progress = 0;
-	if (base->iothread)
+	if (virtio_uses_iothread(base))
 		virtio_set_iothread(base, false);
 
 	nvq = base->vops->nvq;
 	for (vq = base->queues, i = 0; i < nvq; vq++, i++) {
+		/* keep the queue's iothread work out while it is reset */
+		if (vq->mtx)
+			pthread_mutex_lock(vq->mtx);
 		vq->flags = 0;
 		vq->last_avail = 0;
 		vq->save_used = 0;
+		vq->used_pending = 0;
+		/*
+		 * inflight is left alone: backends may still hold chains, and
+		 * their completions bring it back to 0.
+		 */
 		vq->pfn = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 		vq->gpa_desc[0] = 0;
@@ -253,6 +550,16 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		free(vq->chain_len);
+		vq->chain_len = NULL;
+
+		/* whatever was held back is moot now */
+		pthread_mutex_lock(&vq->coal.mtx);
+		vq->coal.pending = 0;
+		vq->coal.armed = false;
+		pthread_mutex_unlock(&vq->coal.mtx);
+		if (vq->mtx)
+			pthread_mutex_unlock(vq->mtx);
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -394,6 +701,60 @@ error:
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/*
+ * Map a packed virtqueue.  The modern queue registers are reused:
+ * queue_desc is the descriptor ring, queue_driver (gpa_avail) the
+ * driver event suppression area and queue_device (gpa_used) the
+ * device one.
+ */
+static int
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint64_t phys;
+	char *vb;
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			vq->qsize * sizeof(struct vring_packed_desc));
+	if (!vb)
+		return -1;
+	vq->pdesc = (struct vring_packed_desc *)vb;
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->driver_event = (struct vring_packed_desc_event *)vb;
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->device_event = (struct vring_packed_desc_event *)vb;
+
+	free(vq->chain_len);
+	vq->chain_len = calloc(vq->qsize, sizeof(uint16_t));
+	if (!vq->chain_len)
+		return -1;
+
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+
+	/* Both wrap counters start at 1. */
+	vq->last_avail = 0;
+	vq->avail_wrap = true;
+	vq->prev_avail = 0;
+	vq->prev_wrap = true;
+	vq->used_idx = 0;
+	vq->used_wrap = true;
+	vq->used_count = 0;
+	vq->save_used = 0;
+	return 0;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -412,6 +773,12 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (vq_is_packed(vq)) {
+		if (virtio_vq_enable_packed(base, vq))
+			goto error;
+		goto done;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct vring_desc);
@@ -441,6 +808,7 @@ virtio_vq_enable(struct virtio_base *base)
 	vq->last_avail = 0;
 	vq->save_used = 0;
 
+done:
 	/* Mark queue as enabled. */
 	vq->enabled = true;
 
@@ -453,6 +821,216 @@ virtio_vq_enable(struct virtio_base *base)
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/* how long a snapshot waits for a device to complete its requests */
+#define VIRTIO_QUIESCE_TIMEOUT_MS	5000
+
+struct virtio_snapshot {
+	uint64_t negotiated_caps;
+	int32_t	curq;
+	uint8_t	status;
+	uint8_t	isr;
+	uint16_t msix_cfg_idx;
+	uint8_t	config_generation;
+	uint8_t	reserved[3];
+	uint32_t device_feature_select;
+	uint32_t driver_feature_select;
+	uint32_t nvq;
+};
+
+struct virtio_vq_snapshot {
+	uint16_t qsize;
+	uint16_t flags;
+	uint16_t last_avail;
+	uint16_t save_used;
+	uint16_t msix_idx;
+	uint16_t enabled;
+	uint32_t pfn;
+	uint32_t gpa_desc[2];
+	uint32_t gpa_avail[2];
+	uint32_t gpa_used[2];
+	uint16_t used_idx;
+	uint16_t used_count;
+	uint8_t	avail_wrap;
+	uint8_t	used_wrap;
+	uint8_t	reserved[2];
+};
+
+static bool
+virtio_idle(struct virtio_base *base)
+{
+	int i;
+
+	/* a negative count is a bug and must not pass for idle */
+	for (i = 0; i < base->vops->nvq; i++) {
+		if (atomic_load(&base->queues[i].inflight) != 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Wait until the backend has used or returned every chain it took.  The
+ * vCPUs must be paused, so that no new chains are made available.
+ */
+int
+virtio_wait_idle(struct virtio_base *base)
+{
+	int ms;
+
+	for (ms = 0; !virtio_idle(base); ms++) {
+		if (ms >= VIRTIO_QUIESCE_TIMEOUT_MS) {
+			pr_err("%s: requests still in flight\n", base->vops->name);
+			return -EBUSY;
+		}
+		usleep(1000);
+	}
+	return 0;
+}
+
+static int
+virtio_snapshot_quiesce(void *arg)
+{
+	struct virtio_base *base = arg;
+	int ret = 0;
+
+	if (base->vops->quiesce)
+		ret = base->vops->quiesce(base);
+	if (ret == 0)
+		ret = virtio_wait_idle(base);
+	return ret;
+}
+
+static int
+virtio_snapshot_save(void *arg, int fd)
+{
+	struct virtio_base *base = arg;
+	struct virtio_vq_info *vq;
+	struct virtio_snapshot snap;
+	struct virtio_vq_snapshot vqs;
+	int i, ret;
+
+	/* a chain taken but not used would never be completed on restore */
+	if (!virtio_idle(base))
+		return -EBUSY;
+
+	memset(&snap, 0, sizeof(snap));
+	snap.negotiated_caps = base->negotiated_caps;
+	snap.curq = base->curq;
+	snap.status = base->status;
+	snap.isr = base->isr;
+	snap.msix_cfg_idx = base->msix_cfg_idx;
+	snap.config_generation = base->config_generation;
+	snap.device_feature_select = base->device_feature_select;
+	snap.driver_feature_select = base->driver_feature_select;
+	snap.nvq = base->vops->nvq;
+
+	ret = snapshot_write(fd, &snap, sizeof(snap));
+	for (i = 0; (ret == 0) && (i < base->vops->nvq); i++) {
+		vq = &base->queues[i];
+		memset(&vqs, 0, sizeof(vqs));
+		vqs.qsize = vq->qsize;
+		vqs.flags = vq->flags;
+		vqs.last_avail = vq->last_avail;
+		vqs.save_used = vq->save_used;
+		vqs.msix_idx = vq->msix_idx;
+		vqs.enabled = vq->enabled;
+		vqs.pfn = vq->pfn;
+		memcpy(vqs.gpa_desc, vq->gpa_desc, sizeof(vqs.gpa_desc));
+		memcpy(vqs.gpa_avail, vq->gpa_avail, sizeof(vqs.gpa_avail));
+		memcpy(vqs.gpa_used, vq->gpa_used, sizeof(vqs.gpa_used));
+		vqs.used_idx = vq->used_idx;
+		vqs.used_count = vq->used_count;
+		vqs.avail_wrap = vq->avail_wrap;
+		vqs.used_wrap = vq->used_wrap;
+		ret = snapshot_write(fd, &vqs, sizeof(vqs));
+
+		/* a packed ring also needs the length of each in-flight chain */
+		if ((ret == 0) && vq_is_packed(vq) && (vq->flags & VQ_ALLOC))
+			ret = snapshot_write(fd, vq->chain_len,
+					vq->qsize * sizeof(uint16_t));
+	}
+	return ret;
+}
+
+static int
+virtio_snapshot_restore(void *arg, int fd, uint32_t len)
+{
+	struct virtio_base *base = arg;
+	struct virtio_vq_info *vq;
+	struct virtio_snapshot snap;
+	struct virtio_vq_snapshot vqs;
+	int i, ret;
+
+	ret = snapshot_read(fd, &snap, sizeof(snap));
+	if (ret < 0)
+		return ret;
+	if (snap.nvq != base->vops->nvq)
+		return -EINVAL;
+
+	base->negotiated_caps = snap.negotiated_caps;
+	base->status = snap.status;
+	base->isr = snap.isr;
+	base->msix_cfg_idx = snap.msix_cfg_idx;
+	base->config_generation = snap.config_generation;
+	base->device_feature_select = snap.device_feature_select;
+	base->driver_feature_select = snap.driver_feature_select;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		ret = snapshot_read(fd, &vqs, sizeof(vqs));
+		if (ret < 0)
+			return ret;
+
+		vq = &base->queues[i];
+		vq->qsize = vqs.qsize;
+		vq->msix_idx = vqs.msix_idx;
+		vq->pfn = vqs.pfn;
+		memcpy(vq->gpa_desc, vqs.gpa_desc, sizeof(vq->gpa_desc));
+		memcpy(vq->gpa_avail, vqs.gpa_avail, sizeof(vq->gpa_avail));
+		memcpy(vq->gpa_used, vqs.gpa_used, sizeof(vq->gpa_used));
+		vq->flags = 0;
+		vq->enabled = false;
+		if ((vqs.flags & VQ_ALLOC) == 0)
+			continue;
+
+		/* re-map the rings, then put the ring cursors back */
+		base->curq = i;
+		if (vqs.pfn)
+			virtio_vq_init(base, vqs.pfn);
+		else
+			virtio_vq_enable(base);
+		vq->enabled = vqs.enabled;
+		vq->last_avail = vqs.last_avail;
+		vq->save_used = vqs.save_used;
+		if (vq_is_packed(vq)) {
+			if (!vq->chain_len)
+				return -EINVAL;
+			ret = snapshot_read(fd, vq->chain_len,
+					vq->qsize * sizeof(uint16_t));
+			if (ret < 0)
+				return ret;
+			vq->used_idx = vqs.used_idx;
+			vq->used_count = vqs.used_count;
+			vq->avail_wrap = vqs.avail_wrap;
+			vq->used_wrap = vqs.used_wrap;
+			vq->prev_avail = vq->last_avail;
+			vq->prev_wrap = vq->avail_wrap;
+		}
+		vq->flags = vqs.flags;
+	}
+	base->curq = snap.curq;
+
+	if (base->vops->apply_features)
+		(*base->vops->apply_features)(DEV_STRUCT(base), base->negotiated_caps);
+
+	return 0;
+}
+
+static struct snapshot_ops virtio_snapshot_ops = {
+	.save		= virtio_snapshot_save,
+	.restore	= virtio_snapshot_restore,
+	.quiesce	= virtio_snapshot_quiesce,
+};
+
 /*
  * Helper inline for vq_getchain(): record the i'th "real"
  * descriptor.
@@ -478,6 +1056,145 @@ _vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+#define	VQ_PACKED_DESC_F_AVAIL_USED \
+	((1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED))
+
+/*
+ * Packed ring variant of _vq_record(); the ring ownership bits are
+ * not reported to the caller.
+ */
+static inline int
+_vq_record_packed(int i, volatile struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags) {
+
+	void *host_addr;
+
+	if (i >= n_iov)
+		return -1;
+	host_addr = paddr_guest2host(ctx, vd->addr, vd->len);
+	if (!host_addr)
+		return -1;
+	iov[i].iov_base = host_addr;
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags & ~VQ_PACKED_DESC_F_AVAIL_USED;
+	return 0;
+}
+
+/*
+ * vq_getchain() for packed rings.  A chain is a run of ring entries
+ * linked by the NEXT flag, possibly wrapping around the end of the
+ * ring; an INDIRECT entry points to a table whose entries are all
+ * part of the chain.  The buffer id is in the last ring entry and
+ * is what we hand back as the "index" for vq_relchain().
+ */
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int n_indir, j;
+	uint16_t idx, ndesc, id;
+	bool wrap;
+
+	volatile struct vring_packed_desc *vd, *vindir;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+
+	if (!vq_has_descs(vq))
+		return 0;
+
+	/* read the descriptors only after seeing the AVAIL flag */
+	atomic_thread_fence();
+
+	ctx = base->dev->vmctx;
+	idx = vq->last_avail;
+	wrap = vq->avail_wrap;
+	for (i = 0, ndesc = 0; ndesc < vq->qsize;) {
+		vd = &vq->pdesc[idx];
+		ndesc++;
+		if (++idx == vq->qsize) {
+			idx = 0;
+			wrap = !wrap;
+		}
+
+		if ((vd->flags & VRING_DESC_F_INDIRECT) == 0) {
+			if (_vq_record_packed(i, vd, ctx, iov, n_iov, flags)) {
+				pr_err("%s: mapping to host failed\r\n", name);
+				return -1;
+			}
+			if (++i > VQ_MAX_DESCRIPTORS)
+				goto loopy;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0 ||
+		    (vd->flags & VRING_DESC_F_NEXT)) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		} else {
+			n_indir = vd->len / sizeof(struct vring_packed_desc);
+			if ((vd->len % sizeof(struct vring_packed_desc)) ||
+			    n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vd->len);
+				return -1;
+			}
+			vindir = paddr_guest2host(ctx, vd->addr, vd->len);
+			if (!vindir) {
+				pr_err("%s cannot get host memory\r\n", name);
+				return -1;
+			}
+			/* the whole table is one chain, in order */
+			for (j = 0; j < n_indir; j++) {
+				if (vindir[j].flags & VRING_DESC_F_INDIRECT) {
+					pr_err("%s: indirect desc has INDIR flag,"
+					    " driver confused?\r\n",
+					    name);
+					return -1;
+				}
+				if (_vq_record_packed(i, &vindir[j], ctx, iov,
+						n_iov, flags)) {
+					pr_err("%s: mapping to host failed\r\n", name);
+					return -1;
+				}
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+
+		if ((vd->flags & VRING_DESC_F_NEXT) == 0) {
+			id = vd->id;
+			if (id >= vq->qsize) {
+				pr_err("%s: buffer id %u out of range, "
+				    "driver confused?\r\n",
+				    name, id);
+				return -1;
+			}
+			vq->prev_avail = vq->last_avail;
+			vq->prev_wrap = vq->avail_wrap;
+			vq->last_avail = idx;
+			vq->avail_wrap = wrap;
+			vq->chain_len[id] = ndesc;
+			*pidx = id;
+			return i;
+		}
+	}
+	pr_err("%s: chain longer than the ring, driver confused?\r\n", name);
+	return -1;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+	return -1;
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -530,6 +1247,13 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	struct virtio_base *base;
 	const char *name;
 
+	if (vq_is_packed(vq)) {
+		i = vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+		if (i > 0)
+			atomic_add_fetch(&vq->inflight, 1);
+		return i;
+	}
+
 	base = vq->base;
 	name = base->vops->name;
 
@@ -636,8 +1360,10 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				}
 			}
 		}
-		if ((vdir->flags & VRING_DESC_F_NEXT) == 0)
+		if ((vdir->flags & VRING_DESC_F_NEXT) == 0) {
+			atomic_add_fetch(&vq->inflight, 1);
 			return i;
+		}
 	}
 loopy:
 	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
@@ -645,6 +1371,15 @@ loopy:
 	return -1;
 }
 
+/* chains used or returned, taking more back than were taken is a bug */
+static void
+vq_inflight_sub(struct virtio_vq_info *vq, int n)
+{
+	if (atomic_sub_fetch(&vq->inflight, n) < 0)
+		pr_err("%s: vq %d: more chains released than taken\n",
+			vq->base->vops->name, vq->num);
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -654,18 +1389,95 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
+	vq_inflight_sub(vq, 1);
+	if (vq_is_packed(vq)) {
+		vq->last_avail = vq->prev_avail;
+		vq->avail_wrap = vq->prev_wrap;
+		return;
+	}
+
 	vq->last_avail--;
 }
 
 /*
- * Return specified request chain to the guest, setting its I/O length
- * to the provided value.
+ * Return the last n chains we handed out, newest first.  A packed
+ * ring steps back over the descriptors each buffer id took.
+ */
+void
+vq_retchains(struct virtio_vq_info *vq, uint16_t *idx, int n)
+{
+	uint16_t len;
+
+	vq_inflight_sub(vq, n);
+	if (!vq_is_packed(vq)) {
+		vq->last_avail -= n;
+		return;
+	}
+
+	while (--n >= 0) {
+		len = vq->chain_len[idx[n]];
+		if (vq->last_avail < len) {
+			vq->last_avail += vq->qsize;
+			vq->avail_wrap = !vq->avail_wrap;
+		}
+		vq->last_avail -= len;
+	}
+	vq->prev_avail = vq->last_avail;
+	vq->prev_wrap = vq->avail_wrap;
+}
+
+/*
+ * vq_relchain_prepare() for packed rings: write the buffer id and length
+ * into the next used slot, then hand the slot back by setting both flag
+ * bits to the device wrap counter.  The driver reads used slots in
+ * order, so only the flags of the first unpublished slot are held back
+ * for vq_relchain_publish().  The slot advances by the number of ring
+ * entries the chain took.
+ */
+static void
+vq_relchain_prepare_packed(struct virtio_vq_info *vq, uint16_t idx,
+			   uint32_t iolen)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t n, flags;
+
+	if (idx >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range\r\n",
+		    vq->base->vops->name, idx);
+		return;
+	}
+
+	vd = &vq->pdesc[vq->used_idx];
+	vd->id = idx;
+	vd->len = iolen;
+	flags = vq->used_wrap ? VQ_PACKED_DESC_F_AVAIL_USED : 0;
+	if (vq->used_pending++ == 0) {
+		vq->pending_slot = vq->used_idx;
+		vq->pending_flags = flags;
+	} else {
+		/* id and len must be visible before the slot flips to used */
+		atomic_thread_fence();
+		vd->flags = flags;
+	}
+
+	n = vq->chain_len[idx];
+	vq->used_count += n;
+	vq->used_idx += n;
+	if (vq->used_idx >= vq->qsize) {
+		vq->used_idx -= vq->qsize;
+		vq->used_wrap = !vq->used_wrap;
+	}
+}
+
+/*
+ * Fill in the used entry of the specified request chain, setting its
+ * I/O length to the provided value, without moving used->idx.
  *
  * (This chain is the one you handled when you called vq_getchain()
  * and used its positive return value.)
  */
 void
-vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+vq_relchain_prepare(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 {
 	uint16_t uidx, mask;
 	volatile struct vring_used *vuh;
@@ -681,14 +1493,88 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	vq_inflight_sub(vq, 1);
+	if (vq_is_packed(vq)) {
+		vq_relchain_prepare_packed(vq, idx, iolen);
+		return;
+	}
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
-	uidx = vuh->idx;
-	vue = &vuh->ring[uidx++ & mask];
+	uidx = vuh->idx + vq->used_pending++;
+	vue = &vuh->ring[uidx & mask];
 	vue->id = idx;
 	vue->len = iolen;
-	vuh->idx = uidx;
+}
+
+/*
+ * Make the chains filled in by vq_relchain_prepare() visible to the
+ * guest: bump used->idx, or flip the first held back packed slot.
+ */
+void
+vq_relchain_publish(struct virtio_vq_info *vq)
+{
+	if (!vq->used_pending)
+		return;
+
+	/* used entries must be visible before the index/flags move */
+	atomic_thread_fence();
+	if (vq_is_packed(vq))
+		vq->pdesc[vq->pending_slot].flags = vq->pending_flags;
+	else
+		vq->used->idx += vq->used_pending;
+	vq->used_pending = 0;
+}
+
+/*
+ * Return specified request chain to the guest, setting its I/O length
+ * to the provided value.
+ *
+ * (This chain is the one you handled when you called vq_getchain()
+ * and used its positive return value.)
+ */
+void
+vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	vq_relchain_prepare(vq, idx, iolen);
+	vq_relchain_publish(vq);
+}
+
+/*
+ * vq_endchains() for packed rings.  The driver event area either
+ * enables or disables interrupts outright, or (with EVENT_IDX) asks
+ * for one once the used slot at <off_wrap> has been written.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq)
+{
+	uint16_t old_cnt, new_cnt, off_wrap, event_flags;
+	int off, intr;
+
+	if (!vq->driver_event)
+		return;
+
+	atomic_thread_fence();
+
+	old_cnt = vq->save_used;
+	vq->save_used = new_cnt = vq->used_count;
+	if (new_cnt == old_cnt)
+		return;
+
+	event_flags = vq->driver_event->flags;
+	if (event_flags == VRING_PACKED_EVENT_FLAG_DESC) {
+		off_wrap = vq->driver_event->off_wrap;
+		off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->used_wrap)
+			off -= vq->qsize;
+		/* how far the used slot has moved past the event slot */
+		intr = (uint16_t)(vq->used_idx - off - 1) <
+			(uint16_t)(new_cnt - old_cnt);
+	} else
+		intr = event_flags == VRING_PACKED_EVENT_FLAG_ENABLE;
+
+	vq_coalesce_signal(vq, intr, new_cnt - old_cnt);
 }
 
 /*
@@ -713,7 +1599,15 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
-	if (!vq || !vq->used)
+	if (!vq)
+		return;
+
+	if (vq_is_packed(vq)) {
+		vq_endchains_packed(vq);
+		return;
+	}
+
+	if (!vq->used)
 		return;
 
 	/*
@@ -746,8 +1640,7 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
-	if (intr)
-		vq_interrupt(base, vq);
+	vq_coalesce_signal(vq, intr, new_idx - old_idx);
 }
 
 /**
@@ -762,14 +1655,42 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq)
 {
-	int backend_type = base->backend_type;
-	int polling_in_progress = base->polling_in_progress;
-
-	/* we should never unmask notification in polling mode */
-	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
+	/* we should never unmask notification while the iothread polls */
+	if (vq->viothrd.polling)
 		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq_is_packed(vq)) {
+		if (vq->device_event)
+			vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	} else if (vq->used) {
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		/* with EVENT_IDX the driver ignores the flag, ask for the next kick */
+		if (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))
+			VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+	}
+}
+
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq_is_packed(vq)) {
+		if (vq->device_event)
+			vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	} else if (vq->used) {
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		/*
+		 * With EVENT_IDX the driver only kicks when avail->idx moves past
+		 * avail_event; keep it just behind what has been consumed so that
+		 * no new buffer crosses it.
+		 */
+		if (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))
+			VQ_AVAIL_EVENT_IDX(vq) = (uint16_t)(vq->last_avail - 1);
+	}
 }
 
 struct config_reg {
@@ -1074,20 +1995,7 @@ bad:
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if ((value == 0) && (vops->reset))
 			(*vops->reset)(DEV_STRUCT(base));
-		if ((value & VIRTIO_CONFIG_S_DRIVER_OK) &&
-		     base->backend_type == BACKEND_VBSU &&
-		     virtio_poll_enabled) {
-			base->polling_timer.clockid = CLOCK_MONOTONIC;
-			acrn_timer_init(&base->polling_timer, virtio_poll_timer, base);
-			/* wait 5s to start virtio poll mode
-			 * skip vsbl and make sure device initialization completed
-			 * FIXME: Need optimization in the future
-			 */
-			virtio_start_timer(&base->polling_timer, 5, 0);
-		}
-		if (!virtio_poll_enabled &&
-			base->backend_type == BACKEND_VBSU &&
-			base->iothread) {
+		if (virtio_uses_iothread(base)) {
 			if (value & VIRTIO_CONFIG_S_DRIVER_OK) {
 				virtio_set_iothread(base, true);
 			} else {
@@ -1518,14 +2426,13 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if ((base->status == 0) && (vops->reset))
 			(*vops->reset)(DEV_STRUCT(base));
-		if (base->backend_type == BACKEND_VBSU && base->iothread) {
+		if (virtio_uses_iothread(base)) {
 			if (value & VIRTIO_CONFIG_S_DRIVER_OK) {
 				virtio_set_iothread(base, true);
 			} else {
 				virtio_set_iothread(base, false);
 			}
 		}
-		/* TODO: virtio poll mode for modern devices */
 		break;
 	case VIRTIO_PCI_COMMON_Q_SELECT:
 		/*
@@ -1977,6 +2884,7 @@ acrn_parse_virtio_poll_interval(const char *optarg)
 		return -1;
 
 	virtio_poll_enabled = 1;
+	iothread_set_poll_max(virtio_poll_interval);
 
 	return 0;
 }
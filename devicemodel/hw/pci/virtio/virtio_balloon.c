@@ -0,0 +1,787 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio memory balloon.
+ *
+ * Inflated pages are taken away from the guest: they are removed from the
+ * stage-2 table and the service VM drops its references on them. Guest RAM
+ * is hugetlb backed, so memory only goes back to the host pool once every
+ * 4K page of a hugepage is in the balloon; the hugepage is then punched out
+ * of the memfd. Partially ballooned hugepages are zeroed instead, which
+ * still keeps them out of VM snapshots. Deflating maps the pages back,
+ * allocating their hugepage again first if it was given away.
+ *
+ * Free page reporting works differently: the guest may reuse a reported
+ * page at any time without telling the device, and there is no way to
+ * populate guest memory on a stage-2 fault. Reported pages therefore stay
+ * mapped, they are only zeroed so snapshots skip them.
+ *
+ * The balloon target is set with the "balloon" command of the command
+ * monitor, in MiB of memory the guest should be left with.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "dm_string.h"
+
+#define VIRTIO_BALLOON_RINGSZ		128
+#define VIRTIO_BALLOON_MAXSEGS		32	/* page reporting capacity */
+
+/* pfns in the inflate and deflate queues are always 4K */
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+#define VIRTIO_BALLOON_PAGE_SIZE	(1UL << VIRTIO_BALLOON_PFN_SHIFT)
+
+/*
+ * Feature bits. FREE_PAGE_HINT is not offered: hints only pay off with an
+ * iterative live migration, snapshots stop the guest before copying.
+ * PAGE_POISON is not offered either, reported pages are zeroed.
+ */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST	(1 << 0)
+#define VIRTIO_BALLOON_F_STATS_VQ	(1 << 1)
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	(1 << 2)
+#define VIRTIO_BALLOON_F_REPORTING	(1 << 5)
+
+#define VIRTIO_BALLOON_S_HOSTCAPS					\
+	(VIRTIO_BALLOON_F_MUST_TELL_HOST | VIRTIO_BALLOON_F_STATS_VQ |	\
+	 VIRTIO_BALLOON_F_REPORTING | (1UL << VIRTIO_F_VERSION_1))
+
+/*
+ * Queues that exist are numbered without gaps, so which index is which
+ * depends on the negotiated features.
+ */
+enum virtio_balloon_vq {
+	VIRTIO_BALLOON_VQ_NONE = 0,
+	VIRTIO_BALLOON_VQ_INFLATE,
+	VIRTIO_BALLOON_VQ_DEFLATE,
+	VIRTIO_BALLOON_VQ_STATS,
+	VIRTIO_BALLOON_VQ_REPORTING,
+};
+#define VIRTIO_BALLOON_MAXQ		4
+
+/* guest memory statistics tags */
+#define VIRTIO_BALLOON_S_SWAP_IN	0
+#define VIRTIO_BALLOON_S_SWAP_OUT	1
+#define VIRTIO_BALLOON_S_MAJFLT		2
+#define VIRTIO_BALLOON_S_MINFLT		3
+#define VIRTIO_BALLOON_S_MEMFREE	4
+#define VIRTIO_BALLOON_S_MEMTOT		5
+#define VIRTIO_BALLOON_S_AVAIL		6
+#define VIRTIO_BALLOON_S_CACHES		7
+#define VIRTIO_BALLOON_S_HTLB_PGALLOC	8
+#define VIRTIO_BALLOON_S_HTLB_PGFAIL	9
+#define VIRTIO_BALLOON_S_NR		10
+
+struct virtio_balloon_config {
+	uint32_t	num_pages;	/* pages the host wants in the balloon */
+	uint32_t	actual;		/* pages the guest put in the balloon */
+	uint32_t	free_page_hint_cmd_id;
+	uint32_t	poison_val;
+} __attribute__((packed));
+
+struct virtio_balloon_stat {
+	uint16_t	tag;
+	uint64_t	val;
+} __attribute__((packed));
+
+struct virtio_balloon_snapshot {
+	struct virtio_balloon_config cfg;
+	uint32_t	stats_held;
+	uint32_t	stats_idx;
+};
+
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info vqs[VIRTIO_BALLOON_MAXQ];
+	enum virtio_balloon_vq role[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_balloon_config cfg;
+	struct vmctx *ctx;
+
+	/* one bit per 4K page of lowmem, then highmem */
+	uint64_t *bitmap;
+	uint64_t nr_pages;
+
+	/* the stats buffer is held until the next poll */
+	bool stats_held;
+	uint16_t stats_idx;
+	uint64_t stats[VIRTIO_BALLOON_S_NR];
+	struct acrn_timer stats_timer;
+	int stats_period;
+};
+
+static struct virtio_balloon *balloon;
+
+static int virtio_balloon_debug;
+#define DPRINTF(params) do { if (virtio_balloon_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+static void virtio_balloon_reset(void *);
+static void virtio_balloon_notify(void *, struct virtio_vq_info *);
+static int virtio_balloon_cfgread(void *, int, int, uint32_t *);
+static int virtio_balloon_cfgwrite(void *, int, int, uint32_t);
+static void virtio_balloon_apply_features(void *, uint64_t);
+static int virtio_balloon_quiesce(void *);
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",			/* our name */
+	VIRTIO_BALLOON_MAXQ,			/* we support 4 virtqueues */
+	sizeof(struct virtio_balloon_config),	/* config reg size */
+	virtio_balloon_reset,			/* reset */
+	virtio_balloon_notify,			/* device-wide qnotify */
+	virtio_balloon_cfgread,			/* read virtio config */
+	virtio_balloon_cfgwrite,		/* write virtio config */
+	virtio_balloon_apply_features,		/* apply negotiated features */
+	NULL,					/* called on guest set status */
+	virtio_balloon_quiesce,			/* give back the stats buffer */
+};
+
+/* bitmap index of the 4K page at gpa, -1 if it is not guest RAM */
+static int64_t
+virtio_balloon_bit(struct virtio_balloon *bal, uint64_t gpa)
+{
+	struct vmctx *ctx = bal->ctx;
+
+	if (gpa < ctx->lowmem)
+		return gpa >> VIRTIO_BALLOON_PFN_SHIFT;
+	if (gpa >= ctx->highmem_gpa_base &&
+	    gpa - ctx->highmem_gpa_base < ctx->highmem)
+		return (ctx->lowmem + gpa - ctx->highmem_gpa_base) >>
+			VIRTIO_BALLOON_PFN_SHIFT;
+	return -1;
+}
+
+static inline bool
+virtio_balloon_test(struct virtio_balloon *bal, int64_t bit)
+{
+	return (bal->bitmap[bit / 64] & (1UL << (bit % 64))) != 0;
+}
+
+static void
+virtio_balloon_mark(struct virtio_balloon *bal, uint64_t gpa, size_t len,
+		bool set)
+{
+	int64_t bit = virtio_balloon_bit(bal, gpa);
+	uint64_t i;
+
+	for (i = 0; i < len >> VIRTIO_BALLOON_PFN_SHIFT; i++, bit++) {
+		if (set)
+			bal->bitmap[bit / 64] |= 1UL << (bit % 64);
+		else
+			bal->bitmap[bit / 64] &= ~(1UL << (bit % 64));
+	}
+}
+
+/* true if [gpa, gpa + len) is guest RAM with every page in the balloon */
+static bool
+virtio_balloon_all_set(struct virtio_balloon *bal, uint64_t gpa, size_t len)
+{
+	int64_t bit;
+	uint64_t off;
+
+	for (off = 0; off < len; off += VIRTIO_BALLOON_PAGE_SIZE) {
+		bit = virtio_balloon_bit(bal, gpa + off);
+		if (bit < 0 || !virtio_balloon_test(bal, bit))
+			return false;
+	}
+	return true;
+}
+
+/* true if [gpa, gpa + len) is guest RAM and none of it is in the balloon */
+static bool
+virtio_balloon_none_set(struct virtio_balloon *bal, uint64_t gpa, size_t len)
+{
+	int64_t bit;
+	uint64_t off;
+
+	for (off = 0; off < len; off += VIRTIO_BALLOON_PAGE_SIZE) {
+		bit = virtio_balloon_bit(bal, gpa + off);
+		if (bit < 0 || virtio_balloon_test(bal, bit))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Take [gpa, gpa + len) away from the guest, the range is already marked.
+ * Hugepages that are now entirely in the balloon go back to the host.
+ */
+static void
+virtio_balloon_inflate_range(struct virtio_balloon *bal, uint64_t gpa,
+		size_t len)
+{
+	uint64_t end = gpa + len;
+	uint64_t hp, start, stop;
+	size_t pgsz;
+
+	if (vm_release_memory(bal->ctx, gpa, len) < 0) {
+		virtio_balloon_mark(bal, gpa, len, false);
+		return;
+	}
+
+	while (gpa < end) {
+		pgsz = hugetlb_page_size(bal->ctx, gpa);
+		if (pgsz == 0)
+			pgsz = VIRTIO_BALLOON_PAGE_SIZE;
+		hp = gpa & ~(pgsz - 1);
+		start = gpa;
+		stop = (hp + pgsz < end) ? hp + pgsz : end;
+
+		if (!virtio_balloon_all_set(bal, hp, pgsz) ||
+		    hugetlb_discard_page(bal->ctx, hp) < 0)
+			memset(bal->ctx->baseaddr + start, 0, stop - start);
+		gpa = stop;
+	}
+}
+
+/* Give [gpa, gpa + len) back to the guest, the range is already unmarked */
+static void
+virtio_balloon_deflate_range(struct virtio_balloon *bal, uint64_t gpa,
+		size_t len)
+{
+	if (hugetlb_populate(bal->ctx, gpa, len) < 0 ||
+	    vm_map_memseg_vma(bal->ctx, len, gpa,
+			(uint64_t)(bal->ctx->baseaddr + gpa), PROT_ALL) < 0) {
+		WPRINTF(("virtio_balloon: failed to return 0x%lx@0x%lx to the guest\n",
+			len, gpa));
+		virtio_balloon_mark(bal, gpa, len, true);
+	}
+}
+
+static void
+virtio_balloon_range(struct virtio_balloon *bal, uint64_t gpa, size_t len,
+		bool inflate)
+{
+	if (inflate)
+		virtio_balloon_inflate_range(bal, gpa, len);
+	else
+		virtio_balloon_deflate_range(bal, gpa, len);
+}
+
+/*
+ * Handle the pfn arrays of the inflate or deflate queue. Contiguous pfns
+ * are handled as one range, a chain is only completed once all of its
+ * pages are dealt with, as the guest may reuse deflated pages right away.
+ */
+static void
+virtio_balloon_pfns(struct virtio_balloon *bal, struct virtio_vq_info *vq,
+		bool inflate)
+{
+	struct iovec iov[VIRTIO_BALLOON_MAXSEGS];
+	uint64_t start, len, gpa;
+	uint32_t *pfns;
+	uint16_t idx;
+	int64_t bit;
+	size_t j;
+	int i, n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_MAXSEGS, NULL);
+		if (n < 1) {
+			WPRINTF(("virtio_balloon: fail to getchain!\n"));
+			return;
+		}
+
+		start = len = 0;
+		for (i = 0; i < n; i++) {
+			pfns = iov[i].iov_base;
+			for (j = 0; j < iov[i].iov_len / sizeof(uint32_t); j++) {
+				gpa = (uint64_t)pfns[j] << VIRTIO_BALLOON_PFN_SHIFT;
+				bit = virtio_balloon_bit(bal, gpa);
+				/* not RAM, or already where it should be */
+				if (bit < 0 || virtio_balloon_test(bal, bit) == inflate)
+					continue;
+				virtio_balloon_mark(bal, gpa, VIRTIO_BALLOON_PAGE_SIZE,
+						inflate);
+
+				if (len && gpa == start + len) {
+					len += VIRTIO_BALLOON_PAGE_SIZE;
+					continue;
+				}
+				if (len)
+					virtio_balloon_range(bal, start, len, inflate);
+				start = gpa;
+				len = VIRTIO_BALLOON_PAGE_SIZE;
+			}
+		}
+		if (len)
+			virtio_balloon_range(bal, start, len, inflate);
+
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+/*
+ * The guest keeps reported pages to itself until the buffer is returned,
+ * so they can safely be cleared meanwhile.
+ */
+static void
+virtio_balloon_report(struct virtio_balloon *bal, struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_BALLOON_MAXSEGS];
+	uint64_t gpa;
+	uint16_t idx;
+	int i, n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_MAXSEGS, NULL);
+		if (n < 1) {
+			WPRINTF(("virtio_balloon: fail to getchain!\n"));
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			gpa = (char *)iov[i].iov_base - bal->ctx->baseaddr;
+			if ((gpa | iov[i].iov_len) & (VIRTIO_BALLOON_PAGE_SIZE - 1))
+				continue;
+			/* ballooned pages may not even be allocated */
+			if (!virtio_balloon_none_set(bal, gpa, iov[i].iov_len))
+				continue;
+			memset(iov[i].iov_base, 0, iov[i].iov_len);
+		}
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_balloon_stats(struct virtio_balloon *bal, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon_stat stat;
+	struct iovec iov;
+	uint16_t idx;
+	size_t off;
+
+	/* keep the latest buffer, it is returned to ask for new stats */
+	while (vq_has_descs(vq)) {
+		if (bal->stats_held) {
+			vq_relchain(vq, bal->stats_idx, 0);
+			bal->stats_held = false;
+		}
+		if (vq_getchain(vq, &idx, &iov, 1, NULL) < 1) {
+			WPRINTF(("virtio_balloon: fail to getchain!\n"));
+			return;
+		}
+
+		for (off = 0; off + sizeof(stat) <= iov.iov_len; off += sizeof(stat)) {
+			memcpy(&stat, (char *)iov.iov_base + off, sizeof(stat));
+			if (stat.tag < VIRTIO_BALLOON_S_NR)
+				bal->stats[stat.tag] = stat.val;
+		}
+		bal->stats_idx = idx;
+		bal->stats_held = true;
+	}
+
+	pr_info("virtio_balloon: guest memory total %lu free %lu available %lu caches %lu, "
+		"major faults %lu, swapped in %lu out %lu\n",
+		bal->stats[VIRTIO_BALLOON_S_MEMTOT],
+		bal->stats[VIRTIO_BALLOON_S_MEMFREE],
+		bal->stats[VIRTIO_BALLOON_S_AVAIL],
+		bal->stats[VIRTIO_BALLOON_S_CACHES],
+		bal->stats[VIRTIO_BALLOON_S_MAJFLT],
+		bal->stats[VIRTIO_BALLOON_S_SWAP_IN],
+		bal->stats[VIRTIO_BALLOON_S_SWAP_OUT]);
+}
+
+/* returning the held stats buffer asks the guest for new stats */
+static void
+virtio_balloon_stats_request(struct virtio_balloon *bal)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	pthread_mutex_lock(&bal->mtx);
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++) {
+		if (bal->role[i] != VIRTIO_BALLOON_VQ_STATS)
+			continue;
+		vq = &bal->vqs[i];
+		if (bal->stats_held && vq_ring_ready(vq)) {
+			vq_relchain(vq, bal->stats_idx, 0);
+			bal->stats_held = false;
+			vq_endchains(vq, 1);
+		}
+	}
+	pthread_mutex_unlock(&bal->mtx);
+}
+
+static void
+virtio_balloon_stats_timer(void *arg, uint64_t nexp)
+{
+	virtio_balloon_stats_request(arg);
+}
+
+/* a snapshot has no chain in flight, the guest refills the buffer later */
+static int
+virtio_balloon_quiesce(void *vdev)
+{
+	virtio_balloon_stats_request(vdev);
+	return 0;
+}
+
+static void
+virtio_balloon_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *bal = vdev;
+
+	switch (bal->role[vq->num]) {
+	case VIRTIO_BALLOON_VQ_INFLATE:
+		virtio_balloon_pfns(bal, vq, true);
+		break;
+	case VIRTIO_BALLOON_VQ_DEFLATE:
+		virtio_balloon_pfns(bal, vq, false);
+		break;
+	case VIRTIO_BALLOON_VQ_STATS:
+		virtio_balloon_stats(bal, vq);
+		break;
+	case VIRTIO_BALLOON_VQ_REPORTING:
+		virtio_balloon_report(bal, vq);
+		break;
+	default:
+		WPRINTF(("virtio_balloon: notify on unused queue %d\n", vq->num));
+		break;
+	}
+}
+
+static void
+virtio_balloon_apply_features(void *vdev, uint64_t negotiated_features)
+{
+	struct virtio_balloon *bal = vdev;
+	int n = 0;
+
+	memset(bal->role, 0, sizeof(bal->role));
+	bal->role[n++] = VIRTIO_BALLOON_VQ_INFLATE;
+	bal->role[n++] = VIRTIO_BALLOON_VQ_DEFLATE;
+	if (negotiated_features & VIRTIO_BALLOON_F_STATS_VQ)
+		bal->role[n++] = VIRTIO_BALLOON_VQ_STATS;
+	if (negotiated_features & VIRTIO_BALLOON_F_REPORTING)
+		bal->role[n++] = VIRTIO_BALLOON_VQ_REPORTING;
+}
+
+/* hand every ballooned page back, a new driver assumes it has all of RAM */
+static void
+virtio_balloon_deflate_all(struct virtio_balloon *bal)
+{
+	uint64_t bit, gpa, start = 0, len = 0;
+
+	for (bit = 0; bit < bal->nr_pages; bit++) {
+		if (!virtio_balloon_test(bal, bit))
+			continue;
+		gpa = bit << VIRTIO_BALLOON_PFN_SHIFT;
+		if (gpa >= bal->ctx->lowmem)
+			gpa += bal->ctx->highmem_gpa_base - bal->ctx->lowmem;
+		virtio_balloon_mark(bal, gpa, VIRTIO_BALLOON_PAGE_SIZE, false);
+
+		if (len && gpa == start + len) {
+			len += VIRTIO_BALLOON_PAGE_SIZE;
+			continue;
+		}
+		if (len)
+			virtio_balloon_deflate_range(bal, start, len);
+		start = gpa;
+		len = VIRTIO_BALLOON_PAGE_SIZE;
+	}
+	if (len)
+		virtio_balloon_deflate_range(bal, start, len);
+}
+
+static void
+virtio_balloon_reset(void *vdev)
+{
+	struct virtio_balloon *bal = vdev;
+
+	DPRINTF(("virtio_balloon: device reset requested !\n"));
+	virtio_reset_dev(&bal->base);
+	virtio_balloon_deflate_all(bal);
+	bal->cfg.actual = 0;
+	bal->stats_held = false;
+	memset(bal->role, 0, sizeof(bal->role));
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *bal = vdev;
+
+	/* our caller has already verified offset and size */
+	memcpy(retval, (uint8_t *)&bal->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	struct virtio_balloon *bal = vdev;
+
+	if (offset == offsetof(struct virtio_balloon_config, actual) &&
+	    size == sizeof(uint32_t)) {
+		bal->cfg.actual = value;
+		return 0;
+	}
+
+	DPRINTF(("virtio_balloon: write to readonly reg %d\n", offset));
+	return -1;
+}
+
+/*
+ * Ask the guest to shrink or grow to target_mb MiB of RAM. Takes the
+ * command monitor argument.
+ */
+int
+vm_monitor_balloon(void *arg, char *target)
+{
+	struct virtio_balloon *bal = balloon;
+	uint64_t total, size;
+	char *end;
+	int mb;
+
+	if (bal == NULL) {
+		pr_err("virtio_balloon: no balloon device\n");
+		return -1;
+	}
+	if (dm_strtoi(target, &end, 10, &mb) || *end != '\0' || mb < 0) {
+		pr_err("virtio_balloon: invalid target %s\n", target);
+		return -1;
+	}
+
+	total = bal->ctx->lowmem + bal->ctx->highmem;
+	size = (uint64_t)mb << 20;
+	if (size > total)
+		size = total;
+
+	pthread_mutex_lock(&bal->mtx);
+	bal->cfg.num_pages = (total - size) >> VIRTIO_BALLOON_PFN_SHIFT;
+	pthread_mutex_unlock(&bal->mtx);
+	pr_notice("virtio_balloon: target %lu MiB, %u pages to balloon\n",
+		size >> 20, bal->cfg.num_pages);
+
+	virtio_config_changed(&bal->base);
+	return 0;
+}
+
+/*
+ * The snapshot has the ballooned pages as holes, so after a restore they
+ * only need to be taken away from the guest again.
+ */
+static int
+virtio_balloon_snapshot_save(void *arg, int fd)
+{
+	struct virtio_balloon *bal = arg;
+	struct virtio_balloon_snapshot snap;
+	int ret;
+
+	memset(&snap, 0, sizeof(snap));
+	snap.cfg = bal->cfg;
+	snap.stats_held = bal->stats_held;
+	snap.stats_idx = bal->stats_idx;
+	ret = snapshot_write(fd, &snap, sizeof(snap));
+	if (ret == 0)
+		ret = snapshot_write(fd, bal->bitmap,
+				(bal->nr_pages + 63) / 64 * sizeof(uint64_t));
+	return ret;
+}
+
+static int
+virtio_balloon_snapshot_restore(void *arg, int fd, uint32_t len)
+{
+	struct virtio_balloon *bal = arg;
+	struct virtio_balloon_snapshot snap;
+	uint64_t bit, gpa, start = 0, size = 0;
+	size_t words = (bal->nr_pages + 63) / 64;
+	int ret;
+
+	if (len != sizeof(snap) + words * sizeof(uint64_t))
+		return -EINVAL;
+
+	ret = snapshot_read(fd, &snap, sizeof(snap));
+	if (ret == 0)
+		ret = snapshot_read(fd, bal->bitmap, words * sizeof(uint64_t));
+	if (ret < 0)
+		return ret;
+	bal->cfg = snap.cfg;
+	bal->stats_held = snap.stats_held != 0;
+	bal->stats_idx = snap.stats_idx;
+
+	for (bit = 0; bit < bal->nr_pages; bit++) {
+		if (!virtio_balloon_test(bal, bit))
+			continue;
+		gpa = bit << VIRTIO_BALLOON_PFN_SHIFT;
+		if (gpa >= bal->ctx->lowmem)
+			gpa += bal->ctx->highmem_gpa_base - bal->ctx->lowmem;
+
+		if (size && gpa == start + size) {
+			size += VIRTIO_BALLOON_PAGE_SIZE;
+			continue;
+		}
+		if (size)
+			virtio_balloon_inflate_range(bal, start, size);
+		start = gpa;
+		size = VIRTIO_BALLOON_PAGE_SIZE;
+	}
+	if (size)
+		virtio_balloon_inflate_range(bal, start, size);
+	return 0;
+}
+
+static struct snapshot_ops virtio_balloon_snapshot_ops = {
+	.save		= virtio_balloon_snapshot_save,
+	.restore	= virtio_balloon_snapshot_restore,
+};
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *bal;
+	struct itimerspec ts;
+	pthread_mutexattr_t attr;
+	char *opts_start, *opts_tmp, *opt, *end;
+	uint64_t caps = VIRTIO_BALLOON_S_HOSTCAPS;
+	int stats_period = 0;
+	int i, rc;
+
+	if (balloon) {
+		pr_err("virtio_balloon: only one balloon device per VM\n");
+		return -1;
+	}
+
+	if (opts) {
+		opts_start = opts_tmp = strdup(opts);
+		if (!opts_start) {
+			WPRINTF(("%s: strdup failed\n", __func__));
+			return -1;
+		}
+		while ((opt = strsep(&opts_tmp, ",")) != NULL) {
+			if (strncmp("stats_period=", opt, 13) == 0) {
+				if (dm_strtoi(opt + 13, &end, 10, &stats_period) ||
+				    *end != '\0' || stats_period < 0) {
+					pr_err("virtio_balloon: invalid %s\n", opt);
+					free(opts_start);
+					return -1;
+				}
+			} else if (strcmp("deflate_on_oom", opt) == 0) {
+				caps |= VIRTIO_BALLOON_F_DEFLATE_ON_OOM;
+			} else if (*opt != '\0') {
+				pr_err("virtio_balloon: unknown option %s\n", opt);
+				free(opts_start);
+				return -1;
+			}
+		}
+		free(opts_start);
+	}
+
+	bal = calloc(1, sizeof(struct virtio_balloon));
+	if (!bal) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		return -1;
+	}
+	bal->ctx = ctx;
+	bal->stats_period = stats_period;
+	bal->nr_pages = (ctx->lowmem + ctx->highmem) >> VIRTIO_BALLOON_PFN_SHIFT;
+	bal->bitmap = calloc((bal->nr_pages + 63) / 64, sizeof(uint64_t));
+	if (!bal->bitmap) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		free(bal);
+		return -1;
+	}
+
+	/* timer callbacks and queue notifies both take the device lock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	rc = pthread_mutex_init(&bal->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (rc) {
+		WPRINTF(("virtio_balloon: pthread_mutex_init failed with error %d!\n", rc));
+		goto fail;
+	}
+
+	virtio_linkup(&bal->base, &virtio_balloon_ops, bal, dev, bal->vqs, BACKEND_VBSU);
+	bal->base.mtx = &bal->mtx;
+	bal->base.device_caps = caps;
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		bal->vqs[i].qsize = VIRTIO_BALLOON_RINGSZ;
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&bal->base, virtio_uses_msix())) {
+		WPRINTF(("virtio_balloon: failed to init interrupt\n"));
+		goto fail_mtx;
+	}
+	if (virtio_set_modern_bar(&bal->base, false)) {
+		WPRINTF(("virtio_balloon: failed to set modern bar\n"));
+		goto fail_mtx;
+	}
+
+	if (stats_period > 0) {
+		if (acrn_timer_init(&bal->stats_timer, virtio_balloon_stats_timer,
+					bal) < 0) {
+			WPRINTF(("virtio_balloon: failed to init stats timer\n"));
+			goto fail_mtx;
+		}
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_sec = stats_period;
+		ts.it_interval.tv_sec = stats_period;
+		acrn_timer_settime(&bal->stats_timer, &ts);
+	}
+
+	snapshot_register("virtio-balloon", &virtio_balloon_snapshot_ops, bal, bal);
+	balloon = bal;
+	return 0;
+
+fail_mtx:
+	pthread_mutex_destroy(&bal->mtx);
+fail:
+	free(bal->bitmap);
+	free(bal);
+	return -1;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *bal = dev->arg;
+
+	if (bal) {
+		DPRINTF(("virtio_balloon: deinit\n"));
+		snapshot_unregister(bal);
+		if (bal->stats_period > 0)
+			acrn_timer_deinit(&bal->stats_timer);
+		/* a system reset keeps guest memory, and the guest needs all of it */
+		virtio_balloon_deflate_all(bal);
+		pthread_mutex_destroy(&bal->mtx);
+		free(bal->bitmap);
+		free(bal);
+		dev->arg = NULL;
+		balloon = NULL;
+	}
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
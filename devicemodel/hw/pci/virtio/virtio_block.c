@@ -44,6 +44,7 @@
 #include "monitor.h"
 
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_MAXQ		16
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
 
 #define VIRTIO_BLK_S_OK	0
@@ -62,6 +63,8 @@
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
 
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple request queues */
+
 #define	VIRTIO_BLK_F_DISCARD	(1 << 13)
 
 /*
@@ -101,8 +104,8 @@ struct virtio_blk_config {
 	} topology;
 	uint8_t	writeback;
 	uint8_t unused;
-	/* Reserve for num_queues when VIRTIO_BLK_F_MQ is support*/
-	uint16_t reserve;
+	/* Number of request queues, valid with VIRTIO_BLK_F_MQ */
+	uint16_t num_queues;
 	/* The maximum discard sectors (in 512-byte sectors) for one segment */
 	uint32_t max_discard_sectors;
 	/* The maximum number of discard segments */
@@ -145,30 +148,47 @@ static struct monitor_vm_ops virtio_blk_rescan_ops = {
 
 struct virtio_blk_ioreq {
 	struct blockif_req req;
-	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	uint8_t *status;
 	uint16_t idx;
 };
 
+/*
+ * Per-request-queue state. Each queue has its own block context, i.e.
+ * its own I/O threads or io_uring, and its own lock, so the queues are
+ * submitted and completed independently.
+ */
+struct virtio_blk_queue {
+	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
+	pthread_mutex_t mtx;
+	struct blockif_ctxt *bc;
+	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+};
+
 /*
  * Per-device struct
  */
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;	/* nvq depends on nqueues */
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAXQ];
 	struct virtio_blk_config cfg;
 	bool dummy_bctxt; /* Used in blockrescan. Indicate if the bctxt can be used */
-	struct blockif_ctxt *bc;
+	struct blockif_ctxt *bc;	/* the first queue's, for the config */
+	int nqueues;
+	struct virtio_blk_queue *queues;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 	uint8_t original_wce;
+	bool packed;	/* transitional device offering packed virtqueues */
 };
 
 static void virtio_blk_reset(void *);
 static void virtio_blk_notify(void *, struct virtio_vq_info *);
 static int virtio_blk_cfgread(void *, int, int, uint32_t *);
 static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
+static int virtio_blk_quiesce(void *);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
@@ -180,8 +200,18 @@ static struct virtio_ops virtio_blk_ops = {
 	virtio_blk_cfgwrite,	/* write PCI config */
 	NULL,			/* apply negotiated features */
 	NULL,			/* called on guest set status */
+	virtio_blk_quiesce,	/* flush before a snapshot */
 };
 
+static void
+virtio_blk_set_wce(struct virtio_blk *blk, uint8_t wce)
+{
+	int i;
+
+	for (i = 0; i < blk->nqueues; i++)
+		blockif_set_wce(blk->queues[i].bc, wce);
+}
+
 static void
 virtio_blk_reset(void *vdev)
 {
@@ -191,14 +221,14 @@ virtio_blk_reset(void *vdev)
 	virtio_reset_dev(&blk->base);
 	/* Reset virtio-blk device only on valid bctxt*/
 	if (!blk->dummy_bctxt)
-		blockif_set_wce(blk->bc, blk->original_wce);
+		virtio_blk_set_wce(blk, blk->original_wce);
 }
 
 static void
 virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
+	struct virtio_blk_queue *q = io->q;
 
 	if (err)
 		DPRINTF(("virtio_blk: done with error = %d\n\r", err));
@@ -215,10 +245,10 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, !vq_has_descs(&blk->vq));
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&q->mtx);
+	vq_relchain(q->vq, io->idx, 1);
+	vq_endchains(q->vq, !vq_has_descs(q->vq));
+	pthread_mutex_unlock(&q->mtx);
 }
 
 static void
@@ -231,8 +261,9 @@ virtio_blk_abort(struct virtio_vq_info *vq, uint16_t idx)
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_blk_queue *q)
 {
+	struct virtio_vq_info *vq = q->vq;
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
 	int i, n;
@@ -259,7 +290,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		return;
 	}
 
-	io = &blk->ios[idx];
+	io = &q->ios[idx];
 	if ((flags[0] & VRING_DESC_F_WRITE) != 0) {
 		WPRINTF(("%s: the type for hdr should not be VRING_DESC_F_WRITE\n", __func__));
 		virtio_blk_abort(vq, idx);
@@ -299,7 +330,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		return;
 	}
 
-	if (writeop && blockif_is_ro(blk->bc)) {
+	if (writeop && blockif_is_ro(q->bc)) {
 		WPRINTF(("Cannot write to a read-only storage!\n"));
 		virtio_blk_done(&io->req, EROFS);
 		return;
@@ -350,14 +381,18 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		}
 
 		err = ((type == VBH_OP_READ) ? blockif_read : blockif_write)
-				(blk->bc, &io->req);
+				(q->bc, &io->req);
 		break;
 	case VBH_OP_DISCARD:
-		err = blockif_discard(blk->bc, &io->req);
+		err = blockif_discard(q->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		/*
+		 * The contexts share the backing file, so this covers the
+		 * writes completed on the other queues too.
+		 */
+		err = blockif_flush(q->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
@@ -379,10 +414,15 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct virtio_blk_queue *q = &blk->queues[vq->num];
+	struct blockif_ctxt *bc;
 
 	if (!vq_has_descs(vq))
 		return;
 
+	/* held already when called from the queue's iothread */
+	pthread_mutex_lock(&q->mtx);
+
 	/*
 	 * The two while loop here is to avoid the race:
 	 *
@@ -393,16 +433,23 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 	 * So, after enable NOTIFY, need to check the queue again to dry the
 	 * requests in virtqueue.
 	 * */
+	/* submit the requests of this notification together */
+	bc = blk->dummy_bctxt ? NULL : q->bc;
+	if (bc)
+		blockif_plug(bc);
 	do {
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(&blk->base, vq);
 		mb();
 		do {
-			virtio_blk_proc(blk, vq);
+			virtio_blk_proc(blk, q);
 		} while (vq_has_descs(vq));
 
 		vq_clear_used_ring_flags(&blk->base, vq);
 		mb();
 	} while (vq_has_descs(vq));
+	if (bc)
+		blockif_unplug(bc);
+	pthread_mutex_unlock(&q->mtx);
 }
 
 static uint64_t
@@ -420,6 +467,12 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
 
+	if (blk->packed)
+		caps |= (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
+
+	if (blk->nqueues > 1)
+		caps |= VIRTIO_BLK_F_MQ;
+
 	return caps;
 }
 
@@ -448,6 +501,7 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.writeback = blockif_get_wce(blk->bc);
 	blk->original_wce = blk->cfg.writeback; /* save for reset */
+	blk->cfg.num_queues = blk->nqueues;
 	if (blockif_candiscard(blk->bc)) {
 		blk->cfg.max_discard_sectors = blockif_max_discard_sectors(blk->bc);
 		blk->cfg.max_discard_seg = blockif_max_discard_seg(blk->bc);
@@ -456,26 +510,94 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 }
+/* Open a block context on the backing file for every queue */
+static int
+virtio_blk_open(struct virtio_blk *blk, struct vmctx *ctx, const char *path,
+		const char *bident)
+{
+	struct blockif_ctxt *bctxt;
+	char qident[16];
+	int i;
+
+	for (i = 0; i < blk->nqueues; i++) {
+		if (i == 0)
+			snprintf(qident, sizeof(qident), "%s", bident);
+		else
+			snprintf(qident, sizeof(qident), "%s.%d", bident, i);
+		bctxt = blockif_open(path, qident, blk->nqueues);
+		if (bctxt == NULL) {
+			while (--i >= 0) {
+				blockif_close(blk->queues[i].bc);
+				blk->queues[i].bc = NULL;
+			}
+			return -1;
+		}
+		blockif_register_mem(bctxt, ctx);
+		blk->queues[i].bc = bctxt;
+	}
+	blk->bc = blk->queues[0].bc;
+	return 0;
+}
+
+/*
+ * Drain the requests in flight, then make what they wrote durable so the
+ * image matches the snapshot.
+ */
+static int
+virtio_blk_quiesce(void *vdev)
+{
+	struct virtio_blk *blk = vdev;
+	int i;
+
+	if (virtio_wait_idle(&blk->base))
+		return -EBUSY;
+
+	for (i = 0; i < blk->nqueues; i++) {
+		if (blk->queues[i].bc && blockif_flush_all(blk->queues[i].bc))
+			return -EIO;
+	}
+	return 0;
+}
+
+static void
+virtio_blk_close(struct virtio_blk *blk, bool flush)
+{
+	int i;
+
+	for (i = 0; i < blk->nqueues; i++) {
+		if (flush && blockif_flush_all(blk->queues[i].bc))
+			WPRINTF(("vrito_blk: Failed to flush before close\n"));
+		blockif_close(blk->queues[i].bc);
+		blk->queues[i].bc = NULL;
+	}
+	blk->bc = NULL;
+}
+
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	bool dummy_bctxt;
 	char bident[16];
-	struct blockif_ctxt *bctxt;
 	char *opts_tmp = NULL;
 	char *opts_start = NULL;
 	char *opt = NULL;
 	u_char digest[16];
 	struct virtio_blk *blk;
 	bool use_iothread;
-	int i;
+	bool use_packed;
+	uint32_t coal_frames = 0, coal_usecs = 0;
+	int iothread_ids[IOTHREAD_NUM_MAX];
+	int iothread_nr = 0;
+	int nqueues = 1;
+	int i, j;
+	char *end;
 	pthread_mutexattr_t attr;
 	int rc;
 
-	bctxt = NULL;
 	/* Assume the bctxt is valid, until identified otherwise */
 	dummy_bctxt = false;
 	use_iothread = false;
+	use_packed = false;
 
 	if (opts == NULL) {
 		pr_err("virtio_blk: backing device required\n");
@@ -501,46 +623,81 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 	if (strstr(opts, "nodisk") == NULL) {
-		opt = strsep(&opts_tmp, ",");
-		if (strcmp("iothread", opt) == 0) {
-			use_iothread = true;
-		} else {
-			/* The opts_start is truncated by strsep, opts_tmp is also
-			 * changed by strsetp, so use opts which points to the
-			 * original parameter string
-			 */
-			opts_tmp = opts;
-		}
-		bctxt = blockif_open(opts_tmp, bident);
-		if (bctxt == NULL) {
-			pr_err("Could not open backing file");
-			free(opts_start);
-			return -1;
+		/* device options come before the backing file */
+		while ((opt = strsep(&opts_tmp, ",")) != NULL) {
+			if (strncmp("iothread", opt, 8) == 0) {
+				if (virtio_parse_iothread_opt(opt, iothread_ids,
+							&iothread_nr)) {
+					free(opts_start);
+					return -1;
+				}
+				use_iothread = true;
+			} else if (strcmp("packed", opt) == 0) {
+				use_packed = true;
+			} else if (strncmp("mq=", opt, 3) == 0) {
+				if (dm_strtoi(opt + 3, &end, 10, &nqueues) ||
+				    (*end != '\0') || (nqueues < 1) ||
+				    (nqueues > VIRTIO_BLK_MAXQ)) {
+					pr_err("virtio_blk: invalid %s, 1 to %d queues\n",
+						opt, VIRTIO_BLK_MAXQ);
+					free(opts_start);
+					return -1;
+				}
+			} else if (strncmp("coalesce=", opt, 9) == 0) {
+				if (virtio_parse_coalesce_opt(opt, &coal_frames,
+							&coal_usecs)) {
+					free(opts_start);
+					return -1;
+				}
+			} else {
+				/* strsep cut the string, put the comma back */
+				if (opts_tmp)
+					opts_tmp[-1] = ',';
+				opts_tmp = opt;
+				break;
+			}
 		}
 	} else {
 		dummy_bctxt = true;
 	}
 
-	free(opts_start);
-
-
 	blk = calloc(1, sizeof(struct virtio_blk));
-	if (!blk) {
+	if (blk)
+		blk->queues = calloc(nqueues, sizeof(struct virtio_blk_queue));
+	if (!blk || !blk->queues) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		free(blk);
+		free(opts_start);
 		return -1;
 	}
+	blk->nqueues = nqueues;
+
+	if (!dummy_bctxt && virtio_blk_open(blk, ctx, opts_tmp, bident)) {
+		pr_err("Could not open backing file");
+		free(blk->queues);
+		free(blk);
+		free(opts_start);
+		return -1;
+	}
+	free(opts_start);
 
-	blk->bc = bctxt;
 	/* Update virtio-blk device struct of dummy ctxt*/
 	blk->dummy_bctxt = dummy_bctxt;
+	blk->packed = use_packed;
+
+	for (j = 0; j < nqueues; j++) {
+		struct virtio_blk_queue *q = &blk->queues[j];
 
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
+		q->blk = blk;
+		q->vq = &blk->vqs[j];
+		for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
+			struct virtio_blk_ioreq *io = &q->ios[i];
 
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->q = q;
+			io->idx = i;
+		}
 	}
 
 	/* init mutex attribute properly to avoid deadlock */
@@ -556,14 +713,29 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (rc)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
+	for (j = 0; j < nqueues; j++) {
+		rc = pthread_mutex_init(&blk->queues[j].mtx, &attr);
+		if (rc)
+			DPRINTF(("virtio_blk: pthread_mutex_init failed with "
+						"error %d!\n", rc));
+	}
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq, BACKEND_VBSU);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = nqueues;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs, BACKEND_VBSU);
 	blk->base.iothread = use_iothread;
+	blk->base.iothread_nr = iothread_nr;
+	memcpy(blk->base.iothread_ids, iothread_ids, sizeof(int) * iothread_nr);
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (j = 0; j < nqueues; j++) {
+		blk->vqs[j].qsize = VIRTIO_BLK_RINGSZ;
+		/* the queues are serviced in parallel */
+		blk->vqs[j].mtx = &blk->queues[j].mtx;
+		if (coal_usecs)
+			vq_set_coalesce(&blk->vqs[j], coal_frames, coal_usecs);
+	}
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -608,12 +780,24 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
 		/* call close only for valid bctxt */
 		if (!blk->dummy_bctxt)
-			blockif_close(blk->bc);
+			virtio_blk_close(blk, false);
+		virtio_coalesce_deinit(&blk->base);
+		free(blk->queues);
 		free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
 
+	/* packed virtqueues are only negotiable over the modern interface */
+	if (blk->packed && virtio_set_modern_bar(&blk->base, false)) {
+		if (!blk->dummy_bctxt)
+			virtio_blk_close(blk, false);
+		virtio_coalesce_deinit(&blk->base);
+		free(blk->queues);
+		free(blk);
+		return -1;
+	}
+
 	/*
 	 * Register ops for virtio-blk Rescan
 	 */
@@ -631,20 +815,17 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
 		/* De-init virtio-blk device only on valid bctxt*/
-		if (!blk->dummy_bctxt) {
-			bctxt = blk->bc;
-			if (blockif_flush_all(bctxt))
-				WPRINTF(("vrito_blk: Failed to flush before close\n"));
-			blockif_close(bctxt);
-		}
+		if (!blk->dummy_bctxt)
+			virtio_blk_close(blk, true);
 		virtio_reset_dev(&blk->base);
+		virtio_coalesce_deinit(&blk->base);
+		free(blk->queues);
 		free(blk);
 	}
 }
@@ -663,7 +844,7 @@ virtio_blk_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 		memcpy(ptr, &value, size);
 		/* Update write cache enable only on valid bctxt*/
 		if (!blk->dummy_bctxt)
-			blockif_set_wce(blk->bc, blkcfg->writeback);
+			virtio_blk_set_wce(blk, blkcfg->writeback);
 		if (blkcfg->writeback)
 			blk->base.device_caps |= VIRTIO_BLK_F_FLUSH;
 		else
@@ -708,7 +889,6 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 {
 	int error = -1;
 	char bident[16];
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk = (struct virtio_blk *) dev->arg;
 
 	if (!blk) {
@@ -744,13 +924,11 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 
 	pr_err("name=%s, Path=%s, ident=%s\n", dev->name, newpath, bident);
 	/* update the bctxt for the virtio-blk device */
-	bctxt = blockif_open(newpath, bident);
-	if (bctxt == NULL) {
+	if (virtio_blk_open(blk, ctx, newpath, bident)) {
 		pr_err("Error opening backing file\n");
 		goto end;
 	}
 
-	blk->bc = bctxt;
 	blk->dummy_bctxt = false;
 
 	/* Update virtio-blk device configuration on valid file*/
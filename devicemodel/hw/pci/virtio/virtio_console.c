@@ -52,6 +52,15 @@
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
 
+/*
+ * Data moves between the rings and a backend in batches: up to
+ * VIRTIO_CONSOLE_BATCH chains share one readv()/writev(), and a new
+ * chain is only taken while VIRTIO_CONSOLE_CHAIN_IOV slots are left.
+ */
+#define	VIRTIO_CONSOLE_BATCH		16
+#define	VIRTIO_CONSOLE_BATCH_IOV	64
+#define	VIRTIO_CONSOLE_CHAIN_IOV	8
+
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
 #define	VIRTIO_CONSOLE_DEVICE_REMOVE	2
@@ -79,8 +88,12 @@ static int virtio_console_debug;
 struct virtio_console;
 struct virtio_console_port;
 struct virtio_console_config;
-typedef void (virtio_console_cb_t)(struct virtio_console_port *, void *,
-				   struct iovec *, int);
+/*
+ * Returns how many bytes of iov the port consumed.  A short count
+ * means the backend is full and the rest must be offered again later.
+ */
+typedef ssize_t (virtio_console_cb_t)(struct virtio_console_port *, void *,
+				      struct iovec *, int);
 
 enum virtio_console_be_type {
 	VIRTIO_CONSOLE_BE_STDIO = 0,
@@ -92,6 +105,16 @@ enum virtio_console_be_type {
 	VIRTIO_CONSOLE_BE_INVALID = VIRTIO_CONSOLE_BE_MAX
 };
 
+struct virtio_console_stats {
+	uint64_t	tx_bytes;
+	uint64_t	tx_chains;
+	uint64_t	tx_writes;
+	uint64_t	tx_stalls;
+	uint64_t	rx_bytes;
+	uint64_t	rx_chains;
+	uint64_t	rx_reads;
+};
+
 struct virtio_console_port {
 	struct virtio_console	*console;
 	int			id;
@@ -100,16 +123,20 @@ struct virtio_console_port {
 	bool			is_console;
 	bool			rx_ready;
 	bool			open;
+	bool			tx_blocked;	/* waiting for EPOLLOUT */
+	size_t			tx_off;		/* bytes of head chain sent */
 	int			rxq;
 	int			txq;
 	void			*arg;
 	virtio_console_cb_t	*cb;
+	struct virtio_console_stats stats;
 };
 
 struct virtio_console_backend {
 	struct virtio_console_port	*port;
 	struct mevent			*evp;
 	struct mevent			*conn_evp;
+	struct mevent			*wr_evp;	/* EPOLLOUT on a dup of fd */
 	int				fd;
 	int				server_fd;
 	bool				open;
@@ -161,6 +188,9 @@ static void virtio_console_control_send(struct virtio_console *,
 static void virtio_console_announce_port(struct virtio_console_port *);
 static void virtio_console_open_port(struct virtio_console_port *, bool);
 static void virtio_console_teardown_backend(void *);
+static void virtio_console_backend_block(struct virtio_console_backend *);
+static void virtio_console_backend_disarm(struct virtio_console_backend *);
+static void virtio_console_reset_backend(struct virtio_console_backend *);
 
 static struct virtio_ops virtio_console_ops = {
 	"vtcon",			/* our name */
@@ -189,10 +219,18 @@ static void
 virtio_console_reset(void *vdev)
 {
 	struct virtio_console *console;
+	struct virtio_console_port *port;
+	int i;
 
 	console = vdev;
 
 	DPRINTF(("vtcon: device reset requested!\n"));
+	for (i = 0; i < console->nports; i++) {
+		port = &console->ports[i];
+		if (port->enabled && port->arg != NULL)
+			virtio_console_backend_disarm(port->arg);
+		port->tx_off = 0;
+	}
 	virtio_reset_dev(&console->base);
 }
 
@@ -271,7 +309,18 @@ virtio_console_add_port(struct virtio_console *console, const char *name,
 	return port;
 }
 
-static void
+static size_t
+virtio_console_iov_len(const struct iovec *iov, int niov)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static ssize_t
 virtio_console_control_tx(struct virtio_console_port *port, void *arg,
 			  struct iovec *iov, int niov __attribute__((unused)))
 {
@@ -284,7 +333,7 @@ virtio_console_control_tx(struct virtio_console_port *port, void *arg,
 	ctrl = (struct virtio_console_control *)iov->iov_base;
 
 	if ((console == NULL) || (ctrl == NULL))
-		return;
+		return 0;
 
 	switch (ctrl->event) {
 	case VIRTIO_CONSOLE_DEVICE_READY:
@@ -304,7 +353,7 @@ virtio_console_control_tx(struct virtio_console_port *port, void *arg,
 		if (ctrl->id >= console->nports) {
 			WPRINTF(("VTCONSOLE_PORT_READY for unknown port %d\n",
 			    ctrl->id));
-			return;
+			return 0;
 		}
 
 		tmp = &console->ports[ctrl->id];
@@ -316,6 +365,7 @@ virtio_console_control_tx(struct virtio_console_port *port, void *arg,
 		}
 		break;
 	}
+	return 0;
 }
 
 static void
@@ -379,6 +429,83 @@ virtio_console_control_send(struct virtio_console *console,
 	vq_endchains(vq, 1);
 }
 
+/*
+ * Hand the guest's output to a backend port, gathering up to
+ * VIRTIO_CONSOLE_BATCH chains into each call of port->cb.  Chains the
+ * backend could not take go back to the ring, with tx_off recording
+ * how much of the first one was already written.  Returns false when
+ * the backend pushed back before the ring was drained.
+ */
+static bool
+virtio_console_port_tx(struct virtio_console_port *port,
+		       struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_CONSOLE_BATCH_IOV], *p;
+	uint16_t flags[VIRTIO_CONSOLE_BATCH_IOV];
+	uint16_t idx[VIRTIO_CONSOLE_BATCH];
+	size_t clen[VIRTIO_CONSOLE_BATCH];
+	size_t done, skip;
+	ssize_t len;
+	int nchains, niov, np, n, i;
+
+	while (vq_has_descs(vq)) {
+		nchains = niov = 0;
+		while (nchains < VIRTIO_CONSOLE_BATCH &&
+		       VIRTIO_CONSOLE_BATCH_IOV - niov >= VIRTIO_CONSOLE_CHAIN_IOV &&
+		       vq_has_descs(vq)) {
+			n = vq_getchain(vq, &idx[nchains], &iov[niov],
+					VIRTIO_CONSOLE_BATCH_IOV - niov, flags);
+			if (n < 1) {
+				pr_err("%s: fail to getchain!\n", __func__);
+				break;
+			}
+			clen[nchains++] = virtio_console_iov_len(&iov[niov], n);
+			niov += n;
+		}
+		if (nchains == 0)
+			break;
+
+		/* skip what an earlier short write already sent */
+		p = iov;
+		np = niov;
+		skip = port->tx_off;
+		while (np > 0 && skip >= p->iov_len) {
+			skip -= p->iov_len;
+			p++;
+			np--;
+		}
+		if (np > 0) {
+			p->iov_base = (char *)p->iov_base + skip;
+			p->iov_len -= skip;
+		}
+
+		if (port->cb != NULL) {
+			len = port->cb(port, port->arg, p, np);
+			port->stats.tx_writes++;
+		} else
+			len = virtio_console_iov_len(p, np);
+		if (len < 0)
+			len = 0;
+		port->stats.tx_bytes += len;
+
+		done = port->tx_off + len;
+		for (i = 0; i < nchains && done >= clen[i]; i++) {
+			done -= clen[i];
+			vq_relchain(vq, idx[i], 0);
+		}
+		port->stats.tx_chains += i;
+
+		if (i < nchains) {
+			port->tx_off = done;
+			vq_retchains(vq, &idx[i], nchains - i);
+			port->stats.tx_stalls++;
+			return false;
+		}
+		port->tx_off = 0;
+	}
+	return true;
+}
+
 static void
 virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 {
@@ -391,12 +518,23 @@ virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
+	if (port != &console->control_port) {
+		/*
+		 * While the backend is full the chains stay in the ring;
+		 * the EPOLLOUT handler picks them up again.
+		 */
+		if (!port->tx_blocked && !virtio_console_port_tx(port, vq))
+			virtio_console_backend_block(port->arg);
+		vq_endchains(vq, 1);
+		return;
+	}
+
 	while (vq_has_descs(vq)) {
 		if (vq_getchain(vq, &idx, iov, 1, flags) < 1) {
 			pr_err("%s: fail to getchain!\n", __func__);
 			break;
 		}
-		if ((port != NULL) && (port->cb != NULL))
+		if (port->cb != NULL)
 			port->cb(port, port->arg, iov, 1);
 
 		/*
@@ -424,6 +562,67 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 	}
 }
 
+static void
+virtio_console_backend_disarm(struct virtio_console_backend *be)
+{
+	if (be->wr_evp) {
+		mevent_delete_close(be->wr_evp);
+		be->wr_evp = NULL;
+	}
+	be->port->tx_blocked = false;
+}
+
+/*
+ * The backend can take more output, or it went away: flush the chains
+ * held back in the ring.  Without a backend fd they are dropped.
+ */
+static void
+virtio_console_backend_drain(int fd __attribute__((unused)),
+			     enum ev_type t __attribute__((unused)),
+			     void *arg)
+{
+	struct virtio_console_backend *be = arg;
+	struct virtio_console_port *port = be->port;
+	struct virtio_vq_info *vq;
+
+	pthread_mutex_lock(&port->console->mtx);
+	if (port->tx_blocked) {
+		virtio_console_backend_disarm(be);
+		vq = virtio_console_port_to_vq(port, false);
+		if (!virtio_console_port_tx(port, vq))
+			virtio_console_backend_block(be);
+		vq_endchains(vq, 1);
+	}
+	pthread_mutex_unlock(&port->console->mtx);
+}
+
+/*
+ * Wait for EPOLLOUT instead of dropping guest output.  be->fd may
+ * already be watched for EPOLLIN, and epoll keys on the descriptor, so
+ * the write side is watched through a dup of it.
+ */
+static void
+virtio_console_backend_block(struct virtio_console_backend *be)
+{
+	struct virtio_console_port *port = be->port;
+	int fd;
+
+	port->tx_blocked = true;
+	fd = dup(be->fd);
+	if (fd >= 0) {
+		be->wr_evp = mevent_add(fd, EVF_WRITE,
+				virtio_console_backend_drain, be, NULL, NULL);
+		if (be->wr_evp != NULL)
+			return;
+		close(fd);
+	}
+
+	WPRINTF(("vtcon: cannot wait for backend, errno = %d\n", errno));
+	port->tx_blocked = false;
+	virtio_console_reset_backend(be);
+	virtio_console_port_tx(port, virtio_console_port_to_vq(port, false));
+}
+
 static void
 virtio_console_reset_backend(struct virtio_console_backend *be)
 {
@@ -436,6 +635,7 @@ virtio_console_reset_backend(struct virtio_console_backend *be)
 		close(be->fd);
 	be->fd = -1;
 	be->open = false;
+	virtio_console_backend_drain(-1, EVF_WRITE, be);
 }
 
 static void
@@ -449,6 +649,7 @@ virtio_console_socket_clear(struct virtio_console_backend *be)
 		close(be->fd);
 		be->fd = -1;
 	}
+	virtio_console_backend_drain(-1, EVF_WRITE, be);
 }
 
 static void
@@ -459,10 +660,12 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
 	struct virtio_vq_info *vq;
-	struct iovec iov;
+	struct iovec iov[VIRTIO_CONSOLE_BATCH_IOV];
 	static char dummybuf[2048];
-	int len, n;
-	uint16_t idx;
+	uint16_t idx[VIRTIO_CONSOLE_BATCH];
+	size_t clen[VIRTIO_CONSOLE_BATCH];
+	size_t total, left, used;
+	int len, n, nchains, niov, i;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
@@ -482,15 +685,34 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 		return;
 	}
 
+	/*
+	 * Read straight into as many guest buffers as are posted, one
+	 * readv() per batch.  A short read means the backend is empty for
+	 * now; EPOLLIN brings us back.
+	 */
 	do {
-		n = vq_getchain(vq, &idx, &iov, 1, NULL);
-		if (n < 1){
-			pr_err("%s: fail to getchain!\n", __func__);
-			break;
+		nchains = niov = 0;
+		total = 0;
+		while (nchains < VIRTIO_CONSOLE_BATCH &&
+		       VIRTIO_CONSOLE_BATCH_IOV - niov >= VIRTIO_CONSOLE_CHAIN_IOV &&
+		       vq_has_descs(vq)) {
+			n = vq_getchain(vq, &idx[nchains], &iov[niov],
+					VIRTIO_CONSOLE_BATCH_IOV - niov, NULL);
+			if (n < 1) {
+				pr_err("%s: fail to getchain!\n", __func__);
+				break;
+			}
+			clen[nchains] = virtio_console_iov_len(&iov[niov], n);
+			total += clen[nchains++];
+			niov += n;
 		}
-		len = readv(be->fd, &iov, n);
+		if (nchains == 0)
+			break;
+
+		len = readv(be->fd, iov, niov);
+		port->stats.rx_reads++;
 		if (len <= 0) {
-			vq_retchain(vq);
+			vq_retchains(vq, idx, nchains);
 			vq_endchains(vq, 0);
 
 			/* no data available */
@@ -506,8 +728,17 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 			goto close;
 		}
 
-		vq_relchain(vq, idx, len);
-	} while (vq_has_descs(vq));
+		port->stats.rx_bytes += len;
+		left = len;
+		for (i = 0; i < nchains && left > 0; i++) {
+			used = left < clen[i] ? left : clen[i];
+			vq_relchain(vq, idx[i], used);
+			left -= used;
+		}
+		port->stats.rx_chains += i;
+		if (i < nchains)
+			vq_retchains(vq, &idx[i], nchains - i);
+	} while ((size_t)len == total && vq_has_descs(vq));
 
 	vq_endchains(vq, 1);
 	return;
@@ -528,25 +759,36 @@ clear:
 	}
 }
 
-static void
+static ssize_t
 virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 			     struct iovec *iov, int niov)
 {
 	struct virtio_console_backend *be;
-	int ret;
+	ssize_t ret;
+	size_t total;
 
 	be = arg;
+	total = virtio_console_iov_len(iov, niov);
 
 	if (be->fd == -1)
-		return;
+		return total;
 
 	ret = writev(be->fd, iov, niov);
-	if (ret <= 0) {
-		/* Case 1:backend cannot receive more data. For example when pts is
-		 * not connected to any client, its tty buffer will become full.
-		 * In this case we just drop data from guest hvc console.
-		 *
-		 * Case 2: Backend connection not yet setup. For example, when
+	if (ret == -1 && errno == EAGAIN)
+		ret = 0;
+	if (ret >= 0) {
+		/* Case 1:backend cannot receive more data. Any backend that
+		 * is being read makes progress again, so the caller waits
+		 * for EPOLLOUT. A pts that is not connected to any client
+		 * never drains once its tty buffer is full, and the guest
+		 * hvc console spins until its output is consumed; in this
+		 * case we just drop data from guest hvc console.
+		 */
+		if ((size_t)ret < total && be->be_type == VIRTIO_CONSOLE_BE_PTY)
+			return total;
+		return ret;
+	} else {
+		/* Case 2: Backend connection not yet setup. For example, when
 		 * virtio-console is used as console port with socket backend, guest
 		 * kernel tries to hook it up with hvc console and sets it up. It
 		 * doesn't check if a client is connected and can result in ENOTCONN
@@ -557,19 +799,20 @@ virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 		 * PS: For Kata, the runtime first launches VM and then proxy which
 		 * acts as a client connects to this socket.
 		 */
-		if (ret == -1 && (errno == EAGAIN || errno == ENOTCONN))
-			return;
+		if (errno == ENOTCONN)
+			return total;
 
-		if (ret == -1 && errno == EBADF) {
+		if (errno == EBADF) {
 			if (be->be_type == VIRTIO_CONSOLE_BE_SOCKET && (be->socket_type == NULL
 				|| !strcmp(be->socket_type,"server"))) {
 				virtio_console_socket_clear(be);
-				return;
+				return total;
 			}
 		}
 		virtio_console_reset_backend(be);
 		WPRINTF(("vtcon: be write failed! errno = %d\n", errno));
 	}
+	return total;
 }
 
 static void
@@ -984,6 +1227,14 @@ virtio_console_close_backend(struct virtio_console_backend *be)
 	if (!be)
 		return;
 
+	virtio_console_backend_disarm(be);
+	DPRINTF(("vtcon: port %s tx %lu bytes in %lu chains, %lu writes, "
+		"%lu stalls; rx %lu bytes in %lu chains, %lu reads\n",
+		be->port->name, be->port->stats.tx_bytes,
+		be->port->stats.tx_chains, be->port->stats.tx_writes,
+		be->port->stats.tx_stalls, be->port->stats.rx_bytes,
+		be->port->stats.rx_chains, be->port->stats.rx_reads));
+
 	switch (be->be_type) {
 	case VIRTIO_CONSOLE_BE_PTY:
 		if (be->pts_fd > 0) {
@@ -73,6 +73,7 @@
 #define VIRTIO_GPU_FLAG_INFO_RING_IDX (1 << 1)
 #define VIRTIO_GPU_FLAG_FENCE	(1 << 0)
 #define VIRTIO_GPU_VGA_FB_SIZE	16 * MB
+#define VIRTIO_GPU_VGA_FB_PAGES	((VIRTIO_GPU_VGA_FB_SIZE) / 4096)
 #define VIRTIO_GPU_VGA_DMEMSZ	128
 #define VIRTIO_GPU_EDID_SIZE	384
 #define VIRTIO_GPU_VGA_IOPORT_OFFSET	0x400
@@ -356,6 +357,10 @@ struct virtio_gpu_scanout {
 	pixman_image_t *cur_img;
 	struct dma_buf_info *dma_buf;
 	bool is_active;
+	/* transferred but not flushed yet, in resource coordinates */
+	pixman_region16_t damage;
+	/* the display has a new texture, upload all of it on the next flush */
+	bool full_update;
 };
 
 /*
@@ -681,6 +686,43 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 		gpu_scanout->is_active = false;
 	}
 	memcpy(&gpu_scanout->scanout_rect, scan_rect, sizeof(*scan_rect));
+	pixman_region_clear(&gpu_scanout->damage);
+	gpu_scanout->full_update = true;
+}
+
+/* add the part of a transfer that the scanout shows to its damage */
+static void
+virtio_gpu_scanout_add_damage(struct virtio_gpu_scanout *gpu_scanout,
+			      struct virtio_gpu_rect *r)
+{
+	pixman_region16_t region;
+
+	pixman_region_init_rect(&region, r->x, r->y, r->width, r->height);
+	pixman_region_intersect_rect(&region, &region,
+				     gpu_scanout->scanout_rect.x,
+				     gpu_scanout->scanout_rect.y,
+				     gpu_scanout->scanout_rect.width,
+				     gpu_scanout->scanout_rect.height);
+	pixman_region_union(&gpu_scanout->damage, &gpu_scanout->damage, &region);
+	pixman_region_fini(&region);
+}
+
+/*
+ * Move the damage a flush covers into region, in scanout coordinates.
+ * region must be released with pixman_region_fini().
+ */
+static void
+virtio_gpu_scanout_take_damage(struct virtio_gpu_scanout *gpu_scanout,
+			       struct virtio_gpu_rect *flush_rect,
+			       pixman_region16_t *region)
+{
+	pixman_region_init(region);
+	pixman_region_intersect_rect(region, &gpu_scanout->damage,
+				     flush_rect->x, flush_rect->y,
+				     flush_rect->width, flush_rect->height);
+	pixman_region_subtract(&gpu_scanout->damage, &gpu_scanout->damage, region);
+	pixman_region_translate(region, -(int)gpu_scanout->scanout_rect.x,
+				-(int)gpu_scanout->scanout_rect.y);
 }
 
 static void
@@ -778,9 +820,10 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_mem_entry *entries;
 	struct virtio_gpu_resource_2d *r2d;
 	struct virtio_gpu_ctrl_hdr resp;
-	int i;
+	int i, n;
 	uint8_t *pbuf;
 	struct iovec *iov;
+	void *base;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
@@ -809,7 +852,6 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 		}
 
 		r2d->iov = iov;
-		r2d->iovcnt = req.nr_entries;
 		entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
 		if (!entries) {
 			free(iov);
@@ -821,13 +863,23 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 			memcpy(pbuf, cmd->iov[i].iov_base, cmd->iov[i].iov_len);
 			pbuf += cmd->iov[i].iov_len;
 		}
-		for (i = 0; i < req.nr_entries; i++) {
-			r2d->iov[i].iov_base = paddr_guest2host(
-					cmd->gpu->base.dev->vmctx,
-					entries[i].addr,
-					entries[i].length);
-			r2d->iov[i].iov_len = entries[i].length;
+		/*
+		 * Guest memory is mapped in one piece, so pages the guest
+		 * allocated back to back are merged and copied in bulk.
+		 */
+		for (i = 0, n = 0; i < req.nr_entries; i++) {
+			base = paddr_guest2host(cmd->gpu->base.dev->vmctx,
+					entries[i].addr, entries[i].length);
+			if (n > 0 && base && r2d->iov[n - 1].iov_base &&
+			    r2d->iov[n - 1].iov_base + r2d->iov[n - 1].iov_len == base) {
+				r2d->iov[n - 1].iov_len += entries[i].length;
+				continue;
+			}
+			r2d->iov[n].iov_base = base;
+			r2d->iov[n].iov_len = entries[i].length;
+			n++;
 		}
+		r2d->iovcnt = n;
 		free(entries);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
@@ -930,17 +982,41 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 	}
 }
 
+/* copy len bytes from offset in the backing pages of a resource */
+static void
+virtio_gpu_copy_from_backing(struct virtio_gpu_resource_2d *r2d,
+			     size_t offset, void *dst, size_t len)
+{
+	size_t bytes;
+	int i;
+
+	for (i = 0; i < r2d->iovcnt && len > 0; i++) {
+		if (offset >= r2d->iov[i].iov_len) {
+			offset -= r2d->iov[i].iov_len;
+			continue;
+		}
+		bytes = r2d->iov[i].iov_len - offset;
+		if (bytes > len)
+			bytes = len;
+		if (r2d->iov[i].iov_base)
+			memcpy(dst, r2d->iov[i].iov_base + offset, bytes);
+		dst += bytes;
+		len -= bytes;
+		offset = 0;
+	}
+}
+
 static void
 virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 {
 	struct virtio_gpu_transfer_to_host_2d req;
 	struct virtio_gpu_resource_2d *r2d;
 	struct virtio_gpu_ctrl_hdr resp;
-	uint32_t src_offset, dst_offset, stride, bpp, h;
+	struct virtio_gpu_scanout *gpu_scanout;
+	uint32_t dst_offset, stride, bpp, h;
 	pixman_format_code_t format;
-	void *img_data, *dst, *src;
-	int i, done, bytes, total;
-	int width, height;
+	void *img_data;
+	int i, width, height;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
@@ -977,33 +1053,27 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		img_data = pixman_image_get_data(r2d->image);
 		width = (req.r.width < r2d->width) ? req.r.width : r2d->width;
 		height = (req.r.height < r2d->height) ? req.r.height : r2d->height;
-		for (h = 0; h < height; h++) {
-			src_offset = req.offset + stride * h;
-			dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
-			dst = img_data + dst_offset;
-			done = 0;
-			total = width * bpp;
-			for (i = 0; i < r2d->iovcnt; i++) {
-				if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
-					continue;
-				}
-
-				if (src_offset < r2d->iov[i].iov_len) {
-					src = r2d->iov[i].iov_base + src_offset;
-					bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
-						 (total - done) : (r2d->iov[i].iov_len - src_offset);
-					memcpy((dst + done), src, bytes);
-					src_offset = 0;
-					done += bytes;
-					if (done >= total) {
-						break;
-					}
-				} else {
-					src_offset -= r2d->iov[i].iov_len;
-				}
+		if (req.r.x == 0 && width * bpp == stride) {
+			/* whole rows, the backing has the same layout */
+			dst_offset = req.r.y * stride;
+			virtio_gpu_copy_from_backing(r2d, req.offset,
+					img_data + dst_offset, height * stride);
+		} else {
+			for (h = 0; h < height; h++) {
+				dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
+				virtio_gpu_copy_from_backing(r2d,
+						req.offset + stride * h,
+						img_data + dst_offset, width * bpp);
 			}
 		}
 		pixman_image_unref(r2d->image);
+
+		for (i = 0; i < cmd->gpu->scanout_num; i++) {
+			gpu_scanout = cmd->gpu->gpu_scanouts + i;
+			if (gpu_scanout->is_active &&
+			    gpu_scanout->resource_id == req.resource_id)
+				virtio_gpu_scanout_add_damage(gpu_scanout, &req.r);
+		}
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
 
@@ -1061,6 +1131,7 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	struct virtio_gpu *gpu;
 	int i;
 	struct virtio_gpu_scanout *gpu_scanout;
+	pixman_region16_t damage;
 	int bytes_pp;
 
 	gpu = cmd->gpu;
@@ -1098,6 +1169,17 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 			continue;
 
 		gpu_scanout = gpu->gpu_scanouts + i;
+		/* only upload what was transferred since the last flush */
+		virtio_gpu_scanout_take_damage(gpu_scanout, &req.r, &damage);
+		if (gpu_scanout->full_update) {
+			gpu_scanout->full_update = false;
+			surf.damage = NULL;
+		} else if (pixman_region_not_empty(&damage)) {
+			surf.damage = &damage;
+		} else {
+			pixman_region_fini(&damage);
+			continue;
+		}
 		surf.pixel = pixman_image_get_data(r2d->image);
 		surf.x = gpu_scanout->scanout_rect.x;
 		surf.y = gpu_scanout->scanout_rect.y;
@@ -1108,6 +1190,7 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 		surf.surf_type = SURFACE_PIXMAN;
 		surf.pixel += bytes_pp * surf.x + surf.y * surf.stride;
 		vdpy_surface_update(gpu->vdpy_handle, i, &surf);
+		pixman_region_fini(&damage);
 	}
 	pixman_image_unref(r2d->image);
 
@@ -1592,12 +1675,110 @@ virtio_gpu_notify_cursorq(void *vdev, struct virtio_vq_info *vq)
 	vdpy_submit_bh(gpu->vdpy_handle, &gpu->cursor_bh);
 }
 
+static void
+virtio_gpu_vga_fb_log_stop(struct virtio_gpu *gpu)
+{
+	if (gpu->vga.fb_log_gpa == 0)
+		return;
+
+	vm_set_dirty_log_range(gpu->base.dev->vmctx, gpu->vga.fb_log_gpa,
+			VIRTIO_GPU_VGA_FB_SIZE, false);
+	gpu->vga.fb_log_gpa = 0;
+}
+
+/*
+ * Add the lines of the VBE framebuffer on the pages the guest wrote since
+ * the last call to damage. The first call arms the dirty log on BAR0 and
+ * damages everything. Return -1 if the log is not enabled with the
+ * fb_dirty_log option or not usable; the caller then uploads the whole
+ * framebuffer.
+ */
+static int
+virtio_gpu_vga_fb_damage(struct virtio_gpu *gpu, pixman_region16_t *damage)
+{
+	struct pci_vdev *dev = gpu->base.dev;
+	uint64_t bitmap[VIRTIO_GPU_VGA_FB_PAGES / 64];
+	uint32_t stride, height, start, end;
+	size_t len;
+	int page, pages;
+
+	if (!gpu->vga.fb_log_enabled || gpu->vga.fb_log_failed)
+		return -1;
+
+	if (gpu->vga.fb_log_gpa != dev->bar[0].addr) {
+		virtio_gpu_vga_fb_log_stop(gpu);
+		if (vm_set_dirty_log_range(dev->vmctx, dev->bar[0].addr,
+				VIRTIO_GPU_VGA_FB_SIZE, true)) {
+			pr_err("%s: no dirty log, falling back to full updates\n",
+					__func__);
+			gpu->vga.fb_log_failed = true;
+			return -1;
+		}
+		gpu->vga.fb_log_gpa = dev->bar[0].addr;
+		pixman_region_union_rect(damage, damage, 0, 0,
+				gpu->vga.surf.width, gpu->vga.surf.height);
+		return 0;
+	}
+
+	stride = gpu->vga.surf.stride;
+	height = gpu->vga.surf.height;
+	len = roundup2((size_t)stride * height, ACRN_DIRTY_LOG_GRANULE);
+	if (len == 0)
+		return 0;
+	if (len > VIRTIO_GPU_VGA_FB_SIZE)
+		len = VIRTIO_GPU_VGA_FB_SIZE;
+	if (vm_get_dirty_log(dev->vmctx, gpu->vga.fb_log_gpa, len, bitmap)) {
+		gpu->vga.fb_log_failed = true;
+		virtio_gpu_vga_fb_log_stop(gpu);
+		return -1;
+	}
+
+	/* each run of dirty pages damages the lines it overlaps */
+	pages = len / 4096;
+	for (page = 0; page < pages; page++) {
+		if (!(bitmap[page / 64] & (1UL << (page % 64))))
+			continue;
+		start = page;
+		while (page + 1 < pages &&
+		       (bitmap[(page + 1) / 64] & (1UL << ((page + 1) % 64))))
+			page++;
+
+		start = start * 4096 / stride;
+		end = ((page + 1) * 4096 - 1) / stride + 1;
+		if (start >= height)
+			break;
+		if (end > height)
+			end = height;
+		pixman_region_union_rect(damage, damage, 0, start,
+				gpu->vga.surf.width, end - start);
+	}
+	return 0;
+}
+
+/*
+ * Runs on the display thread: convert the legacy VGA memory or look up the
+ * written part of the VBE framebuffer, and upload only what changed.
+ */
 static void
 virtio_gpu_vga_bh(void *param)
 {
 	struct virtio_gpu *gpu;
+	pixman_region16_t damage;
+	bool full = false;
 
 	gpu = (struct virtio_gpu*)param;
+	if (!gpu->vga.enable)
+		return;
+
+	pixman_region_init(&damage);
+	if ((gpu->vga.gc->gc_image->vgamode) && (gpu->vga.dev != NULL)) {
+		/* the conversion rewrites the framebuffer behind the log */
+		virtio_gpu_vga_fb_log_stop(gpu);
+		vga_render(gpu->vga.gc, gpu->vga.dev, &damage);
+	} else if(gpu->vga.gc->gc_image->width != gpu->vga.vberegs.xres ||
+		  gpu->vga.gc->gc_image->height != gpu->vga.vberegs.yres) {
+		gc_resize(gpu->vga.gc, gpu->vga.vberegs.xres, gpu->vga.vberegs.yres);
+	}
 
 	if ((gpu->vga.surf.width != gpu->vga.gc->gc_image->width) ||
 		(gpu->vga.surf.height != gpu->vga.gc->gc_image->height)) {
@@ -1608,9 +1789,19 @@ virtio_gpu_vga_bh(void *param)
 		gpu->vga.surf.surf_format = PIXMAN_a8r8g8b8;
 		gpu->vga.surf.surf_type = SURFACE_PIXMAN;
 		vdpy_surface_set(gpu->vdpy_handle, 0, &gpu->vga.surf);
+		full = true;
 	}
 
-	vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+	if (!gpu->vga.gc->gc_image->vgamode &&
+	    virtio_gpu_vga_fb_damage(gpu, &damage) < 0)
+		full = true;
+
+	if (full || pixman_region_not_empty(&damage)) {
+		gpu->vga.surf.damage = full ? NULL : &damage;
+		vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+		gpu->vga.surf.damage = NULL;
+	}
+	pixman_region_fini(&damage);
 }
 
 static void *
@@ -1621,20 +1812,11 @@ virtio_gpu_vga_render(void *param)
 	gpu = (struct virtio_gpu*)param;
 	gpu->vga.surf.width = 0;
 	gpu->vga.surf.stride = 0;
-	/* The below logic needs to be refined */
 	while(gpu->vga.enable) {
-		if ((gpu->vga.gc->gc_image->vgamode) && (gpu->vga.dev != NULL)) {
-			vga_render(gpu->vga.gc, gpu->vga.dev);
-			break;
-		}
-
-		if(gpu->vga.gc->gc_image->width != gpu->vga.vberegs.xres ||
-		   gpu->vga.gc->gc_image->height != gpu->vga.vberegs.yres) {
-			gc_resize(gpu->vga.gc, gpu->vga.vberegs.xres, gpu->vga.vberegs.yres);
-		}
 		vdpy_submit_bh(gpu->vdpy_handle, &gpu->vga_bh);
 		usleep(33000);
 	}
+	virtio_gpu_vga_fb_log_stop(gpu);
 
 	pthread_mutex_lock(&gpu->vga_thread_mtx);
 	atomic_store(&gpu->vga_thread_status, VGA_THREAD_EOL);
@@ -1647,7 +1829,7 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_gpu *gpu;
 	pthread_mutexattr_t attr;
-	int rc = 0;
+	int rc = 0, i;
 	struct display_info info;
 	int prot;
 	struct virtio_pci_cap cap;
@@ -1695,6 +1877,10 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			gpu->vq,
 			BACKEND_VBSU);
 
+	/* the display options are parsed by vdpy_parse_cmd_option() */
+	if (opts && strcasestr(opts, "fb_dirty_log"))
+		gpu->vga.fb_log_enabled = true;
+
 	gpu->scanout_num = 1;
 	gpu->vdpy_handle = vdpy_init(&gpu->scanout_num);
 	gpu->base.mtx = &gpu->mtx;
@@ -1710,6 +1896,8 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		free(gpu);
 		return -1;
 	}
+	for (i = 0; i < gpu->scanout_num; i++)
+		pixman_region_init(&gpu->gpu_scanouts[i].damage);
 
 	if (vm_allow_dmabuf(gpu->base.dev->vmctx)) {
 		FILE *fp;
@@ -1906,6 +2094,7 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			}
 			gpu_scanout->is_active = false;
 		}
+		pixman_region_fini(&gpu_scanout->damage);
 	}
 	free(gpu->gpu_scanouts);
 	gpu->gpu_scanouts = NULL;
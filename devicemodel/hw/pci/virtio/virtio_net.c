@@ -51,6 +51,8 @@
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "iothread.h"
+#include <atomic.h>
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
@@ -77,11 +79,21 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple rx/tx queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
 	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC))
 
+/*
+ * Checksum and segmentation offloads, offered when the tap passes the
+ * virtio-net header through (IFF_VNET_HDR).
+ */
+#define VIRTIO_NET_S_OFFLOADCAPS      \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
+
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	((1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
 	(1 << VIRTIO_RING_F_EVENT_IDX) | VIRTIO_NET_F_MRG_RXBUF | \
@@ -96,16 +108,31 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions.  Queue pair p uses virtqueue 2p for rx and 2p + 1
+ * for tx; with more than one pair, the control queue follows the last
+ * pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAXQP	8
+#define VIRTIO_NET_MAXQ	(VIRTIO_NET_MAXQP * 2 + 1)
+
+#define VIRTIO_NET_CTLQ_RINGSZ	64
+#define VIRTIO_NET_CTRL_MAXSEGS	4
+
+/*
+ * Control queue commands
+ */
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
 
 /*
  * Fixed network header size
@@ -120,6 +147,14 @@ struct virtio_net_rxhdr {
 	uint16_t	vrh_bufs;
 } __attribute__((packed));
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM	1	/* csum_start/offset valid */
+#define VIRTIO_NET_HDR_F_DATA_VALID	2	/* checksum already checked */
+
+#define VIRTIO_NET_HDR_GSO_NONE		0
+#define VIRTIO_NET_HDR_GSO_TCPV4	1
+#define VIRTIO_NET_HDR_GSO_TCPV6	4
+#define VIRTIO_NET_HDR_GSO_ECN		0x80
+
 /*
  * Debug printf
  */
@@ -132,45 +167,72 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[2];		/* rx and tx of one queue pair */
 	int tapfd;
 	bool vhost_started;
 };
 
+struct virtio_net;
+
 /*
- * Per-device struct
+ * Per queue pair struct: each pair has its own tap queue, rx event,
+ * tx thread and, with vhost, its own vhost-net instance.
  */
-struct virtio_net {
-	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
-	pthread_mutex_t mtx;
-	struct mevent	*mevp;
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		idx;
 
 	int		tapfd;
+	bool		tap_attached;	/* tap queue receives traffic */
+	struct mevent	*mevp;
+	struct iothread_mevent iomvt;	/* rx event if on an iothread */
+	int		iothread_id;
+	bool		on_iothread;
 
 	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+
+	pthread_t	tx_tid;
+	bool		tx_started;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	struct vhost_net *vhost_net;
+};
+
+/*
+ * Per-device struct
+ */
+struct virtio_net {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
+	struct virtio_ops ops;		/* nvq depends on max_pairs */
+	pthread_mutex_t mtx;
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the tx i/o threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	bool		tap_vnet_hdr;	/* tap passes the header through */
+	unsigned int	tap_offload;	/* TUN_F_* set on the tap */
+
+	int		max_pairs;
+	int		curr_pairs;	/* set by VIRTIO_NET_CTRL_MQ */
+	int		refs;		/* queue pairs not torn down yet */
+	struct virtio_net_qpair qp[VIRTIO_NET_MAXQP];
+
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp, struct iovec *iov,
 			     int iovcnt, int len);
 
-	struct vhost_net *vhost_net;
 	bool		use_vhost;
 };
 
@@ -184,14 +246,14 @@ static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
 static void virtio_net_teardown(void *param);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
-	int tapfd, int vq_idx);
+	int tapfd, int vq_idx, bool tap_vnet_hdr);
 static int vhost_net_deinit(struct vhost_net *vhost_net);
 static int vhost_net_start(struct vhost_net *vhost_net);
 static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* 2 virtqueues, more with mq */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -270,13 +332,19 @@ ether_aton(const char *a, struct ether_addr *e)
 static void
 virtio_net_txwait(struct virtio_net *net)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		pthread_mutex_lock(&qp->tx_mtx);
+		while (qp->tx_in_progress) {
+			pthread_mutex_unlock(&qp->tx_mtx);
+			usleep(10000);
+			pthread_mutex_lock(&qp->tx_mtx);
+		}
+		pthread_mutex_unlock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
 }
 
 /*
@@ -285,19 +353,59 @@ virtio_net_txwait(struct virtio_net *net)
 static void
 virtio_net_rxwait(struct virtio_net *net)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		pthread_mutex_lock(&qp->rx_mtx);
+		while (qp->rx_in_progress) {
+			pthread_mutex_unlock(&qp->rx_mtx);
+			usleep(10000);
+			pthread_mutex_lock(&qp->rx_mtx);
+		}
+		pthread_mutex_unlock(&qp->rx_mtx);
+	}
+}
+
+/*
+ * Steer the traffic to the first "pairs" tap queues: the kernel only
+ * delivers packets to the attached ones.
+ */
+static int
+virtio_net_set_pairs(struct virtio_net *net, int pairs)
+{
+	struct virtio_net_qpair *qp;
+	struct ifreq ifr;
+	bool attach;
+	int i, rc = 0;
+
+	for (i = 0; (net->max_pairs > 1) && (i < net->max_pairs); i++) {
+		qp = &net->qp[i];
+		attach = i < pairs;
+		if (qp->tapfd < 0 || qp->tap_attached == attach)
+			continue;
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(qp->tapfd, TUNSETQUEUE, (void *)&ifr) < 0) {
+			WPRINTF(("vtnet: %s tap queue %d failed: %d\n",
+				attach ? "attach" : "detach", i, errno));
+			rc = -1;
+			continue;
+		}
+		qp->tap_attached = attach;
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+
+	net->curr_pairs = pairs;
+	return rc;
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -310,44 +418,57 @@ virtio_net_reset(void *vdev)
 	virtio_net_txwait(net);
 	virtio_net_rxwait(net);
 
-	net->rx_ready = 0;
+	for (i = 0; i < net->max_pairs; i++)
+		net->qp[i].rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
 
+	/* the driver starts over with a single queue pair */
+	virtio_net_set_pairs(net, 1);
+
 	net->resetting = 0;
 	net->closing = 0;
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Send signal to tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
+	struct virtio_net_qpair *qp;
 	void *jval;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		if (!qp->tx_started)
+			continue;
 
-	pthread_mutex_lock(&net->tx_mtx);
-	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
+		net->closing = 1;
+		pthread_cond_broadcast(&qp->tx_cond);
+		pthread_mutex_unlock(&qp->tx_mtx);
 
-	pthread_join(net->tx_tid, &jval);
+		pthread_join(qp->tx_tid, &jval);
+		qp->tx_started = false;
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (qp->tapfd == -1)
 		return;
 
 	/*
@@ -360,19 +481,37 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(qp->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
 /*
  *  Called when there is read activity on the tap file descriptor.
- * Each buffer posted by the guest is assumed to be able to contain
- * an entire ethernet frame + rx header.
+ * Without merged rx buffers each buffer posted by the guest is assumed
+ * to be able to contain an entire ethernet frame + rx header; with them
+ * a frame takes as many buffers as it needs.
+ *  At most VIRTIO_NET_RX_BATCH frames are received per call, then the
+ * used ring and the interrupt are updated once. The tap event is
+ * level-triggered, so frames left behind bring us back.
  *  MP note: the dummybuf is only used for discarding frames, so there
  * is no need for it to be per-vtnet or locked.
  */
 static uint8_t dummybuf[2048];
 
+#define VIRTIO_NET_RX_BATCH	64
+#define VIRTIO_NET_RX_MAXCHAINS	64	/* merged buffers per frame */
+
+/* largest frames, with a VLAN tag: with TSO on the tap, and without */
+#define VIRTIO_NET_RX_GSOLEN	(65535 + 14 + 4)
+#define VIRTIO_NET_RX_MTULEN	(1500 + 14 + 4)
+
+/* a chain collected for the frames to come */
+struct virtio_net_rxchain {
+	uint16_t	idx;		/* buffer id from vq_getchain */
+	int		niov;
+	uint32_t	len;		/* bytes it holds */
+};
+
 static inline struct iovec *
 rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 {
@@ -400,20 +539,55 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * Check the header the tap put in front of a received frame against the
+ * offloads enabled with TUNSETOFFLOAD, which follow what the guest
+ * negotiated. Frames the guest could not handle are dropped.
+ */
+static bool
+virtio_net_rxhdr_valid(struct virtio_net *net, struct virtio_net_rxhdr *vrxh)
+{
+	unsigned int offload = net->tap_offload;
+
+	if (!(offload & TUN_F_CSUM)) {
+		if (vrxh->vrh_flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+			return false;
+		vrxh->vrh_flags = 0;
+	}
+
+	if ((vrxh->vrh_gso_type & VIRTIO_NET_HDR_GSO_ECN) &&
+	    !(offload & TUN_F_TSO_ECN))
+		return false;
+
+	switch (vrxh->vrh_gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+		return true;
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		return (offload & TUN_F_TSO4) != 0;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		return (offload & TUN_F_TSO6) != 0;
+	default:
+		return false;
+	}
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov, iov0;
+	struct virtio_net_rxchain chains[VIRTIO_NET_RX_MAXCHAINS];
+	uint16_t ids[VIRTIO_NET_RX_MAXCHAINS];
+	struct virtio_net_rxhdr *vrxh;
 	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
-	ssize_t ret;
+	int nchains, niov, maxchains, used, pkts, i, n;
+	uint32_t cap, maxlen, tlen, seg;
+	ssize_t len, ret;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (qp->tapfd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
 		return;
 	}
@@ -422,11 +596,11 @@ virtio_net_tap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -435,103 +609,185 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = &net->queues[qp->idx * 2 + VIRTIO_NET_RXQ];
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		vq_endchains(vq, 1);
 		return;
 	}
 
-	do {
+	/*
+	 * With merged rx buffers a frame spreads over as many chains as it
+	 * needs; otherwise each chain holds a whole frame.
+	 */
+	maxchains = net->rx_merge ? VIRTIO_NET_RX_MAXCHAINS : 1;
+	maxlen = net->rx_vhdrlen +
+		((net->tap_offload & (TUN_F_TSO4 | TUN_F_TSO6)) ?
+		 VIRTIO_NET_RX_GSOLEN : VIRTIO_NET_RX_MTULEN);
+
+	nchains = niov = 0;
+	cap = 0;
+	for (pkts = 0; pkts < VIRTIO_NET_RX_BATCH; pkts++) {
 		/*
-		 * Get descriptor chain.
+		 * Get descriptor chains until the largest frame fits. The
+		 * ones a frame leaves unused are kept for the next one.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
-			return;
+		while (nchains < maxchains && cap < maxlen && vq_has_descs(vq)) {
+			n = vq_getchain(vq, &chains[nchains].idx, &iov[niov],
+					VIRTIO_NET_MAXSEGS - niov, NULL);
+			if (n < 1) {
+				WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
+				break;
+			}
+			if (n > VIRTIO_NET_MAXSEGS - niov) {
+				if (nchains == 0) {
+					/* can never fit, give it back empty */
+					WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
+					vq_relchain_prepare(vq, chains[0].idx, 0);
+				} else {
+					/* out of iovecs, leave it for the next frame */
+					vq_retchain(vq);
+				}
+				break;
+			}
+
+			for (i = 0, seg = 0; i < n; i++)
+				seg += iov[niov + i].iov_len;
+			chains[nchains].niov = n;
+			chains[nchains].len = seg;
+			nchains++;
+			niov += n;
+			cap += seg;
 		}
+		if (nchains == 0)
+			break;
+
 		/*
 		 * Get a pointer to the rx header, and use the
 		 * data immediately following it for the packet buffer.
+		 * A vnet header tap fills in the header itself.
 		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-		if (riov == NULL)
-			return;
-
-		len = readv(net->tapfd, riov, n);
+		if (iov[0].iov_len < net->rx_vhdrlen) {
+			WPRINTF(("vtnet: rx header iov_len=%lu\n", iov[0].iov_len));
+			break;
+		}
+		vrxh = iov[0].iov_base;
+		if (net->tap_vnet_hdr) {
+			len = readv(qp->tapfd, iov, niov);
+		} else {
+			iov0 = iov[0];
+			n = niov;
+			riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+			len = riov ? readv(qp->tapfd, riov, n) : -1;
+			iov[0] = iov0;
+			if (len >= 0)
+				len += net->rx_vhdrlen;
+		}
 
 		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
 			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * entries.
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
+			break;
+		}
+		if (len < net->rx_vhdrlen) {
+			WPRINTF(("vtnet: tap read %ld\n", len));
+			break;
 		}
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
-
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
-
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+		if (net->tap_vnet_hdr) {
+			/* drop it, the chains take the next frame */
+			if (!virtio_net_rxhdr_valid(net, vrxh))
+				continue;
+		} else {
+			/*
+			 * The only valid field in the rx packet header is the
+			 * number of buffers if merged rx bufs were negotiated.
+			 */
+			memset(vrxh, 0, net->rx_vhdrlen);
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release the chains the frame landed in. The guest must see
+		 * them all at once, so they are published with the batch.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+		tlen = len;
+		used = n = 0;
+		do {
+			seg = MIN(tlen, chains[used].len);
+			vq_relchain_prepare(vq, chains[used].idx, seg);
+			tlen -= seg;
+			cap -= chains[used].len;
+			n += chains[used].niov;
+			used++;
+		} while (tlen > 0 && used < nchains);
+
+		if (net->rx_merge)
+			vrxh->vrh_bufs = used;
+
+		nchains -= used;
+		niov -= n;
+		memmove(chains, &chains[used], nchains * sizeof(chains[0]));
+		memmove(iov, &iov[n], niov * sizeof(iov[0]));
+	}
+
+	/* Hand back the chains no frame needed. */
+	if (nchains) {
+		for (i = 0; i < nchains; i++)
+			ids[i] = chains[i].idx;
+		vq_retchains(vq, ids, nchains);
+	}
+	vq_relchain_publish(vq);
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	vq_endchains(vq, !vq_has_descs(vq));
 }
 
 static void
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
+
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
+
+}
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+static void
+virtio_net_rx_iothread(void *arg)
+{
+	struct virtio_net_qpair *qp = arg;
 
+	virtio_net_rx_callback(qp->tapfd, EVF_READ, qp);
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qp[vq->num / 2];
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		if (vq->used != NULL) {
-			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		}
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		vq_set_used_ring_flags(&net->base, vq);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
 	int i, n;
@@ -556,7 +812,11 @@ virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
 	}
 
 	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	/* a vnet header tap takes the guest's header with the frame */
+	if (qp->net->tap_vnet_hdr)
+		qp->net->virtio_net_tx(qp, iov, n, plen);
+	else
+		qp->net->virtio_net_tx(qp, &iov[1], n - 1, plen);
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, tlen);
@@ -566,6 +826,7 @@ static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qp[vq->num / 2];
 
 	/*
 	 * Any ring entries to process?
@@ -574,11 +835,11 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	vq_set_used_ring_flags(&net->base, vq);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
@@ -587,27 +848,28 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct virtio_vq_info *vq = &net->queues[qp->idx * 2 + VIRTIO_NET_TXQ];
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
 
 	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&qp->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+		qp->tx_in_progress = 0;
 
 		/*
 		 * Checking the avail ring here serves two purposes:
@@ -621,18 +883,18 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_set_used_ring_flags(&net->base, vq);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
 		do {
 			/*
@@ -640,7 +902,7 @@ virtio_net_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
+			virtio_net_proctx(qp, vq);
 		} while (vq_has_descs(vq));
 
 		/*
@@ -648,17 +910,60 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
 }
 
-#ifdef notyet
+/*
+ * Control queue: each chain holds a {class, command} header and the
+ * command data in readable buffers, followed by a writable ack byte.
+ * Only VIRTIO_NET_CTRL_MQ is supported, everything else is refused.
+ */
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_CTRL_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_CTRL_MAXSEGS];
+	uint8_t cmd[8], *ack;
+	uint16_t idx, pairs;
+	size_t len, seg;
+	int i, n;
+
 	DPRINTF(("vtnet: control qnotify!\n\r"));
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_CTRL_MAXSEGS, flags);
+		if (n < 1 || n > VIRTIO_NET_CTRL_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_ping_ctlq: vq_getchain = %d\n", n));
+			break;
+		}
+		if (!(flags[n - 1] & VRING_DESC_F_WRITE) || iov[n - 1].iov_len < 1) {
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+		ack = iov[n - 1].iov_base;
+
+		for (i = 0, len = 0; i < n - 1; i++) {
+			if (flags[i] & VRING_DESC_F_WRITE)
+				break;
+			seg = MIN(iov[i].iov_len, sizeof(cmd) - len);
+			memcpy(cmd + len, iov[i].iov_base, seg);
+			len += seg;
+		}
+
+		*ack = VIRTIO_NET_ERR;
+		if (len >= 2 + sizeof(pairs) && cmd[0] == VIRTIO_NET_CTRL_MQ &&
+		    cmd[1] == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+			memcpy(&pairs, cmd + 2, sizeof(pairs));
+			if (pairs >= 1 && pairs <= net->max_pairs &&
+			    virtio_net_set_pairs(net, pairs) == 0)
+				*ack = VIRTIO_NET_OK;
+		}
+		vq_relchain(vq, idx, 1);
+	}
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -737,11 +1042,16 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 	return true;
 }
 
+/*
+ * Open a tap queue. With *vnet_hdr set, ask for IFF_VNET_HDR if the
+ * tap supports it; *vnet_hdr tells whether it was set.
+ */
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, bool multi_queue, bool *vnet_hdr)
 {
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
+	unsigned int features;
 	struct ifreq ifr;
 
 	/*Check if tun/tap or macvtap interface is used */
@@ -764,6 +1074,15 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (*vnet_hdr) {
+		if (ioctl(tunfd, TUNGETFEATURES, &features) == 0 &&
+		    (features & IFF_VNET_HDR))
+			ifr.ifr_flags |= IFF_VNET_HDR;
+		else
+			*vnet_hdr = false;
+	}
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -782,12 +1101,49 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Create one vhost-net instance per queue pair; all or nothing.
+ */
+static int
+virtio_net_vhost_setup(struct virtio_net *net)
+{
+	struct virtio_net_qpair *qp;
+	int vhost_fd, i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		vhost_fd = open("/dev/vhost-net", O_RDWR);
+		if (vhost_fd < 0) {
+			WPRINTF(("open of vhost-net failed\n"));
+			goto fail;
+		}
+
+		qp->vhost_net = vhost_net_init(&net->base, vhost_fd,
+			qp->tapfd, i * 2, net->tap_vnet_hdr);
+		if (!qp->vhost_net) {
+			close(vhost_fd);
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	WPRINTF(("vhost_net_init failed, fallback to userspace virtio\n"));
+	while (--i >= 0) {
+		qp = &net->qp[i];
+		vhost_net_deinit(qp->vhost_net);
+		free(qp->vhost_net);
+		qp->vhost_net = NULL;
+	}
+	return -1;
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
+	struct virtio_net_qpair *qp;
 	char tbuf[IFNAMSIZ];
-	int vhost_fd = -1;
-	int rc;
+	int rc, i;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
@@ -796,51 +1152,123 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
-
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * One tap queue per queue pair. The first open names the
+	 * interface if no name was given, the others attach to it
+	 * with the same flags.
 	 */
-	int opt = 1;
+	net->tap_vnet_hdr = true;
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		qp->tapfd = virtio_net_tap_open(tbuf, net->max_pairs > 1,
+						&net->tap_vnet_hdr);
+		if (qp->tapfd == -1) {
+			WPRINTF(("open of tap device %s failed\n", tbuf));
+			goto fail;
+		}
+		qp->tap_attached = true;
+		DPRINTF(("open of tap device %s queue %d success!\n", tbuf, i));
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		int opt = 1;
+
+		if (ioctl(qp->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			goto fail;
+		}
 	}
 
-	if (net->use_vhost) {
-		vhost_fd = open("/dev/vhost-net", O_RDWR);
-		if (vhost_fd < 0)
-			WPRINTF(("open of vhost-net failed\n"));
-		else {
-			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
-			if (!net->vhost_net) {
-				WPRINTF(("vhost_net_init failed, fallback "
-					"to userspace virtio\n"));
-				close(vhost_fd);
-				vhost_fd = -1;
+	if (net->use_vhost && virtio_net_vhost_setup(net) == 0)
+		return;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+
+		/* keep the pair's rx with the iothread of its rx queue */
+		if (net->base.iothread) {
+			qp->iothread_id = net->base.iothread_nr ?
+				net->base.iothread_ids[(i * 2) % net->base.iothread_nr] : 0;
+			qp->iomvt.run = virtio_net_rx_iothread;
+			qp->iomvt.arg = qp;
+			qp->iomvt.fd = qp->tapfd;
+			/* a read would eat a packet, rx reads the tap itself */
+			qp->iomvt.nodrain = true;
+			if (iothread_add(qp->iothread_id, qp->tapfd, &qp->iomvt) == 0) {
+				qp->on_iothread = true;
+				continue;
 			}
 		}
-	}
 
-	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
+		qp->mevp = mevent_add(qp->tapfd, EVF_READ,
+				       virtio_net_rx_callback, qp,
+				       virtio_net_teardown, qp);
+		if (qp->mevp == NULL) {
 			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+			close(qp->tapfd);
+			qp->tapfd = -1;
+		}
+	}
+	return;
+
+fail:
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		if (qp->tapfd >= 0) {
+			close(qp->tapfd);
+			qp->tapfd = -1;
+		}
+	}
+	net->tap_vnet_hdr = false;
+}
+
+/*
+ * Match the tap's header length and receive offloads to the negotiated
+ * features.
+ */
+static void
+virtio_net_tap_offload(struct virtio_net *net)
+{
+	struct virtio_net_qpair *qp;
+	unsigned int offload = 0;
+	int hdrlen, i;
+
+	if (!net->tap_vnet_hdr)
+		return;
+
+	hdrlen = net->rx_vhdrlen;
+	if (net->features & (1UL << VIRTIO_F_VERSION_1))
+		hdrlen = sizeof(struct virtio_net_rxhdr);
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if ((offload & (TUN_F_TSO4 | TUN_F_TSO6)) &&
+		    (net->features & VIRTIO_NET_F_GUEST_ECN))
+			offload |= TUN_F_TSO_ECN;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		if (qp->tapfd < 0)
+			continue;
+
+		if (ioctl(qp->tapfd, TUNSETVNETHDRSZ, &hdrlen) < 0)
+			WPRINTF(("vtnet: TUNSETVNETHDRSZ %d failed: %d\n",
+				hdrlen, errno));
+		if (ioctl(qp->tapfd, TUNSETOFFLOAD, offload) < 0) {
+			WPRINTF(("vtnet: TUNSETOFFLOAD 0x%x failed: %d\n",
+				offload, errno));
+			offload = 0;
+			ioctl(qp->tapfd, TUNSETOFFLOAD, offload);
 		}
 	}
+	net->tap_offload = offload;
 }
 
 static int
@@ -859,8 +1287,13 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *vtopts = NULL;
 	char *opt = NULL;
 	int mac_provided;
+	uint32_t coal_frames = 0, coal_usecs = 0;
+	int iothread_ids[IOTHREAD_NUM_MAX];
+	int iothread_nr = 0;
+	bool use_iothread = false;
+	struct virtio_net_qpair *qp;
 	pthread_mutexattr_t attr;
-	int rc;
+	int rc, i;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -886,7 +1319,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 * Read the MAC address if specified
 	 */
 	mac_provided = 0;
-	net->vhost_net = NULL;
+	net->max_pairs = 1;
 	if (opts != NULL) {
 		int err;
 
@@ -911,28 +1344,76 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					return err;
 				}
 				mac_provided = 1;
+			} else if (!strncmp(opt, "coalesce=", 9)) {
+				if (virtio_parse_coalesce_opt(opt, &coal_frames,
+							&coal_usecs)) {
+					free(devopts);
+					free(net);
+					return -1;
+				}
+			} else if (!strncmp(opt, "mq=", 3)) {
+				if (dm_strtoi(opt + 3, &tmp, 10, &net->max_pairs) ||
+				    (*tmp != '\0') || (net->max_pairs < 1) ||
+				    (net->max_pairs > VIRTIO_NET_MAXQP)) {
+					pr_err("vtnet: invalid %s, 1 to %d queue pairs\n",
+						opt, VIRTIO_NET_MAXQP);
+					free(devopts);
+					free(net);
+					return -1;
+				}
+				tmp = NULL;
+			} else if (!strncmp(opt, "iothread", 8)) {
+				if (virtio_parse_iothread_opt(opt, iothread_ids,
+							&iothread_nr)) {
+					free(devopts);
+					free(net);
+					return -1;
+				}
+				use_iothread = true;
 			}
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
+	/* rx/tx pairs, plus the control queue for multiqueue */
+	net->ops = virtio_net_ops;
+	if (net->max_pairs > 1)
+		net->ops.nvq = net->max_pairs * 2 + 1;
+
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
 		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
 	net->base.mtx = &net->mtx;
 	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	net->base.iothread = use_iothread;
+	net->base.iothread_nr = iothread_nr;
+	memcpy(net->base.iothread_ids, iothread_ids, sizeof(int) * iothread_nr);
+
+	for (i = 0; i < net->max_pairs; i++) {
+		net->queues[i * 2 + VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i * 2 + VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
+		net->queues[i * 2 + VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i * 2 + VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
+	}
+	if (net->max_pairs > 1) {
+		net->queues[net->max_pairs * 2].qsize = VIRTIO_NET_CTLQ_RINGSZ;
+		net->queues[net->max_pairs * 2].notify = virtio_net_ping_ctlq;
+		net->base.device_caps |= VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+	}
+	net->config.max_virtqueue_pairs = net->max_pairs;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		qp->net = net;
+		qp->idx = i;
+		qp->tapfd = -1;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+	}
+	net->refs = net->max_pairs;
 
 	/*
 	 * Attempt to open the tap device
 	 */
-	net->tapfd = -1;
 
 	if (!devopts) {
 		WPRINTF(("virtio_net: invalid optional argument\n"));
@@ -960,6 +1441,16 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			virtio_net_tap_setup(net, name);
 		}
 	}
+	if (net->tap_vnet_hdr)
+		net->base.device_caps |= VIRTIO_NET_S_OFFLOADCAPS;
+	/* only the first queue pair until the driver asks for more */
+	virtio_net_set_pairs(net, 1);
+
+	/* vhost signals the guest from the kernel */
+	if (coal_usecs && !net->qp[0].vhost_net) {
+		for (i = 0; i < net->max_pairs * 2; i++)
+			vq_set_coalesce(&net->queues[i], coal_frames, coal_usecs);
+	}
 
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
@@ -1008,7 +1499,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	net->config.status = (opts == NULL || net->qp[0].tapfd >= 0);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
@@ -1025,22 +1516,21 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	virtio_net_tap_offload(net);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn one TX processing thread per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		if (pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)qp))
+			continue;
+		qp->tx_started = true;
+		snprintf(tname, sizeof(tname), "vtnet-%u:%u tx%u",
+			 dev->slot & 0x1f, dev->func & 0x7, i & 0x7);
+		pthread_setname_np(qp->tx_tid, tname);
+	}
 
 	return 0;
 }
@@ -1092,75 +1582,105 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 		/* non-merge rx header is 2 bytes shorter */
 		net->rx_vhdrlen -= 2;
 	}
+
+	virtio_net_tap_offload(net);
 }
 
 static void
 virtio_net_set_status(void *vdev, uint64_t status)
 {
 	struct virtio_net *net = vdev;
-	int rc;
+	struct virtio_net_qpair *qp;
+	int rc, i;
 
-	if (!net->vhost_net)
-		return;
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qp[i];
+		if (!qp->vhost_net)
+			return;
 
-	if (!net->vhost_net->vhost_started &&
-		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
+		if (!qp->vhost_net->vhost_started &&
+			(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+			if (qp->mevp)
+				mevent_disable(qp->mevp);
 
-		rc = vhost_net_start(net->vhost_net);
-		if (rc < 0) {
-			WPRINTF(("vhost_net_start failed\n"));
-			return;
+			rc = vhost_net_start(qp->vhost_net);
+			if (rc < 0) {
+				WPRINTF(("vhost_net_start failed\n"));
+				return;
+			}
+		} else if (qp->vhost_net->vhost_started &&
+			((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
+			rc = vhost_net_stop(qp->vhost_net);
+			if (rc < 0)
+				WPRINTF(("vhost_net_stop failed\n"));
 		}
-	} else if (net->vhost_net->vhost_started &&
-		((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
-		rc = vhost_net_stop(net->vhost_net);
-		if (rc < 0)
-			WPRINTF(("vhost_net_stop failed\n"));
 	}
 }
 
+static void
+virtio_net_put(struct virtio_net *net)
+{
+	if (atomic_sub_fetch(&net->refs, 1) == 0) {
+		virtio_reset_dev(&net->base);
+		free(net);
+	}
+}
+
+/*
+ * Called once per queue pair, from the event loop once its rx event is
+ * gone or directly if it had none. The last one frees the device.
+ */
 static void
 virtio_net_teardown(void *param)
 {
-	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
 
-	net = (struct virtio_net *)param;
-	if (!net)
+	qp = (struct virtio_net_qpair *)param;
+	if (!qp)
 		return;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (qp->tapfd >= 0) {
+		close(qp->tapfd);
+		qp->tapfd = -1;
 	} else
 		pr_err("net->tapfd is -1!\n");
 
-	virtio_reset_dev(&net->base);
-	free(net);
+	virtio_net_put(qp->net);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
 		virtio_net_tx_stop(net);
+		virtio_coalesce_deinit(&net->base);
+
+		/* keep net alive while the pairs are being torn down */
+		atomic_add_fetch(&net->refs, 1);
+		for (i = 0; i < net->max_pairs; i++) {
+			qp = &net->qp[i];
+			if (qp->vhost_net) {
+				vhost_net_stop(qp->vhost_net);
+				vhost_net_deinit(qp->vhost_net);
+				free(qp->vhost_net);
+				qp->vhost_net = NULL;
+			}
 
-		if (net->vhost_net) {
-			vhost_net_stop(net->vhost_net);
-			vhost_net_deinit(net->vhost_net);
-			free(net->vhost_net);
-			net->vhost_net = NULL;
+			if (qp->mevp != NULL)
+				mevent_delete(qp->mevp);
+			else {
+				if (qp->on_iothread)
+					iothread_del(qp->iothread_id, qp->tapfd);
+				virtio_net_teardown(qp);
+			}
 		}
-
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-		else
-			virtio_net_teardown(net);
+		virtio_net_put(net);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
@@ -1168,14 +1688,19 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 }
 
 static struct vhost_net *
-vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
+vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx,
+	       bool tap_vnet_hdr)
 {
 	struct vhost_net *vhost_net = NULL;
 	uint64_t vhost_features = VIRTIO_NET_S_VHOSTCAPS;
-	uint64_t vhost_ext_features =  1 << VHOST_NET_F_VIRTIO_NET_HDR;
+	uint64_t vhost_ext_features = 0;
 	uint32_t busyloop_timeout = 0;
 	int rc;
 
+	/* vhost adds and strips the header unless the tap carries it */
+	if (!tap_vnet_hdr)
+		vhost_ext_features = 1 << VHOST_NET_F_VIRTIO_NET_HDR;
+
 	vhost_net = calloc(1, sizeof(struct vhost_net));
 	if (!vhost_net) {
 		WPRINTF(("vhost init out of memory\n"));
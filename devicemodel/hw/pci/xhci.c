@@ -98,6 +98,7 @@
 #include "vmmapi.h"
 #include "dm_string.h"
 #include "timer.h"
+#include "monitor.h"
 
 #undef LOG_TAG
 #define LOG_TAG			"xHCI: "
@@ -115,6 +116,7 @@
 #define	XHCI_PORTREGS_START	0x400
 #define	XHCI_DOORBELL_MAX	256
 #define	XHCI_STREAMS_MAX	1	/* 4-15 in XHCI spec */
+#define	XHCI_EVQ_MAX		256	/* events held while event ring full */
 
 /* caplength and hci-version registers */
 #define	XHCI_SET_CAPLEN(x)		((x) & 0xFF)
@@ -369,6 +371,11 @@ struct pci_xhci_dev_emu {
 	void			*dev_instance;	/* device's instance */
 
 	struct usb_hci		hci;
+
+	/* statistics, see vm_monitor_usbstat() */
+	uint64_t		stat_doorbells;
+	uint64_t		stat_trbs;
+	uint64_t		stat_events;
 };
 
 struct pci_xhci_native_port {
@@ -443,6 +450,28 @@ struct pci_xhci_vdev {
 	struct pci_xhci_native_port native_ports[XHCI_MAX_VIRT_PORTS];
 	struct timespec init_time;
 	uint32_t	quirks;
+
+	/*
+	 * Event ring full error posted, nothing more goes on the ring
+	 * until the guest moves ERDP. Events raised meanwhile wait in
+	 * evq and are posted from the ERDP write.
+	 */
+	bool		er_full;
+	struct xhci_trb	evq[XHCI_EVQ_MAX];
+	int		evq_head;
+	int		evq_cnt;
+
+	/* interrupt moderation, see pci_xhci_assert_interrupt() */
+	struct acrn_timer imod_timer;
+	uint64_t	intr_next_ns;	/* no interrupt before, per IMOD */
+	bool		intr_deferred;	/* imod_timer raises it */
+	bool		intr_sent;	/* since the guest last cleared EHB */
+
+	uint64_t	stat_intrs;
+	uint64_t	stat_intrs_coalesced;
+	uint64_t	stat_intrs_moderated;
+	uint64_t	stat_events_deferred;
+	uint64_t	stat_events_dropped;
 };
 
 /* portregs and devices arrays are set up to start from idx=1 */
@@ -464,6 +493,7 @@ struct pci_xhci_option_elem {
 };
 
 static int xhci_in_use;
+static struct pci_xhci_vdev *xhci_vdev;	/* for the monitor */
 static int pci_xhci_insert_event(struct pci_xhci_vdev *xdev,
 				 struct xhci_trb *evtrb, int do_intr);
 static void pci_xhci_dump_trb(struct xhci_trb *trb);
@@ -1215,6 +1245,10 @@ pci_xhci_reset(struct pci_xhci_vdev *xdev)
 	xdev->rtsregs.er_enq_idx = 0;
 	xdev->rtsregs.er_enq_seg = 0;
 	xdev->rtsregs.event_pcs = 1;
+	xdev->er_full = false;
+	xdev->evq_head = 0;
+	xdev->evq_cnt = 0;
+	xdev->intr_sent = false;
 	struct pci_xhci_dev_emu *dev;
 
 	for (i = 1; i <= XHCI_MAX_DEVS; i++)
@@ -1565,17 +1599,27 @@ pci_xhci_trb_next(struct pci_xhci_vdev *xdev,
 	return next;
 }
 
-static void
-pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+static uint64_t
+pci_xhci_now_ns(void)
 {
+	struct timespec t;
 
-	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
-	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
-	xdev->opregs.usbsts |= XHCI_STS_EINT;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * NS_PER_SEC + t.tv_nsec;
+}
+
+static void
+pci_xhci_fire_interrupt(struct pci_xhci_vdev *xdev)
+{
+	/* IMODI, in 250ns units, is the least time between interrupts */
+	xdev->intr_next_ns = pci_xhci_now_ns() +
+		XHCI_IMOD_IVAL_GET(xdev->rtsregs.intrreg.imod) * 250UL;
 
 	/* only trigger interrupt if permitted */
 	if ((xdev->opregs.usbcmd & XHCI_CMD_INTE) &&
 	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA)) {
+		xdev->stat_intrs++;
+		xdev->intr_sent = true;
 		if (pci_msi_enabled(xdev->dev))
 			pci_generate_msi(xdev->dev, 0);
 		else
@@ -1583,6 +1627,57 @@ pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
 	}
 }
 
+static void
+pci_xhci_imod_timer(void *arg, uint64_t nexp)
+{
+	struct pci_xhci_vdev *xdev = arg;
+
+	pthread_mutex_lock(&xdev->mtx);
+	if (xdev->intr_deferred) {
+		xdev->intr_deferred = false;
+		pci_xhci_fire_interrupt(xdev);
+	}
+	pthread_mutex_unlock(&xdev->mtx);
+}
+
+/*
+ * Tell the guest about new events. Once an interrupt went out, the guest
+ * has not cleared the event handler busy bit yet, so its handler will
+ * find the new events, or pci_xhci_rtsregs_write() raises another
+ * interrupt when ERDP is written back short of them. An interrupt is
+ * held back until the IMOD interval since the previous one has passed.
+ */
+static void
+pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+{
+	struct itimerspec ts;
+	uint64_t now;
+
+	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
+	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
+	xdev->opregs.usbsts |= XHCI_STS_EINT;
+
+	if (xdev->intr_sent || xdev->intr_deferred) {
+		xdev->stat_intrs_coalesced++;
+		return;
+	}
+
+	now = pci_xhci_now_ns();
+	if (now >= xdev->intr_next_ns) {
+		pci_xhci_fire_interrupt(xdev);
+		return;
+	}
+
+	xdev->stat_intrs_moderated++;
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = (xdev->intr_next_ns - now) / NS_PER_SEC;
+	ts.it_value.tv_nsec = (xdev->intr_next_ns - now) % NS_PER_SEC;
+	if (acrn_timer_settime(&xdev->imod_timer, &ts) == 0)
+		xdev->intr_deferred = true;
+	else
+		pci_xhci_fire_interrupt(xdev);
+}
+
 static void
 pci_xhci_deassert_interrupt(struct pci_xhci_vdev *xdev)
 {
@@ -1830,30 +1925,66 @@ pci_xhci_reset_slot(struct pci_xhci_vdev *xdev, int slot)
 	/* TODO: reset ring buffer pointers */
 }
 
-static int
-pci_xhci_insert_event(struct pci_xhci_vdev *xdev,
-		      struct xhci_trb *evtrb,
-		      int do_intr)
+/* guest address of the event ring enqueue entry */
+static uint64_t
+pci_xhci_er_enq(struct pci_xhci_vdev *xdev)
 {
-	struct pci_xhci_rtsregs *rts;
+	struct pci_xhci_rtsregs *rts = &xdev->rtsregs;
+
+	return rts->erstba_p[rts->er_enq_seg].qwRingSegBase +
+		rts->er_enq_idx * sizeof(struct xhci_trb);
+}
+
+/* guest address of the event ring entry after the enqueue one */
+static uint64_t
+pci_xhci_er_next(struct pci_xhci_vdev *xdev)
+{
+	struct pci_xhci_rtsregs *rts = &xdev->rtsregs;
+	struct xhci_erst *erst = &rts->erstba_p[rts->er_enq_seg];
+
+	if (rts->er_enq_idx < erst->dwRingSegSize - 1)
+		return erst->qwRingSegBase +
+			(rts->er_enq_idx + 1) * sizeof(struct xhci_trb);
+
+	erst = &rts->erstba_p[(rts->er_enq_seg + 1) % rts->intrreg.erstsz];
+	return erst->qwRingSegBase;
+}
+
+static bool
+pci_xhci_er_valid(struct pci_xhci_vdev *xdev)
+{
+	struct pci_xhci_rtsregs *rts = &xdev->rtsregs;
 	struct xhci_erst *erst;
-	struct xhci_trb *evts;
-	uint64_t erdp;
-	int erdp_idx;
 
-	rts = &xdev->rtsregs;
 	if (rts->erstba_p == NULL) {
 		UPRINTF(LFTL, "Invalid Event Ring Segment Table base address!\r\n");
-		return -EINVAL;
+		return false;
 	}
 
-	erdp = rts->intrreg.erdp & ~0xF;
 	erst = &rts->erstba_p[rts->er_enq_seg];
 	if (erst->dwRingSegSize < 16 || erst->dwRingSegSize > 4096) {
 		UPRINTF(LDBG, "xHCI: ERSTSZ is not valiad: %u\n",
 				erst->dwRingSegSize);
-		return -EINVAL;
+		return false;
 	}
+	return true;
+}
+
+/* copy an event to the enqueue entry of a valid event ring */
+static int
+pci_xhci_write_event(struct pci_xhci_vdev *xdev,
+		     struct xhci_trb *evtrb,
+		     int do_intr)
+{
+	struct pci_xhci_rtsregs *rts;
+	struct xhci_erst *erst;
+	struct xhci_trb *evts;
+	uint64_t erdp;
+	int erdp_idx;
+
+	rts = &xdev->rtsregs;
+	erdp = rts->intrreg.erdp & ~0xF;
+	erst = &rts->erstba_p[rts->er_enq_seg];
 	erdp_idx = (erdp - erst->qwRingSegBase) / sizeof(struct xhci_trb);
 
 	UPRINTF(LDBG, "insert event 0[%lx] 2[%x] 3[%x]\r\n"
@@ -1893,6 +2024,77 @@ pci_xhci_insert_event(struct pci_xhci_vdev *xdev,
 	return 0;
 }
 
+/*
+ * The last free entry gets an event ring full error, the guest has
+ * to consume events before anything else can be posted.
+ */
+static bool
+pci_xhci_er_check_full(struct pci_xhci_vdev *xdev)
+{
+	struct xhci_trb full;
+
+	if (pci_xhci_er_next(xdev) != (xdev->rtsregs.intrreg.erdp & ~0xFUL))
+		return false;
+
+	UPRINTF(LWRN, "event ring full\r\n");
+	pci_xhci_set_evtrb(&full, 0, XHCI_TRB_ERROR_EV_RING_FULL,
+			   XHCI_TRB_EVENT_HOST_CTRL);
+	xdev->er_full = true;
+	pci_xhci_write_event(xdev, &full, 1);
+	return true;
+}
+
+/* hold an event back until the guest frees event ring entries */
+static int
+pci_xhci_evq_put(struct pci_xhci_vdev *xdev, struct xhci_trb *evtrb)
+{
+	if (xdev->evq_cnt == XHCI_EVQ_MAX) {
+		xdev->stat_events_dropped++;
+		return -ENOSPC;
+	}
+
+	xdev->evq[(xdev->evq_head + xdev->evq_cnt) % XHCI_EVQ_MAX] = *evtrb;
+	xdev->evq_cnt++;
+	xdev->stat_events_deferred++;
+	return 0;
+}
+
+/*
+ * Post the events held back while the event ring was full, called when
+ * the guest writes ERDP. Stops at another event ring full error if the
+ * guest freed too few entries.
+ */
+static void
+pci_xhci_evq_replay(struct pci_xhci_vdev *xdev)
+{
+	while (xdev->evq_cnt > 0) {
+		if (!pci_xhci_er_valid(xdev) || pci_xhci_er_check_full(xdev))
+			return;
+
+		pci_xhci_write_event(xdev, &xdev->evq[xdev->evq_head], 1);
+		xdev->evq_head = (xdev->evq_head + 1) % XHCI_EVQ_MAX;
+		xdev->evq_cnt--;
+	}
+}
+
+static int
+pci_xhci_insert_event(struct pci_xhci_vdev *xdev,
+		      struct xhci_trb *evtrb,
+		      int do_intr)
+{
+	if (!pci_xhci_er_valid(xdev))
+		return -EINVAL;
+
+	/* nothing overtakes the events already held back */
+	if (xdev->er_full || xdev->evq_cnt > 0)
+		return pci_xhci_evq_put(xdev, evtrb);
+
+	if (pci_xhci_er_check_full(xdev))
+		return pci_xhci_evq_put(xdev, evtrb);
+
+	return pci_xhci_write_event(xdev, evtrb, do_intr);
+}
+
 static uint32_t
 pci_xhci_cmd_enable_slot(struct pci_xhci_vdev *xdev, uint32_t *slot)
 {
@@ -2976,11 +3178,14 @@ pci_xhci_xfer_complete(struct pci_xhci_vdev *xdev, struct usb_xfer *xfer,
 			edtla = 0;
 		}
 
+		/* the caller raises one interrupt for all the events */
 		*do_intr = 1;
-		if (pci_xhci_insert_event(xdev, &evtrb, 1) != 0) {
+		if (pci_xhci_insert_event(xdev, &evtrb, 0) != 0) {
 			UPRINTF(LFTL, "Failed to inject xfer complete event!\r\n");
 			return err;
 		}
+		if (XHCI_SLOTDEV_PTR(xdev, slot))
+			XHCI_SLOTDEV_PTR(xdev, slot)->stat_events++;
 		/* The xHC stop on the TRB in error.*/
 		if (err != XHCI_TRB_ERROR_SUCCESS &&
 			err != XHCI_TRB_ERROR_SHORT_PKT)
@@ -3066,7 +3271,7 @@ pci_xhci_try_usb_xfer(struct pci_xhci_vdev *xdev,
 		else if (dev->dev_ue->ue_devtype == USB_DEV_STATIC) {
 			err = pci_xhci_xfer_complete(xdev, xfer, slot, epid,
 						     &do_intr);
-			if (err == XHCI_TRB_ERROR_SUCCESS && do_intr)
+			if (do_intr)
 				pci_xhci_assert_interrupt(xdev);
 
 			pci_xhci_free_usb_xfer(dev, devep->ep_xfer);
@@ -3099,7 +3304,7 @@ pci_xhci_handle_transfer(struct pci_xhci_vdev *xdev,
 	uint64_t		val;
 	uint32_t		trbflags;
 	int			do_intr, err;
-	int			do_retry;
+	int			do_retry, intr;
 
 	ep_ctx->dwEpCtx0 = FIELD_REPLACE(ep_ctx->dwEpCtx0,
 					 XHCI_ST_EPCTX_RUNNING, 0x7, 0);
@@ -3109,6 +3314,8 @@ pci_xhci_handle_transfer(struct pci_xhci_vdev *xdev,
 
 	UPRINTF(LDBG, "handle_transfer slot %u\r\n", slot);
 
+	/* the events of all the TD batches of this doorbell share an interrupt */
+	intr = 0;
 retry:
 	err = 0;
 	do_retry = 0;
@@ -3120,6 +3327,7 @@ retry:
 		pci_xhci_dump_trb(trb);
 
 		trbflags = trb->dwTrb3;
+		dev->stat_trbs++;
 
 		if (XHCI_TRB_3_TYPE_GET(trbflags) != XHCI_TRB_TYPE_LINK &&
 		    (trbflags & XHCI_TRB_3_CYCLE_BIT) !=
@@ -3340,13 +3548,14 @@ errout:
 	if (!do_retry)
 		pthread_mutex_unlock(&devep->mtx);
 
-	if (do_intr)
-		pci_xhci_assert_interrupt(xdev);
-
+	intr |= do_intr;
 	if (do_retry) {
 		UPRINTF(LDBG, "[%d]: retry next TRBs\r\n", __LINE__);
 		goto retry;
 	}
+
+	if (intr)
+		pci_xhci_assert_interrupt(xdev);
 	return err;
 }
 
@@ -3376,6 +3585,7 @@ pci_xhci_device_doorbell(struct pci_xhci_vdev *xdev,
 	dev = XHCI_SLOTDEV_PTR(xdev, slot);
 	if (!dev)
 		return;
+	dev->stat_doorbells++;
 
 	devep = &dev->eps[epid];
 	dev_ctx = pci_xhci_get_dev_ctx(xdev, slot);
@@ -3500,7 +3710,10 @@ pci_xhci_rtsregs_write(struct pci_xhci_vdev *xdev,
 		break;
 
 	case 0x04:
+		/* IMODC counts down to the next interrupt, IMODI reloads it */
 		rts->intrreg.imod = value;
+		xdev->intr_next_ns = pci_xhci_now_ns() +
+			XHCI_IMOD_ICNT_GET(value) * 250UL;
 		break;
 
 	case 0x08:
@@ -3536,12 +3749,20 @@ pci_xhci_rtsregs_write(struct pci_xhci_vdev *xdev,
 			MASK_64_HI(xdev->rtsregs.intrreg.erdp) |
 			(rts->intrreg.erdp & XHCI_ERDP_LO_BUSY) |
 			(value & ~0xF);
+		rts->er_deq_seg = XHCI_ERDP_LO_SINDEX(value);
+		xdev->er_full = false;
+		pci_xhci_evq_replay(xdev);
+
 		if (value & XHCI_ERDP_LO_BUSY) {
 			rts->intrreg.erdp &= ~XHCI_ERDP_LO_BUSY;
 			rts->intrreg.iman &= ~XHCI_IMAN_INTR_PEND;
-		}
+			xdev->intr_sent = false;
 
-		rts->er_deq_seg = XHCI_ERDP_LO_SINDEX(value);
+			/* events posted while the guest was handling the last batch */
+			if (rts->erstba_p != NULL &&
+			    (rts->intrreg.erdp & ~0xFUL) != pci_xhci_er_enq(xdev))
+				pci_xhci_assert_interrupt(xdev);
+		}
 		break;
 
 	case 0x1C:
@@ -4461,7 +4682,21 @@ pci_xhci_isoc_handler(void *arg, uint64_t param)
 static void
 pci_xhci_async_enqueue(struct pci_xhci_vdev *xdev, uint64_t offset, uint64_t value)
 {
-	struct pci_xhci_async_request_node *request;
+	struct pci_xhci_async_request_node *request, *r;
+
+	/*
+	 * A doorbell already queued behind the one being handled makes the
+	 * thread go through the whole ring again, another one adds nothing.
+	 */
+	pthread_mutex_lock(&xdev->async_tmx);
+	r = STAILQ_FIRST(&xdev->async_head);
+	while (r != NULL && (r = STAILQ_NEXT(r, link)) != NULL) {
+		if (r->offset == offset && r->value == value) {
+			pthread_mutex_unlock(&xdev->async_tmx);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&xdev->async_tmx);
 
 	request = malloc(sizeof(struct pci_xhci_async_request_node));
 	if (request == NULL) {
@@ -4629,6 +4864,10 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	pthread_mutex_init(&xdev->mtx, NULL);
 
+	error = acrn_timer_init(&xdev->imod_timer, pci_xhci_imod_timer, xdev);
+	if (error)
+		goto done;
+
 	/* create vbdp_thread */
 	xdev->vbdp_polling = true;
 	sem_init(&xdev->vbdp_sem, 0, 0);
@@ -4647,6 +4886,7 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		goto done;
 
 	xhci_in_use = 1;
+	xhci_vdev = xdev;
 done:
 	if (error) {
 		UPRINTF(LFTL, "%s fail, error=%d\n", __func__, error);
@@ -4709,11 +4949,47 @@ pci_xhci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pthread_cond_destroy(&xdev->async_cond);
 	pthread_mutex_destroy(&xdev->async_tmx);
 
+	acrn_timer_deinit(&xdev->imod_timer);
 	pthread_mutex_destroy(&xdev->mtx);
 	free(xdev);
+	xhci_vdev = NULL;
 	xhci_in_use = 0;
 }
 
+/*
+ * Write the per slot transfer statistics and the interrupter counters to
+ * buf, for the "usbstat" command monitor command.
+ */
+int
+vm_monitor_usbstat(void *arg, char *buf, size_t len)
+{
+	struct pci_xhci_vdev *xdev = xhci_vdev;
+	struct pci_xhci_dev_emu *dev;
+	size_t n;
+	int slot;
+
+	if (xdev == NULL) {
+		pr_err("%s: no xHCI controller\n", __func__);
+		return -1;
+	}
+
+	pthread_mutex_lock(&xdev->mtx);
+	n = snprintf(buf, len, "interrupts %lu coalesced %lu moderated %lu "
+		"events deferred %lu dropped %lu\n", xdev->stat_intrs,
+		xdev->stat_intrs_coalesced, xdev->stat_intrs_moderated,
+		xdev->stat_events_deferred, xdev->stat_events_dropped);
+	for (slot = 1; slot <= XHCI_MAX_SLOTS && n < len; slot++) {
+		dev = XHCI_SLOTDEV_PTR(xdev, slot);
+		if (dev == NULL)
+			continue;
+		n += snprintf(buf + n, len - n,
+			"slot %d: doorbells %lu trbs %lu events %lu\n", slot,
+			dev->stat_doorbells, dev->stat_trbs, dev->stat_events);
+	}
+	pthread_mutex_unlock(&xdev->mtx);
+	return 0;
+}
+
 struct pci_vdev_ops pci_ops_xhci = {
 	.class_name	= "xhci",
 	.vdev_init	= pci_xhci_init,
@@ -33,6 +33,12 @@
 #define VDPY_MIN_HEIGHT 480
 #define transto_10bits(color) (uint16_t)(color * 1024 + 0.5)
 #define VSCREEN_MAX_NUM 2
+/* frame interval if the refresh rate of the screen is unknown */
+#define VDPY_FRAME_NS 16666667
+/* an idle screen is redrawn at 30fps for the cursor */
+#define VDPY_IDLE_FRAME_NS 33000000
+/* past this many rectangles, their bounding box is uploaded instead */
+#define VDPY_MAX_DAMAGE_RECTS 16
 
 static unsigned char default_raw_argb[VDPY_DEFAULT_WIDTH * VDPY_DEFAULT_HEIGHT * 4];
 
@@ -74,8 +80,12 @@ struct vscreen {
 	SDL_Renderer *renderer;
 	pixman_image_t *img;
 	EGLImage egl_img;
-	/* Record the update_time that is activated from guest_vm */
+	/* Record the last time the screen was presented */
 	struct timespec last_time;
+	/* refresh interval of the physical screen */
+	uint64_t frame_ns;
+	/* the texture changed since it was last presented */
+	bool frame_pending;
 };
 
 static struct display {
@@ -83,7 +93,7 @@ static struct display {
 	struct vscreen *vscrs;
 	int vscrs_num;
 	pthread_t tid;
-	/* Add one UI_timer(33ms) to render the buffers from guest_vm */
+	/* Add one UI_timer(16ms) to present the deferred frames from guest_vm */
 	struct acrn_timer ui_timer;
 	struct vdpy_display_bh ui_timer_bh;
 	// protect the request_list
@@ -816,10 +826,83 @@ vdpy_cursor_position_transformation(struct display *vdpy, int scanout_id, SDL_Re
 	rect->h = (vscr->cur.height * vscr->height) / vscr->guest_height;
 }
 
+static uint64_t
+vdpy_ns_since(struct timespec *t)
+{
+	struct timespec cur_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &cur_time);
+	return (cur_time.tv_sec - t->tv_sec) * 1000000000 +
+		cur_time.tv_nsec - t->tv_nsec;
+}
+
+static void
+vdpy_sdl_present(struct display *ui_vdpy, int scanout_id)
+{
+	SDL_Rect cursor_rect;
+	struct vscreen *vscr;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+	sdl_gl_prepare_draw(vscr);
+	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
+
+	/* This should be handled after rendering the surface_texture.
+	 * Otherwise it will be hidden
+	 */
+	if (vscr->cur_tex) {
+		vdpy_cursor_position_transformation(ui_vdpy, scanout_id, &cursor_rect);
+		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
+				NULL, &cursor_rect);
+	}
+
+	SDL_RenderPresent(vscr->renderer);
+
+	/* update the rendering time */
+	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+	vscr->frame_pending = false;
+}
+
+/* upload the damaged part of a pixman surface to the texture */
+static void
+vdpy_surface_upload(struct vscreen *vscr, struct surface *surf)
+{
+	pixman_box16_t *boxes;
+	SDL_Rect rect;
+	int i, n, bpp;
+
+	if (surf->damage == NULL) {
+		SDL_UpdateTexture(vscr->surf_tex, NULL, surf->pixel,
+				  surf->stride);
+		return;
+	}
+
+	boxes = pixman_region_rectangles(surf->damage, &n);
+	if (n > VDPY_MAX_DAMAGE_RECTS) {
+		boxes = pixman_region_extents(surf->damage);
+		n = 1;
+	}
+	bpp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+	for (i = 0; i < n; i++) {
+		rect.x = boxes[i].x1;
+		rect.y = boxes[i].y1;
+		rect.w = boxes[i].x2 - boxes[i].x1;
+		rect.h = boxes[i].y2 - boxes[i].y1;
+		SDL_UpdateTexture(vscr->surf_tex, &rect,
+				  (uint8_t *)surf->pixel + rect.y * surf->stride +
+				  rect.x * bpp,
+				  surf->stride);
+	}
+}
+
+/*
+ * Upload the update, and present it if a frame interval has passed since
+ * the last present. Otherwise the UI timer presents it with whatever else
+ * arrives in the meantime, so the screen is presented once per refresh at
+ * most however often the guest flushes.
+ */
 void
 vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 {
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
 
 	if (handle != vdpy.s.n_connect) {
@@ -843,26 +926,11 @@ vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 
 	vscr = vdpy.vscrs + scanout_id;
 	if (surf->surf_type == SURFACE_PIXMAN)
-		SDL_UpdateTexture(vscr->surf_tex, NULL,
-			  surf->pixel,
-			  surf->stride);
-
-	sdl_gl_prepare_draw(vscr);
-	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-	/* This should be handled after rendering the surface_texture.
-	 * Otherwise it will be hidden
-	 */
-	if (vscr->cur_tex) {
-		vdpy_cursor_position_transformation(&vdpy, scanout_id, &cursor_rect);
-		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-				NULL, &cursor_rect);
-	}
+		vdpy_surface_upload(vscr, surf);
 
-	SDL_RenderPresent(vscr->renderer);
-
-	/* update the rendering time */
-	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+	vscr->frame_pending = true;
+	if (vdpy_ns_since(&vscr->last_time) >= vscr->frame_ns)
+		vdpy_sdl_present(&vdpy, scanout_id);
 }
 
 void
@@ -932,9 +1000,7 @@ static void
 vdpy_sdl_ui_refresh(void *data)
 {
 	struct display *ui_vdpy;
-	struct timespec cur_time;
 	uint64_t elapsed_time;
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
 	int i;
 
@@ -947,28 +1013,16 @@ vdpy_sdl_ui_refresh(void *data)
 		if (vscr->surf_tex == NULL)
 			continue;
 
-		clock_gettime(CLOCK_MONOTONIC, &cur_time);
-
-		elapsed_time = (cur_time.tv_sec - vscr->last_time.tv_sec) * 1000000000 +
-				cur_time.tv_nsec - vscr->last_time.tv_nsec;
-
-		/* the time interval is less than 10ms. Skip it */
-		if (elapsed_time < 10000000)
-			return;
+		elapsed_time = vdpy_ns_since(&vscr->last_time);
 
-		sdl_gl_prepare_draw(vscr);
-		SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-		/* This should be handled after rendering the surface_texture.
-		 * Otherwise it will be hidden
+		/* present a pending frame once the frame interval is over,
+		 * and redraw an idle screen at the idle rate
 		 */
-		if (vscr->cur_tex) {
-			vdpy_cursor_position_transformation(ui_vdpy, i, &cursor_rect);
-			SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-					NULL, &cursor_rect);
-		}
+		if (elapsed_time < (vscr->frame_pending ?
+				vscr->frame_ns : VDPY_IDLE_FRAME_NS))
+			continue;
 
-		SDL_RenderPresent(vscr->renderer);
+		vdpy_sdl_present(ui_vdpy, i);
 	}
 }
 
@@ -1024,6 +1078,7 @@ vdpy_calibrate_vscreen_geometry(struct vscreen *vscr)
 int
 vdpy_create_vscreen_window(struct vscreen *vscr)
 {
+	SDL_DisplayMode mode;
 	uint32_t win_flags;
 
 	win_flags = SDL_WINDOW_OPENGL |
@@ -1054,6 +1109,11 @@ vdpy_create_vscreen_window(struct vscreen *vscr)
 	pr_info("SDL display bind to screen %d: [%d,%d,%d,%d].\n", vscr->pscreen_id,
 			vscr->org_x, vscr->org_y, vscr->width, vscr->height);
 
+	vscr->frame_ns = VDPY_FRAME_NS;
+	if ((SDL_GetWindowDisplayMode(vscr->win, &mode) == 0) &&
+	    (mode.refresh_rate > 0))
+		vscr->frame_ns = 1000000000UL / mode.refresh_rate;
+
 	vscr->renderer = SDL_CreateRenderer(vscr->win, -1, 0);
 	if (vscr->renderer == NULL) {
 		pr_err("Failed to Create GL_Renderer \n");
@@ -1107,11 +1167,11 @@ vdpy_sdl_display_thread(void *data)
 	vdpy.ui_timer.clockid = CLOCK_MONOTONIC;
 	acrn_timer_init(&vdpy.ui_timer, vdpy_sdl_ui_timer, &vdpy);
 	ui_timer_spec.it_interval.tv_sec = 0;
-	ui_timer_spec.it_interval.tv_nsec = 33000000;
+	ui_timer_spec.it_interval.tv_nsec = VDPY_FRAME_NS;
 	/* Wait for 5s to start the timer */
 	ui_timer_spec.it_value.tv_sec = 5;
 	ui_timer_spec.it_value.tv_nsec = 0;
-	/* Start one periodic timer to refresh UI based on 30fps */
+	/* Start one periodic timer to present the deferred frames at 60fps */
 	acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
 
 	pr_info("SDL display thread is created\n");
@@ -20,10 +20,15 @@
 #include "vga.h"
 #include "gc.h"
 #include "log.h"
+#include "atomic.h"
 
 #define	KB	(1024UL)
 #define	MB	(1024 * 1024UL)
 
+/* one dirty bit per 64 bytes of a plane */
+#define	VGA_DIRTY_SHIFT		6
+#define	VGA_DIRTY_BITS		((64 * KB) >> VGA_DIRTY_SHIFT)
+
 struct vga_vdev {
 	struct mem_range	mr;
 
@@ -34,6 +39,13 @@ struct vga_vdev {
 
 	uint8_t			*vga_ram;
 
+	/*
+	 * Changes since the last render: the plane offsets written, and
+	 * whether a register or the font changed so all of it is redrawn
+	 */
+	uint64_t		vga_dirty[VGA_DIRTY_BITS / 64];
+	bool			vga_redraw;
+
 	/*
 	 * General registers
 	 */
@@ -147,6 +159,35 @@ struct vga_vdev {
 	} vga_dac;
 };
 
+static bool
+vga_is_graphics(struct vga_vdev *vd)
+{
+	return (vd->vga_gc.gc_misc_gm && (vd->vga_atc.atc_mode & ATC_MC_GA));
+}
+
+static void
+vga_mark_dirty(struct vga_vdev *vd, int offset)
+{
+	int bit;
+
+	bit = (offset & (64 * KB - 1)) >> VGA_DIRTY_SHIFT;
+	atomic_fetch_or(&vd->vga_dirty[bit / 64], 1UL << (bit % 64));
+}
+
+/* whether a plane range was written, according to a copy of vga_dirty */
+static bool
+vga_range_dirty(const uint64_t *dirty, int offset, int len)
+{
+	int bit, last;
+
+	last = (offset + len - 1) >> VGA_DIRTY_SHIFT;
+	for (bit = offset >> VGA_DIRTY_SHIFT; bit <= last; bit++) {
+		if (dirty[(bit % VGA_DIRTY_BITS) / 64] & (1UL << (bit % 64)))
+			return true;
+	}
+	return false;
+}
+
 static bool
 vga_in_reset(struct vga_vdev *vd)
 {
@@ -180,8 +221,10 @@ vga_check_size(struct gfx_ctx *gc, struct vga_vdev *vd)
 	    (((vd->vga_crtc.crtc_overflow & CRTC_OF_VDE8) >> CRTC_OF_VDE8_SHIFT) << 8) |
 	    (((vd->vga_crtc.crtc_overflow & CRTC_OF_VDE9) >> CRTC_OF_VDE9_SHIFT) << 9)) + 1;
 
-	if (old_width != vd->gc_width || old_height != vd->gc_height)
+	if (old_width != vd->gc_width || old_height != vd->gc_height) {
 		gc_resize(gc, vd->gc_width, vd->gc_height);
+		vd->vga_redraw = true;
+	}
 }
 
 static uint32_t
@@ -214,17 +257,23 @@ vga_get_pixel(struct vga_vdev *vd, int x, int y)
 }
 
 static void
-vga_render_graphics(struct vga_vdev *vd)
+vga_render_graphics(struct vga_vdev *vd, const uint64_t *dirty, bool redraw,
+		    pixman_region16_t *damage)
 {
-	int x, y;
+	int x, y, line;
 
+	line = vd->gc_width / 8;
 	for (y = 0; y < vd->gc_height; y++) {
+		if (!redraw && !vga_range_dirty(dirty, y * line, line))
+			continue;
+
 		for (x = 0; x < vd->gc_width; x++) {
 			int offset;
 
 			offset = y * vd->gc_width + x;
 			vd->gc_image->data[offset] = vga_get_pixel(vd, x, y);
 		}
+		pixman_region_union_rect(damage, damage, 0, y, vd->gc_width, 1);
 	}
 }
 
@@ -277,38 +326,64 @@ vga_get_text_pixel(struct vga_vdev *vd, int x, int y)
 }
 
 static void
-vga_render_text(struct vga_vdev *vd)
+vga_render_text(struct vga_vdev *vd, const uint64_t *dirty, bool redraw,
+		pixman_region16_t *damage)
 {
-	int x, y;
+	int x, y, cols, offset;
 
+	/* a character row is 16 lines, redrawn when one of its cells changed */
+	cols = vd->gc_width / vd->vga_seq.seq_cm_dots;
 	for (y = 0; y < vd->gc_height; y++) {
-		for (x = 0; x < vd->gc_width; x++) {
-			int offset;
+		offset = 2 * vd->vga_crtc.crtc_start_addr + (y / 16 * cols) * 2;
+		if (!redraw && !vga_range_dirty(dirty, offset, cols * 2))
+			continue;
 
+		for (x = 0; x < vd->gc_width; x++) {
 			offset = y * vd->gc_width + x;
 			vd->gc_image->data[offset] = vga_get_text_pixel(vd, x, y);
 		}
+		pixman_region_union_rect(damage, damage, 0, y, vd->gc_width, 1);
 	}
 }
 
-void
-vga_render(struct gfx_ctx *gc, void *arg)
+/*
+ * Convert the lines of VGA memory written since the last call, all of them
+ * after a register change, and add them to damage. Return false if nothing
+ * changed.
+ */
+bool
+vga_render(struct gfx_ctx *gc, void *arg, pixman_region16_t *damage)
 {
 	struct vga_vdev *vd = arg;
+	uint64_t dirty[VGA_DIRTY_BITS / 64];
+	bool redraw;
+	int i;
 
 	vga_check_size(gc, vd);
 
+	/* take the changes first, writes during the conversion count next time */
+	redraw = atomic_xchg(&vd->vga_redraw, false);
+	for (i = 0; i < VGA_DIRTY_BITS / 64; i++)
+		dirty[i] = atomic_xchg(&vd->vga_dirty[i], 0);
+
 	if (vga_in_reset(vd)) {
+		if (!redraw)
+			return false;
 		memset(vd->gc_image->data, 0,
 		    vd->gc_image->width * vd->gc_image->height *
 		     sizeof (uint32_t));
-		return;
+		pixman_region_union_rect(damage, damage, 0, 0,
+					 vd->gc_image->width,
+					 vd->gc_image->height);
+		return true;
 	}
 
-	if (vd->vga_gc.gc_misc_gm && (vd->vga_atc.atc_mode & ATC_MC_GA))
-		vga_render_graphics(vd);
+	if (vga_is_graphics(vd))
+		vga_render_graphics(vd, dirty, redraw, damage);
 	else
-		vga_render_text(vd);
+		vga_render_text(vd, dirty, redraw, damage);
+
+	return pixman_region_not_empty(damage);
 }
 
 static uint64_t
@@ -668,6 +743,11 @@ vga_mem_wr_handler(struct vmctx *ctx, uint64_t addr, uint8_t val, void *arg1)
 		if (vd->vga_seq.seq_map_mask & 8)
 			vd->vga_ram[offset + 3*64*KB] = c3;
 	}
+
+	vga_mark_dirty(vd, offset);
+	/* plane 2 holds the font in text modes */
+	if ((vd->vga_seq.seq_map_mask & 4) && !vga_is_graphics(vd))
+		vd->vga_redraw = true;
 }
 
 static int
@@ -1229,6 +1309,9 @@ vga_port_out_handler(struct vmctx *ctx, int in, int port, int bytes,
 		pr_dbg("vga_port_out_handler() unhandled port 0x%x, val 0x%x\n", port, val);
 		return (-1);
 	}
+
+	/* registers rarely change, simply redraw everything */
+	vd->vga_redraw = true;
 	return (0);
 }
 
@@ -1336,6 +1419,7 @@ vga_init(struct gfx_ctx *gc, int io_only)
 		free(vd);
 		return NULL;
 	}
+	vd->vga_redraw = true;
 
 	{
 		static uint8_t palette[] = {
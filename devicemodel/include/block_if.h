@@ -51,7 +51,9 @@ struct blockif_req {
 };
 
 struct blockif_ctxt;
-struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
+struct vmctx;
+struct blockif_ctxt *blockif_open(const char *optstr, const char *ident,
+				  int nqueues);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
 		    uint8_t *s);
@@ -72,5 +74,10 @@ int	blockif_flush_all(struct blockif_ctxt *bc);
 int	blockif_max_discard_sectors(struct blockif_ctxt *bc);
 int	blockif_max_discard_seg(struct blockif_ctxt *bc);
 int	blockif_discard_sector_alignment(struct blockif_ctxt *bc);
+void	blockif_set_batch_done(struct blockif_ctxt *bc,
+			       void (*cb)(void *arg), void *arg);
+void	blockif_plug(struct blockif_ctxt *bc);
+void	blockif_unplug(struct blockif_ctxt *bc);
+int	blockif_register_mem(struct blockif_ctxt *bc, struct vmctx *ctx);
 
 #endif /* _BLOCK_IF_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * ACRN sparse disk image.
+ *
+ * A two level cluster map, like qcow2 without refcounts, compression or
+ * snapshots: an L1 table of L2 table offsets, and L2 tables of data
+ * cluster offsets. Clusters are allocated on first write, appended to
+ * the end of the file. Clusters that were never written read from the
+ * backing file, which may itself be an image or a raw file, or as
+ * zeros if there is none. Discarded clusters are punched out of the
+ * file and read as zeros.
+ *
+ * All on-disk values are little endian.
+ *
+ *   cluster 0   header, followed by the backing file name
+ *   cluster 1.. L1 table, l1_size 64-bit entries
+ *   then        L2 tables and data clusters, in allocation order
+ */
+
+#ifndef _BLOCK_IMG_H_
+#define _BLOCK_IMG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define BLKIMG_MAGIC		"ACRNIMG"	/* with the NUL, 8 bytes */
+#define BLKIMG_VERSION		1
+
+#define BLKIMG_CLUSTER_BITS	16		/* default, 64 KiB */
+#define BLKIMG_MIN_CLUSTER_BITS	12
+#define BLKIMG_MAX_CLUSTER_BITS	21
+
+/* L1 and L2 entries: a cluster aligned file offset, or 0 */
+#define BLKIMG_E_ZERO		(1UL << 0)	/* L2: reads as zeros */
+#define BLKIMG_E_OFFSET(e)	((e) & ~0x1ffUL)
+
+struct blkimg_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	cluster_bits;
+	uint64_t	size;		/* virtual disk size in bytes */
+	uint64_t	l1_offset;
+	uint32_t	l1_size;	/* entries */
+	uint32_t	backing_len;	/* name length, 0 if none */
+} __attribute__((packed));
+
+struct blkimg_check {
+	uint64_t	l2_tables;
+	uint64_t	allocated;	/* data clusters */
+	uint64_t	zero;		/* discarded clusters over a backing file */
+	uint64_t	leaked;		/* data in the file nothing points to */
+	uint64_t	errors;
+};
+
+struct blkimg;
+
+int	blkimg_probe(int fd);
+int	blkimg_create(const char *path, uint64_t size, int cluster_bits,
+		      const char *backing);
+struct blkimg *blkimg_open(int fd, const char *path, bool rdonly, int *err);
+void	blkimg_close(struct blkimg *img);
+uint64_t blkimg_size(struct blkimg *img);
+uint64_t blkimg_cluster_size(struct blkimg *img);
+const char *blkimg_backing(struct blkimg *img);
+ssize_t	blkimg_preadv(struct blkimg *img, const struct iovec *iov, int iovcnt,
+		      off_t offset);
+ssize_t	blkimg_pwritev(struct blkimg *img, const struct iovec *iov, int iovcnt,
+		       off_t offset);
+int	blkimg_discard(struct blkimg *img, off_t offset, off_t len);
+int	blkimg_check(struct blkimg *img, struct blkimg_check *res);
+
+#endif /* _BLOCK_IMG_H_ */
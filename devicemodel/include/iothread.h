@@ -7,13 +7,40 @@
 #ifndef	_iothread_CTX_H_
 #define	_iothread_CTX_H_
 
+#include <stdbool.h>
+
+/* iothread 0 always exists, the others are created with --iothread */
+#define IOTHREAD_NUM_MAX	8
+
+#include <stdint.h>
+
 struct iothread_mevent {
 	void (*run)(void *);
 	void *arg;
 	int fd;
+	/*
+	 * The fd is not an eventfd, e.g. an io_uring or a tap, so run()
+	 * is called without reading the fd first.
+	 */
+	bool nodrain;
+
+	/*
+	 * Optional busy-poll hooks. After an event, the iothread calls
+	 * poll_start() to mask the notification and then keeps calling
+	 * poll(), which handles pending work and returns true if there was
+	 * some. When the poll window expires, poll_stop() unmasks the
+	 * notification and returns true if work raced in meanwhile.
+	 */
+	void (*poll_start)(void *);
+	bool (*poll)(void *);
+	bool (*poll_stop)(void *);
+	bool polling;		/* owned by the iothread */
 };
-int iothread_add(int fd, struct iothread_mevent *aevt);
-int iothread_del(int fd);
+int iothread_add(int id, int fd, struct iothread_mevent *aevt);
+int iothread_del(int id, int fd);
+bool iothread_valid(int id);
+int iothread_parse_options(char *opt);
+void iothread_set_poll_max(uint64_t ns);
 int iothread_init(void);
 void iothread_deinit(void);
 
@@ -155,6 +155,9 @@ struct pci_vdev {
 		pthread_mutex_t	lock;
 	} lintr;
 
+	/* serializes guest accesses to config space and BARs */
+	pthread_mutex_t	emul_lock;
+
 	struct {
 		int		enabled;
 		uint64_t	addr;
@@ -81,6 +81,10 @@
 	_IO(ACRN_IOCTL_TYPE, 0x15)
 #define ACRN_IOCTL_SET_VCPU_REGS	\
 	_IOW(ACRN_IOCTL_TYPE, 0x16, struct acrn_vcpu_regs)
+#define ACRN_IOCTL_GET_VCPU_SNAPSHOT	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x17, struct acrn_vcpu_snapshot)
+#define ACRN_IOCTL_SET_VCPU_SNAPSHOT	\
+	_IOW(ACRN_IOCTL_TYPE, 0x18, struct acrn_vcpu_snapshot)
 
 /* IRQ and Interrupts */
 #define ACRN_IOCTL_INJECT_MSI		\
@@ -107,6 +111,12 @@
 	_IOW(ACRN_IOCTL_TYPE, 0x41, struct acrn_vm_memmap)
 #define ACRN_IOCTL_UNSET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x42, struct acrn_vm_memmap)
+#define ACRN_IOCTL_SET_DIRTY_LOG	\
+	_IOW(ACRN_IOCTL_TYPE, 0x43, struct acrn_dirty_log)
+#define ACRN_IOCTL_GET_DIRTY_LOG	\
+	_IOW(ACRN_IOCTL_TYPE, 0x44, struct acrn_dirty_log)
+#define ACRN_IOCTL_RELEASE_MEM		\
+	_IOW(ACRN_IOCTL_TYPE, 0x45, struct acrn_mem_release)
 
 /* PCI assignment*/
 #define ACRN_IOCTL_SET_PTDEV_INTR	\
@@ -184,6 +194,43 @@ struct acrn_vm_memmap {
 	__u64	len;
 };
 
+/* dirty log ranges must be aligned to 64 pages, one bitmap word */
+#define ACRN_DIRTY_LOG_GRANULE	(64UL * 4096UL)
+
+/**
+ * @brief Info to start/stop or fetch dirty page logging of a User VM range
+ */
+struct acrn_dirty_log {
+	/** user OS guest physical start address of the range */
+	__u64	gpa;
+	/** length of the range */
+	__u64	size;
+	/** ACRN_IOCTL_SET_DIRTY_LOG only: 1 to start logging, 0 to stop */
+	__u32	enable;
+	/** Reserved */
+	__u32	reserved;
+	/** ACRN_IOCTL_GET_DIRTY_LOG only: service OS user virtual address of
+	 * the bitmap, one bit per 4K page, size / 32K bytes long. The HSM
+	 * driver pins it and passes its service OS gpa to HC_VM_GET_DIRTY_LOG
+	 * in place of this address (acrn_dirty_log.bitmap_gpa).
+	 */
+	__u64	bitmap;
+};
+
+/**
+ * @brief Info to take a page aligned range of RAM away from a User VM
+ *
+ * The range is removed from the stage-2 table and the service OS drops
+ * its references on the backing pages. ACRN_IOCTL_SET_MEMSEG maps it
+ * back.
+ */
+struct acrn_mem_release {
+	/** user OS guest physical start address of the range */
+	__u64	gpa;
+	/** length of the range */
+	__u64	size;
+};
+
 /* Type of interrupt of a passthrough device */
 #define ACRN_PTDEV_IRQ_INTX	0
 #define ACRN_PTDEV_IRQ_MSI	1
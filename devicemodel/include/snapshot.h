@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct vmctx;
+
+#define SNAPSHOT_NAME_LEN	32
+
+/*
+ * Per-device snapshot hooks.
+ *
+ * quiesce(), if set, is called on every device before anything is saved
+ * and waits until the device has completed the guest requests it took.
+ * save() streams the device state with snapshot_write(); restore() reads
+ * back exactly what save() wrote with snapshot_read(). All return 0 on
+ * success and a negative value on failure.
+ */
+struct snapshot_ops {
+	int (*save)(void *arg, int fd);
+	int (*restore)(void *arg, int fd, uint32_t len);
+	int (*quiesce)(void *arg);
+};
+
+int snapshot_register(const char *name, struct snapshot_ops *ops,
+		void *arg, void *owner);
+void snapshot_unregister(void *owner);
+
+int snapshot_write(int fd, const void *buf, size_t len);
+int snapshot_read(int fd, void *buf, size_t len);
+
+int vm_snapshot_save(struct vmctx *ctx, const char *path, int nr_vcpus);
+int vm_snapshot_restore(struct vmctx *ctx, const char *path, int nr_vcpus);
+
+#endif /* _SNAPSHOT_H_ */
@@ -64,6 +64,10 @@ struct surface {
 	uint32_t bpp;
 	uint32_t stride;
 	void *pixel;
+	/* changed area of a pixman surface for vdpy_surface_update(), in
+	 * surface coordinates. NULL means all of it.
+	 */
+	pixman_region16_t *damage;
 	struct  {
 		int dmabuf_fd;
 		uint32_t surf_fourcc;
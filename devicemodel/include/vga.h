@@ -169,6 +169,11 @@ struct vga {
 	struct gfx_ctx *gc;
 	struct surface surf;
 	pthread_t tid;
+	/* track VBE framebuffer writes with the dirty log, off by default */
+	bool fb_log_enabled;
+	/* BAR0 address the framebuffer dirty log is armed on, 0 if none */
+	uint64_t fb_log_gpa;
+	bool fb_log_failed;
 	struct {
 		uint16_t  id;
 		uint16_t  xres;
@@ -185,7 +190,7 @@ struct vga {
 };
 
 void *vga_init(struct gfx_ctx *gc, int io_only);
-void vga_render(struct gfx_ctx *gc, void *arg);
+bool vga_render(struct gfx_ctx *gc, void *arg, pixman_region16_t *damage);
 int vga_port_in_handler(struct vmctx *ctx, int in, int port, int bytes,
 		     uint8_t *val, void *arg);
 int vga_port_out_handler(struct vmctx *ctx, int in, int port, int bytes,
@@ -124,6 +124,23 @@
  * notify, when descriptors are added to the corresponding ring.
  * (These are provided only for interrupt optimization and need
  * not be implemented.)
+ *
+ * A device may also offer VIRTIO_F_RING_PACKED.  When the driver
+ * accepts it, each queue is a single ring of <N> 16-byte
+ * "vring_packed_desc" entries {<addr>, <len>, <id>, <flags>} that
+ * the guest and the device both write: the guest makes a descriptor
+ * available by setting its AVAIL flag bit to, and its USED flag bit
+ * to the inverse of, its current wrap counter, and the device marks
+ * a buffer used by writing the buffer <id> and <len> into the next
+ * used slot and setting both bits to its own wrap counter.  Each wrap
+ * counter starts at 1 and flips whenever the side walks past the
+ * last ring entry.  The avail and used rings are replaced by two
+ * 4-byte "vring_packed_desc_event" areas, one written by the driver
+ * and one by the device, which carry the notification suppression
+ * state (ENABLE, DISABLE or, with EVENT_IDX, a ring position).  The
+ * generic code hides the ring layout behind vq_getchain(),
+ * vq_relchain(), vq_endchains() and the notification helpers, so
+ * devices need no changes beyond offering the feature.
  */
 
 #include <linux/virtio_ring.h>
@@ -219,6 +236,7 @@ enum {
 #define	VIRTIO_VENDOR		0x1AF4
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
 #define	VIRTIO_DEV_GPU		0x1050
@@ -347,6 +365,8 @@ struct virtio_base {
 	struct virtio_ops *vops;	/**< virtio operations */
 	int	flags;			/**< VIRTIO_* flags from above */
 	bool	iothread;
+	int	iothread_ids[IOTHREAD_NUM_MAX];	/**< iothreads used round-robin by the queues */
+	int	iothread_nr;		/**< number of iothread_ids, 0 for iothread 0 */
 	pthread_mutex_t *mtx;		/**< POSIX mutex, if any */
 	struct pci_vdev *dev;		/**< PCI device instance */
 	uint64_t negotiated_caps;	/**< negotiated capabilities */
@@ -364,8 +384,6 @@ struct virtio_base {
 	uint32_t driver_feature_select;	/**< current selected guest feature */
 	int cfg_coff;			/**< PCI cfg access capability offset */
 	int backend_type;               /**< VBSU, VBSK or VHOST */
-	struct acrn_timer polling_timer; /**< timer for polling mode */
-	int polling_in_progress;        /**< The polling status */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -399,6 +417,9 @@ struct virtio_ops {
 				/**< to apply negotiated features */
 	void    (*set_status)(void *, uint64_t);
 				/**< called to set device status */
+	int	(*quiesce)(void *);
+				/**< called before a snapshot, to give back
+				     the chains the device holds on purpose */
 };
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
@@ -425,12 +446,37 @@ struct virtio_ops {
 struct virtio_iothread {
 	struct virtio_base *base;
 	int idx;
+	int iothread_id;
 	int kick_fd;
 	bool	ioevent_started;
+	bool	polling;	/* notifications masked by the iothread busy-poll */
 	struct iothread_mevent iomvt;
 	void (*iothread_run)(void *, struct virtio_vq_info *);
 };
 
+/*
+ * Interrupt coalescing of a virtqueue: once an interrupt is due, it is
+ * held back until max_frames buffers are pending or max_usecs have
+ * passed, whichever comes first.  The timer is a timerfd serviced by
+ * the queue's iothread.
+ */
+struct virtio_vq_coalesce {
+	uint32_t max_frames;	/* 0 to only use max_usecs */
+	uint32_t max_usecs;	/* 0 disables coalescing */
+	uint32_t pending;	/* used buffers not signalled yet */
+	uint64_t pending_ns;	/* when the first of them was used */
+	bool	armed;
+	bool	timer_ready;
+	int	timer_fd;
+	int	iothread_id;
+	struct iothread_mevent iomvt;
+	pthread_mutex_t mtx;
+
+	uint64_t interrupts;	/* interrupts sent */
+	uint64_t saved;		/* interrupts folded into a later one */
+	uint64_t delay_ns;	/* total latency added to the first buffers */
+};
+
 struct virtio_vq_info {
 	uint16_t qsize;		/**< size of this queue (a power of 2) */
 	void	(*notify)(void *, struct virtio_vq_info *);
@@ -447,6 +493,8 @@ struct virtio_vq_info {
 
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
 	struct virtio_iothread viothrd;
+	pthread_mutex_t *mtx;	/**< if set, serializes the iothread work on
+				     this queue instead of the device mutex */
 
 	volatile struct vring_desc *desc;
 				/**< descriptor array */
@@ -455,10 +503,33 @@ struct virtio_vq_info {
 	volatile struct vring_used *used;
 				/**< the "used" ring */
 
+	volatile struct vring_packed_desc *pdesc;
+				/**< packed descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< packed driver event suppression */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< packed device event suppression */
+	uint16_t used_idx;	/**< next packed used slot */
+	uint16_t used_count;	/**< packed descriptors used, mod 2^16 */
+	bool	avail_wrap;	/**< packed driver ring wrap counter */
+	bool	used_wrap;	/**< packed device ring wrap counter */
+	uint16_t prev_avail;	/**< packed last_avail before vq_getchain */
+	bool	prev_wrap;	/**< packed avail_wrap before vq_getchain */
+	uint16_t *chain_len;	/**< packed ring descriptors per buffer id */
+
+	uint16_t used_pending;	/**< chains prepared but not published */
+	int	inflight;	/**< chains taken and not yet used or
+				     returned, updated atomically */
+	uint16_t pending_slot;	/**< packed: first unpublished used slot */
+	uint16_t pending_flags;	/**< packed: its flags, written on publish */
+
 	uint32_t gpa_desc[2];	/**< gpa of descriptors */
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	struct virtio_vq_coalesce coal;
+				/**< interrupt coalescing state */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -480,6 +551,19 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return ((vq->flags & VQ_ALLOC) == VQ_ALLOC);
 }
 
+/**
+ * @brief Does this ring use the packed layout?
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return true if VIRTIO_F_RING_PACKED was negotiated.
+ */
+static inline bool
+vq_is_packed(struct virtio_vq_info *vq)
+{
+	return (vq->base->negotiated_caps & (1ULL << VIRTIO_F_RING_PACKED)) != 0;
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -493,6 +577,14 @@ static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
 	bool ret = false;
+
+	if (vq_ring_ready(vq) && vq_is_packed(vq)) {
+		uint16_t flags = vq->pdesc[vq->last_avail].flags;
+
+		return (!!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) == vq->avail_wrap) &&
+			(!!(flags & (1 << VRING_PACKED_DESC_F_USED)) != vq->avail_wrap);
+	}
+
 	if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
 		if ((uint16_t)((u_int)vq->avail->idx - vq->last_avail) > vq->qsize)
 			pr_err ("%s: no valid descriptor\n", vq->base->vops->name);
@@ -578,6 +670,57 @@ void virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
  */
 int acrn_parse_virtio_poll_interval(const char *optarg);
 
+/**
+ * @brief Parse the iothread option of a virtio device
+ *
+ * The option is "iothread" for the default iothread or
+ * "iothread=<id>[:<id>...]" to spread the virtqueues round-robin
+ * over the given iothreads.
+ *
+ * @param opt Pointer to the option string.
+ * @param ids Array of IOTHREAD_NUM_MAX iothread ids to fill.
+ * @param nr Number of ids filled, 0 for the default iothread.
+ *
+ * @return 0 on success and -1 on invalid option.
+ */
+int virtio_parse_iothread_opt(char *opt, int *ids, int *nr);
+
+/**
+ * @brief Parse the interrupt coalescing option of a virtio device
+ *
+ * The option is "coalesce=<frames>:<usecs>".
+ *
+ * @param opt Pointer to the option string.
+ * @param frames Maximum number of buffers to hold the interrupt for.
+ * @param usecs Maximum time in microseconds to hold the interrupt for.
+ *
+ * @return 0 on success and -1 on invalid option.
+ */
+int virtio_parse_coalesce_opt(char *opt, uint32_t *frames, uint32_t *usecs);
+
+/**
+ * @brief Set the interrupt coalescing parameters of a virtqueue.
+ *
+ * A max_usecs of 0 turns coalescing off and signals any held back
+ * interrupt.  The queue must already be linked to its virtio_base.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param max_frames Maximum number of buffers, 0 for no limit.
+ * @param max_usecs Maximum delay in microseconds.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int vq_set_coalesce(struct virtio_vq_info *vq, uint32_t max_frames,
+		uint32_t max_usecs);
+
+/**
+ * @brief Release the coalescing timers of a device and log the
+ * per-queue coalescing statistics.
+ *
+ * @param base Pointer to struct virtio_base.
+ */
+void virtio_coalesce_deinit(struct virtio_base *base);
+
 /**
  * @brief Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -621,6 +764,17 @@ int virtio_intr_init(struct virtio_base *base, int barnum, int use_msix);
  */
 void virtio_reset_dev(struct virtio_base *base);
 
+/**
+ * @brief Wait until the device completed every chain it took.
+ *
+ * The vCPUs must be paused. Gives up after a few seconds.
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return 0 once idle, -EBUSY on timeout.
+ */
+int virtio_wait_idle(struct virtio_base *base);
+
 /**
  * @brief Set I/O BAR (usually 0) to map PCI config registers.
  *
@@ -653,6 +807,16 @@ int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
  */
 void vq_retchain(struct virtio_vq_info *vq);
 
+/**
+ * @brief Return the last n chains obtained with vq_getchain() back to
+ * the available ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Buffer ids of those chains, in the order they were obtained.
+ * @param n Number of chains.
+ */
+void vq_retchains(struct virtio_vq_info *vq, uint16_t *idx, int n);
+
 /**
  * @brief Return specified request chain to the guest,
  * setting its I/O length to the provided value.
@@ -663,6 +827,30 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Fill in the used entry of a chain without handing it to the
+ * frontend yet.
+ *
+ * Chains prepared this way become visible together, in order, with the
+ * next vq_relchain_publish(). Used for buffers the frontend must see at
+ * once, e.g. the merged rx buffers of one packet, and to update the used
+ * index once per batch.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Pointer to available ring position, returned by vq_getchain().
+ * @param iolen Number of data bytes to be returned to frontend.
+ */
+void vq_relchain_prepare(struct virtio_vq_info *vq, uint16_t idx,
+			 uint32_t iolen);
+
+/**
+ * @brief Hand all chains prepared with vq_relchain_prepare() to the
+ * frontend.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_relchain_publish(struct virtio_vq_info *vq);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -686,6 +874,19 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
 
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Tell the guest it need not notify us of new available buffers,
+ * i.e. set VRING_USED_F_NO_NOTIFY, or disable the device event of
+ * a packed ring.  Drivers should use this rather than writing the
+ * used ring directly.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
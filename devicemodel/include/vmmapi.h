@@ -125,10 +125,22 @@ bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+size_t	hugetlb_page_size(struct vmctx *ctx, vm_paddr_t gpa);
+int	hugetlb_discard_page(struct vmctx *ctx, vm_paddr_t gpa);
+int	hugetlb_populate(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+bool	hugetlb_discarded(struct vmctx *ctx, vm_paddr_t gpa);
+bool	hugetlb_range_discarded(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+void	hugetlb_pin(struct vmctx *ctx);
+void	hugetlb_unpin(struct vmctx *ctx);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 size_t	vm_get_lowmem_size(struct vmctx *ctx);
 size_t	vm_get_highmem_size(struct vmctx *ctx);
+int	vm_set_dirty_log_range(struct vmctx *ctx, vm_paddr_t gpa, size_t len,
+		bool enable);
+int	vm_set_dirty_log(struct vmctx *ctx, bool enable);
+int	vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len, uint64_t *bitmap);
+int	vm_release_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
 int	vm_run(struct vmctx *ctx);
 int	vm_suspend(struct vmctx *ctx, enum vm_suspend_how how);
 int	vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg);
@@ -151,6 +163,8 @@ int	vm_remove_hv_vdev(struct vmctx *ctx, struct acrn_vdev *dev);
 int	acrn_parse_cpu_affinity(char *arg);
 uint64_t vm_get_cpu_affinity_dm(void);
 int	vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *cpu_regs);
+int	vm_get_vcpu_snapshot(struct vmctx *ctx, struct acrn_vcpu_snapshot *snap);
+int	vm_set_vcpu_snapshot(struct vmctx *ctx, struct acrn_vcpu_snapshot *snap);
 
 int	vm_get_cpu_state(struct vmctx *ctx, void *state_buf);
 int	vm_intr_monitor(struct vmctx *ctx, void *intr_buf);
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * acrn-img: create, convert and check ACRN sparse disk images offline.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_img.h"
+
+#define CONVERT_CHUNK	(2UL << 20)	/* a multiple of any cluster size */
+#define RAW_GRAIN	(64UL << 10)	/* zero detection unit for raw output */
+
+/* a source or destination disk: an image, or a raw file */
+struct disk {
+	int		fd;
+	struct blkimg	*img;
+	uint64_t	size;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: acrn-img create [-c <cluster size>] [-b <backing file>] <file> [<size>]\n"
+		"       acrn-img convert [-O acrn|raw] [-c <cluster size>] <src> <dst>\n"
+		"       acrn-img check <file>\n"
+		"       acrn-img info <file>\n"
+		"Sizes take a K, M, G or T suffix. The size of an image with a\n"
+		"backing file defaults to the backing file's.\n");
+	exit(1);
+}
+
+static int
+parse_size(const char *s, uint64_t *size)
+{
+	char *end;
+	uint64_t v;
+
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (errno || end == s)
+		return -1;
+	switch (*end) {
+	case 'T': case 't':
+		v <<= 10;
+		/* fallthrough */
+	case 'G': case 'g':
+		v <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		v <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		return -1;
+	*size = v;
+	return 0;
+}
+
+static int
+parse_cluster(const char *s, int *bits)
+{
+	uint64_t v;
+
+	if (parse_size(s, &v) || v == 0 || (v & (v - 1)))
+		return -1;
+	*bits = __builtin_ctzll(v);
+	if (*bits < BLKIMG_MIN_CLUSTER_BITS || *bits > BLKIMG_MAX_CLUSTER_BITS)
+		return -1;
+	return 0;
+}
+
+static int
+disk_open(struct disk *d, const char *path, bool rdonly)
+{
+	int err = 0;
+
+	memset(d, 0, sizeof(*d));
+	d->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (d->fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (blkimg_probe(d->fd) > 0) {
+		d->img = blkimg_open(d->fd, path, rdonly, &err);
+		if (d->img == NULL) {
+			fprintf(stderr, "%s: %s\n", path, strerror(-err));
+			close(d->fd);
+			return -1;
+		}
+		d->size = blkimg_size(d->img);
+	} else {
+		d->size = lseek(d->fd, 0, SEEK_END);
+	}
+	return 0;
+}
+
+static void
+disk_close(struct disk *d)
+{
+	if (d->img)
+		blkimg_close(d->img);
+	close(d->fd);
+}
+
+static int
+cmd_create(int argc, char **argv)
+{
+	const char *backing = NULL;
+	int bits = BLKIMG_CLUSTER_BITS;
+	uint64_t size = 0;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "b:c:")) != -1) {
+		switch (c) {
+		case 'b':
+			backing = optarg;
+			break;
+		case 'c':
+			if (parse_cluster(optarg, &bits))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 == argc && backing == NULL)
+		usage();
+	if (optind + 1 != argc && optind + 2 != argc)
+		usage();
+	if (optind + 2 == argc && parse_size(argv[optind + 1], &size))
+		usage();
+
+	err = blkimg_create(argv[optind], size, bits, backing);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return 1;
+	}
+	return 0;
+}
+
+static bool
+is_zero(const char *buf, size_t len)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * Copy the virtual disk, leaving out the parts that read as zeros so the
+ * destination stays sparse. An image destination ends up with every
+ * cluster in disk order and no backing file.
+ */
+static int
+cmd_convert(int argc, char **argv)
+{
+	int bits = BLKIMG_CLUSTER_BITS;
+	bool raw = false;
+	struct disk src, dst;
+	struct iovec iov;
+	uint64_t off, grain, g;
+	size_t len;
+	char *buf;
+	int c, fd, err = 0;
+
+	while ((c = getopt(argc, argv, "O:c:")) != -1) {
+		switch (c) {
+		case 'O':
+			if (!strcmp(optarg, "raw"))
+				raw = true;
+			else if (strcmp(optarg, "acrn"))
+				usage();
+			break;
+		case 'c':
+			if (parse_cluster(optarg, &bits))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+
+	if (disk_open(&src, argv[optind], true))
+		return 1;
+
+	if (raw) {
+		fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, src.size) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind + 1],
+				strerror(errno));
+			disk_close(&src);
+			return 1;
+		}
+		close(fd);
+	} else {
+		err = blkimg_create(argv[optind + 1], src.size, bits, NULL);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind + 1],
+				strerror(-err));
+			disk_close(&src);
+			return 1;
+		}
+	}
+	if (disk_open(&dst, argv[optind + 1], false)) {
+		disk_close(&src);
+		return 1;
+	}
+	grain = dst.img ? blkimg_cluster_size(dst.img) : RAW_GRAIN;
+
+	buf = malloc(CONVERT_CHUNK);
+	if (buf == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (off = 0; off < src.size && err == 0; off += len) {
+		len = CONVERT_CHUNK;
+		if (len > src.size - off)
+			len = src.size - off;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		if (src.img)
+			err = blkimg_preadv(src.img, &iov, 1, off);
+		else if (pread(src.fd, buf, len, off) != len)
+			err = -EIO;
+		if (err < 0)
+			break;
+		err = 0;
+
+		for (g = 0; g < len && err == 0; g += grain) {
+			iov.iov_base = buf + g;
+			iov.iov_len = (len - g < grain) ? len - g : grain;
+			if (is_zero(iov.iov_base, iov.iov_len))
+				continue;
+			if (dst.img)
+				err = blkimg_pwritev(dst.img, &iov, 1, off + g);
+			else if (pwrite(dst.fd, iov.iov_base, iov.iov_len,
+					off + g) != iov.iov_len)
+				err = -EIO;
+			if (err > 0)
+				err = 0;
+		}
+	}
+	if (err == 0 && fsync(dst.fd) < 0)
+		err = -errno;
+	free(buf);
+out:
+	if (err < 0)
+		fprintf(stderr, "convert failed: %s\n", strerror(-err));
+	disk_close(&dst);
+	disk_close(&src);
+	return err < 0;
+}
+
+static int
+cmd_check(int argc, char **argv)
+{
+	struct blkimg_check res;
+	struct disk d;
+	int err;
+
+	if (argc != 2)
+		usage();
+	if (disk_open(&d, argv[1], true))
+		return 1;
+	if (d.img == NULL) {
+		fprintf(stderr, "%s: not an ACRN image\n", argv[1]);
+		disk_close(&d);
+		return 1;
+	}
+
+	err = blkimg_check(d.img, &res);
+	disk_close(&d);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(-err));
+		return 1;
+	}
+	printf("%lu L2 tables, %lu clusters allocated, %lu zero clusters\n",
+		res.l2_tables, res.allocated, res.zero);
+	if (res.leaked)
+		printf("%lu leaked clusters, convert the image to reclaim them\n",
+			res.leaked);
+	if (res.errors)
+		printf("%lu errors: clusters out of the file, misaligned or referenced twice\n",
+			res.errors);
+	return res.errors ? 2 : (res.leaked ? 3 : 0);
+}
+
+static int
+cmd_info(int argc, char **argv)
+{
+	struct stat sbuf;
+	struct disk d;
+
+	if (argc != 2)
+		usage();
+	if (disk_open(&d, argv[1], true))
+		return 1;
+	fstat(d.fd, &sbuf);
+	printf("image: %s\n", argv[1]);
+	printf("format: %s\n", d.img ? "acrn" : "raw");
+	printf("virtual size: %lu\n", d.size);
+	printf("disk size: %lu\n", (uint64_t)sbuf.st_blocks * 512);
+	if (d.img) {
+		printf("cluster size: %lu\n", blkimg_cluster_size(d.img));
+		if (blkimg_backing(d.img))
+			printf("backing file: %s\n", blkimg_backing(d.img));
+	}
+	disk_close(&d);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+
+	argv++;
+	argc--;
+	if (!strcmp(argv[0], "create"))
+		return cmd_create(argc, argv);
+	if (!strcmp(argv[0], "convert"))
+		return cmd_convert(argc, argv);
+	if (!strcmp(argv[0], "check"))
+		return cmd_check(argc, argv);
+	if (!strcmp(argv[0], "info"))
+		return cmd_info(argc, argv);
+	usage();
+	return 1;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * acrn-blockif-bench: issue a burst of overlapping writes through blockif
+ * at several queue depths, time them, and check that the data read back
+ * is that of the last write to each sector.
+ *
+ * The writes land in a small window of the file, so most of them overlap
+ * requests still in flight and are ordered through the blockif interval
+ * tree. The run is repeated for each depth given with -d, with the thread
+ * pool or, with -u, the io_uring backend.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmmapi.h"
+#include "block_if.h"
+#include "iothread.h"
+#include "log.h"
+
+#define SECTSZ		512
+#define WINDOW		(256UL << 10)
+#define NSECT		(WINDOW / SECTSZ)
+#define MAXSECT		32		/* longest write, in sectors */
+#define READSZ		(64UL << 10)
+#define MAXDEPTHS	16
+
+struct slot {
+	struct blockif_req	req;
+	uint32_t		*buf;
+	struct slot		*next;
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct slot *freelist;
+static int inflight;
+static int errors;
+
+/*
+ * block_if.c logs through the device model loggers and pins guest memory
+ * for io_uring buffers; neither exists here.
+ */
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_ERROR)
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void
+hugetlb_pin(struct vmctx *ctx)
+{
+}
+
+void
+hugetlb_unpin(struct vmctx *ctx)
+{
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: acrn-blockif-bench [-u] [-n <writes>] [-d <depth>[,<depth>...]] <file>\n"
+		"  -u  use the io_uring backend instead of the thread pool\n"
+		"  -n  overlapping writes per run (default 3000)\n"
+		"  -d  queue depths to run at (default 8,64,256,1024,4096)\n"
+		"The first %lu KiB of <file> are overwritten.\n", WINDOW >> 10);
+	exit(1);
+}
+
+static void
+put_slot(struct slot *s, int failed)
+{
+	pthread_mutex_lock(&mtx);
+	if (failed)
+		errors++;
+	s->next = freelist;
+	freelist = s;
+	inflight--;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+}
+
+static void
+bench_done(struct blockif_req *br, int err)
+{
+	put_slot(br->param, err != 0 || br->resid != 0);
+}
+
+static struct slot *
+get_slot(void)
+{
+	struct slot *s;
+
+	pthread_mutex_lock(&mtx);
+	while (freelist == NULL)
+		pthread_cond_wait(&cond, &mtx);
+	s = freelist;
+	freelist = s->next;
+	inflight++;
+	pthread_mutex_unlock(&mtx);
+
+	return s;
+}
+
+static void
+drain(void)
+{
+	pthread_mutex_lock(&mtx);
+	while (inflight != 0)
+		pthread_cond_wait(&cond, &mtx);
+	pthread_mutex_unlock(&mtx);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+submit(struct blockif_ctxt *bc, struct slot *s, int write)
+{
+	int err;
+
+	/*
+	 * blockif frees a request only after its callback has returned, so
+	 * the queue can still be full for a moment when a slot is free.
+	 */
+	do {
+		err = write ? blockif_write(bc, &s->req) :
+			      blockif_read(bc, &s->req);
+	} while (err == E2BIG && sched_yield() == 0);
+
+	if (err != 0) {
+		fprintf(stderr, "blockif_%s: %d\n", write ? "write" : "read",
+			err);
+		put_slot(s, 1);
+		return -1;
+	}
+	return 0;
+}
+
+/* Check the window against owner[], which holds the last writer of each sector */
+static int
+verify(struct blockif_ctxt *bc, struct slot *slots, const uint32_t *owner)
+{
+	struct slot *s;
+	off_t off;
+	size_t i, j, sect;
+	int bad = 0;
+
+	for (off = 0; off < (off_t)WINDOW; off += READSZ) {
+		s = get_slot();
+		s->req.iov[0].iov_len = READSZ;
+		s->req.offset = off;
+		s->req.resid = READSZ;
+		if (submit(bc, s, 0) != 0)
+			return -1;
+		drain();
+
+		for (i = 0; i < READSZ / SECTSZ; i++) {
+			sect = off / SECTSZ + i;
+			for (j = 0; j < SECTSZ / sizeof(uint32_t); j++) {
+				if (s->buf[i * SECTSZ / sizeof(uint32_t) + j] !=
+				    owner[sect]) {
+					bad++;
+					break;
+				}
+			}
+		}
+	}
+
+	if (bad)
+		fprintf(stderr, "%d sectors out of order\n", bad);
+	return bad ? -1 : 0;
+}
+
+static int
+run(const char *path, int uring, int depth, int nwrites)
+{
+	char opts[256];
+	struct blockif_ctxt *bc;
+	struct slot *slots, *s;
+	uint32_t *owner;
+	uint64_t seed = 0x9e3779b97f4a7c15UL;
+	size_t start, len, i;
+	double t0, t1;
+	int fd, n, qsz, ret = -1;
+
+	/* start from a zeroed window */
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, WINDOW) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(opts, sizeof(opts), "%s,qdepth=%d,aio=%s", path, depth,
+		 uring ? "io_uring" : "threads");
+	bc = blockif_open(opts, "bench", 1);
+	if (bc == NULL)
+		return -1;
+
+	qsz = blockif_queuesz(bc);
+	slots = calloc(qsz, sizeof(*slots));
+	owner = calloc(NSECT, sizeof(*owner));
+	if (slots == NULL || owner == NULL)
+		goto out;
+	for (n = 0; n < qsz; n++) {
+		slots[n].buf = malloc(READSZ);
+		if (slots[n].buf == NULL)
+			goto out;
+		slots[n].req.iov[0].iov_base = slots[n].buf;
+		slots[n].req.iovcnt = 1;
+		slots[n].req.callback = bench_done;
+		slots[n].req.param = &slots[n];
+		slots[n].next = freelist;
+		freelist = &slots[n];
+	}
+	errors = 0;
+
+	t0 = now();
+	for (n = 0; n < nwrites; n++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		len = 1 + seed % MAXSECT;
+		start = (seed >> 8) % (NSECT - len + 1);
+
+		s = get_slot();
+		for (i = 0; i < len * SECTSZ / sizeof(uint32_t); i++)
+			s->buf[i] = n + 1;
+		for (i = start; i < start + len; i++)
+			owner[i] = n + 1;
+
+		s->req.iov[0].iov_len = len * SECTSZ;
+		s->req.offset = start * SECTSZ;
+		s->req.resid = len * SECTSZ;
+		if (submit(bc, s, 1) != 0) {
+			drain();
+			goto out;
+		}
+	}
+	drain();
+	t1 = now();
+
+	if (errors) {
+		fprintf(stderr, "%d requests failed\n", errors);
+		goto out;
+	}
+	if (verify(bc, slots, owner) != 0)
+		goto out;
+
+	printf("%-8s depth %5d: %d writes in %.3f s, %.2f us/write\n",
+	       uring ? "io_uring" : "threads", qsz + 1, nwrites, t1 - t0,
+	       (t1 - t0) * 1e6 / nwrites);
+	ret = 0;
+
+out:
+	blockif_close(bc);
+	freelist = NULL;
+	if (slots != NULL) {
+		for (n = 0; n < qsz; n++)
+			free(slots[n].buf);
+	}
+	free(slots);
+	free(owner);
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	int depths[MAXDEPTHS] = { 8, 64, 256, 1024, 4096 };
+	int ndepths = 5, nwrites = 3000, uring = 0;
+	char *cp, *tok;
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "un:d:")) != -1) {
+		switch (c) {
+		case 'u':
+			uring = 1;
+			break;
+		case 'n':
+			nwrites = atoi(optarg);
+			if (nwrites <= 0)
+				usage();
+			break;
+		case 'd':
+			ndepths = 0;
+			cp = optarg;
+			while ((tok = strsep(&cp, ",")) != NULL) {
+				if (ndepths == MAXDEPTHS)
+					usage();
+				depths[ndepths] = atoi(tok);
+				if (depths[ndepths] < 2)
+					usage();
+				ndepths++;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if (iothread_init() != 0) {
+		fprintf(stderr, "iothread_init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < ndepths; i++) {
+		if (run(argv[0], uring, depths[i], nwrites) != 0) {
+			fprintf(stderr, "depth %d: failed\n", depths[i]);
+			ret = 1;
+		}
+	}
+
+	iothread_deinit();
+	return ret;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * acrn-mmio-bench: replay an MMIO access trace against the emulate_mem()
+ * range lookup, from one or more threads, and report the cost per access.
+ *
+ * A trace is a text file with one record per line:
+ *
+ *	range <base> <size>		register a range
+ *	r <gpa> <size>			read access
+ *	w <gpa> <size> [<value>]	write access
+ *
+ * Numbers take any strtoull() base. Blank lines and lines starting with
+ * '#' are ignored. Without a trace, a synthetic one is generated: bursts
+ * of accesses to a few hot ranges out of many, as vCPUs polling device
+ * registers produce.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define SYN_BASE	0xe0000000UL
+#define SYN_STRIDE	0x10000UL
+#define SYN_SIZE	0x1000UL
+#define SYN_BURST	8
+#define CHURN_BASE	0xf0000000UL
+
+struct access {
+	uint64_t	gpa;
+	uint64_t	value;
+	uint32_t	dir;
+	uint32_t	size;
+};
+
+struct worker {
+	pthread_t	tid;
+	int		id;
+	uint64_t	done;
+	uint64_t	misses;
+};
+
+static struct mem_range *ranges;
+static int nr_ranges;
+static struct access *accesses;
+static size_t nr_accesses;
+
+static int nthreads = 1;
+static int iters = 1000;
+static pthread_barrier_t start_barrier;
+static volatile int stop_churn;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: acrn-mmio-bench [-j <threads>] [-i <iterations>] [-c] [<trace>]\n"
+		"       acrn-mmio-bench [-j <threads>] [-i <iterations>] [-c] -s <ranges>\n"
+		"  -j  replay the trace from this many threads (default 1)\n"
+		"  -i  replay the trace this many times per thread (default 1000)\n"
+		"  -c  register and unregister a spare range concurrently\n"
+		"  -s  generate a synthetic trace over this many ranges\n");
+	exit(1);
+}
+
+static int
+bench_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
+	      int size, uint64_t *val, void *arg1, long arg2)
+{
+	if (dir == MEM_F_READ)
+		*val = addr - (uint64_t)arg2;
+
+	return 0;
+}
+
+static void
+add_range(uint64_t base, uint64_t size)
+{
+	struct mem_range *mr;
+
+	ranges = realloc(ranges, (nr_ranges + 1) * sizeof(*ranges));
+	if (ranges == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+
+	mr = &ranges[nr_ranges++];
+	memset(mr, 0, sizeof(*mr));
+	mr->name = "bench";
+	mr->flags = MEM_F_RW;
+	mr->handler = bench_handler;
+	mr->arg2 = (long)base;
+	mr->base = base;
+	mr->size = size;
+}
+
+static void
+add_access(uint32_t dir, uint64_t gpa, uint32_t size, uint64_t value)
+{
+	static size_t cap;
+	struct access *a;
+
+	if (nr_accesses == cap) {
+		cap = cap ? cap * 2 : 1024;
+		accesses = realloc(accesses, cap * sizeof(*accesses));
+		if (accesses == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	a = &accesses[nr_accesses++];
+	a->dir = dir;
+	a->gpa = gpa;
+	a->size = size;
+	a->value = value;
+}
+
+static void
+load_trace(const char *path)
+{
+	char line[256], op[16];
+	unsigned long long a, b, v;
+	unsigned int lineno = 0;
+	FILE *f;
+	int n;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		v = 0;
+		n = sscanf(line, "%15s %lli %lli %lli", op, &a, &b, &v);
+		if (n >= 3 && strcmp(op, "range") == 0)
+			add_range(a, b);
+		else if (n == 3 && strcmp(op, "r") == 0)
+			add_access(ACRN_IOREQ_DIR_READ, a, b, 0);
+		else if (n >= 3 && strcmp(op, "w") == 0)
+			add_access(ACRN_IOREQ_DIR_WRITE, a, b, v);
+		else {
+			fprintf(stderr, "%s:%u: bad record\n", path, lineno);
+			exit(1);
+		}
+	}
+
+	fclose(f);
+}
+
+static void
+gen_trace(int n)
+{
+	uint64_t seed = 0x9e3779b97f4a7c15UL;
+	uint64_t base;
+	int i, j, hot;
+
+	for (i = 0; i < n; i++)
+		add_range(SYN_BASE + i * SYN_STRIDE, SYN_SIZE);
+
+	/* three quarters of the bursts go to four hot ranges */
+	for (i = 0; i < 4096 / SYN_BURST; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		hot = (seed & 3) != 0;
+		base = SYN_BASE + ((seed >> 8) % (hot ? 4 : n)) * SYN_STRIDE;
+		for (j = 0; j < SYN_BURST; j++)
+			add_access((j & 1) ? ACRN_IOREQ_DIR_WRITE :
+				   ACRN_IOREQ_DIR_READ, base + j * 4, 4, j);
+	}
+}
+
+static void *
+replay(void *arg)
+{
+	struct worker *w = arg;
+	struct acrn_mmio_request req;
+	size_t i, start;
+	int it;
+
+	/* start each thread at a different point of the trace */
+	start = nr_accesses * w->id / nthreads;
+
+	pthread_barrier_wait(&start_barrier);
+	for (it = 0; it < iters; it++) {
+		for (i = 0; i < nr_accesses; i++) {
+			const struct access *a =
+				&accesses[(start + i) % nr_accesses];
+
+			req.direction = a->dir;
+			req.address = a->gpa;
+			req.size = a->size;
+			req.value = a->value;
+			if (emulate_mem(NULL, &req) != 0)
+				w->misses++;
+		}
+	}
+	w->done = (uint64_t)iters * nr_accesses;
+
+	return NULL;
+}
+
+static void *
+churn(void *arg)
+{
+	struct mem_range mr;
+	uint64_t *count = arg;
+
+	memset(&mr, 0, sizeof(mr));
+	mr.name = "churn";
+	mr.flags = MEM_F_RW;
+	mr.handler = bench_handler;
+	mr.arg2 = (long)CHURN_BASE;
+	mr.base = CHURN_BASE;
+	mr.size = SYN_SIZE;
+
+	pthread_barrier_wait(&start_barrier);
+	while (!stop_churn) {
+		if (register_mem(&mr) == 0 && unregister_mem(&mr) == 0)
+			(*count)++;
+	}
+
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct worker *workers;
+	pthread_t churn_tid;
+	uint64_t total = 0, misses = 0, churns = 0;
+	int synthetic = 0, do_churn = 0;
+	double t0, t1;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "j:i:cs:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		case 'c':
+			do_churn = 1;
+			break;
+		case 's':
+			synthetic = atoi(optarg);
+			if (synthetic <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (nthreads <= 0 || iters <= 0)
+		usage();
+	if (synthetic == 0 && argc != 1)
+		usage();
+	if (synthetic != 0 && argc != 0)
+		usage();
+
+	init_mem();
+	if (synthetic)
+		gen_trace(synthetic);
+	else
+		load_trace(argv[0]);
+	if (nr_accesses == 0) {
+		fprintf(stderr, "no accesses to replay\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_ranges; i++) {
+		if (register_mem(&ranges[i]) != 0) {
+			fprintf(stderr, "range 0x%lx+0x%lx: overlap\n",
+				ranges[i].base, ranges[i].size);
+			return 1;
+		}
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, nthreads + do_churn + 1);
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].tid, NULL, replay, &workers[i]);
+	}
+	if (do_churn)
+		pthread_create(&churn_tid, NULL, churn, &churns);
+
+	pthread_barrier_wait(&start_barrier);
+	t0 = now();
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		total += workers[i].done;
+		misses += workers[i].misses;
+	}
+	t1 = now();
+	if (do_churn) {
+		stop_churn = 1;
+		pthread_join(churn_tid, NULL);
+	}
+
+	printf("%d ranges, %zu accesses x %d iterations x %d threads\n",
+	       nr_ranges, nr_accesses, iters, nthreads);
+	printf("%.3f s, %.1f ns/access per thread, %.2f Maccesses/s total\n",
+	       t1 - t0, (t1 - t0) * 1e9 * nthreads / total,
+	       total / (t1 - t0) / 1e6);
+	if (misses)
+		printf("%lu accesses hit no range\n", misses);
+	if (do_churn)
+		printf("%lu register/unregister cycles\n", churns);
+
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023-2024 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/s2vm.h>
+#include <asm/guest/guest_memory.h>
+#include <acrn_hv_defs.h>
+#include <hypercall.h>
+#include <logmsg.h>
+#include <common/sbuf.h>
+
+/**
+ * @brief save the state of a vCPU of a paused VM for a snapshot
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vcpu_snapshot, vcpu_id is the input
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_snapshot(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu_snapshot snap;
+	int32_t ret = -1;
+
+	if (is_paused_vm(target_vm) && (copy_from_gpa(vm, &snap, param2, sizeof(snap)) == 0)) {
+		if (snap.vcpu_id < target_vm->hw.created_vcpus) {
+			get_vcpu_snapshot(vcpu_from_vid(target_vm, snap.vcpu_id), &snap);
+			ret = copy_to_gpa(vm, &snap, param2, sizeof(snap));
+		}
+	} else {
+		pr_err("%p %s: target_vm is not paused", target_vm, __func__);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief restore the state of a vCPU from a snapshot
+ *
+ * The VM must not be running, i.e. just created or paused.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vcpu_snapshot
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vcpu_snapshot(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu_snapshot snap;
+	int32_t ret = -1;
+
+	if ((is_created_vm(target_vm) || is_paused_vm(target_vm)) &&
+			(copy_from_gpa(vm, &snap, param2, sizeof(snap)) == 0)) {
+		if (snap.vcpu_id < target_vm->hw.created_vcpus) {
+			set_vcpu_snapshot(vcpu_from_vid(target_vm, snap.vcpu_id), &snap);
+			ret = 0;
+		}
+	} else {
+		pr_err("%p %s: target_vm is running or invalid", target_vm, __func__);
+	}
+
+	return ret;
+}
+
+/* bitmap words fetched per copy to the Service VM, covers 16M of guest memory */
+#define DIRTY_LOG_CHUNK_WORDS	64U
+
+/**
+ * @brief start or stop stage-2 dirty page logging for a range of a VM
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_dirty_log log;
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm)) {
+		if (copy_from_gpa(vm, &log, param2, sizeof(log)) == 0) {
+			ret = s2pt_set_dirty_log(target_vm, log.gpa, log.size, log.enable != 0U);
+		}
+	} else {
+		pr_err("%p %s: target_vm is invalid", target_vm, __func__);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief fetch and clear the stage-2 dirty page bitmap for a range of a VM
+ *
+ * The bitmap is written to acrn_dirty_log.bitmap_gpa in the Service VM,
+ * the reported pages are write protected again.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_dirty_log log;
+	uint64_t bitmap[DIRTY_LOG_CHUNK_WORDS];
+	uint64_t gpa, end, bitmap_gpa;
+	uint32_t nr_words;
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm)) {
+		if (copy_from_gpa(vm, &log, param2, sizeof(log)) == 0) {
+			ret = -EINVAL;
+			if (mem_aligned_check(log.size, DIRTY_LOG_GRANULE) && (log.size != 0UL) &&
+					(log.size <= (~0UL - log.gpa))) {
+				gpa = log.gpa;
+				end = log.gpa + log.size;
+				bitmap_gpa = log.bitmap_gpa;
+				ret = 0;
+			}
+
+			while ((ret == 0) && (gpa < end)) {
+				nr_words = (uint32_t)min((end - gpa) / DIRTY_LOG_GRANULE,
+						(uint64_t)DIRTY_LOG_CHUNK_WORDS);
+				ret = s2pt_fetch_dirty_log(target_vm, gpa, bitmap, nr_words);
+				if (ret == 0) {
+					ret = copy_to_gpa(vm, bitmap, bitmap_gpa, nr_words * sizeof(uint64_t));
+				}
+				gpa += (uint64_t)nr_words * DIRTY_LOG_GRANULE;
+				bitmap_gpa += (uint64_t)nr_words * sizeof(uint64_t);
+			}
+		}
+	} else {
+		pr_err("%p %s: target_vm is invalid", target_vm, __func__);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief remove a range of RAM from the stage-2 table of a VM
+ *
+ * Used by the device model to take back memory the guest gave up, e.g.
+ * through a balloon. The Service VM drops its own references to the
+ * backing pages once this returns, any later guest access to the range
+ * faults like an access to unbacked address space.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_mem_release
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_release_memory(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_mem_release rel;
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm)) {
+		if (copy_from_gpa(vm, &rel, param2, sizeof(rel)) == 0) {
+			ret = s2pt_release_mr(target_vm, rel.gpa, rel.size);
+		}
+	} else {
+		pr_err("%p %s: target_vm is invalid", target_vm, __func__);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Setup a share buffer for a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_sbuf_param
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_setup_sbuf(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_sbuf_param asp;
+	uint64_t *hva;
+	int32_t ret = -1;
+
+	if (copy_from_gpa(vm, &asp, param2, sizeof(asp)) == 0) {
+		if (asp.gpa != 0U) {
+			hva = (uint64_t *)gpa2hva(vm, asp.gpa);
+			ret = sbuf_setup_common(target_vm, asp.cpu_id, asp.sbuf_id, hva);
+		}
+	}
+	return ret;
+}
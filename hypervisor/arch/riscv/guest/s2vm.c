@@ -5,6 +5,8 @@
  */
 
 #include <types.h>
+#include <errno.h>
+#include <util.h>
 #include <asm/init.h>
 #include <asm/mem.h>
 #include <asm/tlb.h>
@@ -18,6 +20,10 @@
 
 unsigned int s2vm_inital_level;
 
+/* one bit per 4K guest page, indexed by gpa >> PAGE_SHIFT */
+#define DIRTY_BITMAP_WORDS	(CONFIG_GUEST_ADDRESS_SPACE_SIZE >> (PAGE_SHIFT + 6U))
+static uint64_t vm_dirty_bitmap[CONFIG_MAX_VM_NUM][DIRTY_BITMAP_WORDS];
+
 void *get_s2pt_entry(struct acrn_vm *vm)
 {
 	void *s2ptp = vm->arch_vm.s2ptp;
@@ -132,6 +138,8 @@ int s2pt_init(struct acrn_vm *vm)
 	int rc = 0;
 
 	spinlock_init(&vm->s2pt_lock);
+	vm->arch_vm.dirty_log = false;
+	vm->arch_vm.dirty_bitmap = vm_dirty_bitmap[vm->vm_id];
 
 	s2pt_setup_satp(vm);
 
@@ -169,6 +177,237 @@ void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page,
 
 	s2pt_flush_guest(vm);
 }
+
+/*
+ * Arm (or disarm) dirty tracking on every mapped leaf in [gpa, gpa + size).
+ *
+ * Without hardware A/D updates the leaf loses PAGE_W and is tagged with
+ * S2PT_DIRTY_WP so the store fault can tell it from MMIO. Large leaves are
+ * left intact and only split on their first write fault.
+ *
+ * @pre vm->s2pt_lock is held
+ */
+static void s2pt_dirty_arm(struct acrn_vm *vm, uint64_t gpa, uint64_t size, bool arm)
+{
+	const struct memory_ops *mem_ops = &vm->arch_vm.s2pt_mem_ops;
+	uint64_t addr = gpa;
+	uint64_t end = gpa + size;
+	uint64_t pg_size, pte;
+	uint64_t *entry;
+
+	while (addr < end) {
+		pg_size = PTE_SIZE;
+		entry = (uint64_t *)lookup_address((uint64_t *)get_s2pt_entry(vm), addr, &pg_size, mem_ops);
+		if (entry != NULL) {
+			pte = *entry;
+#ifdef CONFIG_S2PT_HW_AD_UPDATE
+			if (arm) {
+				pte &= ~PAGE_D;
+			}
+#else
+			if (arm && ((pte & PAGE_W) != 0UL)) {
+				pte = (pte & ~PAGE_W) | S2PT_DIRTY_WP;
+			} else if (!arm && ((pte & S2PT_DIRTY_WP) != 0UL)) {
+				pte = (pte & ~S2PT_DIRTY_WP) | PAGE_W;
+			}
+#endif
+			if (pte != *entry) {
+				set_pgentry(entry, pte, mem_ops);
+			}
+		}
+		addr = (addr & ~(pg_size - 1UL)) + pg_size;
+	}
+}
+
+static inline void s2pt_dirty_mark(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	uint64_t pfn = gpa >> PAGE_SHIFT;
+	uint64_t end = (gpa + size) >> PAGE_SHIFT;
+
+	for (; pfn < end; pfn++) {
+		vm->arch_vm.dirty_bitmap[pfn >> 6U] |= 1UL << (pfn & 0x3fUL);
+	}
+}
+
+static inline bool s2pt_dirty_range_valid(uint64_t gpa, uint64_t size)
+{
+	return mem_aligned_check(gpa, DIRTY_LOG_GRANULE) && mem_aligned_check(size, DIRTY_LOG_GRANULE) &&
+		(size != 0UL) && (size <= (~0UL - gpa));
+}
+
+/*
+ * Stage-2 maps nothing at or above CONFIG_GUEST_ADDRESS_SPACE_SIZE, so only
+ * the part of a range below it is tracked; the rest never gets dirty.
+ */
+static inline uint64_t s2pt_dirty_tracked_size(uint64_t gpa, uint64_t size)
+{
+	uint64_t tracked = 0UL;
+
+	if (gpa < CONFIG_GUEST_ADDRESS_SPACE_SIZE) {
+		tracked = min(size, CONFIG_GUEST_ADDRESS_SPACE_SIZE - gpa);
+	}
+
+	return tracked;
+}
+
+/**
+ * @pre gpa and size are DIRTY_LOG_GRANULE aligned
+ */
+int32_t s2pt_set_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t size, bool enable)
+{
+	int32_t ret = -EINVAL;
+	uint64_t i, tracked;
+
+	if (s2pt_dirty_range_valid(gpa, size)) {
+		tracked = s2pt_dirty_tracked_size(gpa, size);
+		spin_lock(&vm->s2pt_lock);
+		if (tracked != 0UL) {
+			s2pt_dirty_arm(vm, gpa, tracked, enable);
+		}
+		for (i = gpa >> (PAGE_SHIFT + 6U); i < ((gpa + tracked) >> (PAGE_SHIFT + 6U)); i++) {
+			vm->arch_vm.dirty_bitmap[i] = 0UL;
+		}
+		/* stays set on disable, other ranges may still be armed */
+		if (enable) {
+			vm->arch_vm.dirty_log = true;
+		}
+		spin_unlock(&vm->s2pt_lock);
+
+		s2pt_flush_guest(vm);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+#ifdef CONFIG_S2PT_HW_AD_UPDATE
+/*
+ * Fold the hardware D bits of [gpa, gpa + size) into the bitmap and clear
+ * them, a dirty large leaf dirties all the pages it maps.
+ *
+ * @pre vm->s2pt_lock is held
+ */
+static void s2pt_dirty_harvest(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	const struct memory_ops *mem_ops = &vm->arch_vm.s2pt_mem_ops;
+	uint64_t addr = gpa;
+	uint64_t pg_size;
+	uint64_t *entry;
+
+	while (addr < (gpa + size)) {
+		pg_size = PTE_SIZE;
+		entry = (uint64_t *)lookup_address((uint64_t *)get_s2pt_entry(vm), addr, &pg_size, mem_ops);
+		if ((entry != NULL) && ((*entry & PAGE_D) != 0UL)) {
+			s2pt_dirty_mark(vm, addr & ~(pg_size - 1UL), pg_size);
+			set_pgentry(entry, *entry & ~PAGE_D, mem_ops);
+		}
+		addr = (addr & ~(pg_size - 1UL)) + pg_size;
+	}
+}
+#else
+/*
+ * Write protect again the 64 pages from gpa that @word reports dirty.
+ *
+ * @pre vm->s2pt_lock is held
+ */
+static void s2pt_dirty_rearm(struct acrn_vm *vm, uint64_t gpa, uint64_t word)
+{
+	uint64_t bit;
+
+	for (bit = 0UL; bit < 64UL; bit++) {
+		if ((word & (1UL << bit)) != 0UL) {
+			s2pt_dirty_arm(vm, gpa + (bit << PAGE_SHIFT), PAGE_SIZE, true);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Fetch and clear the dirty bits of [gpa, gpa + nr_words * 64 pages)
+ *
+ * Pages reported dirty are write protected again, so the next store
+ * reports them once more.
+ *
+ * @pre gpa is DIRTY_LOG_GRANULE aligned
+ */
+int32_t s2pt_fetch_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t *bitmap, uint32_t nr_words)
+{
+	uint64_t size = (uint64_t)nr_words * DIRTY_LOG_GRANULE;
+	uint64_t idx = gpa >> (PAGE_SHIFT + 6U);
+	uint32_t i, tracked_words;
+	int32_t ret = -EINVAL;
+
+	if (s2pt_dirty_range_valid(gpa, size)) {
+		tracked_words = (uint32_t)(s2pt_dirty_tracked_size(gpa, size) / DIRTY_LOG_GRANULE);
+		for (i = tracked_words; i < nr_words; i++) {
+			bitmap[i] = 0UL;
+		}
+
+		spin_lock(&vm->s2pt_lock);
+#ifdef CONFIG_S2PT_HW_AD_UPDATE
+		if (tracked_words != 0U) {
+			s2pt_dirty_harvest(vm, gpa, (uint64_t)tracked_words * DIRTY_LOG_GRANULE);
+		}
+#endif
+		for (i = 0U; i < tracked_words; i++) {
+			bitmap[i] = vm->arch_vm.dirty_bitmap[idx + i];
+			vm->arch_vm.dirty_bitmap[idx + i] = 0UL;
+#ifndef CONFIG_S2PT_HW_AD_UPDATE
+			if (bitmap[i] != 0UL) {
+				s2pt_dirty_rearm(vm, gpa + ((uint64_t)i * DIRTY_LOG_GRANULE), bitmap[i]);
+			}
+#endif
+		}
+		spin_unlock(&vm->s2pt_lock);
+
+		s2pt_flush_guest(vm);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Handle a stage-2 store fault on a dirty tracked page
+ *
+ * The faulting page gets write access back (a large leaf is split first so
+ * only this 4K page is unprotected) and is recorded in the dirty bitmap.
+ *
+ * @return true if the fault was a dirty logging fault and the guest can
+ *	   simply retry the store, false if it should be emulated as MMIO.
+ */
+bool s2pt_dirty_log_fault(struct acrn_vm *vm, uint64_t gpa)
+{
+	const struct memory_ops *mem_ops = &vm->arch_vm.s2pt_mem_ops;
+	uint64_t *s2ptp = (uint64_t *)get_s2pt_entry(vm);
+	const uint64_t *entry;
+	uint64_t pg_size = 0UL;
+	bool handled = false;
+
+	if (vm->arch_vm.dirty_log && (gpa < CONFIG_GUEST_ADDRESS_SPACE_SIZE)) {
+		spin_lock(&vm->s2pt_lock);
+		entry = lookup_address(s2ptp, gpa, &pg_size, mem_ops);
+		if (entry != NULL) {
+			if ((*entry & S2PT_DIRTY_WP) != 0UL) {
+				mmu_modify_or_del(s2ptp, round_page_down(gpa), PAGE_SIZE,
+						PAGE_W, S2PT_DIRTY_WP, mem_ops, MR_MODIFY);
+				s2pt_dirty_mark(vm, round_page_down(gpa), PAGE_SIZE);
+				handled = true;
+			} else if ((*entry & PAGE_W) != 0UL) {
+				/* another vCPU unprotected it first */
+				handled = true;
+			}
+		}
+		spin_unlock(&vm->s2pt_lock);
+
+		if (handled) {
+			s2pt_flush_guest(vm);
+		}
+	}
+
+	return handled;
+}
+
 /**
  * @pre [gpa,gpa+size) has been mapped into host physical memory region
  */
@@ -185,6 +424,23 @@ void s2pt_del_mr(struct acrn_vm *vm, uint64_t *vpn3_page, uint64_t gpa, uint64_t
 	s2pt_flush_guest(vm);
 }
 
+/*
+ * Unmap guest RAM the Service VM takes back, e.g. ballooned pages. Holes in
+ * the range are skipped, large leaves straddling its ends are split.
+ */
+int32_t s2pt_release_mr(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	int32_t ret = -EINVAL;
+
+	if (mem_aligned_check(gpa, PAGE_SIZE) && mem_aligned_check(size, PAGE_SIZE) && (size != 0UL) &&
+		(gpa < CONFIG_GUEST_ADDRESS_SPACE_SIZE) && (size <= (CONFIG_GUEST_ADDRESS_SPACE_SIZE - gpa))) {
+		s2pt_del_mr(vm, vm->arch_vm.s2ptp, gpa, size);
+		ret = 0;
+	}
+
+	return ret;
+}
+
 /**
  * @pre vm != NULL && cb != NULL.
  */
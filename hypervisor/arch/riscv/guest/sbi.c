@@ -4,19 +4,550 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
-#include <asm/sbi.h>
+#include <types.h>
+#include <errno.h>
+#include <version.h>
+#include <schedule.h>
+#include <console.h>
+#include <asm/tlb.h>
+#include <asm/lib/spinlock.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/virq.h>
+#include <asm/guest/vclint.h>
+#include <asm/guest/vmexit.h>
+#include <asm/guest/guest_memory.h>
+#include <asm/guest/sbi.h>
+#include <logmsg.h>
 
-void sbi_set_timer(uint64_t deadline, uint32_t cpu)
+#define SSTATUS_SIE		(1UL << 1U)
+#define SBI_HART_MASK_ALL	(~0UL)
+#define SBI_DBCN_CHUNK		64U
+
+#define SBI_RFENCE_FENCE_I	(1U << 0U)
+#define SBI_RFENCE_VMA		(1U << 1U)
+
+struct sbi_ret {
+	int64_t error;
+	uint64_t value;
+};
+
+/*
+ * Returns false when the caller must not write a0/a1 back, i.e. the
+ * vCPU stopped and may already have been restarted with new ones.
+ */
+typedef bool (*sbi_ext_handler_t)(struct acrn_vcpu *vcpu, uint64_t fid,
+		struct sbi_ret *ret);
+
+struct sbi_ext {
+	uint64_t eid;
+	uint32_t stat;
+	sbi_ext_handler_t handler;
+};
+
+/* serializes HSM state changes, get_vm_lock() is a no-op on riscv */
+static spinlock_t sbi_hsm_lock = { .head = 0U, .tail = 0U, };
+
+/* guards the rfence_* fields of all vCPUs */
+static spinlock_t sbi_rfence_lock = { .head = 0U, .tail = 0U, };
+
+static const char *const sbi_stat_names[SBI_STAT_NUM] = {
+	[SBI_STAT_BASE]		= "base",
+	[SBI_STAT_TIME]		= "time",
+	[SBI_STAT_IPI]		= "ipi",
+	[SBI_STAT_RFENCE]	= "rfence",
+	[SBI_STAT_HSM]		= "hsm",
+	[SBI_STAT_SRST]		= "srst",
+	[SBI_STAT_DBCN]		= "dbcn",
+	[SBI_STAT_ACRN]		= "acrn",
+	[SBI_STAT_LEGACY]	= "legacy",
+	[SBI_STAT_UNKNOWN]	= "unknown",
+};
+
+const char *sbi_stat_name(uint32_t stat)
+{
+	return (stat < SBI_STAT_NUM) ? sbi_stat_names[stat] : "";
+}
+
+static inline uint64_t sbi_arg(const struct acrn_vcpu *vcpu, uint32_t n)
+{
+	return vcpu_get_gpreg(vcpu, CPU_REG_A0 + n);
+}
+
+/*
+ * Turn an SBI (hart_mask, hart_mask_base) pair into a vCPU bitmap.
+ * Hart ids are vCPU ids.
+ */
+static int64_t sbi_hart_mask(const struct acrn_vm *vm, uint64_t mask,
+		uint64_t base, uint64_t *vdmask)
+{
+	uint16_t nr = vm->hw.created_vcpus;
+	uint16_t i;
+
+	*vdmask = 0UL;
+	if (base == SBI_HART_MASK_ALL) {
+		*vdmask = (nr >= 64U) ? ~0UL : ((1UL << nr) - 1UL);
+		return SBI_SUCCESS;
+	}
+
+	for (i = 0U; i < 64U; i++) {
+		if ((mask & (1UL << i)) == 0UL) {
+			continue;
+		}
+		/* written so that a huge base cannot wrap around */
+		if ((base >= nr) || (i >= (nr - base))) {
+			return SBI_ERR_INVALID_PARAM;
+		}
+		*vdmask |= 1UL << (base + i);
+	}
+
+	return SBI_SUCCESS;
+}
+
+static bool sbi_probe(uint64_t eid);
+
+static bool sbi_base(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	switch (fid) {
+	case SBI_BASE_GET_SPEC_VERSION:
+		ret->value = SBI_SPEC_VERSION;
+		break;
+	case SBI_BASE_GET_IMPL_ID:
+		ret->value = SBI_IMPL_ID_ACRN;
+		break;
+	case SBI_BASE_GET_IMPL_VERSION:
+		ret->value = (HV_API_MAJOR_VERSION << 16U) | HV_API_MINOR_VERSION;
+		break;
+	case SBI_BASE_PROBE_EXT:
+		ret->value = sbi_probe(sbi_arg(vcpu, 0U)) ? 1UL : 0UL;
+		break;
+	case SBI_BASE_GET_MVENDORID:
+	case SBI_BASE_GET_MARCHID:
+	case SBI_BASE_GET_MIMPID:
+		/* 0 is a legal "not implemented" for all three */
+		ret->value = 0UL;
+		break;
+	default:
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+		break;
+	}
+
+	return true;
+}
+
+static bool sbi_time(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
 {
-	writeq_relaxed(deadline, CLINT_MTIMECMP(cpu));
+	if (fid == SBI_TIME_SET_TIMER) {
+		vclint_set_timer(vcpu, sbi_arg(vcpu, 0U));
+	} else {
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+	}
+
+	return true;
+}
+
+static bool sbi_ipi(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	struct acrn_vcpu *target;
+	uint64_t vdmask;
+	uint16_t i;
+
+	if (fid != SBI_IPI_SEND_IPI) {
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+	} else {
+		ret->error = sbi_hart_mask(vcpu->vm, sbi_arg(vcpu, 0U), sbi_arg(vcpu, 1U), &vdmask);
+		if (ret->error == SBI_SUCCESS) {
+			foreach_vcpu(i, vcpu->vm, target) {
+				if ((vdmask & (1UL << i)) != 0UL) {
+					vclint_send_ipi(target);
+				}
+			}
+		}
+	}
+
+	return true;
 }
 
-uint64_t sbi_get_time()
+static void sbi_rfence_local(uint32_t kinds)
 {
-	return readq_relaxed(CLINT_MTIME);
+	if ((kinds & SBI_RFENCE_FENCE_I) != 0U) {
+		isb();
+	}
+	if ((kinds & SBI_RFENCE_VMA) != 0U) {
+		flush_vs_tlb_local();
+	}
 }
 
-uint64_t sbi_send_ipi()
+/*
+ * Run the fences queued for this vCPU and ack their callers.  Called
+ * for ACRN_REQUEST_RFENCE before guest entry, when the vCPU stops, and
+ * while it waits in sbi_rfence() itself, so two vCPUs fencing each
+ * other do not wait forever.  Returns the acks this vCPU still waits for.
+ */
+uint32_t sbi_rfence_handle(struct acrn_vcpu *vcpu)
 {
-	return readq_relaxed(CLINT_MTIME);
+	struct acrn_vcpu *caller;
+	uint64_t waiters;
+	uint32_t kinds, acks;
+	uint16_t i;
+
+	spinlock_obtain(&sbi_rfence_lock);
+	kinds = vcpu->arch.rfence_kinds;
+	waiters = vcpu->arch.rfence_waiters;
+	vcpu->arch.rfence_kinds = 0U;
+	vcpu->arch.rfence_waiters = 0UL;
+	spinlock_release(&sbi_rfence_lock);
+
+	sbi_rfence_local(kinds);
+
+	spinlock_obtain(&sbi_rfence_lock);
+	foreach_vcpu(i, vcpu->vm, caller) {
+		if ((waiters & (1UL << i)) != 0UL) {
+			caller->arch.rfence_acks--;
+			if (caller->arch.rfence_acks == 0U) {
+				signal_event(&caller->events[VCPU_EVENT_RFENCE]);
+			}
+		}
+	}
+	acks = vcpu->arch.rfence_acks;
+	spinlock_release(&sbi_rfence_lock);
+
+	return acks;
+}
+
+/*
+ * Remote harts flush before their next guest entry; the request kicks
+ * them out of the guest, and the call returns once every running
+ * target acked.  Stopped harts are skipped.  The guest has no H
+ * extension, so the hfence functions are not offered.
+ */
+static bool sbi_rfence(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	struct acrn_vcpu *target;
+	uint64_t vdmask, tmask = 0UL;
+	uint32_t kind;
+	uint16_t i;
+
+	if (fid == SBI_RFENCE_REMOTE_FENCE_I) {
+		kind = SBI_RFENCE_FENCE_I;
+	} else if ((fid == SBI_RFENCE_REMOTE_SFENCE_VMA) ||
+		   (fid == SBI_RFENCE_REMOTE_SFENCE_VMA_ASID)) {
+		/* the whole VS-stage is flushed, whatever the range and ASID */
+		kind = SBI_RFENCE_VMA;
+	} else {
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+		return true;
+	}
+
+	ret->error = sbi_hart_mask(vcpu->vm, sbi_arg(vcpu, 0U), sbi_arg(vcpu, 1U), &vdmask);
+	if (ret->error != SBI_SUCCESS) {
+		return true;
+	}
+
+	reset_event(&vcpu->events[VCPU_EVENT_RFENCE]);
+	spinlock_obtain(&sbi_rfence_lock);
+	foreach_vcpu(i, vcpu->vm, target) {
+		if (((vdmask & (1UL << i)) != 0UL) && (target != vcpu) &&
+		    (target->state == VCPU_RUNNING)) {
+			target->arch.rfence_kinds |= kind;
+			target->arch.rfence_waiters |= 1UL << vcpu->vcpu_id;
+			vcpu->arch.rfence_acks++;
+			tmask |= 1UL << i;
+		}
+	}
+	spinlock_release(&sbi_rfence_lock);
+
+	foreach_vcpu(i, vcpu->vm, target) {
+		if ((tmask & (1UL << i)) != 0UL) {
+			vcpu_make_request(target, ACRN_REQUEST_RFENCE);
+			/* in case it waits in a suspend or an rfence of its own */
+			signal_event(&target->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+			signal_event(&target->events[VCPU_EVENT_RFENCE]);
+		}
+	}
+
+	if ((vdmask & (1UL << vcpu->vcpu_id)) != 0UL) {
+		sbi_rfence_local(kind);
+	}
+
+	while (sbi_rfence_handle(vcpu) != 0U) {
+		wait_event(&vcpu->events[VCPU_EVENT_RFENCE]);
+	}
+
+	return true;
+}
+
+static int64_t sbi_hart_start(struct acrn_vcpu *vcpu, uint64_t hartid,
+		uint64_t start_addr, uint64_t opaque)
+{
+	struct run_context *ctx;
+	struct acrn_vcpu *target;
+	int64_t err = SBI_SUCCESS;
+
+	if (hartid >= vcpu->vm->hw.created_vcpus) {
+		return SBI_ERR_INVALID_PARAM;
+	}
+
+	target = vcpu_from_vid(vcpu->vm, (uint16_t)hartid);
+	spinlock_obtain(&sbi_hsm_lock);
+	if (target->state != VCPU_INIT) {
+		err = SBI_ERR_ALREADY_AVAILABLE;
+	} else {
+		/* a1 = opaque, satp = 0 and SIE clear, as the spec asks */
+		ctx = &target->arch.contexts[target->arch.cur_context].run_ctx;
+		ctx->satp = 0UL;
+		ctx->sstatus &= ~SSTATUS_SIE;
+		vcpu_set_rip(target, start_addr);
+		vcpu_set_gpreg(target, CPU_REG_A0, hartid);
+		vcpu_set_gpreg(target, CPU_REG_A1, opaque);
+		vcpu_set_state(target, VCPU_RUNNING);
+		wake_thread(&target->thread_obj);
+	}
+	spinlock_release(&sbi_hsm_lock);
+
+	return err;
+}
+
+/*
+ * Park the calling vCPU in VCPU_INIT until a hart_start.  The vCPU
+ * timer is stopped, the sleep takes effect at the next reschedule
+ * point on the way back to the guest.
+ */
+static void sbi_hart_stop(struct acrn_vcpu *vcpu)
+{
+	vclint_set_timer(vcpu, 0UL);
+	vclint_clear_ipi(vcpu);
+
+	spinlock_obtain(&sbi_hsm_lock);
+	vcpu_set_state(vcpu, VCPU_INIT);
+	sleep_thread(&vcpu->thread_obj);
+	spinlock_release(&sbi_hsm_lock);
+
+	/* fences queued before the state change above are still acked */
+	(void)sbi_rfence_handle(vcpu);
+}
+
+static bool sbi_hsm(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	struct acrn_vcpu *target;
+	uint64_t hartid;
+	bool reply = true;
+
+	switch (fid) {
+	case SBI_HSM_HART_START:
+		ret->error = sbi_hart_start(vcpu, sbi_arg(vcpu, 0U),
+				sbi_arg(vcpu, 1U), sbi_arg(vcpu, 2U));
+		break;
+	case SBI_HSM_HART_STOP:
+		sbi_hart_stop(vcpu);
+		reply = false;
+		break;
+	case SBI_HSM_HART_GET_STATUS:
+		hartid = sbi_arg(vcpu, 0U);
+		if (hartid >= vcpu->vm->hw.created_vcpus) {
+			ret->error = SBI_ERR_INVALID_PARAM;
+		} else {
+			target = vcpu_from_vid(vcpu->vm, (uint16_t)hartid);
+			ret->value = (target->state == VCPU_RUNNING) ?
+				SBI_HSM_STATE_STARTED : SBI_HSM_STATE_STOPPED;
+		}
+		break;
+	case SBI_HSM_HART_SUSPEND:
+		/* default retentive suspend is a wfi that returns success */
+		if (sbi_arg(vcpu, 0U) != SBI_HSM_SUSPEND_RET_DEFAULT) {
+			ret->error = SBI_ERR_NOT_SUPPORTED;
+		} else if ((vcpu->arch.pending_req == 0UL) && (!vclint_has_pending_intr(vcpu))) {
+			wait_event(&vcpu->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+		}
+		break;
+	default:
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+		break;
+	}
+
+	return reply;
+}
+
+/*
+ * There is no device model path for guest initiated power state changes
+ * on riscv yet; every vCPU is stopped the way a fatal guest fault stops
+ * it, and the owner of the VM tears it down or resets it.
+ */
+static void sbi_system_reset(struct acrn_vcpu *vcpu, uint64_t type)
+{
+	struct acrn_vcpu *target;
+	uint16_t i;
+
+	pr_info("VM%hu: SBI %s requested", vcpu->vm->vm_id,
+		(type == SBI_SRST_TYPE_SHUTDOWN) ? "shutdown" : "reboot");
+
+	foreach_vcpu(i, vcpu->vm, target) {
+		vcpu_make_request(target, ACRN_REQUEST_TRP_FAULT);
+	}
+}
+
+static bool sbi_srst(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	uint64_t type = sbi_arg(vcpu, 0U);
+
+	if (fid != SBI_SRST_SYSTEM_RESET) {
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+	} else if (type > SBI_SRST_TYPE_WARM_REBOOT) {
+		ret->error = ((uint32_t)type >= 0xF0000000U) ?
+			SBI_ERR_NOT_SUPPORTED : SBI_ERR_INVALID_PARAM;
+	} else {
+		sbi_system_reset(vcpu, type);
+	}
+
+	return true;
+}
+
+/*
+ * Guest debug console output goes to the hypervisor console.  The riscv
+ * build has no vUART to take input from, so reads return no data.
+ */
+static bool sbi_dbcn(struct acrn_vcpu *vcpu, uint64_t fid, struct sbi_ret *ret)
+{
+	char buf[SBI_DBCN_CHUNK];
+	uint64_t len = sbi_arg(vcpu, 0U);
+	uint64_t gpa = sbi_arg(vcpu, 1U);
+	uint32_t n;
+
+	switch (fid) {
+	case SBI_DBCN_CONSOLE_WRITE:
+		if (sbi_arg(vcpu, 2U) != 0UL) {
+			ret->error = SBI_ERR_INVALID_PARAM;
+			break;
+		}
+		while (len > 0UL) {
+			n = (len > SBI_DBCN_CHUNK) ? SBI_DBCN_CHUNK : (uint32_t)len;
+			if (copy_from_gpa(vcpu->vm, buf, gpa, n) != 0) {
+				ret->error = (ret->value == 0UL) ? SBI_ERR_INVALID_PARAM : SBI_SUCCESS;
+				break;
+			}
+			(void)console_write(buf, n);
+			ret->value += n;
+			gpa += n;
+			len -= n;
+		}
+		break;
+	case SBI_DBCN_CONSOLE_READ:
+		ret->value = 0UL;
+		break;
+	case SBI_DBCN_CONSOLE_WRITE_BYTE:
+		buf[0] = (char)len;
+		console_putc(buf);
+		break;
+	default:
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+		break;
+	}
+
+	return true;
+}
+
+/* v0.1 calls, kept for early consoles and timers; results go in a0 only */
+static bool sbi_legacy(struct acrn_vcpu *vcpu, uint64_t eid, struct sbi_ret *ret)
+{
+	char ch;
+
+	switch (eid) {
+	case SBI_EXT_LEGACY_SET_TIMER:
+		vclint_set_timer(vcpu, sbi_arg(vcpu, 0U));
+		break;
+	case SBI_EXT_LEGACY_PUTCHAR:
+		ch = (char)sbi_arg(vcpu, 0U);
+		console_putc(&ch);
+		break;
+	case SBI_EXT_LEGACY_GETCHAR:
+		ret->error = -1L;
+		break;
+	case SBI_EXT_LEGACY_CLEAR_IPI:
+		vclint_clear_ipi(vcpu);
+		break;
+	case SBI_EXT_LEGACY_SHUTDOWN:
+		sbi_system_reset(vcpu, SBI_SRST_TYPE_SHUTDOWN);
+		break;
+	default:
+		ret->error = SBI_ERR_NOT_SUPPORTED;
+		break;
+	}
+
+	return true;
+}
+
+static const struct sbi_ext sbi_exts[] = {
+	{ SBI_EXT_BASE,		SBI_STAT_BASE,		sbi_base },
+	{ SBI_EXT_TIME,		SBI_STAT_TIME,		sbi_time },
+	{ SBI_EXT_IPI,		SBI_STAT_IPI,		sbi_ipi },
+	{ SBI_EXT_RFENCE,	SBI_STAT_RFENCE,	sbi_rfence },
+	{ SBI_EXT_HSM,		SBI_STAT_HSM,		sbi_hsm },
+	{ SBI_EXT_SRST,		SBI_STAT_SRST,		sbi_srst },
+	{ SBI_EXT_DBCN,		SBI_STAT_DBCN,		sbi_dbcn },
+};
+
+static const struct sbi_ext *sbi_find_ext(uint64_t eid)
+{
+	const struct sbi_ext *ext = NULL;
+	uint32_t i;
+
+	for (i = 0U; i < ARRAY_SIZE(sbi_exts); i++) {
+		if (sbi_exts[i].eid == eid) {
+			ext = &sbi_exts[i];
+			break;
+		}
+	}
+
+	return ext;
+}
+
+static bool sbi_probe(uint64_t eid)
+{
+	return (eid == SBI_EXT_ACRN) || (sbi_find_ext(eid) != NULL);
+}
+
+/*
+ * VS-mode ecall: dispatch on a7 (EID) / a6 (FID) and complete the call
+ * in this exit.
+ */
+int32_t sbi_ecall_vmexit_handler(struct acrn_vcpu *vcpu)
+{
+	const struct sbi_ext *ext;
+	struct sbi_ret ret = { SBI_SUCCESS, 0UL };
+	uint64_t eid = vcpu_get_gpreg(vcpu, CPU_REG_A7);
+	uint64_t fid = vcpu_get_gpreg(vcpu, CPU_REG_A6);
+	bool reply;
+
+	/* step over the ecall, hart_start may still move the pc */
+	vcpu_set_gpreg(vcpu, CPU_REG_IP, vcpu_get_gpreg(vcpu, CPU_REG_IP) + 4UL);
+
+	if (eid == SBI_EXT_ACRN) {
+		vcpu->arch.sbi_calls[SBI_STAT_ACRN]++;
+		return vmcall_vmexit_handler(vcpu);
+	}
+
+	if (eid <= SBI_EXT_LEGACY_SHUTDOWN) {
+		vcpu->arch.sbi_calls[SBI_STAT_LEGACY]++;
+		(void)sbi_legacy(vcpu, eid, &ret);
+		vcpu_set_gpreg(vcpu, CPU_REG_A0, (uint64_t)ret.error);
+		return 0;
+	}
+
+	ext = sbi_find_ext(eid);
+	if (ext == NULL) {
+		vcpu->arch.sbi_calls[SBI_STAT_UNKNOWN]++;
+		pr_dbg("unsupported SBI call eid 0x%lx fid 0x%lx", eid, fid);
+		ret.error = SBI_ERR_NOT_SUPPORTED;
+		reply = true;
+	} else {
+		vcpu->arch.sbi_calls[ext->stat]++;
+		reply = ext->handler(vcpu, fid, &ret);
+	}
+
+	if (reply) {
+		vcpu_set_gpreg(vcpu, CPU_REG_A0, (uint64_t)ret.error);
+		vcpu_set_gpreg(vcpu, CPU_REG_A1, ret.value);
+	}
+
+	return 0;
 }
@@ -111,10 +111,18 @@ static void vclint_reset_timer(struct acrn_vclint *vclint)
 	}
 }
 
+/* guest time to host time, 0 is kept free for "no deadline" */
+static inline uint64_t vclint_host_deadline(const struct acrn_vclint *vclint, uint64_t val)
+{
+	uint64_t deadline = val - vclint->time_offset;
+
+	return (deadline != 0UL) ? deadline : 1UL;
+}
+
 static void vclint_write_tmr(struct acrn_vclint *vclint, uint32_t index, uint64_t data)
 {
 	del_timer(&vclint->vtimer[index].timer);
-	vclint->vtimer[index].timer.timeout = data;
+	vclint->vtimer[index].timer.timeout = vclint_host_deadline(vclint, data);
 	(void)add_timer(&vclint->vtimer[index].timer);
 }
 
@@ -136,7 +144,7 @@ void vclint_set_tsc_deadline_csr(struct acrn_vclint *vclint, uint32_t index, uin
 
 	if (val != 0UL) {
 		/* transfer guest tsc to host tsc */
-		timer->timeout = val;
+		timer->timeout = vclint_host_deadline(vclint, val);
 		/* vclint_init_timer has been called,
 		 * and timer->timeout is not 0,here
 		 * add_timer should not return error
@@ -290,6 +298,33 @@ void vclint_set_intr(struct acrn_vcpu *vcpu)
 	vcpu_make_request(vcpu, ACRN_REQUEST_EVENT);
 }
 
+/*
+ * SBI TIME and sPI requests update the same state a guest would reach
+ * through the vCLINT MMIO page, without the instruction decode.
+ */
+void vclint_set_timer(struct acrn_vcpu *vcpu, uint64_t deadline)
+{
+	struct acrn_vclint *vclint = vcpu_vclint(vcpu);
+
+	/* a new deadline retires the pending tick, like an mtimecmp write */
+	clear_bit(vcpu->vcpu_id, &vclint->mtip);
+	vcpu->arch.hvip &= ~CLINT_HVIP_VSTIP;
+	vclint->clint_page.mtimer[vcpu->vcpu_id] = deadline;
+	vclint_set_tsc_deadline_csr(vclint, vcpu->vcpu_id, deadline);
+}
+
+void vclint_send_ipi(struct acrn_vcpu *vcpu)
+{
+	vclint_write_msip(vcpu_vclint(vcpu), vcpu->vcpu_id, 1U);
+}
+
+/* also retires an IPI already handed to the guest, see vcpu_inject_intr() */
+void vclint_clear_ipi(struct acrn_vcpu *vcpu)
+{
+	vcpu_vclint(vcpu)->clint_page.msip[vcpu->vcpu_id] = 0U;
+	vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx.sip &= ~CLINT_VECTOR_SSI;
+}
+
 /* interrupt context */
 static void vclint_timer_expired(void *data)
 {
@@ -332,30 +367,28 @@ vclint_get_clint_page_addr(struct acrn_vclint *vclint)
 	return hva2hpa(&(vclint->clint_page));
 }
 
-bool vclint_find_deliverable_intr(const struct acrn_vcpu *vcpu, uint32_t *vector)
+/*
+ * Both are level interrupts the hart masks with the guest's own SIE and
+ * sie, so they are posted whatever the guest state. A pending msip moves
+ * to the guest's sip.SSIP (hvip.VSSIP), which the guest clears itself.
+ * VSTIP follows the timer until a new deadline is set. load_guest_state()
+ * writes both into the CSRs on the next entry.
+ */
+void vcpu_inject_intr(struct acrn_vcpu *vcpu, __unused bool guest_irq_enabled,
+		__unused bool injected)
 {
 	struct acrn_vclint *vclint = vcpu_vclint(vcpu);
-	bool ret = false;
-
-	if (vclint->clint_page.msip[vcpu->vcpu_id] & 0x1) {
-		*vector = CLINT_VECTOR_SSI;
-		ret = true;
-	} else if (test_bit(vcpu->vcpu_id, vclint->mtip)) {
-		*vector = CLINT_VECTOR_STI;
-		ret = true;
-	}
+	struct run_context *ctx = &vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx;
 
-	return false;
-}
-
-void vcpu_inject_intr(struct acrn_vcpu *vcpu, bool guest_irq_enabled, bool injected)
-{
-	uint32_t vector = 0U;
+	if ((vclint->clint_page.msip[vcpu->vcpu_id] & 0x1U) != 0U) {
+		vclint->clint_page.msip[vcpu->vcpu_id] = 0U;
+		ctx->sip |= CLINT_VECTOR_SSI;
+	}
 
-	if (guest_irq_enabled && (!injected)) {
-		if (vclint_find_deliverable_intr(vcpu, &vector)) {
-			cpu_csr_write(hvip, vector);
-		}
+	if (test_bit(vcpu->vcpu_id, vclint->mtip)) {
+		vcpu->arch.hvip |= CLINT_HVIP_VSTIP;
+	} else {
+		vcpu->arch.hvip &= ~CLINT_HVIP_VSTIP;
 	}
 }
 
@@ -452,6 +485,7 @@ void vclint_init(struct acrn_vm *vm)
 	vclint->clint_base = DEFAULT_CLINT_BASE;
 	vclint->ops = &acrn_vclint_ops;
 	vclint->clint_page.mtime = (uint64_t)get_tick();
+	vclint->time_offset = 0UL;
 	for (int i = 0; i < 5; i++)
 		vclint_init_timer(vclint, i);
 }
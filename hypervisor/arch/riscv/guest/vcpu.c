@@ -21,6 +21,7 @@
 #include <sprintf.h>
 #include <asm/irq.h>
 #include <asm/current.h>
+#include <asm/timer.h>
 
 /* stack_frame is linked with the sequence of stack operation in arch_switch_to() */
 struct stack_frame {
@@ -206,6 +207,7 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 
 	vcpu->launched = false;
 	vcpu->arch.nr_sipi = 0U;
+	vcpu->arch.restored = false;
 
 	vcpu->arch.exception_info.exception = VECTOR_INVALID;
 	vcpu->arch.cur_context = NORMAL_WORLD;
@@ -262,6 +264,70 @@ void set_vcpu_regs(struct acrn_vcpu *vcpu, struct cpu_regs *vcpu_gp_regs)
 	}
 }
 
+/**
+ * @pre vcpu is not running, so run_ctx holds its VS CSRs
+ */
+void get_vcpu_snapshot(struct acrn_vcpu *vcpu, struct acrn_vcpu_snapshot *snap)
+{
+	struct run_context *ctx = &(vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx);
+	struct acrn_vclint *vclint = vcpu_vclint(vcpu);
+
+	(void)memcpy_s((void *)snap->gprs, sizeof(snap->gprs),
+			(void *)&(ctx->cpu_gp_regs.regs), sizeof(snap->gprs));
+	snap->status = ctx->cpu_gp_regs.regs.status;
+	snap->hstatus = ctx->cpu_gp_regs.regs.hstatus;
+
+	snap->vsstatus = ctx->sstatus;
+	snap->vsepc = ctx->sepc;
+	snap->vsip = ctx->sip;
+	snap->vsie = ctx->sie;
+	snap->vstvec = ctx->stvec;
+	snap->vsscratch = ctx->sscratch;
+	snap->vstval = ctx->stval;
+	snap->vscause = ctx->scause;
+	snap->vsatp = ctx->satp;
+
+	snap->mtimecmp = vclint->clint_page.mtimer[vcpu->vcpu_id];
+	snap->msip = vclint->clint_page.msip[vcpu->vcpu_id];
+	snap->hart_started = vcpu->arch.started ? 1U : 0U;
+	snap->guest_time = get_tick() + vclint->time_offset;
+}
+
+/**
+ * @pre vcpu is not running, the VS CSRs are loaded from run_ctx when
+ * it is switched in
+ */
+void set_vcpu_snapshot(struct acrn_vcpu *vcpu, const struct acrn_vcpu_snapshot *snap)
+{
+	struct run_context *ctx = &(vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx);
+	struct acrn_vclint *vclint = vcpu_vclint(vcpu);
+
+	(void)memcpy_s((void *)&(ctx->cpu_gp_regs.regs), sizeof(snap->gprs),
+			(const void *)snap->gprs, sizeof(snap->gprs));
+	ctx->cpu_gp_regs.regs.status = snap->status;
+	ctx->cpu_gp_regs.regs.hstatus = snap->hstatus;
+
+	ctx->sstatus = snap->vsstatus;
+	ctx->sepc = snap->vsepc;
+	ctx->sip = snap->vsip;
+	ctx->sie = snap->vsie;
+	ctx->stvec = snap->vstvec;
+	ctx->sscratch = snap->vsscratch;
+	ctx->stval = snap->vstval;
+	ctx->scause = snap->vscause;
+	ctx->satp = snap->vsatp;
+	vcpu->arch.started = (snap->hart_started != 0U);
+	vcpu->arch.restored = true;
+
+	/* the deadlines below are converted with the restored clock */
+	if (is_vcpu_bsp(vcpu) && (snap->guest_time != 0UL)) {
+		vclint->time_offset = snap->guest_time - get_tick();
+	}
+	vclint->clint_page.msip[vcpu->vcpu_id] = snap->msip & 0x1U;
+	vclint->clint_page.mtimer[vcpu->vcpu_id] = snap->mtimecmp;
+	vclint_set_tsc_deadline_csr(vclint, vcpu->vcpu_id, snap->mtimecmp);
+}
+
 void init_vcpu_protect_mode_regs(struct acrn_vcpu *vcpu, uint64_t vgdt_base_gpa)
 {
 }
@@ -491,16 +557,16 @@ static void context_switch_in(struct thread_object *next)
 }
 
 /**
+ * The registers are left alone, a first entry sets a0 to the hart id
+ * in init_guest_state() and a resumed vCPU keeps its context.
+ *
  * @pre vcpu != NULL
- * @pre vcpu->state == VCPU_INIT
+ * @pre vcpu->state == VCPU_INIT || vcpu->state == VCPU_ZOMBIE
  */
 void launch_vcpu(struct acrn_vcpu *vcpu)
 {
-	uint16_t pcpu_id = vcpu->pcpu_id;
-
-	pr_info("vcpu%hu scheduled on pcpu%hu", vcpu->vcpu_id, pcpu_id);
+	pr_info("vcpu%hu scheduled on pcpu%hu", vcpu->vcpu_id, vcpu->pcpu_id);
 	vcpu_set_state(vcpu, VCPU_RUNNING);
-	vcpu_set_gpreg(vcpu, CPU_REG_A0, pcpu_id);
 	wake_thread(&vcpu->thread_obj);
 }
 
@@ -573,6 +639,7 @@ int create_vcpu(struct acrn_vm *vm, uint16_t vcpu_id)
 
 		/* Populate the return handle */
 		vcpu_set_state(vcpu, VCPU_INIT);
+		vcpu->arch.started = is_vcpu_bsp(vcpu);
 #ifdef CONFIG_KTEST
 		vcpu_set_rip(vcpu, (uint64_t)_vboot);
 #else
@@ -53,13 +53,17 @@ int32_t s2pt_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	/* Handle page fault from guest */
 	exit_qual = vcpu->arch.exit_qualification;
-	//gpa = ctx->cpu_gp_regs.regs.ip;
-	gpa = ctx->cpu_gp_regs.regs.tval;
+	/* stval holds the guest virtual address, htval the gpa >> 2 */
+	gpa = (ctx->htval << 2U) | (ctx->cpu_gp_regs.regs.tval & 0x3UL);
 	io_req->io_type = ACRN_IOREQ_TYPE_MMIO;
 
 	/* Specify if read or write operation */
 	switch (exit_qual) {
 	case HX_EXIT_PF_GUEST_STORE:
+		/* Store to a dirty tracked RAM page, let the guest retry it */
+		if (s2pt_dirty_log_fault(vcpu->vm, gpa)) {
+			return 0;
+		}
 		/* Write operation */
 		mmio_req->direction = ACRN_IOREQ_DIR_WRITE;
 		mmio_req->value = 0UL;
@@ -9,6 +9,7 @@
 #include <asm/lib/bits.h>
 #include <asm/irq.h>
 #include <asm/vmx.h>
+#include <asm/tlb.h>
 #include <asm/guest/vcpu.h>
 #include <asm/guest/vmcs.h>
 #include <asm/guest/vm.h>
@@ -350,6 +351,11 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 		init_vmcs(vcpu);
 	}
 
+	/* ack remote fences even on the way down, their callers are waiting */
+	if (bitmap_test_and_clear_lock(ACRN_REQUEST_RFENCE, pending_req_bits)) {
+		(void)sbi_rfence_handle(vcpu);
+	}
+
 	if (bitmap_test_and_clear_lock(ACRN_REQUEST_TRP_FAULT, pending_req_bits)) {
 		pr_fatal("Tiple fault happen -> shutdown!");
 		ret = -EFAULT;
@@ -363,7 +369,7 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 		}
 
 		if (bitmap_test_and_clear_lock(ACRN_REQUEST_VPID_FLUSH,	pending_req_bits)) {
-			//flush_vpid_single(arch->vpid);
+			flush_vs_tlb_local();
 		}
 
 		if (bitmap_test_and_clear_lock(ACRN_REQUEST_EOI_EXIT_BITMAP_UPDATE, pending_req_bits)) {
@@ -107,6 +107,8 @@ vm_exit:
 	sd t1, REG_CAUSE(a0)
 	csrr t1, hstatus
 	sd t1, REG_HSTATUS(a0)
+	csrr t1, htval
+	sd t1, REG_HTVAL(a0)
 	csrrw t1, sscratch, a0
 	sd t1, REG_A0(a0)
 	la t1, strap_handler
@@ -307,41 +307,78 @@ int create_vm(struct acrn_vm *vm)
 
 int32_t shutdown_vm(struct acrn_vm *vm)
 {
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
 	/* Only allow shutdown paused vm */
 	vm->state = VM_POWERED_OFF;
 
-	/* TODO: only have one core */
-	offline_vcpu(&vm->hw.vcpu[0]);
+	foreach_vcpu(i, vm, vcpu) {
+		offline_vcpu(vcpu);
+	}
 
 	/* Return status to caller */
 	return 0;
 }
 
+/*
+ * Every vCPU is off its pCPU when this returns, zombie_vcpu() waits for
+ * the remote ones, so guest memory and vCPU contexts can be read.
+ */
 void pause_vm(struct acrn_vm *vm)
 {
-	/* For RTVM, we can only pause its vCPUs when it is powering off by itself */
-	zombie_vcpu(&vm->hw.vcpu[0], VCPU_ZOMBIE);
-	vm->state = VM_PAUSED;
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
+	if (vm->state != VM_PAUSED) {
+		foreach_vcpu(i, vm, vcpu) {
+			vcpu->arch.started = (vcpu->state == VCPU_RUNNING);
+			zombie_vcpu(vcpu, VCPU_ZOMBIE);
+		}
+		vm->state = VM_PAUSED;
+	}
 }
 
 int32_t reset_vm(struct acrn_vm *vm)
 {
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
 	if (is_service_vm(vm)) {
 		/* TODO: */
 	}
 
+	/* boots again on the BSP alone */
+	foreach_vcpu(i, vm, vcpu) {
+		vcpu->arch.started = is_vcpu_bsp(vcpu);
+	}
+
 	reset_vm_ioreqs(vm);
 	vm->state = VM_CREATED;
 
 	return 0;
 }
 
+/*
+ * Run the harts marked started, from their contexts as they are, and
+ * park the others in VCPU_INIT for SBI hart_start. On a cold boot that
+ * is the BSP alone at the kernel entry; after a pause or a snapshot
+ * restore, the harts that were running then.
+ */
 void start_vm(struct acrn_vm *vm)
 {
-	vm->state = VM_RUNNING;
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		if (vcpu->arch.started) {
+			launch_vcpu(vcpu);
+		} else {
+			vcpu_set_state(vcpu, VCPU_INIT);
+		}
+	}
 
-	for (int i = 0; i < vm->hw.created_vcpus; i++)
-		launch_vcpu(&vm->hw.vcpu[i]);
+	vm->state = VM_RUNNING;
 }
 
 static inline struct cpu_info *get_cpu_info_from_sp(uint16_t id)
@@ -88,6 +88,20 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 		}
 		break;
 
+	case HC_GET_VCPU_SNAPSHOT:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_get_vcpu_snapshot(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_SET_VCPU_SNAPSHOT:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_set_vcpu_snapshot(vcpu, target_vm, param1, param2);
+		}
+		break;
+
 	case HC_SET_IRQLINE:
 		/* param1: relative vmid to sos, vm_id: absolute vmid */
 		if (is_valid_postlaunched_vmid(vm_id)) {
@@ -130,6 +144,42 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 		}
 		break;
 
+	case HC_SETUP_SBUF:
+		/*
+		 * param1: relative vmid to sos, ACRN_INVALID_VMID for the per-pCPU
+		 * buffers owned by the hypervisor; any other buffer belongs to a
+		 * post-launched VM that must have been created.
+		 */
+		if (relative_vm_id == ACRN_INVALID_VMID) {
+			ret = hcall_setup_sbuf(vcpu, sos_vm, param1, param2);
+		} else if (is_valid_postlaunched_vmid(vm_id) && !is_poweroff_vm(target_vm)) {
+			ret = hcall_setup_sbuf(vcpu, target_vm, param1, param2);
+		} else {
+			ret = -EINVAL;
+		}
+		break;
+
+	case HC_VM_SET_DIRTY_LOG:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_set_dirty_log(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_VM_GET_DIRTY_LOG:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_get_dirty_log(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_VM_RELEASE_MEMORY:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_release_memory(vcpu, target_vm, param1, param2);
+		}
+		break;
+
 	/*
 	 * Don't do MSI remapping and make the pmsi_data equal to vmsi_data
 	 * This is a temporary solution before this hypercall is removed from SOS
@@ -206,25 +256,19 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 	return ret;
 }
 
-#define VMCALL_TYPE_HYPERCALL 0x0A000000
 /*
- * Pass return value to SOS by register rax.
+ * Pass return value to SOS by register a0.
  * This function should always return 0 since we shouldn't
  * deal with hypercall error in hypervisor.
+ *
+ * Reached from the SBI dispatcher for EID SBI_EXT_ACRN.
  */
 int32_t vmcall_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	int32_t ret;
 	struct acrn_vm *vm = vcpu->vm;
 	/* hypercall ID from guest*/
-	uint64_t vmcall_type = vcpu_get_gpreg(vcpu, CPU_REG_A7);
-	uint64_t hypcall_id;
-
-
-	if (vmcall_type != VMCALL_TYPE_HYPERCALL)
-		return ecall_vmexit_handler(vcpu);
-
-	hypcall_id = vcpu_get_gpreg(vcpu, CPU_REG_A6);
+	uint64_t hypcall_id = vcpu_get_gpreg(vcpu, CPU_REG_A6);
 	
 	if (hypcall_id == HC_WORLD_SWITCH ||
 	    hypcall_id == HC_INITIALIZE_TRUSTY ||
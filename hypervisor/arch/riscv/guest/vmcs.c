@@ -49,6 +49,8 @@ static void load_guest_state(struct acrn_vcpu *vcpu)
 
 	/* use magic # to check if vs-mode switching succeeds or not */
 	//cpu_csr_write(vsepc, 0xaaaabbbb);
+	/* hvip first, the vsip write then restores VSSIP */
+	cpu_csr_write(hvip, vcpu->arch.hvip);
 	cpu_csr_write(vsip, ctx->run_ctx.sip);
 	cpu_csr_write(vsie, ctx->run_ctx.sie);
 	cpu_csr_write(vstvec, ctx->run_ctx.stvec);
@@ -56,6 +58,7 @@ static void load_guest_state(struct acrn_vcpu *vcpu)
 	cpu_csr_write(vstval, ctx->run_ctx.stval);
 	cpu_csr_write(vscause, ctx->run_ctx.scause);
 	cpu_csr_write(vsatp, ctx->run_ctx.satp);
+	cpu_csr_write(htimedelta, vcpu->vm->vclint.time_offset);
 }
 
 static void save_guest_state(struct acrn_vcpu *vcpu)
@@ -84,12 +87,16 @@ static void init_host_state(struct acrn_vcpu *vcpu)
 	value64 = 0x200000180;
 	//value64 = 0x200200080;
 	cpu_csr_set(hstatus, value64);
-	ctx->run_ctx.cpu_gp_regs.regs.hstatus = value64;
+	if (!vcpu->arch.restored) {
+		ctx->run_ctx.cpu_gp_regs.regs.hstatus = value64;
+	}
 
 	/* must set the SPP in order to enter into guest s-mode */
 	value64 = 0x2000C0100;
 	cpu_csr_set(sstatus, value64);
-	ctx->run_ctx.cpu_gp_regs.regs.status = value64;
+	if (!vcpu->arch.restored) {
+		ctx->run_ctx.cpu_gp_regs.regs.status = value64;
+	}
 	//value64 = (uint64_t)_vkernel;
 //	cpu_csr_write(sepc, value64);
 
@@ -108,7 +115,13 @@ void init_vmcs(struct acrn_vcpu *vcpu)
 	pr_dbg("Initializing VMCS");
 	/* Initialize the Virtual Machine Control Structure (VMCS) */
 	init_host_state(vcpu);
-	init_guest_state(vcpu);
+	/* a vCPU restored from a snapshot continues from its saved context */
+	if (vcpu->arch.restored) {
+		load_guest_state(vcpu);
+		vcpu->arch.restored = false;
+	} else {
+		init_guest_state(vcpu);
+	}
 	*vcpu_ptr = (void *)vcpu;
 }
 
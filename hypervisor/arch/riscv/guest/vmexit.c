@@ -14,6 +14,8 @@
 #include <asm/guest/vio.h>
 #include <asm/guest/s2vm.h>
 #include <asm/guest/vcsr.h>
+#include <asm/guest/sbi.h>
+#include <asm/pmu.h>
 #include <trace.h>
 #include <logmsg.h>
 
@@ -46,6 +48,8 @@ static const struct vm_exit_dispatch interrupt_dispatch_table[NR_HX_EXIT_IRQ_REA
 		.handler = undefined_vmexit_handler},
 	[HX_EXIT_IRQ_MEXT] = {
 		.handler = unhandled_vmexit_handler},
+	[HX_EXIT_IRQ_LCOF] = {
+		.handler = profiling_pmi_vmexit_handler},
 	[HX_EXIT_IRQ_GUEST_SEXT] = {
 		.handler = unhandled_vmexit_handler},
 };
@@ -71,7 +75,7 @@ static const struct vm_exit_dispatch exception_dispatch_table[NR_HX_EXIT_REASONS
 	[HX_EXIT_ECALL_HS] = {
 		.handler = unhandled_vmexit_handler},
 	[HX_EXIT_ECALL_VS] = {
-		.handler = vmcall_vmexit_handler},
+		.handler = sbi_ecall_vmexit_handler},
 	[HX_EXIT_ECALL_M] = {
 		.handler = unhandled_vmexit_handler},
 	[HX_EXIT_PF_INS] = {
@@ -158,24 +162,6 @@ static int32_t hlt_vmexit_handler(struct acrn_vcpu *vcpu)
 	return 0;
 }
 
-int32_t ecall_vmexit_handler(struct acrn_vcpu *vcpu)
-{
-	uint64_t rax, rbx, rcx, rdx;
-
-	rax = vcpu_get_gpreg(vcpu, CPU_REG_A0);
-	rbx = vcpu_get_gpreg(vcpu, CPU_REG_A1);
-	rcx = vcpu_get_gpreg(vcpu, CPU_REG_A2);
-	rdx = vcpu_get_gpreg(vcpu, CPU_REG_A3);
-	guest_cpuid(vcpu, (uint32_t *)&rax, (uint32_t *)&rbx,
-		(uint32_t *)&rcx, (uint32_t *)&rdx);
-	vcpu_set_gpreg(vcpu, CPU_REG_A0, rax);
-	vcpu_set_gpreg(vcpu, CPU_REG_A1, rbx);
-	vcpu_set_gpreg(vcpu, CPU_REG_A2, rcx);
-	vcpu_set_gpreg(vcpu, CPU_REG_A3, rdx);
-
-	return 0;
-}
-
 bool has_rt_vm(void)
 {
 	return false;
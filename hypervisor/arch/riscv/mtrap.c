@@ -22,6 +22,43 @@ static int cpu_id(void)
 	return cpu;
 }
 
+#define MCOUNTINHIBIT_HPM3	(1UL << 3U)
+#define MIP_LCOFIP		(1UL << 13U)
+
+/*
+ * a1: mhpmevent3 value, 0 stops the counter
+ * a2: initial counter value
+ */
+static void m_pmu_config(uint64_t event, uint64_t count)
+{
+	asm volatile ("csrs 0x320, %0" :: "r"(MCOUNTINHIBIT_HPM3));
+	asm volatile ("csrw mhpmevent3, %0" :: "r"(event));
+	if (event != 0UL) {
+		asm volatile (
+			"csrw mhpmcounter3, %0 \n\t" \
+			"csrs mcounteren, %1 \n\t" \
+			"csrs mideleg, %2 \n\t" \
+			"csrc mip, %2 \n\t" \
+			"csrc 0x320, %1 \n\t"
+			:: "r"(count), "r"(MCOUNTINHIBIT_HPM3), "r"(MIP_LCOFIP)
+			: "memory"
+		);
+	}
+}
+
+/* reload the counter and clear its overflow flag */
+static void m_pmu_rearm(uint64_t count)
+{
+	asm volatile (
+		"csrs 0x320, %1 \n\t" \
+		"csrw mhpmcounter3, %0 \n\t" \
+		"csrc mhpmevent3, %2 \n\t" \
+		"csrc 0x320, %1 \n\t"
+		:: "r"(count), "r"(MCOUNTINHIBIT_HPM3), "r"(1UL << 63U)
+		: "memory"
+	);
+}
+
 void m_service(struct cpu_regs *regs)
 {
 	int call = regs->a0;
@@ -34,6 +71,14 @@ void m_service(struct cpu_regs *regs)
 			);
 			regs->ip += 4;
 			break;
+		case M_SERVICE_PMU_CONFIG:
+			m_pmu_config(regs->a1, regs->a2);
+			regs->ip += 4;
+			break;
+		case M_SERVICE_PMU_REARM:
+			m_pmu_rearm(regs->a1);
+			regs->ip += 4;
+			break;
 		default:
 			break;
 	}
@@ -51,35 +51,34 @@ static void split_large_page(uint64_t *pte, enum _page_table_level level,
 		uint64_t vaddr, const struct memory_ops *mem_ops)
 {
 	uint64_t *pbase;
-	uint64_t ref_paddr, paddr, paddrinc;
+	uint64_t ref_ppn, ppn, ppninc;
 	uint64_t i, ref_prot;
 
+	/*
+	 * The children inherit the leaf permissions (and the software bits)
+	 * of the large page, only the PPN advances.
+	 */
+	ref_ppn = (*pte) & PTE_ADDR_MASK_BLOCK_ENTRY;
+	ref_prot = (*pte) & ~PTE_ADDR_MASK_BLOCK_ENTRY;
+
 	switch (level) {
 	case VPN2:
-		ref_paddr = (*pte) & VPN2_PFN_MASK;
-		paddrinc = VPN1_SIZE;
-		ref_prot = (*pte) & ~VPN2_PFN_MASK;
+		ppninc = (VPN1_SIZE >> PTE_SHIFT) << 10U;
 		pbase = (uint64_t *)mem_ops->get_pd_page(mem_ops->info, vaddr);
 		break;
 	default:	/* VPN1 */
-		ref_paddr = (*pte) & VPN1_PFN_MASK;
-		paddrinc = PTE_SIZE;
-		ref_prot = (*pte) & ~VPN1_PFN_MASK;
+		ppninc = 1UL << 10U;
 		mem_ops->recover_exe_right(&ref_prot);
 		pbase = (uint64_t *)mem_ops->get_pt_page(mem_ops->info, vaddr);
 		break;
 	}
 
-	pr_dbg("%s, paddr: 0x%lx, pbase: 0x%lx", __func__, ref_paddr, pbase);
+	pr_dbg("%s, ppn: 0x%lx, pbase: 0x%lx", __func__, ref_ppn, pbase);
 
-	paddr = ref_paddr;
+	ppn = ref_ppn;
 	for (i = 0UL; i < PTRS_PER_PTE; i++) {
-		if (level == VPN1) {
-			construct_pgentry(pbase + i, (void *)paddr, ref_prot, mem_ops);
-		} else {
-			construct_pte(pbase + i, paddr, ref_prot, mem_ops);
-		}
-		paddr += paddrinc;
+		set_pgentry(pbase + i, ref_prot | ppn, mem_ops);
+		ppn += ppninc;
 	}
 
 	ref_prot = mem_ops->get_default_access_right();
@@ -208,7 +207,7 @@ static void modify_or_del_vpn2(const uint64_t *vpn3, uint64_t vaddr_start, uint6
 			if (vpn_large(*vpn2) != 0UL) {
 				if ((vaddr_next > vaddr_end) ||
 						(!mem_aligned_check(vaddr, VPN2_SIZE))) {
-					split_large_page(vpn2, VPN3, vaddr, mem_ops);
+					split_large_page(vpn2, VPN2, vaddr, mem_ops);
 				} else {
 					local_modify_or_del_pte(vpn2, prot_set, prot_clr, type, mem_ops);
 					if (vaddr_next < vaddr_end) {
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2023-2024 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <asm/cpu.h>
+#include <asm/cpumask.h>
+#include <asm/per_cpu.h>
+#include <asm/notify.h>
+#include <asm/pmu.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/vm.h>
+#include <common/sbuf.h>
+#include <profiling.h>
+#include <ticks.h>
+#include <logmsg.h>
+#include "trap.h"
+
+#define SSTATUS_SPP	(1UL << 8U)
+#define CSR_SCOUNTOVF	0xda0
+
+struct pmu_sampling_ctl {
+	uint64_t event;		/* mhpmevent3 value, including inhibit bits */
+	uint64_t period;
+	bool enabled;
+};
+
+static struct pmu_sampling_ctl pmu_ctl;
+static struct pmu_sample_stats pmu_stats[MAX_PCPU_NUM];
+
+static inline void pmu_m_service(uint64_t id, uint64_t arg1, uint64_t arg2)
+{
+	register uint64_t a0 asm("a0") = id;
+	register uint64_t a1 asm("a1") = arg1;
+	register uint64_t a2 asm("a2") = arg2;
+
+	asm volatile ("ecall" : "+r"(a0) : "r"(a1), "r"(a2) : "memory");
+}
+
+static uint32_t sbuf_free_entries(const struct shared_buf *sbuf)
+{
+	uint32_t used;
+
+	if (sbuf->tail >= sbuf->head) {
+		used = sbuf->tail - sbuf->head;
+	} else {
+		used = sbuf->size - (sbuf->head - sbuf->tail);
+	}
+
+	/* one element is always kept empty to tell full from empty */
+	return ((sbuf->size - used) / sbuf->ele_size) - 1U;
+}
+
+/*
+ * A sample spans several sbuf elements; it is either
+ * written whole or dropped, never truncated.
+ */
+static void pmu_sample_put(uint16_t pcpu_id, struct pmu_sample *sample)
+{
+	struct shared_buf *sbuf = per_cpu(sbuf, pcpu_id)[ACRN_SEP];
+	uint32_t i, nr = (uint32_t)(sizeof(struct pmu_sample) / PMU_SAMPLE_ENTRY_SIZE);
+
+	if ((sbuf == NULL) || (sbuf->ele_size != PMU_SAMPLE_ENTRY_SIZE) ||
+			(sbuf_free_entries(sbuf) < nr)) {
+		pmu_stats[pcpu_id].dropped++;
+	} else {
+		for (i = 0U; i < nr; i++) {
+			(void)sbuf_put(sbuf, (uint8_t *)sample + (i * PMU_SAMPLE_ENTRY_SIZE));
+		}
+		pmu_stats[pcpu_id].logged++;
+	}
+}
+
+static void pmu_sample_record(uint64_t pc, uint8_t mode, const struct acrn_vcpu *vcpu)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+	struct pmu_sample sample;
+
+	if ((cpu_csr_read(CSR_SCOUNTOVF) & (1UL << PMU_SAMPLE_COUNTER)) == 0UL) {
+		return;
+	}
+
+	(void)memset(&sample, 0U, sizeof(sample));
+	sample.magic = PMU_SAMPLE_MAGIC;
+	sample.pcpu_id = pcpu_id;
+	sample.timestamp = cpu_ticks();
+	sample.pc = pc;
+	sample.event = pmu_ctl.event & PMU_EVENT_MASK;
+	sample.mode = mode;
+
+	if (vcpu != NULL) {
+		sample.vm_id = vcpu->vm->vm_id;
+		sample.vcpu_id = vcpu->vcpu_id;
+		sample.exit_reason = (uint32_t)vcpu->arch.exit_reason;
+	} else {
+		sample.vm_id = ACRN_INVALID_VMID;
+		sample.vcpu_id = 0xffffU;
+	}
+
+	pmu_sample_put(pcpu_id, &sample);
+
+	if (pmu_ctl.enabled) {
+		pmu_m_service(M_SERVICE_PMU_REARM, -pmu_ctl.period, 0UL);
+	}
+}
+
+/*
+ * LCOFI taken in HS mode, i.e. while the hypervisor itself was running;
+ * sepc is the sampled PC and sstatus.SPP tells HS from HU. Overflows taken
+ * while a guest runs come in through the vm_exit path instead, see
+ * profiling_pmi_vmexit_handler().
+ */
+void profiling_pmi_handler(void)
+{
+	uint64_t sstatus = cpu_csr_read(sstatus);
+
+	/* LCOFIP stays pending until software clears it, whatever is recorded */
+	cpu_csr_clear(sip, 1UL << IRQ_LCOF);
+	pmu_sample_record(cpu_csr_read(sepc),
+		((sstatus & SSTATUS_SPP) != 0UL) ? PMU_MODE_HS : PMU_MODE_HU,
+		get_running_vcpu(get_pcpu_id()));
+}
+
+/*
+ * LCOFI taken while a guest was running. vm_exit has already saved the
+ * guest context, so the sampled PC and the guest sstatus.SPP (VS or VU)
+ * come from the vCPU rather than from the live CSRs.
+ */
+int32_t profiling_pmi_vmexit_handler(struct acrn_vcpu *vcpu)
+{
+	struct cpu_regs *regs =
+		&vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx.cpu_gp_regs.regs;
+
+	cpu_csr_clear(sip, 1UL << IRQ_LCOF);
+	pmu_sample_record(regs->ip,
+		((regs->status & SSTATUS_SPP) != 0UL) ? PMU_MODE_VS : PMU_MODE_VU, vcpu);
+	vcpu_retain_ip(vcpu);
+
+	return 0;
+}
+
+static void pmu_sampling_setup_local(__unused void *data)
+{
+	if (pmu_ctl.enabled) {
+		pmu_m_service(M_SERVICE_PMU_CONFIG, pmu_ctl.event, -pmu_ctl.period);
+		cpu_csr_set(sie, 1UL << IRQ_LCOF);
+	} else {
+		cpu_csr_clear(sie, 1UL << IRQ_LCOF);
+		pmu_m_service(M_SERVICE_PMU_CONFIG, 0UL, 0UL);
+	}
+}
+
+/*
+ * Start sampling on all pCPUs: one sample every period occurrences of
+ * event. inhibit is a mask of PMU_EVENT_*INH bits for the modes that
+ * should not be counted.
+ */
+int32_t pmu_sampling_start(uint64_t event, uint64_t period, uint64_t inhibit)
+{
+	int32_t ret = 0;
+
+	if ((event == 0UL) || ((event & ~PMU_EVENT_MASK) != 0UL) || (period == 0UL) ||
+			((inhibit & ~(PMU_EVENT_MINH | PMU_EVENT_SINH | PMU_EVENT_UINH |
+				PMU_EVENT_VSINH | PMU_EVENT_VUINH)) != 0UL)) {
+		ret = -EINVAL;
+	} else {
+		/* M-mode belongs to the hypervisor itself, never count it */
+		pmu_ctl.event = event | inhibit | PMU_EVENT_MINH;
+		pmu_ctl.period = period;
+		pmu_ctl.enabled = true;
+		(void)memset(pmu_stats, 0U, sizeof(pmu_stats));
+		smp_call_function(cpu_online_map, pmu_sampling_setup_local, NULL);
+	}
+
+	return ret;
+}
+
+void pmu_sampling_stop(void)
+{
+	pmu_ctl.enabled = false;
+	smp_call_function(cpu_online_map, pmu_sampling_setup_local, NULL);
+}
+
+bool pmu_sampling_enabled(void)
+{
+	return pmu_ctl.enabled;
+}
+
+void pmu_sampling_get_stats(uint16_t pcpu_id, struct pmu_sample_stats *stats)
+{
+	*stats = pmu_stats[pcpu_id];
+}
+
+void profiling_vmenter_handler(__unused struct acrn_vcpu *vcpu) {}
+void profiling_pre_vmexit_handler(__unused struct acrn_vcpu *vcpu) {}
+void profiling_post_vmexit_handler(__unused struct acrn_vcpu *vcpu) {}
+void profiling_setup(void) {}
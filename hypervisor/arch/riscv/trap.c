@@ -7,6 +7,7 @@
 #include <asm/cpu.h>
 #include <asm/smp.h>
 #include "uart.h"
+#include <asm/pmu.h>
 #include "trap.h"
 
 void sexpt_handler(void)
@@ -59,16 +60,20 @@ static irq_handler_t sirq_handler[] = {
 	sexpt_handler,
 	sexpt_handler,
 	sexti_handler,
+	sexpt_handler,
+	sexpt_handler,
+	sexpt_handler,
+	profiling_pmi_handler,
 	sexpt_handler
 };
 
 void sint_handler(int irq)
 {
 	//printk("sint handler\n");
-	if (irq < 10)
+	if (irq < 14)
 		sirq_handler[irq]();
 	else
-		sirq_handler[10]();
+		sirq_handler[14]();
 }
 
 void vsswi_handler(void)
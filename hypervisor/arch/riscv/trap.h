@@ -1,6 +1,10 @@
 #ifndef __RISCV_TRAP_H__
 #define __RISCV_TRAP_H__
 
+/* M-mode services requested by HS-mode through ecall, id in a0 */
+#define M_SERVICE_PMU_CONFIG	2
+#define M_SERVICE_PMU_REARM	3
+
 typedef void (* irq_handler_t)(void);
 extern void dispatch_interrupt(struct cpu_regs *regs);
 extern void hv_timer_handler(void);
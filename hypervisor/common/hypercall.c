@@ -284,6 +284,7 @@ int32_t hcall_destroy_vm(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target
  * @brief start virtual machine
  *
  * Start a virtual machine, it will schedule target VM's vcpu to run.
+ * On riscv a paused VM is resumed, its vCPUs continue where they stopped.
  * The function will return -1 if the target VM does not exist or the
  * IOReq buffer page for the VM is not ready.
  *
@@ -295,8 +296,13 @@ int32_t hcall_start_vm(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_v
 		__unused uint64_t param1, __unused uint64_t param2)
 {
 	int32_t ret = -1;
+#ifdef CONFIG_RISCV64
+	bool startable = is_created_vm(target_vm) || is_paused_vm(target_vm);
+#else
+	bool startable = is_created_vm(target_vm);
+#endif
 
-	if ((is_created_vm(target_vm)) && (target_vm->sw.io_shared_page != NULL)) {
+	if (startable && (target_vm->sw.io_shared_page != NULL)) {
 		/* TODO: check target_vm guest_flags */
 		start_vm(target_vm);
 		ret = 0;
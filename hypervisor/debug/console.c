@@ -168,6 +168,9 @@ static void console_timer_callback(__unused void *data)
 {
 	struct acrn_vuart *vu;
 
+	/* Emit the binary log records queued since the last tick */
+	drain_logmsg();
+
 	/* Kick HV-Shell and Uart-Console tasks */
 	vu = vuart_console_active();
 	if (vu != NULL) {
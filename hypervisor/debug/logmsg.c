@@ -13,6 +13,7 @@
 #include <logmsg.h>
 #include <ticks.h>
 #include <common/sbuf.h>
+#include <asm/init.h>
 
 /* buf size should be identical to the size in hvlog option, which is
  * transfered to Service VM:
@@ -20,19 +21,294 @@
  */
 
 struct acrn_logmsg_ctl {
-	int32_t seq;
 	spinlock_t lock;
 };
 
 static struct acrn_logmsg_ctl logmsg_ctl;
 
+/*
+ * Record messages in binary form and format them off the logging path.
+ * Off by default: the memory log then holds records that only acrnlog -e
+ * can read back.
+ */
+bool binlog_enabled = false;
+
+/* Argument classes consumed by a conversion specification */
+#define LOG_ARG_INT	0U
+#define LOG_ARG_LONG	1U
+#define LOG_ARG_STR	2U
+#define LOG_ARG_BAD	3U
+
 void init_logmsg()
 {
-	logmsg_ctl.seq = 0;
-
 	spinlock_init(&(logmsg_ctl.lock));
 }
 
+/*
+ * Messages are numbered per pCPU so that logging does not bounce a shared
+ * counter between pCPUs; consumers order messages of different pCPUs by
+ * their timestamp.
+ */
+static uint32_t log_next_seq(uint16_t pcpu_id)
+{
+	uint64_t flags;
+	uint32_t seq;
+
+	local_irq_save(flags);
+	per_cpu(binlog, pcpu_id).seq++;
+	seq = per_cpu(binlog, pcpu_id).seq;
+	local_irq_restore(flags);
+
+	return seq;
+}
+
+/*
+ * Addresses in a binary record are offsets from the start of the hypervisor
+ * rodata, so that they do not depend on where the image was loaded.
+ */
+static inline uint64_t log_bin_offset(const char *p)
+{
+	return (uint64_t)(p - _srodata);
+}
+
+static inline const char *log_bin_addr(uint64_t offset)
+{
+	return _srodata + offset;
+}
+
+static inline bool is_digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+/*
+ * Find the next conversion specification in fmt. Return the address of
+ * its '%', or NULL if there is none left; *end is set past the conversion
+ * character and *kind to the class of argument it consumes.
+ */
+static const char *log_bin_next_conv(const char *fmt, const char **end, uint32_t *kind)
+{
+	const char *p = fmt;
+	const char *start = NULL;
+	bool is_long = false;
+
+	while ((*p != '\0') && (start == NULL)) {
+		if (*p != '%') {
+			p++;
+		} else if (*(p + 1) == '%') {
+			p += 2;
+		} else {
+			start = p;
+		}
+	}
+
+	if (start != NULL) {
+		p++;
+		while ((*p == '#') || (*p == '0') || (*p == '-') || (*p == ' ') || (*p == '+')) {
+			p++;
+		}
+		while (is_digit(*p) || (*p == '.')) {
+			p++;
+		}
+		while ((*p == 'h') || (*p == 'l') || (*p == 'j') || (*p == 'z')) {
+			is_long = is_long || (*p != 'h');
+			p++;
+		}
+
+		switch (*p) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			*kind = is_long ? LOG_ARG_LONG : LOG_ARG_INT;
+			break;
+		case 'p':
+			*kind = LOG_ARG_LONG;
+			break;
+		case 's':
+			*kind = LOG_ARG_STR;
+			break;
+		default:
+			/* '*' width, unknown conversions and truncated specs */
+			*kind = LOG_ARG_BAD;
+			break;
+		}
+		*end = (*p != '\0') ? (p + 1) : p;
+	}
+
+	return start;
+}
+
+/*
+ * Capture the raw arguments of fmt into entry. Only format strings and
+ * string arguments that live in the hypervisor image can be deferred, as
+ * they have to stay valid until the record is formatted; anything else
+ * is left to the text path.
+ */
+static bool log_bin_capture(struct log_bin_entry *entry, const char *fmt, va_list args)
+{
+	const char *p, *end = NULL;
+	const char *str;
+	uint32_t kind = LOG_ARG_BAD;
+	uint8_t n = 0U;
+	bool ret = is_kernel_rodata(fmt);
+
+	(void)memset(entry, 0U, sizeof(struct log_bin_entry));
+	p = log_bin_next_conv(fmt, &end, &kind);
+	while (ret && (p != NULL)) {
+		if ((n == LOG_BIN_MAX_ARGS) || (kind == LOG_ARG_BAD)) {
+			ret = false;
+		} else if (kind == LOG_ARG_INT) {
+			entry->args[n] = (uint64_t)va_arg(args, uint32_t);
+		} else if (kind == LOG_ARG_LONG) {
+			entry->args[n] = va_arg(args, uint64_t);
+		} else {
+			str = va_arg(args, const char *);
+			ret = is_kernel_rodata(str);
+			entry->args[n] = ret ? log_bin_offset(str) : 0UL;
+		}
+		n++;
+		p = log_bin_next_conv(end, &end, &kind);
+	}
+
+	entry->nargs = n;
+	entry->fmt = log_bin_offset(fmt);
+	return ret;
+}
+
+/* Copy the literal text [from, to) to buf, collapsing "%%" */
+static size_t log_bin_copy_literal(char *buf, size_t size, const char *from, const char *to)
+{
+	const char *p = from;
+	size_t len = 0UL;
+
+	while ((p < to) && (*p != '\0') && ((len + 1UL) < size)) {
+		buf[len] = *p;
+		len++;
+		p += ((*p == '%') && (*(p + 1) == '%')) ? 2 : 1;
+	}
+	buf[len] = '\0';
+
+	return len;
+}
+
+static void log_bin_format(char *buf, size_t size, const struct log_bin_entry *entry)
+{
+	const char *fmt = log_bin_addr(entry->fmt);
+	const char *p, *end = NULL;
+	char spec[16];
+	uint32_t kind = LOG_ARG_BAD;
+	size_t len, spec_len;
+	uint8_t n = 0U;
+
+	len = snprintf(buf, size, "[%luus][cpu=%hu][sev=%u][seq=%u]:",
+			entry->timestamp, entry->pcpu_id, entry->severity, entry->seq);
+
+	p = log_bin_next_conv(fmt, &end, &kind);
+	while ((p != NULL) && (n < entry->nargs) && (len < size)) {
+		len += log_bin_copy_literal(buf + len, size - len, fmt, p);
+
+		spec_len = (size_t)(end - p);
+		if (spec_len >= sizeof(spec)) {
+			spec_len = sizeof(spec) - 1UL;
+		}
+		(void)memcpy_s(spec, sizeof(spec), p, spec_len);
+		spec[spec_len] = '\0';
+
+		if (len < size) {
+			if (kind == LOG_ARG_INT) {
+				len += snprintf(buf + len, size - len, spec, (uint32_t)entry->args[n]);
+			} else if (kind == LOG_ARG_LONG) {
+				len += snprintf(buf + len, size - len, spec, entry->args[n]);
+			} else {
+				len += snprintf(buf + len, size - len, spec, log_bin_addr(entry->args[n]));
+			}
+		}
+
+		n++;
+		fmt = end;
+		p = log_bin_next_conv(fmt, &end, &kind);
+	}
+
+	if (len < size) {
+		(void)log_bin_copy_literal(buf + len, size - len, fmt, fmt + strnlen_s(fmt, size - len));
+	}
+}
+
+/*
+ * Queue a record on the local pCPU ring. The ring is only written by its
+ * own pCPU, so disabling local interrupts is enough to keep nested
+ * messages from interleaving; no lock is shared with other pCPUs.
+ */
+static void log_bin_put(uint16_t pcpu_id, struct log_bin_entry *entry)
+{
+	struct log_bin_ring *ring = &per_cpu(binlog, pcpu_id);
+	uint64_t flags;
+	uint32_t head;
+
+	local_irq_save(flags);
+	head = ring->head;
+	if ((head - ring->tail) >= LOG_BIN_RING_SIZE) {
+		ring->dropped++;
+	} else {
+		entry->dropped = ring->dropped;
+		(void)memcpy_s(&ring->entries[head & (LOG_BIN_RING_SIZE - 1U)],
+				sizeof(struct log_bin_entry), entry, sizeof(struct log_bin_entry));
+		/* publish the record before the new head */
+		smp_wmb();
+		ring->head = head + 1U;
+	}
+	local_irq_restore(flags);
+}
+
+uint32_t get_logmsg_dropped(uint16_t pcpu_id)
+{
+	return per_cpu(binlog, pcpu_id).dropped;
+}
+
+/*
+ * Format and emit the records queued by all pCPUs. Called periodically
+ * from the console timer on the BSP, which is the only consumer.
+ */
+void drain_logmsg(void)
+{
+	static char buffer[LOG_MESSAGE_MAX_SIZE];
+	struct log_bin_ring *ring;
+	struct log_bin_entry *entry;
+	uint64_t rflags;
+	uint32_t head;
+	uint16_t pcpu_id;
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		ring = &per_cpu(binlog, pcpu_id);
+		head = ring->head;
+		/* read the records only after observing the head */
+		smp_rmb();
+
+		while (ring->tail != head) {
+			entry = &ring->entries[ring->tail & (LOG_BIN_RING_SIZE - 1U)];
+			log_bin_format(buffer, LOG_MESSAGE_MAX_SIZE, entry);
+
+			if (entry->severity <= npk_loglevel) {
+				npk_log_write(buffer, strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE));
+			}
+
+			if (entry->severity <= console_loglevel) {
+				spinlock_irqsave_obtain(&(logmsg_ctl.lock), &rflags);
+				printf("%s\n\r", buffer);
+				spinlock_irqrestore_release(&(logmsg_ctl.lock), rflags);
+			}
+
+			/* finish with the slot before handing it back */
+			smp_mb();
+			ring->tail++;
+		}
+	}
+}
+
 void do_logmsg(uint32_t severity, const char *fmt, ...)
 {
 	va_list args;
@@ -60,13 +336,46 @@ void do_logmsg(uint32_t severity, const char *fmt, ...)
 
 	/* Get CPU ID */
 	pcpu_id = get_pcpu_id();
+
+	/* fatal messages must reach the outputs before the caller stops */
+	if (binlog_enabled && (severity > LOG_ACRN)) {
+		struct log_bin_entry entry;
+		bool captured;
+
+		va_start(args, fmt);
+		captured = log_bin_capture(&entry, fmt, args);
+		va_end(args);
+
+		if (captured) {
+			entry.magic = LOG_BIN_MAGIC;
+			entry.pcpu_id = pcpu_id;
+			entry.severity = (uint8_t)severity;
+			entry.seq = log_next_seq(pcpu_id);
+			entry.timestamp = timestamp;
+
+			if (do_console_log || do_npk_log) {
+				log_bin_put(pcpu_id, &entry);
+			}
+
+			if (do_mem_log) {
+				struct shared_buf *sbuf = per_cpu(sbuf, pcpu_id)[ACRN_HVLOG];
+
+				/* one record per entry, acrnlog decodes it */
+				if (sbuf != NULL) {
+					entry.dropped = per_cpu(binlog, pcpu_id).dropped;
+					(void)sbuf_put(sbuf, (uint8_t *)&entry);
+				}
+			}
+			return;
+		}
+	}
 	buffer = per_cpu(logbuf, pcpu_id);
 	current = sched_get_current(pcpu_id);
 
 	(void)memset(buffer, 0U, LOG_MESSAGE_MAX_SIZE);
 	/* Put time-stamp, CPU ID and severity into buffer */
 	snprintf(buffer, LOG_MESSAGE_MAX_SIZE, "[%luus][cpu=%hu][%s][sev=%u][seq=%u]:",
-			timestamp, pcpu_id, current->name, severity, atomic_inc_return(&logmsg_ctl.seq));
+			timestamp, pcpu_id, current->name, severity, log_next_seq(pcpu_id));
 
 	/* Put message into remaining portion of local buffer */
 	va_start(args, fmt);
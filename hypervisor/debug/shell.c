@@ -19,6 +19,7 @@
 #else
 #include <asm/lib/string.h>
 #include <asm/plicreg.h>
+#include <asm/pmu.h>
 #endif
 #include <ptdev.h>
 #include <asm/guest/vm.h>
@@ -52,6 +53,11 @@ static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv
 static int32_t shell_show_vioapic_info(int32_t argc, char **argv);
 static int32_t shell_show_ioapic_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_loglevel(int32_t argc, char **argv);
+static int32_t shell_binlog(int32_t argc, char **argv);
+#ifdef CONFIG_RISCV64
+static int32_t shell_pmu_sample(int32_t argc, char **argv);
+static int32_t shell_sbi_stat(int32_t argc, char **argv);
+#endif
 static int32_t shell_cpuid(int32_t argc, char **argv);
 static int32_t shell_reboot(int32_t argc, char **argv);
 static int32_t shell_rdmsr(int32_t argc, char **argv);
@@ -136,6 +142,26 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_LOG_LVL_HELP,
 		.fcn		= shell_loglevel,
 	},
+	{
+		.str		= SHELL_CMD_BINLOG,
+		.cmd_param	= SHELL_CMD_BINLOG_PARAM,
+		.help_str	= SHELL_CMD_BINLOG_HELP,
+		.fcn		= shell_binlog,
+	},
+#ifdef CONFIG_RISCV64
+	{
+		.str		= SHELL_CMD_PMU_SAMPLE,
+		.cmd_param	= SHELL_CMD_PMU_SAMPLE_PARAM,
+		.help_str	= SHELL_CMD_PMU_SAMPLE_HELP,
+		.fcn		= shell_pmu_sample,
+	},
+	{
+		.str		= SHELL_CMD_SBI_STAT,
+		.cmd_param	= SHELL_CMD_SBI_STAT_PARAM,
+		.help_str	= SHELL_CMD_SBI_STAT_HELP,
+		.fcn		= shell_sbi_stat,
+	},
+#endif
 	{
 		.str		= SHELL_CMD_CPUID,
 		.cmd_param	= SHELL_CMD_CPUID_PARAM,
@@ -1302,6 +1328,114 @@ static int32_t shell_loglevel(int32_t argc, char **argv)
 	return 0;
 }
 
+static int32_t shell_binlog(int32_t argc, char **argv)
+{
+	char str[MAX_STR_SIZE] = {0};
+	uint16_t pcpu_id;
+	int32_t ret = 0;
+
+	if (argc == 2) {
+		if (strcmp(argv[1], "on") == 0) {
+			binlog_enabled = true;
+		} else if (strcmp(argv[1], "off") == 0) {
+			binlog_enabled = false;
+		} else {
+			ret = -EINVAL;
+		}
+	} else if (argc == 1) {
+		snprintf(str, MAX_STR_SIZE, "binlog: %s\r\n", binlog_enabled ? "on" : "off");
+		shell_puts(str);
+		for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+			snprintf(str, MAX_STR_SIZE, "cpu%hu dropped: %u\r\n",
+				pcpu_id, get_logmsg_dropped(pcpu_id));
+			shell_puts(str);
+		}
+	} else {
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+#ifdef CONFIG_RISCV64
+static int32_t shell_pmu_sample(int32_t argc, char **argv)
+{
+	char str[MAX_STR_SIZE] = {0};
+	struct pmu_sample_stats stats;
+	uint64_t inhibit;
+	uint16_t pcpu_id;
+	int32_t i, ret = 0;
+
+	if ((argc == 2) && (strcmp(argv[1], "off") == 0)) {
+		pmu_sampling_stop();
+	} else if (argc >= 3) {
+		/* count the listed modes only, all of them if none is given */
+		inhibit = (argc > 3) ? (PMU_EVENT_SINH | PMU_EVENT_UINH | PMU_EVENT_VSINH | PMU_EVENT_VUINH) : 0UL;
+		for (i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "hs") == 0) {
+				inhibit &= ~(PMU_EVENT_SINH | PMU_EVENT_UINH);
+			} else if (strcmp(argv[i], "vs") == 0) {
+				inhibit &= ~PMU_EVENT_VSINH;
+			} else if (strcmp(argv[i], "vu") == 0) {
+				inhibit &= ~PMU_EVENT_VUINH;
+			} else {
+				ret = -EINVAL;
+			}
+		}
+		if (ret == 0) {
+			ret = pmu_sampling_start(strtoul_hex(argv[1]), (uint64_t)strtol_deci(argv[2]), inhibit);
+		}
+	} else if (argc == 1) {
+		snprintf(str, MAX_STR_SIZE, "pmu sampling: %s\r\n", pmu_sampling_enabled() ? "on" : "off");
+		shell_puts(str);
+		for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+			pmu_sampling_get_stats(pcpu_id, &stats);
+			snprintf(str, MAX_STR_SIZE, "cpu%hu logged: %lu dropped: %lu\r\n",
+				pcpu_id, stats.logged, stats.dropped);
+			shell_puts(str);
+		}
+	} else {
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static int32_t shell_sbi_stat(int32_t argc, char **argv)
+{
+	char str[MAX_STR_SIZE] = {0};
+	struct acrn_vcpu *vcpu;
+	struct acrn_vm *vm;
+	uint16_t vm_id, i;
+	uint32_t stat;
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	vm_id = sanitize_vmid((uint16_t)strtol_deci(argv[1]));
+	vm = get_vm_from_vmid(vm_id);
+	if (is_poweroff_vm(vm)) {
+		shell_puts("VM is not valid \n");
+		return -EINVAL;
+	}
+
+	foreach_vcpu(i, vm, vcpu) {
+		snprintf(str, MAX_STR_SIZE, "vcpu%hu:\r\n", i);
+		shell_puts(str);
+		for (stat = 0U; stat < SBI_STAT_NUM; stat++) {
+			if (vcpu->arch.sbi_calls[stat] != 0UL) {
+				snprintf(str, MAX_STR_SIZE, "  %-8s %lu\r\n",
+					sbi_stat_name(stat), vcpu->arch.sbi_calls[stat]);
+				shell_puts(str);
+			}
+		}
+	}
+
+	return 0;
+}
+#endif
+
 #ifdef CONFIG_RISCV64
 static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv)
 {
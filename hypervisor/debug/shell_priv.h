@@ -101,6 +101,20 @@ struct shell {
 #define SHELL_CMD_LOG_LVL_HELP		"No argument: get the level of logging for the console, memory and npk. Set "\
 					"the level by giving (up to) 3 parameters between 0 and 6 (verbose)"
 
+#define SHELL_CMD_BINLOG		"binlog"
+#define SHELL_CMD_BINLOG_PARAM		"[on|off]"
+#define SHELL_CMD_BINLOG_HELP		"No argument: show whether binary logging is enabled and the per-CPU drop "\
+					"counters. Turn deferred binary logging on or off"
+
+#define SHELL_CMD_PMU_SAMPLE		"pmu_sample"
+#define SHELL_CMD_PMU_SAMPLE_PARAM	"[off | <event> <period> [hs] [vs] [vu]]"
+#define SHELL_CMD_PMU_SAMPLE_HELP	"No argument: show the sampling state and per-CPU sample counters. Sample "\
+					"every <period> (decimal) hpm <event> (hex) in the given modes into the SEP sbuf"
+
+#define SHELL_CMD_SBI_STAT		"sbi_stat"
+#define SHELL_CMD_SBI_STAT_PARAM	"<vm id>"
+#define SHELL_CMD_SBI_STAT_HELP		"Display the per-vCPU SBI call counters of the VM, by extension"
+
 #define SHELL_CMD_CPUID			"cpuid"
 #define SHELL_CMD_CPUID_PARAM		"<leaf> [subleaf]"
 #define SHELL_CMD_CPUID_HELP		"Display the CPUID leaf [subleaf], in hexadecimal"
@@ -56,4 +56,7 @@ enum CLINT_REGISTERS {
 #define CLINT_VECTOR_STI       0x00000020U
 #define CLINT_VECTOR_SEI       0x00000200U
 
+/* the vectors are vsip bits, hvip has the VS ones one bit up */
+#define CLINT_HVIP_VSTIP       (CLINT_VECTOR_STI << 1U)
+
 #endif /* __RISCV_APICREG_H__ */
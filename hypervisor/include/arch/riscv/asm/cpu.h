@@ -189,6 +189,14 @@ extern void cpu_do_idle(void);
 			:: "r"(val));		 			\
 })
 
+/* Clear CSR */
+#define cpu_csr_clear(reg, csr_val)					\
+({									\
+	uint64_t val = (uint64_t)csr_val;				\
+	asm volatile (" csrc " ASM_STR(reg) ", %0 \n\t"			\
+			:: "r"(val));		 			\
+})
+
 static inline void asm_pause(void)
 {
 	asm volatile ("fence; nop");
@@ -233,6 +241,11 @@ struct run_context {
 		uint64_t longs[NUM_GPRS];
 	} cpu_gp_regs;
 
+	/* guest physical address >> 2 of the last guest page fault, saved by
+	 * vm_exit at REG_HTVAL before interrupts are enabled again
+	 */
+	uint64_t htval;
+
 	uint64_t sstatus;
 	uint64_t sepc;
 	uint64_t sip;
@@ -14,6 +14,11 @@
 #define INVALID_HPA   (0x1UL << 52U)
 #define S2PT_PFN_HIGH_MASK      0xFFFF000000000000UL
 
+/* software PTE bit: leaf write protected for dirty page logging */
+#define S2PT_DIRTY_WP		PAGE_RSW0
+/* dirty log ranges are handled 64 pages (one bitmap word) at a time */
+#define DIRTY_LOG_GRANULE	(PAGE_SIZE << 6U)
+
 struct acrn_vm;
 struct acrn_vcpu;
 
@@ -29,6 +34,10 @@ extern void s2pt_add_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t hpa,
 extern void s2pt_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size);
 extern void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page, uint64_t gpa,
 				uint64_t size, uint64_t prot_set, uint64_t prot_clr);
+extern int32_t s2pt_set_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t size, bool enable);
+extern int32_t s2pt_fetch_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t *bitmap, uint32_t nr_words);
+extern bool s2pt_dirty_log_fault(struct acrn_vm *vm, uint64_t gpa);
+extern int32_t s2pt_release_mr(struct acrn_vm *vm, uint64_t gpa, uint64_t size);
 extern void s2vm_restore_state(struct acrn_vcpu *vcpu);
 
 #endif /* __RISCV_S2VM_H__ */
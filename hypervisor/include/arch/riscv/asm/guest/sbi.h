@@ -7,32 +7,94 @@
 #ifndef __RISCV_SBI_H__
 #define __RISCV_SBI_H__
 
-typedef struct sbi_ret {
-	long error;
-	long value;
+/*
+ * SBI v2.0 as seen by VS-mode guests: a7 holds the extension id (EID),
+ * a6 the function id (FID), a0-a5 the arguments.  The error code is
+ * returned in a0 and the value in a1.
+ */
+#define SBI_SPEC_VERSION		(2UL << 24U)	/* 2.0 */
+#define SBI_IMPL_ID_ACRN		0x4143524EUL	/* "ACRN" */
+
+/* Legacy extensions, the result goes back in a0 only */
+#define SBI_EXT_LEGACY_SET_TIMER	0x00UL
+#define SBI_EXT_LEGACY_PUTCHAR		0x01UL
+#define SBI_EXT_LEGACY_GETCHAR		0x02UL
+#define SBI_EXT_LEGACY_CLEAR_IPI	0x03UL
+#define SBI_EXT_LEGACY_SHUTDOWN		0x08UL
+
+#define SBI_EXT_BASE			0x10UL
+#define SBI_EXT_TIME			0x54494D45UL
+#define SBI_EXT_IPI			0x735049UL
+#define SBI_EXT_RFENCE			0x52464E43UL
+#define SBI_EXT_HSM			0x48534DUL
+#define SBI_EXT_SRST			0x53525354UL
+#define SBI_EXT_DBCN			0x4442434EUL
+/* ACRN hypercalls: a6 carries the hypercall id, a0 the result */
+#define SBI_EXT_ACRN			0x0A000000UL
+
+#define SBI_BASE_GET_SPEC_VERSION	0UL
+#define SBI_BASE_GET_IMPL_ID		1UL
+#define SBI_BASE_GET_IMPL_VERSION	2UL
+#define SBI_BASE_PROBE_EXT		3UL
+#define SBI_BASE_GET_MVENDORID		4UL
+#define SBI_BASE_GET_MARCHID		5UL
+#define SBI_BASE_GET_MIMPID		6UL
+
+#define SBI_TIME_SET_TIMER		0UL
+
+#define SBI_IPI_SEND_IPI		0UL
+
+#define SBI_RFENCE_REMOTE_FENCE_I	0UL
+#define SBI_RFENCE_REMOTE_SFENCE_VMA	1UL
+#define SBI_RFENCE_REMOTE_SFENCE_VMA_ASID	2UL
+
+#define SBI_HSM_HART_START		0UL
+#define SBI_HSM_HART_STOP		1UL
+#define SBI_HSM_HART_GET_STATUS		2UL
+#define SBI_HSM_HART_SUSPEND		3UL
+
+#define SBI_HSM_STATE_STARTED		0UL
+#define SBI_HSM_STATE_STOPPED		1UL
+#define SBI_HSM_SUSPEND_RET_DEFAULT	0x00000000UL
+
+#define SBI_SRST_SYSTEM_RESET		0UL
+#define SBI_SRST_TYPE_SHUTDOWN		0UL
+#define SBI_SRST_TYPE_COLD_REBOOT	1UL
+#define SBI_SRST_TYPE_WARM_REBOOT	2UL
+
+#define SBI_DBCN_CONSOLE_WRITE		0UL
+#define SBI_DBCN_CONSOLE_READ		1UL
+#define SBI_DBCN_CONSOLE_WRITE_BYTE	2UL
+
+#define SBI_SUCCESS			0L
+#define SBI_ERR_FAILED			-1L
+#define SBI_ERR_NOT_SUPPORTED		-2L
+#define SBI_ERR_INVALID_PARAM		-3L
+#define SBI_ERR_DENIED			-4L
+#define SBI_ERR_INVALID_ADDRESS		-5L
+#define SBI_ERR_ALREADY_AVAILABLE	-6L
+#define SBI_ERR_ALREADY_STARTED		-7L
+#define SBI_ERR_ALREADY_STOPPED		-8L
+
+/* Per-vCPU call counters, indexed into acrn_vcpu_arch.sbi_calls[] */
+enum sbi_stat {
+	SBI_STAT_BASE = 0U,
+	SBI_STAT_TIME,
+	SBI_STAT_IPI,
+	SBI_STAT_RFENCE,
+	SBI_STAT_HSM,
+	SBI_STAT_SRST,
+	SBI_STAT_DBCN,
+	SBI_STAT_ACRN,
+	SBI_STAT_LEGACY,
+	SBI_STAT_UNKNOWN,
+	SBI_STAT_NUM,
 };
 
-static inline sbi_ret sbi_ecall(uint64_t a0, uint64_t a1, uint64_t a2,
-				uint64_t a3, uint64_t a4, uint64_t a5,
-				uint64_t func, uint64_t ext)
-{
-	sbi_ret ret;
-	asm volatile ("mv a0, %2 \t\n" 		\
-			"mv a1, %3 \t\n"	\
-			"mv a2, %4 \t\n"	\
-			"mv a3, %5 \t\n"	\
-			"mv a4, %6 \t\n"	\
-			"mv a5, %7 \t\n"	\
-			"mv a6, %8 \t\n"	\
-			"mv a7, %9 \t\n" 	\
-			"ecall \t\n"	 	\
-			"sw %0, %2\t\n"	 	\
-			"sw %1, %3\t\n"	 	\
-			"ecall" : "=r" (&ret.error), "=r" (&ret.value):
-			"r" (a0), "r" (a1), "r" (a2), "r" (a3),
-			"r" (a4), "r" (a5), "r" (func), "r" (ext):
-	);
-	return ret;
-}
+struct acrn_vcpu;
+
+extern const char *sbi_stat_name(uint32_t stat);
+extern int32_t sbi_ecall_vmexit_handler(struct acrn_vcpu *vcpu);
+extern uint32_t sbi_rfence_handle(struct acrn_vcpu *vcpu);
 
 #endif /*  __RISCV_SBI_H__ */
@@ -24,6 +24,8 @@ struct acrn_vclint {
 	struct vclint_timer	vtimer[5];
 	uint64_t		mtip;
 	uint64_t		clint_base;
+	/* guest time is host time plus this, set when a VM is restored */
+	uint64_t		time_offset;
 
 	const struct acrn_vclint_ops *ops;
 } __aligned(PAGE_SIZE);
@@ -45,6 +47,9 @@ extern void vclint_set_tsc_deadline_csr(struct acrn_vclint*vclint, uint32_t inde
 extern uint64_t vclint_get_clintbase(const struct acrn_vclint*vclint);
 extern int32_t vclint_set_clintbase(struct acrn_vclint*vclint, uint64_t new);
 extern void vclint_set_intr(struct acrn_vcpu *vcpu);
+extern void vclint_set_timer(struct acrn_vcpu *vcpu, uint64_t deadline);
+extern void vclint_send_ipi(struct acrn_vcpu *vcpu);
+extern void vclint_clear_ipi(struct acrn_vcpu *vcpu);
 extern void vclint_init(struct acrn_vm *vm);
 extern void vclint_free(struct acrn_vcpu *vcpu);
 extern void vclint_reset(struct acrn_vclint*vclint, const struct acrn_vclint_ops *ops, enum reset_mode mode);
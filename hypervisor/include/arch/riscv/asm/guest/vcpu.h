@@ -17,6 +17,7 @@
 #include <asm/vmx.h>
 #include <asm/guest/guest_memory.h>
 #include <asm/guest/vclint.h>
+#include <asm/guest/sbi.h>
 
 #define ACRN_REQUEST_EXCP			0U
 #define ACRN_REQUEST_EVENT			1U
@@ -28,6 +29,7 @@
 #define ACRN_REQUEST_VPID_FLUSH			7U
 #define ACRN_REQUEST_INIT_VMCS			8U
 #define ACRN_REQUEST_WAIT_WBINVD		9U
+#define ACRN_REQUEST_RFENCE			10U
 
 #define foreach_vcpu(idx, vm, t_vcpu)				\
 	for ((idx) = 0U, (t_vcpu) = &((vm)->hw.vcpu[(idx)]);	\
@@ -49,7 +51,8 @@ enum vm_cpu_mode {
 #define	VCPU_EVENT_IOREQ		0
 #define	VCPU_EVENT_VIRTUAL_INTERRUPT	1
 #define	VCPU_EVENT_SYNC_WBINVD		2
-#define	VCPU_EVENT_NUM			3
+#define	VCPU_EVENT_RFENCE		3
+#define	VCPU_EVENT_NUM			4
 
 enum reset_mode;
 
@@ -123,13 +126,29 @@ struct acrn_vcpu_arch {
 	enum vm_cpu_mode cpu_mode;
 	uint8_t nr_sipi;
 
+	/* start_vm() runs the hart: the BSP on boot, else as paused or restored */
+	bool started;
+	/* run_ctx was loaded from a snapshot, init_vmcs() keeps it */
+	bool restored;
+
 	/* interrupt injection information */
 	uint64_t pending_req;
+	/* VS-level timer pending from the vCLINT, loaded into hvip on entry */
+	uint64_t hvip;
+
+	/* SBI remote fences other vCPUs queued here, see sbi_rfence() */
+	uint32_t rfence_kinds;
+	uint64_t rfence_waiters;
+	/* acks this vCPU still waits for in sbi_rfence() */
+	uint32_t rfence_acks;
 
 	struct csr_store_area csr_area;
 
 	/* EOI_EXIT_BITMAP buffer, for the bitmap update */
 	uint64_t eoi_exit_bitmap[EOI_EXIT_BITMAP_SIZE >> 6U];
+
+	/* SBI calls handled, per extension */
+	uint64_t sbi_calls[SBI_STAT_NUM];
 } __aligned(8);
 
 struct acrn_vcpu {
@@ -206,6 +225,8 @@ extern void vcpu_set_eoi_exit_bitmap(struct acrn_vcpu *vcpu, uint32_t vector);
 extern void vcpu_clear_eoi_exit_bitmap(struct acrn_vcpu *vcpu, uint32_t vector);
 extern void set_vcpu_regs(struct acrn_vcpu *vcpu, struct cpu_regs *vcpu_regs);
 extern void reset_vcpu_regs(struct acrn_vcpu *vcpu);
+extern void get_vcpu_snapshot(struct acrn_vcpu *vcpu, struct acrn_vcpu_snapshot *snap);
+extern void set_vcpu_snapshot(struct acrn_vcpu *vcpu, const struct acrn_vcpu_snapshot *snap);
 extern void init_vcpu_protect_mode_regs(struct acrn_vcpu *vcpu, uint64_t vgdt_base_gpa);
 extern void set_vcpu_startup_entry(struct acrn_vcpu *vcpu, uint64_t entry);
 
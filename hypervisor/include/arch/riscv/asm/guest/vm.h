@@ -113,6 +113,8 @@ struct vm_arch {
 	void *sworld_s2ptp;
 	uint64_t s2pt_satp;
 	struct memory_ops s2pt_mem_ops;
+	bool dirty_log;			/* stage-2 dirty page logging armed */
+	uint64_t *dirty_bitmap;		/* one bit per 4K guest page */
 
 	struct acrn_vpic vpic;      /* Virtual PIC */
 	enum vm_vlapic_mode vlapic_mode; /* Represents vLAPIC mode across vCPUs*/
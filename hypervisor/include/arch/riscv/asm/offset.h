@@ -45,5 +45,7 @@
 #define REG_CAUSE	0x110
 #define REG_HSTATUS	0x118
 #define REG_ORIG_A0	0x120
+/* run_context.htval, right after the register frame */
+#define REG_HTVAL	0x128
 
 #endif /* __RISCV_OFFSET_H__ */
@@ -22,6 +22,7 @@
 struct per_cpu_region {
 	struct shared_buf *sbuf[ACRN_SBUF_PER_PCPU_ID_MAX];
 	char logbuf[LOG_MESSAGE_MAX_SIZE];
+	struct log_bin_ring binlog;
 	uint32_t npk_log_ref;
 	uint64_t irq_count[NR_IRQS];
 	uint64_t softirq_pending;
@@ -48,6 +48,8 @@
 #define PAGE_G  BIT5
 #define PAGE_A  BIT6
 #define PAGE_D  BIT7
+#define PAGE_RSW0  BIT8
+#define PAGE_RSW1  BIT9
 
 #define PAGE_TYPE_MASK			0xf
 #define PAGE_TYPE_TABLE 		(0x0 | PAGE_V)
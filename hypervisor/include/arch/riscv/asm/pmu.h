@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023-2024 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __RISCV_PMU_H__
+#define __RISCV_PMU_H__
+
+#include <types.h>
+
+/*
+ * Sampling uses hpmcounter3 with Sscofpmf overflow interrupts. The
+ * hypervisor owns M-mode, so the M-level counter CSRs are programmed
+ * through M-mode services and the local counter overflow interrupt
+ * (LCOFI) is delegated to HS-mode.
+ */
+#define PMU_SAMPLE_COUNTER	3U
+#define IRQ_LCOF		13U
+
+/* mhpmevent bits defined by Sscofpmf */
+#define PMU_EVENT_OF		(1UL << 63U)
+#define PMU_EVENT_MINH		(1UL << 62U)
+#define PMU_EVENT_SINH		(1UL << 61U)
+#define PMU_EVENT_UINH		(1UL << 60U)
+#define PMU_EVENT_VSINH		(1UL << 59U)
+#define PMU_EVENT_VUINH		(1UL << 58U)
+#define PMU_EVENT_MASK		((1UL << 56U) - 1UL)
+
+/* Privilege mode a sample was taken in */
+#define PMU_MODE_HS		0U
+#define PMU_MODE_HU		1U
+#define PMU_MODE_VS		2U
+#define PMU_MODE_VU		3U
+
+#define PMU_SAMPLE_MAGIC	0x504d5553U	/* "SUMP" */
+/* element size of the ACRN_SEP sbuf, same as SEP_BUF_ENTRY_SIZE */
+#define PMU_SAMPLE_ENTRY_SIZE	32U
+
+/*
+ * One sample as written to the ACRN_SEP shared buffer, two
+ * PMU_SAMPLE_ENTRY_SIZE elements. Keep in sync with the report tool
+ * misc/debug_tools/acrn_prof/acrnprof.py.
+ */
+struct pmu_sample {
+	uint32_t magic;
+	uint16_t pcpu_id;
+	uint8_t mode;
+	uint8_t reserved;
+	uint16_t vm_id;		/* ACRN_INVALID_VMID if no vCPU was loaded */
+	uint16_t vcpu_id;
+	uint32_t exit_reason;	/* last exit reason of that vCPU */
+	uint64_t timestamp;
+	uint64_t pc;
+	uint64_t event;
+	uint64_t reserved1[3];
+};
+
+struct pmu_sample_stats {
+	uint64_t logged;
+	uint64_t dropped;
+};
+
+int32_t pmu_sampling_start(uint64_t event, uint64_t period, uint64_t inhibit);
+void pmu_sampling_stop(void);
+bool pmu_sampling_enabled(void);
+void pmu_sampling_get_stats(uint16_t pcpu_id, struct pmu_sample_stats *stats);
+void profiling_pmi_handler(void);
+
+struct acrn_vcpu;
+int32_t profiling_pmi_vmexit_handler(struct acrn_vcpu *vcpu);
+
+#endif /* __RISCV_PMU_H__ */
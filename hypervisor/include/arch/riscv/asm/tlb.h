@@ -37,6 +37,12 @@ static inline void name(void)		\
 		: : : "memory");	\
 }
 
+/* Flush the VS-stage TLB of the local processor, current VMID only. */
+static inline void flush_vs_tlb_local(void)
+{
+	asm volatile("hfence.vvma;" : : : "memory");
+}
+
 /* Flush all hypervisor mappings from the TLB of the local processor. */
 TLB_HELPER(flush_acrn_tlb_local);
 
@@ -27,6 +27,7 @@ struct per_cpu_region {
 #ifdef HV_DEBUG
 	struct shared_buf *sbuf[ACRN_SBUF_PER_PCPU_ID_MAX];
 	char logbuf[LOG_MESSAGE_MAX_SIZE];
+	struct log_bin_ring binlog;
 	uint32_t npk_log_ref;
 #endif
 	uint64_t irq_count[NR_IRQS];
@@ -23,6 +23,41 @@
  */
 #define LOG_MESSAGE_MAX_SIZE	(4U * LOG_ENTRY_SIZE)
 
+/*
+ * Binary log record. The format string is not expanded when the message
+ * is logged; the record keeps the format string location and the raw
+ * arguments, and is formatted later by the console drain or offline by
+ * acrnlog against the hypervisor image. Format and string arguments are
+ * stored as offsets from the start of the hypervisor .rodata, so they
+ * resolve the same way whether or not the image was relocated. A record
+ * fits exactly one memory log entry, the magic tells it apart from text
+ * entries (which start with '[').
+ */
+#define LOG_BIN_MAGIC		0x474c4e42U	/* "BNLG" */
+#define LOG_BIN_MAX_ARGS	6U
+#define LOG_BIN_RING_SIZE	64U	/* power of 2 */
+
+struct log_bin_entry {
+	uint32_t magic;
+	uint16_t pcpu_id;
+	uint8_t severity;
+	uint8_t nargs;
+	uint32_t seq;		/* per pCPU */
+	uint32_t dropped;	/* records dropped on this pCPU before this one */
+	uint64_t timestamp;	/* in us */
+	uint64_t fmt;		/* offset of the format string in .rodata */
+	uint64_t args[LOG_BIN_MAX_ARGS];
+};
+
+/* Single producer (the owning pCPU), single consumer (the console drain) */
+struct log_bin_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	uint32_t seq;		/* last message number used on this pCPU */
+	struct log_bin_entry entries[LOG_BIN_RING_SIZE];
+};
+
 #define DBG_LEVEL_LAPICPT	5U
 #if defined(HV_DEBUG)
 
@@ -45,12 +80,16 @@ void asm_assert(int32_t line, const char *file, const char *txt);
 
 #endif /* HV_DEBUG */
 
+extern bool binlog_enabled;
+
 void init_logmsg(void);
 
 /*
  * @pre the severity > 0
  */
 void do_logmsg(uint32_t severity, const char *fmt, ...);
+void drain_logmsg(void);
+uint32_t get_logmsg_dropped(uint16_t pcpu_id);
 
 /** The well known printf() function.
  *
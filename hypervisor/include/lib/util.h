@@ -11,6 +11,7 @@
 #define offsetof(st, m) __builtin_offsetof(st, m)
 #define va_start	__builtin_va_start
 #define va_end		__builtin_va_end
+#define va_arg		__builtin_va_arg
 
 /** Roundup (x/y) to ( x/y + (x%y) ? 1 : 0) **/
 #define INT_DIV_ROUNDUP(x, y)	((((x)+(y))-1)/(y))
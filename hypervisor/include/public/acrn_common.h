@@ -464,6 +464,49 @@ struct acrn_vcpu_regs {
 	struct acrn_regs vcpu_regs;
 };
 
+/**
+ * @brief Info to save or restore the state of a vCPU for a VM snapshot
+ *
+ * the parameter for HC_GET_VCPU_SNAPSHOT and HC_SET_VCPU_SNAPSHOT hypercalls
+ */
+struct acrn_vcpu_snapshot {
+	/** the virtual CPU ID of the vCPU */
+	uint16_t vcpu_id;
+
+	/** reserved space to make gprs aligned to 8 bytes */
+	uint16_t reserved[3];
+
+	/** pc and x1..x31, in the order of the hypervisor's struct cpu_regs */
+	uint64_t gprs[32];
+
+	/** guest status and hstatus saved on VM exit */
+	uint64_t status;
+	uint64_t hstatus;
+
+	/** VS-mode CSRs */
+	uint64_t vsstatus;
+	uint64_t vsepc;
+	uint64_t vsip;
+	uint64_t vsie;
+	uint64_t vstvec;
+	uint64_t vsscratch;
+	uint64_t vstval;
+	uint64_t vscause;
+	uint64_t vsatp;
+
+	/** vCLINT timer compare and software interrupt of this hart */
+	uint64_t mtimecmp;
+	uint32_t msip;
+
+	/** 1 when the hart was started (SBI HSM), it runs on resume */
+	uint32_t hart_started;
+
+	/** guest time when the snapshot was taken. Loading it on the BSP
+	 *  makes the VM clock resume from this value, 0 keeps the clock.
+	 */
+	uint64_t guest_time;
+};
+
 /** Operation types for setting IRQ line */
 #define GSI_SET_HIGH		0U
 #define GSI_SET_LOW		1U
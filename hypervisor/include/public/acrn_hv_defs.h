@@ -39,6 +39,8 @@
 #define HC_CREATE_VCPU              BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x04UL)
 #define HC_RESET_VM                 BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x05UL)
 #define HC_SET_VCPU_REGS            BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x06UL)
+#define HC_GET_VCPU_SNAPSHOT        BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x07UL)
+#define HC_SET_VCPU_SNAPSHOT        BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x08UL)
 
 /* IRQ and Interrupts */
 #define HC_ID_IRQ_BASE              0x20UL
@@ -60,6 +62,9 @@
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
 #define HC_SETUP_SBUF               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
+#define HC_VM_SET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x05UL)
+#define HC_VM_GET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x06UL)
+#define HC_VM_RELEASE_MEMORY        BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x07UL)
 
 /* PCI assignment*/
 #define HC_ID_PCI_BASE              0x50UL
@@ -186,6 +191,48 @@ struct wp_data {
 	uint64_t gpa;
 } __aligned(8);
 
+/**
+ * @brief Info to arm or fetch stage-2 dirty page logging
+ *
+ * the parameter for HC_VM_SET_DIRTY_LOG and HC_VM_GET_DIRTY_LOG hypercalls,
+ * gpa and size must be aligned to 64 pages (256K)
+ */
+struct acrn_dirty_log {
+	/** start guest physical address of the range in the User VM */
+	uint64_t gpa;
+
+	/** size of the range in bytes */
+	uint64_t size;
+
+	/** HC_VM_SET_DIRTY_LOG only: 1 to start logging, 0 to stop */
+	uint32_t enable;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** HC_VM_GET_DIRTY_LOG only: Service VM gpa of the bitmap buffer,
+	 *  one bit per 4K page, size / 32K bytes long. The device model passes
+	 *  a user virtual address in the same field of the ioctl; the HSM
+	 *  driver pins that buffer and hands its gpa to the hypervisor.
+	 *  Pages at or above the stage-2 address space are reported clean.
+	 */
+	uint64_t bitmap_gpa;
+} __aligned(8);
+
+/**
+ * @brief Info to take a range of RAM away from a User VM
+ *
+ * the parameter for HC_VM_RELEASE_MEMORY hypercall, gpa and size must be
+ * page aligned. The range is mapped back with HC_VM_SET_MEMORY_REGIONS.
+ */
+struct acrn_mem_release {
+	/** start guest physical address of the range in the User VM */
+	uint64_t gpa;
+
+	/** size of the range in bytes */
+	uint64_t size;
+} __aligned(8);
+
 /**
  * Setup parameter for share buffer, used for HC_SETUP_SBUF hypercall
  */
@@ -140,6 +140,7 @@ BOOT_C_SRCS += arch/riscv/clint.c
 BOOT_C_SRCS += arch/riscv/plic.c
 BOOT_C_SRCS += arch/riscv/notify.c
 BOOT_C_SRCS += arch/riscv/boot.c
+BOOT_C_SRCS += arch/riscv/profiling.c
 BOOT_C_SRCS += arch/riscv/lib/bits.c
 BOOT_C_SRCS += arch/riscv/lib/memory.c
 
@@ -153,10 +154,11 @@ BOOT_C_SRCS += arch/riscv/guest/virq.c
 BOOT_C_SRCS += arch/riscv/guest/vclint.c
 BOOT_C_SRCS += arch/riscv/guest/vmexit.c
 BOOT_C_SRCS += arch/riscv/guest/vmcall.c
+BOOT_C_SRCS += arch/riscv/guest/sbi.c
+BOOT_C_SRCS += arch/riscv/guest/hypercall.c
 BOOT_C_SRCS += arch/riscv/guest/guest_memory.c
 BOOT_C_SRCS += arch/riscv/guest/instr_emul.c
 
-BOOT_C_SRCS += release/profiling.c
 BOOT_C_SRCS += release/trace.c
 BOOT_C_SRCS += lib/sprintf.c
 BOOT_C_SRCS += lib/string.c
@@ -170,7 +172,7 @@ BOOT_C_SRCS += common/ticks.c
 BOOT_C_SRCS += common/hv_main.c
 #BOOT_C_SRCS += common/hypercall.c
 BOOT_C_SRCS += debug/printf.c
-BOOT_C_SRCS += release/sbuf.c
+BOOT_C_SRCS += debug/sbuf.c
 BOOT_C_SRCS += debug/shell.c
 BOOT_C_SRCS += debug/string.c
 BOOT_C_SRCS += debug/logmsg.c
@@ -16,6 +16,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <elf.h>
 
 #define LOG_ELEMENT_SIZE        80
 #define LOG_MSG_SIZE		480
@@ -58,6 +60,37 @@ static struct hvlog_file last_log = {
 	.num = LOG_FILE_NUM
 };
 
+/*
+ * Binary log record, must match struct log_bin_entry in the hypervisor
+ * (hypervisor/include/debug/logmsg.h). The format string and string
+ * arguments are offsets from the start of the hypervisor .rodata, resolved
+ * with the ELF file given by '-e'; being relative to the image, they do
+ * not depend on the address the hypervisor was relocated to.
+ */
+#define LOG_BIN_MAGIC		0x474c4e42U
+#define LOG_BIN_MAX_ARGS	6
+
+struct log_bin_entry {
+	uint32_t magic;
+	uint16_t pcpu_id;
+	uint8_t severity;
+	uint8_t nargs;
+	uint32_t seq;
+	uint32_t dropped;
+	uint64_t timestamp;
+	uint64_t fmt;
+	uint64_t args[LOG_BIN_MAX_ARGS];
+};
+
+/* loadable segments of the hypervisor image, to resolve format strings */
+static struct {
+	char *data;
+	size_t size;
+	Elf64_Phdr *phdr;
+	int phnum;
+	uint64_t rodata;	/* link address of .rodata */
+} hv_image;
+
 struct hvlog_msg {
 	__u64 usec;		/* timestamp, from tsc reset in usec */
 	int cpu;		/* which physical cpu output the log */
@@ -83,6 +116,192 @@ struct hvlog_dev {
 
 size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len);
 
+/* find the link address of the .rodata section */
+static int find_hv_rodata(Elf64_Ehdr *ehdr)
+{
+	Elf64_Shdr *shdr, *strtab;
+	const char *name;
+	int i;
+
+	if (ehdr->e_shoff == 0 || ehdr->e_shstrndx >= ehdr->e_shnum ||
+			ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > hv_image.size)
+		return -1;
+
+	shdr = (Elf64_Shdr *)(hv_image.data + ehdr->e_shoff);
+	strtab = &shdr[ehdr->e_shstrndx];
+	if (strtab->sh_offset + strtab->sh_size > hv_image.size)
+		return -1;
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_name >= strtab->sh_size)
+			continue;
+		name = hv_image.data + strtab->sh_offset + shdr[i].sh_name;
+		if (strncmp(name, ".rodata", strtab->sh_size - shdr[i].sh_name) == 0) {
+			hv_image.rodata = shdr[i].sh_addr;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int load_hv_image(const char *path)
+{
+	Elf64_Ehdr *ehdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Failed to open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	hv_image.data = malloc(st.st_size);
+	if (!hv_image.data || read(fd, hv_image.data, st.st_size) != st.st_size) {
+		printf("Failed to read %s\n", path);
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+	hv_image.size = st.st_size;
+
+	ehdr = (Elf64_Ehdr *)hv_image.data;
+	if (hv_image.size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+			ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+			ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(Elf64_Phdr) > hv_image.size) {
+		printf("%s is not a valid hypervisor image\n", path);
+		goto fail;
+	}
+	hv_image.phdr = (Elf64_Phdr *)(hv_image.data + ehdr->e_phoff);
+	hv_image.phnum = ehdr->e_phnum;
+	if (find_hv_rodata(ehdr)) {
+		printf("%s has no .rodata section\n", path);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free(hv_image.data);
+	hv_image.data = NULL;
+	return -1;
+}
+
+/* map a .rodata offset to a NUL terminated string in the image */
+static const char *hv_image_str(uint64_t rodata_off)
+{
+	uint64_t addr = hv_image.rodata + rodata_off;
+	Elf64_Phdr *ph;
+	size_t off;
+	int i;
+
+	for (i = 0; i < hv_image.phnum; i++) {
+		ph = &hv_image.phdr[i];
+		if (ph->p_type != PT_LOAD || addr < ph->p_vaddr ||
+				addr >= ph->p_vaddr + ph->p_filesz)
+			continue;
+		off = ph->p_offset + (addr - ph->p_vaddr);
+		if (off < hv_image.size &&
+				memchr(hv_image.data + off, '\0', hv_image.size - off))
+			return hv_image.data + off;
+	}
+	return NULL;
+}
+
+/*
+ * Expand a binary record into the same text the hypervisor would have
+ * logged. Conversions are parsed the same way as on the hypervisor side:
+ * 'l', 'j', 'z' take a 64-bit argument, 'p' is 64-bit, 's' is an address
+ * in the image, everything else is 32-bit.
+ */
+static size_t hvlog_format_bin(const struct log_bin_entry *e, char *buf, size_t size)
+{
+	const char *fmt, *p, *str;
+	char spec[16];
+	size_t len, spec_len;
+	int n = 0, is_long;
+
+	len = snprintf(buf, size, "[%luus][cpu=%hu][sev=%u][seq=%u]:",
+		       (unsigned long)e->timestamp, e->pcpu_id, e->severity, e->seq);
+
+	fmt = hv_image_str(e->fmt);
+	if (!fmt) {
+		len += snprintf(buf + len, size - len, "fmt@rodata+0x%lx", (unsigned long)e->fmt);
+		for (n = 0; n < e->nargs && n < LOG_BIN_MAX_ARGS && len < size; n++)
+			len += snprintf(buf + len, size - len, " 0x%lx", (unsigned long)e->args[n]);
+		return len < size ? len : size - 1;
+	}
+
+	for (p = fmt; *p != '\0' && len + 1 < size; ) {
+		if (*p != '%' || *(p + 1) == '%') {
+			buf[len++] = *p;
+			p += (*p == '%') ? 2 : 1;
+			continue;
+		}
+
+		fmt = p++;
+		is_long = 0;
+		p += strspn(p, "#0- +");
+		p += strspn(p, "0123456789.");
+		while (*p == 'h' || *p == 'l' || *p == 'j' || *p == 'z') {
+			is_long |= (*p != 'h');
+			p++;
+		}
+		if (*p != '\0')
+			p++;
+
+		spec_len = p - fmt;
+		if (spec_len >= sizeof(spec))
+			spec_len = sizeof(spec) - 1;
+		memcpy(spec, fmt, spec_len);
+		spec[spec_len] = '\0';
+
+		if (n >= e->nargs || n >= LOG_BIN_MAX_ARGS)
+			break;
+
+		switch (spec[spec_len - 1]) {
+		case 's':
+			str = hv_image_str(e->args[n]);
+			len += snprintf(buf + len, size - len, spec, str ? str : "(?)");
+			break;
+		case 'p':
+			len += snprintf(buf + len, size - len, spec, (void *)(uintptr_t)e->args[n]);
+			break;
+		default:
+			if (is_long)
+				len += snprintf(buf + len, size - len, spec, (unsigned long)e->args[n]);
+			else
+				len += snprintf(buf + len, size - len, spec, (unsigned int)e->args[n]);
+			break;
+		}
+		n++;
+	}
+
+	if (len >= size)
+		len = size - 1;
+	buf[len] = '\0';
+	return len;
+}
+
+static int is_bin_entry(const char *entry)
+{
+	return ((const struct log_bin_entry *)entry)->magic == LOG_BIN_MAGIC;
+}
+
+/* decode the binary entry at the start of msg->raw in place */
+static void hvlog_decode_bin(struct hvlog_msg *msg)
+{
+	struct log_bin_entry e;
+
+	memcpy(&e, msg->raw, sizeof(e));
+	msg->seq = e.seq;
+	msg->cpu = e.pcpu_id;
+	msg->sev = e.severity;
+	msg->usec = e.timestamp;
+	msg->len = hvlog_format_bin(&e, msg->raw, LOG_MSG_SIZE - 1);
+}
+
 static int get_dev_cnt(char *prefix)
 {
 	struct dirent *pdir;
@@ -136,17 +355,37 @@ struct hvlog_msg *hvlog_read_dev(struct hvlog_dev *dev)
 			       LOG_ELEMENT_SIZE);
 			msg_num++;
 			memcpy(msg[0], msg[1], sizeof(struct hvlog_msg));
+			if (is_bin_entry(msg[0]->raw)) {
+				hvlog_decode_bin(msg[0]);
+				break;
+			}
 		} else {
 			ret =
 			    read(dev->fd, &msg[0]->raw[msg[0]->len],
 				 LOG_ELEMENT_SIZE);
 			if (!ret)
 				break;
+			/* a binary record is always a complete message */
+			if (is_bin_entry(&msg[0]->raw[msg[0]->len])) {
+				if (msg_num > 0) {
+					dev->latched = 1;
+					memcpy(dev->entry_latch,
+					       &msg[0]->raw[msg[0]->len],
+					       LOG_ELEMENT_SIZE);
+					memset(&msg[0]->raw[msg[0]->len], 0,
+					       LOG_ELEMENT_SIZE);
+					break;
+				}
+				hvlog_decode_bin(msg[0]);
+				break;
+			}
 			/* do we read a new meaasge?
 			 * msg[0]->raw[msg[0]->len format: [%lluus][cpu=%d][sev=%d][seq=%llu]: */
 			p = strstr(&msg[0]->raw[msg[0]->len], "][seq=");
 			if (p) {
+				msg[msg_num]->usec = strtoull(&msg[0]->raw[msg[0]->len] + 1, NULL, 10);
 				p = p + strlen("][seq=");
+				errno = 0;
 				msg[msg_num]->seq = strtoull(p, NULL, 10);
 				if ((errno == ERANGE && (msg[msg_num]->seq == ULLONG_MAX))
 						|| (errno != 0 && msg[msg_num]->seq == 0)) {
@@ -242,6 +481,7 @@ void hvlog_close_dev(struct hvlog_dev *dev)
 static struct hvlog_data {
 	struct hvlog_dev *dev;
 	struct hvlog_msg *msg;	/* clean it after use */
+	__u64 last_seq;		/* sequence numbers are per physical cpu */
 } *cur, *last;
 
 /*
@@ -267,10 +507,16 @@ static int hvlog_dev_read_msg(struct hvlog_data *data, int num_dev)
 	return new_read;
 }
 
-static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
+/*
+ * Pick the earliest msg of all devs. Each dev carries the log of one
+ * physical cpu and sequence numbers are only meaningful within a cpu, so
+ * msgs of different devs are ordered by timestamp. If index is not NULL,
+ * the dev the msg was taken from is returned there.
+ */
+static struct hvlog_msg *get_earliest_msg(struct hvlog_data *data, int num_dev, int *index)
 {
 	int i, index_min = -1;
-	__u64 min_seq = 0;
+	__u64 min_usec = 0;
 	struct hvlog_msg *msg;
 
 	for (i = 0; i < num_dev; i++) {
@@ -279,14 +525,14 @@ static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
 
 		if (index_min == -1) {
 			index_min = i;
-			min_seq = data[i].msg->seq;
+			min_usec = data[i].msg->usec;
 			continue;
 		}
 
-		if (data[i].msg->seq > min_seq)
+		if (data[i].msg->usec >= min_usec)
 			continue;
 		index_min = i;
-		min_seq = data[i].msg->seq;
+		min_usec = data[i].msg->usec;
 	}
 
 	if (index_min == -1)
@@ -294,6 +540,8 @@ static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
 
 	msg = data[index_min].msg;
 	data[index_min].msg = NULL;
+	if (index)
+		*index = index_min;
 
 	return msg;
 }
@@ -349,19 +597,19 @@ size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len)
 static void *cur_read_func(void *arg)
 {
 	struct hvlog_msg *msg;
-	__u64 last_seq = 0;
 	char warn_msg[LOG_MSG_SIZE] = {0};
+	int i;
 
 	while (1) {
 		hvlog_dev_read_msg(cur, cur_cnt);
-		msg = get_min_seq_msg(cur, cur_cnt);
+		msg = get_earliest_msg(cur, cur_cnt, &i);
 		if (!msg) {
 			usleep(interval);
 			continue;
 		}
 
-		/* if msg->seq is not contineous, warn for logs missing */
-		if (last_seq + 1 < msg->seq) {
+		/* if msg->seq is not contineous on its cpu, warn for logs missing */
+		if (cur[i].last_seq + 1 < msg->seq) {
 			if (snprintf(warn_msg, LOG_MSG_SIZE,
 				 "\n\n\t%s[%lu ms]\n\n\n",
 				 LOG_INCOMPLETE_WARNING, interval) >= LOG_MSG_SIZE) {
@@ -371,7 +619,7 @@ static void *cur_read_func(void *arg)
 			write_log_file(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
 		}
 
-		last_seq = msg->seq;
+		cur[i].last_seq = msg->seq;
 
 		write_log_file(&cur_log, msg->raw, msg->len);
 	}
@@ -421,18 +669,19 @@ static int mk_dir(const char *path)
 }
 
 /* for user optinal args */
-static const char optString[] = "s:n:t:h";
+static const char optString[] = "s:n:t:e:h";
 
 static void display_usage(void)
 {
 	printf("acrnlog - tool to collect ACRN hypervisor log\n"
-	       "[Usage] acrnlog [-s size] [-n number] [-t interval] [-h]\n\n"
+	       "[Usage] acrnlog [-s size] [-n number] [-t interval] [-e hv_image] [-h]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
 	       "\t-t: polling interval to collect logs, in ms\n"
 	       "\t-s: size limitation for each log file, in MB.\n"
 	       "\t    0 means no limitation.\n"
 	       "\t-n: how many files you would like to keep on disk\n"
+	       "\t-e: hypervisor ELF image, used to expand binary log records\n"
 	       "[Output] capatured log files under /var/log/acrnlog/\n");
 }
 
@@ -471,6 +720,10 @@ static int parse_opt(int argc, char *argv[])
 			interval = ret * 1000;
 			printf("Polling interval is %u ms\n", ret);
 			break;
+		case 'e':
+			if (load_hv_image(optarg))
+				return -EINVAL;
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -570,7 +823,7 @@ int main(int argc, char *argv[])
 	if (num_last) {
 		while (1) {
 			hvlog_dev_read_msg(last, cur_cnt);
-			msg = get_min_seq_msg(last, cur_cnt);
+			msg = get_earliest_msg(last, cur_cnt, NULL);
 			if (!msg)
 				break;
 			write_log_file(&last_log, msg->raw, msg->len);
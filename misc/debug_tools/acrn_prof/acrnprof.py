@@ -0,0 +1,156 @@
+#!/usr/bin/python3
+# -*- coding: UTF-8 -*-
+
+"""
+This script resolves the RISC-V PMU samples logged by the hypervisor
+into the ACRN_SEP shared buffers and prints flat and hierarchical
+profiles of where the sampled event was spent.
+"""
+
+import bisect
+import getopt
+import os
+import struct
+import subprocess
+import sys
+from collections import defaultdict
+
+PMU_SAMPLE_MAGIC = 0x504d5553
+# struct pmu_sample, see hypervisor/include/arch/riscv/asm/pmu.h
+PMU_SAMPLE_FMT = '<IHBBHHIQQQ24x'
+PMU_SAMPLE_SIZE = struct.calcsize(PMU_SAMPLE_FMT)
+
+MODES = ['HS', 'HU', 'VS', 'VU']
+INVALID_VM_ID = 0xffff
+
+def usage():
+    """print usage"""
+    print("Usage: %s -e <hv_image> [-n <top>] <sample_file> [<sample_file> ...]" % sys.argv[0])
+    print("  -e: hypervisor ELF image (acrn.elf) used to resolve hypervisor PCs")
+    print("  -n: number of entries in the flat profile (default 20)")
+    print("  -h: print this message")
+
+class SymbolTable:
+    """sorted text symbols of the hypervisor image"""
+
+    def __init__(self, image):
+        self.addrs = []
+        self.names = []
+        out = subprocess.run(['nm', '-n', image], stdout=subprocess.PIPE,
+                             universal_newlines=True, check=True).stdout
+        for line in out.splitlines():
+            fields = line.split()
+            if len(fields) == 3 and fields[1] in 'tTwW':
+                self.addrs.append(int(fields[0], 16))
+                self.names.append(fields[2])
+
+    def lookup(self, pc):
+        """return the symbol containing pc"""
+        idx = bisect.bisect_right(self.addrs, pc) - 1
+        if idx < 0:
+            return '0x%x' % pc
+        return self.names[idx]
+
+def read_samples(path):
+    """yield the valid samples of a raw sample file"""
+    with open(path, 'rb') as sfile:
+        data = sfile.read()
+
+    for off in range(0, len(data) - PMU_SAMPLE_SIZE + 1, PMU_SAMPLE_SIZE):
+        fields = struct.unpack_from(PMU_SAMPLE_FMT, data, off)
+        if fields[0] != PMU_SAMPLE_MAGIC:
+            continue
+        yield {
+            'pcpu': fields[1], 'mode': fields[2], 'vm': fields[4],
+            'vcpu': fields[5], 'exit': fields[6], 'pc': fields[8]
+        }
+
+def location(sample, syms):
+    """name of the sampled location; guest PCs are not resolved"""
+    if sample['mode'] <= 1 and syms is not None:
+        return syms.lookup(sample['pc'])
+    return 'guest@0x%x' % sample['pc']
+
+def owner(sample):
+    """VM/vCPU the pCPU was running for when the sample was taken"""
+    if sample['vm'] == INVALID_VM_ID:
+        return 'idle'
+    return 'vm%d/vcpu%d' % (sample['vm'], sample['vcpu'])
+
+def print_flat(flat, total, top):
+    """flat profile: one line per symbol, split by mode"""
+    print("%8s %7s  %-7s %-16s %s" % ('samples', 'percent', 'mode', 'owner', 'symbol'))
+    for (sym, mode, own), cnt in sorted(flat.items(), key=lambda x: -x[1])[:top]:
+        print("%8d %6.2f%%  %-7s %-16s %s" % (cnt, cnt * 100.0 / total, MODES[mode], own, sym))
+
+def print_tree(tree, total):
+    """hierarchical profile: mode -> vm/vcpu -> exit reason -> symbol"""
+    def subtotal(node):
+        if isinstance(node, int):
+            return node
+        return sum(subtotal(child) for child in node.values())
+
+    def walk(node, depth):
+        for key, child in sorted(node.items(), key=lambda x: -subtotal(x[1])):
+            cnt = subtotal(child)
+            print("%s%-*s %8d %6.2f%%" % ('  ' * depth, 48 - 2 * depth, key,
+                                          cnt, cnt * 100.0 / total))
+            if not isinstance(child, int):
+                walk(child, depth + 1)
+
+    walk(tree, 0)
+
+def main(argv):
+    """main function"""
+    image = None
+    top = 20
+
+    try:
+        opts, args = getopt.getopt(argv, "he:n:")
+    except getopt.GetoptError:
+        usage()
+        sys.exit(1)
+
+    for opt, arg in opts:
+        if opt == '-h':
+            usage()
+            sys.exit(0)
+        elif opt == '-e':
+            image = arg
+        elif opt == '-n':
+            top = int(arg)
+
+    if not args:
+        usage()
+        sys.exit(1)
+
+    syms = SymbolTable(image) if image is not None else None
+    flat = defaultdict(int)
+    tree = {}
+    total = 0
+
+    for path in args:
+        if not os.path.isfile(path):
+            print("%s: no such file" % path)
+            sys.exit(1)
+        for sample in read_samples(path):
+            sym = location(sample, syms)
+            own = owner(sample)
+            flat[(sym, sample['mode'], own)] += 1
+
+            node = tree.setdefault(MODES[sample['mode']], {}).setdefault(own, {})
+            node = node.setdefault('exit 0x%x' % sample['exit'], {})
+            node[sym] = node.get(sym, 0) + 1
+            total += 1
+
+    if total == 0:
+        print("no samples found")
+        return
+
+    print("%d samples\n" % total)
+    print_flat(flat, total, top)
+    print("")
+    print_tree(tree, total)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])